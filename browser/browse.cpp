@@ -146,10 +146,11 @@ struct FoldStateEndOfListSearcher {
     }
 };
 
-DecodedTraceLine::DecodedTraceLine(const ParseParams &pparams,
+DecodedTraceLine::DecodedTraceLine(const ParseParams &pparams, int cpu,
                                    const string &line)
 {
-    TarmacLineParser parser(pparams, *this);
+    CPUFilter filter(*this, cpu);
+    TarmacLineParser parser(pparams, filter);
     try {
         parser.parse(line);
     } catch (TarmacParseError err) {
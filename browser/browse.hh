@@ -229,7 +229,8 @@ class DecodedTraceLine : public ParseReceiver {
     std::unique_ptr<InstructionEvent> iev;
     std::unique_ptr<RegisterEvent> rev;
     std::unique_ptr<MemoryEvent> mev;
-    DecodedTraceLine(const ParseParams &pparams, const std::string &line);
+    DecodedTraceLine(const ParseParams &pparams, int cpu,
+                     const std::string &line);
 
   private:
     virtual void got_event(MemoryEvent &ev) override;
@@ -961,7 +961,7 @@ class TraceBuffer : public Window {
                 ref_node = vu.curr_visible_node;
 
             DecodedTraceLine dtl(
-                br.index.parseParams(),
+                br.index.parseParams(), br.index.indexedCPU(),
                 br.index.get_trace_line(vu.curr_visible_node, selected_event));
             unsigned line = 0;
             if (dtl.mev) {
@@ -2292,7 +2292,7 @@ int main(int argc, char **argv)
     ap.parse();
     tu.setup();
 
-    Browser br(tu.trace, tu.image_filename, tu.load_offset);
+    Browser br(tu.trace, tu.images);
     run_browser(br, use_terminal_colours);
 
     return 0;
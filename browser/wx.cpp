@@ -2188,7 +2188,7 @@ bool TraceWindow::prepare_context_menu(const LogicalPos &logpos)
             context_menu_memroot = prev_node.memory_root;
         else
             context_menu_memroot = 0;
-        DecodedTraceLine dtl(br.index.parseParams(),
+        DecodedTraceLine dtl(br.index.parseParams(), br.index.indexedCPU(),
                              br.index.get_trace_line(node, logpos.y1));
         if (dtl.mev) {
             contextmenu->AppendSeparator();
@@ -3384,8 +3384,8 @@ class WXGUIReporter : public Reporter {
     void indexing_error(const string &trace_filename,
                         unsigned lineno, const string &msg) override;
     void indexing_start(streampos total) override;
-    void indexing_progress(streampos pos) override;
-    void indexing_done() override;
+    void indexing_progress(const IndexingProgress &prog) override;
+    void indexing_done(const IndexingProgress &prog) override;
 
     string progress_title;
     int progress_max;
@@ -3480,8 +3480,8 @@ void WXGUIReporter::indexing_status(const TracePair &trace,
       case IndexUpdateCheck::Missing:
         oss << endl << _("(new index file)");
         break;
-      case IndexUpdateCheck::TooOld:
-        oss << endl << _("(index file was older than trace file)");
+      case IndexUpdateCheck::Changed:
+        oss << endl << _("(trace file has changed since it was indexed)");
         break;
       case IndexUpdateCheck::WrongFormat:
         oss << endl
@@ -3490,6 +3490,9 @@ void WXGUIReporter::indexing_status(const TracePair &trace,
       case IndexUpdateCheck::Incomplete:
         oss << endl << _("(previous index file generation was not completed)");
         break;
+      case IndexUpdateCheck::WrongCPU:
+        oss << endl << _("(index file was built for a different CPU)");
+        break;
       case IndexUpdateCheck::OK:
         oss << endl << _("(not actually indexing)");
         break;
@@ -3555,16 +3558,16 @@ void WXGUIReporter::indexing_start(streampos total)
     prev_progress = 0;
 }
 
-void WXGUIReporter::indexing_progress(streampos pos)
+void WXGUIReporter::indexing_progress(const IndexingProgress &prog)
 {
-    int value = progress_scale * pos;
+    int value = progress_scale * prog.pos;
     if (prev_progress != value) {
         prev_progress = value;
         progress_dlg->Update(value);
     }
 }
 
-void WXGUIReporter::indexing_done()
+void WXGUIReporter::indexing_done(const IndexingProgress &)
 {
     progress_dlg = nullptr;
 }
@@ -3739,7 +3742,7 @@ bool GuiTarmacBrowserApp::OnInit()
 
     config.read();
 
-    br = make_unique<Browser>(tu.trace, tu.image_filename, tu.load_offset);
+    br = make_unique<Browser>(tu.trace, tu.images);
 
     if (config.font.empty()) {
         TextViewWindow::font = wxFont(12, wxFONTFAMILY_TELETYPE,
@@ -19,6 +19,7 @@
 #ifndef TARMAC_ARGPARSE_HH
 #define TARMAC_ARGPARSE_HH
 
+#include <climits>
 #include <deque>
 #include <functional>
 #include <map>
@@ -38,9 +39,23 @@ class ArgparseError : public std::exception {
 
 class ArgparseSpecialAction : public std::exception {
 };
+
 class ArgparseHelpAction : public ArgparseSpecialAction {
 };
 
+// Parse the value of a numeric option: a whole number in decimal, or
+// in hex or octal with the C prefixes. Throw ArgparseError if it isn't
+// one (including if it is negative or has anything after it), or if
+// it is outside [min,max].
+unsigned long long parse_unsigned(const std::string &s,
+                                  unsigned long long min = 0,
+                                  unsigned long long max = ULLONG_MAX);
+
+// The same for a size in bytes, which may also end in K, M or G.
+unsigned long long parse_size(const std::string &s,
+                              unsigned long long min = 0,
+                              unsigned long long max = ULLONG_MAX);
+
 class Argparse {
   public:
     using OptNoValResponder = std::function<void()>;
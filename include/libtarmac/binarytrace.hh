@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#ifndef LIBTARMAC_BINARYTRACE_HH
+#define LIBTARMAC_BINARYTRACE_HH
+
+#include "libtarmac/index.hh"
+#include "libtarmac/parser.hh"
+
+#include <memory>
+#include <string>
+
+/*
+ * A binary trace file holds the stream of events that TarmacLineParser
+ * found in a text trace file, in a compact encoding that can be
+ * replayed into a ParseReceiver far faster than the text can be parsed
+ * again.
+ *
+ * It doesn't contain the text of the trace. Instead it records the
+ * length of each line of the original file, so that anything built
+ * from it, such as an index, refers to the same line numbers and file
+ * positions as if it had been built from the text. The original file
+ * is still needed for anything that displays trace lines.
+ *
+ * The file starts with a 16-byte magic number, followed by a header
+ * describing the original trace, and then a sequence of records, each
+ * a tag byte followed by fields encoded as LEB128 varints. Event
+ * timestamps are stored as zigzag-encoded differences from the
+ * previous event's timestamp.
+ */
+
+struct BinaryTraceHeader {
+    ParseParams pparams;         // options the trace was parsed with
+    TraceFingerprint fingerprint; // of the original text trace file
+    std::string tarmac_filename; // absolute name of that file
+};
+
+// Return true if the file looks like a binary trace, rather than text.
+bool is_binary_trace(const std::string &filename);
+
+// Convert a text trace file into a binary trace. Parse errors and
+// progress are reported through the global reporter, as they are by
+// the indexer.
+void write_binary_trace(const std::string &tarmac_filename,
+                        const std::string &binary_filename,
+                        const ParseParams &pparams);
+
+class Arena;
+
+class BinaryTraceReader {
+    std::shared_ptr<Arena> file;
+    std::string filename;
+    const unsigned char *data, *pos, *end;
+    BinaryTraceHeader hdr;
+    Time prev_time = 0;
+    int cpu = -1;
+    uint64_t final_pos = 0;
+    bool finished = false;
+
+    // Reused for each event, to save reallocating their contents.
+    InstructionEvent iev;
+    RegisterEvent rev;
+    TextOnlyEvent tev;
+
+    void corrupt() const; // reports a fatal error
+    uint64_t varint();
+    unsigned char byte();
+    Time time();
+    void string_into(std::string &out);
+
+  public:
+    // Opens the file, reporting a fatal error if it can't be read or
+    // isn't a binary trace.
+    BinaryTraceReader(const std::string &filename);
+
+    const BinaryTraceHeader &header() const { return hdr; }
+
+    // Replay the events from the next line of the original trace into
+    // 'recv', and set 'linelen' to the length of that line, including
+    // its newline. Returns false, without calling 'recv', if there are
+    // no more lines.
+    bool next_line(ParseReceiver &recv, size_t &linelen);
+
+    // After next_line has returned false, the position in the original
+    // trace file at which reading stopped. (Normally the size of the
+    // file, but earlier if a truncated last line was discarded.)
+    uint64_t end_position() const { return final_pos; }
+
+    // How much of the binary file has been read so far.
+    uint64_t bytes_read() const { return pos - data; }
+};
+
+#endif // LIBTARMAC_BINARYTRACE_HH
@@ -21,6 +21,7 @@
 
 #include "libtarmac/index.hh"
 
+#include <map>
 #include <ostream>
 #include <sstream>
 #include <string>
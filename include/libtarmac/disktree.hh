@@ -36,6 +36,7 @@ class Arena {
     void *mapping = nullptr;
 
   private:
+    unsigned resize_count = 0;
     virtual void resize(size_t newsize) = 0; // must update curr_size
 
   public:
@@ -44,6 +45,25 @@ class Arena {
     OFF_T alloc(size_t size);
     OFF_T curr_offset() const { return next_offset; }
 
+    // Number of times alloc() has had to enlarge the arena.
+    unsigned resizes() const { return resize_count; }
+
+    // Hint that the arena's contents below offset 'end' are unlikely to
+    // be needed again soon, so they need not take up memory. They
+    // remain valid, and are read back in if they are accessed later.
+    // Does nothing in arenas that can't take advantage of it.
+    virtual void release(OFF_T /*end*/) {}
+
+    // Number of bytes of the arena currently in memory, or 0 if that
+    // isn't known. (On Windows, an MMapFile can only report the
+    // working set of the whole process, which includes the arena.)
+    virtual uint64_t resident() const { return 0; }
+
+    // Whether arenas created from now on should ask for huge pages of
+    // memory, on platforms that support them. True unless the user
+    // has turned it off with --no-huge-pages.
+    static bool use_huge_pages;
+
     template <class T> inline T *getptr(OFF_T offset)
     {
         assert(0 <= offset && (OFF_T)sizeof(T) <= next_offset &&
@@ -70,6 +90,7 @@ class MMapFile: public Arena {
 
     const std::string filename;
     bool writable;
+    bool huge_pages;
     PlatformData *pdata;
 
     void map();
@@ -78,12 +99,27 @@ class MMapFile: public Arena {
     void resize(size_t newsize) override;
 
   public:
-    MMapFile(const std::string &filename, bool writable);
+    // 'huge_pages' can turn huge pages off for this file even if
+    // use_huge_pages is set.
+    MMapFile(const std::string &filename, bool writable,
+             bool huge_pages = use_huge_pages);
     ~MMapFile();
+
+    // Write out the pages below 'end', and drop them from both the
+    // mapping and the operating system's file cache. Only whole small
+    // pages are released, so this has no effect on a file mapped with
+    // huge pages.
+    void release(OFF_T end) override;
+    uint64_t resident() const override;
 };
 
-// Arena stored as an allocated block of ordinary memory
+// Arena stored as an allocated block of ordinary memory, moved into
+// memory that can be backed by huge pages once it is big enough to
+// fill one
 class MemArena: public Arena {
+    bool huge_pages = use_huge_pages;
+    bool in_huge_page_block = false;
+
     void resize(size_t newsize) override;
 
   public:
@@ -129,6 +165,17 @@ template <class Payload> class EmptyAnnotation {
     EmptyAnnotation(const EmptyAnnotation &, const EmptyAnnotation &) {}
 };
 
+// Counts of the nodes an AVLDisk has written, for performance
+// statistics. 'nodes_cloned' counts the subset of 'nodes_allocated'
+// that were copies of an existing node which was immutable, or about
+// to become part of a different tree. 'bytes' counts only nodes that
+// extended the arena, not ones reused from the free list.
+struct TreeStats {
+    uint64_t nodes_allocated = 0;
+    uint64_t nodes_cloned = 0;
+    uint64_t bytes = 0;
+};
+
 template <class Payload, class Annotation = EmptyAnnotation<Payload>>
 class AVLDisk {
     friend class AVLTest; // so the unit test can look inside
@@ -187,15 +234,19 @@ class AVLDisk {
         OFF_T next;
     };
 
+    TreeStats counters;
+
     OFF_T alloc_node()
     {
         OFF_T newnode;
+        counters.nodes_allocated++;
         if (freehead) {
             freenode &fn = *arena.getptr<freenode>(freehead);
             newnode = freehead;
             freehead = fn.next;
         } else {
             newnode = arena.alloc(sizeof(disknode));
+            counters.bytes += sizeof(disknode);
         }
 
         disknode &dn = *arena.getptr<disknode>(newnode);
@@ -280,6 +331,7 @@ class AVLDisk {
     {
         if (immutable(n) || must_modify) {
             n.offset = alloc_node();
+            counters.nodes_cloned++;
             if (n.lc)
                 adjust_refcount(n.lc, +1);
             if (n.rc)
@@ -396,10 +448,12 @@ class AVLDisk {
             cmp = root.lc ? -1 : 0;
         }
 
+        // If nothing was removed, the tree is unchanged. (We can't
+        // tell that from the child's offset, because a node written
+        // since the last commit() is modified in place.)
         if (cmp < 0) {
-            OFF_T oldlc = lc.offset;
             lc = remove_main(lc, keyfinder, removed, must_modify);
-            if (lc.offset == oldlc)
+            if (!removed->offset)
                 return root;
 
             rewrite(root, lc.offset, rc.offset, must_modify);
@@ -407,8 +461,11 @@ class AVLDisk {
             k = lc.height;
 
             if (rc.height == k + 2) {
-                node rlc = get(rc.lc);
-                if (rlc.height == k + 1) {
+                // Unlike after an insertion, both of rc's children
+                // can have height k+1 here, and then a single
+                // rotation is the one that keeps the tree balanced.
+                node rlc = get(rc.lc), rrc = get(rc.rc);
+                if (rlc.height > rrc.height) {
                     rc = rotate_right(rc, must_modify);
                     rewrite(root, lc.offset, rc.offset, must_modify);
                 }
@@ -416,9 +473,8 @@ class AVLDisk {
             }
         } else {
             if (cmp > 0) {
-                OFF_T oldrc = rc.offset;
                 rc = remove_main(rc, keyfinder, removed, must_modify);
-                if (rc.offset == oldrc)
+                if (!removed->offset)
                     return root;
             } else {
                 *removed = root;
@@ -441,8 +497,8 @@ class AVLDisk {
             k = rc.height;
 
             if (lc.height == k + 2) {
-                node lrc = get(lc.rc);
-                if (lrc.height == k + 1) {
+                node llc = get(lc.lc), lrc = get(lc.rc);
+                if (lrc.height > llc.height) {
                     lc = rotate_left(lc, must_modify);
                     rewrite(root, lc.offset, rc.offset, must_modify);
                 }
@@ -558,6 +614,63 @@ class AVLDisk {
         }
     }
 
+    // Make a tree from 'k' with the trees 'l' and 'r' as its left
+    // and right children, which may differ in height by any amount.
+    // If they're close enough in height already, that's just a
+    // rewrite of 'k', and otherwise we go down the spine of the
+    // taller tree to a subtree of the right height to put beside the
+    // shorter one, and rebalance on the way back up.
+    node join_main(node &l, node &k, node &r)
+    {
+        if (l.height > r.height + 1) {
+            node lc = get(l.lc), lrc = get(l.rc);
+            node t = join_main(lrc, k, r);
+            if (t.height <= lc.height + 1) {
+                rewrite(l, lc.offset, t.offset, false);
+                return l;
+            }
+            if (get(t.lc).height > get(t.rc).height)
+                t = rotate_right(t, false);
+            rewrite(l, lc.offset, t.offset, false);
+            return rotate_left(l, false);
+        }
+
+        if (r.height > l.height + 1) {
+            node rlc = get(r.lc), rc = get(r.rc);
+            node t = join_main(l, k, rlc);
+            if (t.height <= rc.height + 1) {
+                rewrite(r, t.offset, rc.offset, false);
+                return r;
+            }
+            if (get(t.rc).height > get(t.lc).height)
+                t = rotate_left(t, false);
+            rewrite(r, t.offset, rc.offset, false);
+            return rotate_right(r, false);
+        }
+
+        rewrite(k, l.offset, r.offset, false);
+        return k;
+    }
+
+    template <class PayloadComparable>
+    void split_main(node &root, const PayloadComparable *keyfinder, node *left,
+                    node *right)
+    {
+        if (root.offset == 0) {
+            *left = *right = root;
+            return;
+        }
+
+        node lc = get(root.lc), rc = get(root.rc), sub;
+        if (keyfinder->cmp(root.payload) > 0) {
+            split_main(rc, keyfinder, &sub, right);
+            *left = join_main(lc, root, sub);
+        } else {
+            split_main(lc, keyfinder, left, &sub);
+            *right = join_main(sub, root, rc);
+        }
+    }
+
   public:
     AVLDisk(Arena &arena, bool refcounting = false)
         : arena(arena), refcounting(refcounting)
@@ -572,6 +685,8 @@ class AVLDisk {
         hwm = arena.curr_offset();
     }
 
+    const TreeStats &stats() const { return counters; }
+
     OFF_T clone_tree(OFF_T root)
     {
         adjust_refcount(root, +1);
@@ -706,6 +821,59 @@ class AVLDisk {
         return root.offset;
     }
 
+    // Concatenate two trees, with every element of 'left' sorting
+    // before every element of 'right' (and before or after 'payload'
+    // respectively, in the three-argument form). This takes time
+    // proportional to the difference in their heights.
+    //
+    // join and split can only be used in the non-refcounting mode.
+    // Like insert and remove, they may modify nodes written since the
+    // last commit() in place, so a caller who wants to go on using
+    // the trees it passes in must commit() first.
+    OFF_T join(OFF_T left, Payload payload, OFF_T right)
+    {
+        assert(!refcounting && "join() is only supported in hwm mode");
+        node l = get(left), r = get(right);
+        node k;
+        k.offset = alloc_node();
+        k.lc = k.rc = 0;
+        k.height = 1;
+        k.payload = payload;
+        k.annotation = Annotation(k.payload);
+        put(k);
+        return join_main(l, k, r).offset;
+    }
+
+    OFF_T join(OFF_T left, OFF_T right)
+    {
+        assert(!refcounting && "join() is only supported in hwm mode");
+        if (!left)
+            return right;
+        if (!right)
+            return left;
+
+        // Use the first element of 'right' to join the rest of it on.
+        node l = get(left), r = get(right), first;
+        r = remove_main<Payload>(r, nullptr, &first, immutable(r));
+        return join_main(l, first, r).offset;
+    }
+
+    // Divide a tree into the elements for which keyfinder.cmp returns
+    // a positive value, i.e. the ones that sort before the key, and
+    // the rest. As with pred and succ, the keyfinder can be a class
+    // that never reports equality, to split at a boundary between
+    // elements. Takes time logarithmic in the size of the tree.
+    template <class PayloadComparable>
+    void split(OFF_T root, const PayloadComparable &keyfinder, OFF_T *left,
+               OFF_T *right)
+    {
+        assert(!refcounting && "split() is only supported in hwm mode");
+        node n = get(root), l, r;
+        split_main(n, &keyfinder, &l, &r);
+        *left = l.offset;
+        *right = r.offset;
+    }
+
     using Searcher =
         std::function<int(OFF_T, const Annotation *, OFF_T, const Payload &,
                           const Annotation &, OFF_T, const Annotation *)>;
@@ -801,6 +969,63 @@ class AVLDisk {
             walk(n.rc, order, visitor);
     }
 
+    // Post-order walk that doesn't descend into any subtree whose
+    // root annotation satisfies 'skip'. Useful for visiting each node
+    // once across many roots sharing subtrees, if the visitor leaves
+    // a mark in the annotations of nodes it's dealt with.
+    using SkipPredicate = std::function<bool(const Annotation &)>;
+
+    void walk_unless(OFF_T nodeoff, const SkipPredicate &skip,
+                     WalkVisitor visitor)
+    {
+        if (!nodeoff)
+            return;
+
+        node n = get(nodeoff);
+        if (skip(n.annotation))
+            return;
+
+        walk_unless(n.lc, skip, visitor);
+        walk_unless(n.rc, skip, visitor);
+
+        node lc, rc;
+        Annotation *lca = n.lc ? (lc = get(n.lc), &lc.annotation) : nullptr;
+        Annotation *rca = n.rc ? (rc = get(n.rc), &rc.annotation) : nullptr;
+        visitor(n.payload, n.annotation, n.lc, lca, n.rc, rca, nodeoff);
+        put(n);
+    }
+
+    // Read a single node, for clients that need to steer their own
+    // way around the tree rather than following a single search path.
+    void read_node(OFF_T nodeoff, Payload &payload, Annotation &annotation,
+                   OFF_T &lc, OFF_T &rc) const
+    {
+        const node n = get(nodeoff);
+        payload = n.payload;
+        annotation = n.annotation;
+        lc = n.lc;
+        rc = n.rc;
+    }
+
+    // Size in the arena of a single node.
+    static size_t node_size() { return sizeof(disknode); }
+
+    // Like read_node, but for examining an index that might be
+    // damaged: also returns the node's stored height, and returns
+    // false, without reading anything, if nodeoff is null or there
+    // isn't room for a whole node there.
+    bool read_node_checked(OFF_T nodeoff, Payload &payload,
+                           Annotation &annotation, OFF_T &lc, OFF_T &rc,
+                           int &height) const
+    {
+        if (nodeoff <= 0 ||
+            nodeoff > arena.curr_offset() - (OFF_T)sizeof(disknode))
+            return false;
+        read_node(nodeoff, payload, annotation, lc, rc);
+        height = get(nodeoff).height;
+        return true;
+    }
+
     using SimpleVisitor = std::function<void(const Payload &, OFF_T)>;
 
     void visit(OFF_T nodeoff, SimpleVisitor visitor) const
@@ -820,9 +1045,11 @@ class AVLDisk {
 // file alongside, or in memory via a MemArena.
 struct TracePair {
     std::string tarmac_filename;
+    std::string binary_filename; // pre-parsed events to index, if not empty
 
     bool index_on_disk;
     std::string index_filename;             // if index_on_disk is true
+    bool index_shared = false;              // index is in the index cache
     std::shared_ptr<MemArena> memory_index; // if index_on_disk is false
 };
 
@@ -20,7 +20,9 @@
 #define LIBTARMAC_ELF_HH
 
 #include <memory>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 static constexpr unsigned EI_NIDENT = 16;
 
@@ -59,6 +61,19 @@ struct ElfSectionHeader {
     uint64_t entries() const;
 };
 
+// One row of the address-to-line mapping decoded from a DWARF
+// .debug_line section. Each row applies from its address up to the
+// address of the next row; a row with end_sequence set marks the end
+// of a contiguous range of code, and carries no line information.
+struct ElfLineRow {
+    static constexpr unsigned NO_FILE = ~0U;
+
+    uint64_t address;
+    unsigned file; // index into the file list returned alongside, or NO_FILE
+    unsigned line;
+    bool end_sequence;
+};
+
 struct ElfSymbol {
     uint32_t st_name;
     uint8_t st_bind, st_type; // physically, both stored in st_info
@@ -77,6 +92,21 @@ class ElfFile {
                         ElfSymbol &) const = 0;
     virtual std::string strtab_string(const ElfSectionHeader &shdr,
                                       unsigned offset) const = 0;
+    // Return the full contents of a section, or nullptr if the
+    // section can't be read from the file.
+    virtual const std::vector<uint8_t> *
+    section_data(const ElfSectionHeader &shdr) const = 0;
+    // Find a section by name. Returns false if there isn't one.
+    virtual bool find_section(const std::string &name,
+                              ElfSectionHeader &) const = 0;
+    // Decode the DWARF line number programs in .debug_line. File
+    // names (with their directories prefixed) are written to 'files',
+    // shared between all compilation units that mention the same
+    // file, and the rows of every sequence are appended to 'rows' in
+    // the order the programs generate them. Returns false if there's
+    // no .debug_line section; a unit that can't be decoded is skipped.
+    virtual bool debug_line(std::vector<std::string> &files,
+                            std::vector<ElfLineRow> &rows) const = 0;
 };
 
 std::unique_ptr<ElfFile> elf_open(const std::string &filename);
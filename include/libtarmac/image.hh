@@ -22,11 +22,12 @@
 #include "libtarmac/elf.hh"
 #include "libtarmac/misc.hh"
 
-#include <forward_list>
-#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+class MMapFile;
+
 struct Symbol {
     enum class binding_type { any = 0, local, global };
     enum class kind_type { any = 0, object, function };
@@ -37,19 +38,27 @@ struct Symbol {
     binding_type binding; // can be used for smarter symbol lookup
     kind_type kind;       // can be used for smarter symbol lookup
 
-    Symbol(Addr addr, size_t size, const std::string &name,
+    Symbol(Addr addr, size_t size, const char *name, size_t namelen,
            binding_type binding, kind_type kind)
-        : addr(addr), size(size), binding(binding), kind(kind), name(name)
+        : addr(addr), size(size), binding(binding), kind(kind), name(name),
+          namelen(namelen)
     {
     }
     std::string getName() const;
 
-    bool operator<(const Symbol &other) const { return name < other.name; }
+    bool operator<(const Symbol &other) const;
 
   private:
     // This is private so that clients call getName() instead, which
     // annotates the symbol name to resolve ambiguities.
-    std::string name;
+    //
+    // The name isn't NUL-terminated, and the characters belong to the
+    // Image the symbol came from: either its own copy of the names
+    // read from the ELF file, or its mapping of the symbol cache.
+    const char *name;
+    size_t namelen;
+
+    bool has_name(const char *othername, size_t otherlen) const;
 
     // But Image is allowed to access it, to set these structures up
     // in the first place.
@@ -60,45 +69,181 @@ class Image {
     std::unique_ptr<ElfFile> elf_file;
     const std::string image_filename;
     bool is_big_end;
-    std::forward_list<Symbol> symbols;
-    std::map<Addr, std::vector<const Symbol *>> addrtab;
-    std::map<std::string, std::vector<const Symbol *>> symtab;
 
-    void add_symbol(const Symbol &sym);
+    // All the symbols we're interested in, in the order they were
+    // loaded from the ELF file. This is never modified after the
+    // constructor finishes, so pointers into it remain valid.
+    std::vector<Symbol> symbols;
+
+    // Storage for the symbol names: 'symbol_names' when they were read
+    // from the ELF file, or 'symbol_cache' when the symbols were
+    // loaded from a symbol cache, whose names are used where they lie.
+    std::string symbol_names;
+    std::unique_ptr<MMapFile> symbol_cache;
+
+    // Flat tables for looking up symbols by address, holding indices
+    // into 'symbols'.
+    //
+    // 'interval_starts' divides the address space into intervals, and
+    // the same index in 'interval_syms' gives the sized symbol to
+    // report for any address in that interval (or NO_SYMBOL if no
+    // sized symbol contains it).
+    //
+    // 'label_addrs' lists every distinct symbol address in order, and
+    // 'label_syms' gives the first symbol loaded at each one. These
+    // are the fallback for addresses not covered by a sized symbol.
+    static constexpr unsigned NO_SYMBOL = ~0U;
+    std::vector<Addr> interval_starts;
+    std::vector<unsigned> interval_syms;
+    std::vector<Addr> label_addrs;
+    std::vector<unsigned> label_syms;
+
+    // Tables for looking up symbols by name. 'name_order' lists
+    // indices into 'symbols' sorted by name (and by load order within
+    // a name), so that all symbols with the same name are adjacent.
+    // 'name_hash' is an open-addressed hash table whose nonzero
+    // entries are 1 + the position in 'name_order' of the first
+    // symbol with a given name.
+    std::vector<unsigned> name_order;
+    std::vector<unsigned> name_hash;
+
+    // find_symbol(Addr) results are kept in a small direct-mapped
+    // cache, since clients tend to symbolise the same PC values over
+    // and over. The cache is per thread, so that lookups in the same
+    // Image can be made from several threads at once; entries are
+    // tagged with this identifier, unique to each Image ever created.
+    uint64_t lookup_cache_id;
+
+    // Table mapping addresses to source lines, from the image's DWARF
+    // line information. It's built on first use, since most clients
+    // never need it. Each entry in 'line_info' applies from the same
+    // index in the sorted 'line_addrs' up to the next one; entries
+    // whose file is ElfLineRow::NO_FILE mark gaps with no line
+    // information. Consecutive entries for the same line are merged.
+    struct LineInfo {
+        unsigned file, line;
+    };
+    mutable bool line_table_built = false;
+    mutable std::vector<std::string> source_files;
+    mutable std::vector<Addr> line_addrs;
+    mutable std::vector<LineInfo> line_info;
+
+    struct SymbolCacheKey;
+
     void load_headers();
     void load_symboltable();
+    void build_address_tables();
+    void build_name_tables();
+    void build_line_table() const;
+    const Symbol *find_symbol_uncached(Addr address) const;
+    const Symbol *symbol_or_null(unsigned index) const
+    {
+        return index == NO_SYMBOL ? nullptr : &symbols[index];
+    }
+
+    bool get_symbol_cache_key(SymbolCacheKey &key) const;
+    bool load_symbol_cache(const std::string &filename,
+                           const SymbolCacheKey &key);
+    void save_symbol_cache(const std::string &filename,
+                           const SymbolCacheKey &key) const;
 
   public:
     const std::string &get_filename() const { return image_filename; }
     bool is_big_endian() const { return is_big_end; }
 
+    // Return the lowest address of any symbol in the image, or false
+    // if it has no symbols at all.
+    bool lowest_symbol_address(Addr &out) const;
+
     // Return the 'best' symbol that represent the given address
-    // Returns NULL if no symbol matches
+    // Returns NULL if no symbol matches. Safe to call from several
+    // threads at once.
     const Symbol *find_symbol(Addr address) const;
     // Return the symbol for the given name
     const Symbol *find_symbol(const std::string &name) const;
     const Symbol *find_symbol(const std::string &name, int index) const;
     // Return all symbols with the given name
-    const std::vector<const Symbol *> *
-    find_all_symbols(const std::string &name) const
-    {
-        auto res = this->symtab.find(name);
-        return (res == this->symtab.end() ? nullptr : &res->second);
-    }
     std::vector<const Symbol *>
-    find_all_symbols_starting_with(const std::string &name) const
-    {
-        std::vector<const Symbol *> res;
-        for (const auto &it : this->symtab)
-            if (it.first.rfind(name, 0) == 0)
-                res.insert(res.end(), it.second.begin(), it.second.end());
-        return res;
-    }
-
-    Image(const std::string &image_filename);
+    find_all_symbols(const std::string &name) const;
+    std::vector<const Symbol *>
+    find_all_symbols_starting_with(const std::string &name) const;
+
+    // Return the source file and line that the code at an address
+    // came from, or false if the image has no line information for it.
+    bool find_source_line(Addr address, std::string &file,
+                          unsigned &line) const;
+
+    // If symbol_cache_filename is not empty, the symbol tables are
+    // loaded from that file if it was made from an identical copy of
+    // the image, and otherwise, are written to it after loading the
+    // image in the usual way.
+    Image(const std::string &image_filename,
+          const std::string &symbol_cache_filename = "");
     ~Image();
 
     void dump(); // debug function
 };
 
+// Description of where one image is loaded in the address space of
+// the trace.
+struct ImageMapping {
+    std::shared_ptr<Image> image;
+    uint64_t load_offset = 0; // (loaded address) - (address in image file)
+
+    // If has_range is set, the image is only used to symbolise trace
+    // addresses in the inclusive range [lo,hi]. Otherwise, it's used
+    // for addresses from its lowest symbol upwards, until some other
+    // image takes over.
+    bool has_range = false;
+    Addr lo = 0, hi = 0;
+};
+
+/*
+ * A set of images loaded at different places in the trace's address
+ * space, e.g. a bootloader, a kernel and some user-space programs,
+ * which are queried as if they were a single image.
+ *
+ * Addresses are looked up by a binary search in a flat table that
+ * divides the address space into regions, each belonging to at most
+ * one image, followed by the image's own lookup. Where ranged
+ * mappings overlap, the one added first wins; a ranged mapping takes
+ * priority over an unranged one.
+ */
+class ImageSet {
+    static constexpr unsigned NO_MAPPING = ~0U;
+
+    std::vector<ImageMapping> mappings;
+    std::vector<Addr> region_starts;
+    std::vector<unsigned> region_mappings;
+
+    void build_regions();
+
+  public:
+    ImageSet() = default;
+    ImageSet(std::shared_ptr<Image> image, uint64_t load_offset = 0);
+
+    void add(const ImageMapping &mapping);
+
+    bool empty() const { return mappings.empty(); }
+    const std::vector<ImageMapping> &get_mappings() const { return mappings; }
+
+    // Return the mapping responsible for a given trace address, or
+    // nullptr if there is none.
+    const ImageMapping *mapping_for(Addr addr) const;
+
+    // Look up a symbol by trace address, or by name (in the same
+    // syntax as Image::find_symbol). In both cases, the load offset of
+    // the image the symbol came from is written to *load_offset, so
+    // that the symbol's address in the trace is sym->addr +
+    // *load_offset.
+    const Symbol *find_symbol(Addr addr, uint64_t *load_offset) const;
+    const Symbol *find_symbol(const std::string &name,
+                              uint64_t *load_offset) const;
+
+    // Look up the source line for a trace address, in whichever image
+    // is mapped there.
+    bool find_source_line(Addr addr, std::string &file,
+                          unsigned &line) const;
+};
+
 #endif // LIBTARMAC_IMAGE_HH
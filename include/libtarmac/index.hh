@@ -44,6 +44,37 @@ struct IndexerParams {
     bool record_memory = true;
     bool record_calls = true;
 
+    // In a trace interleaving several CPUs, index only the events from
+    // this one (see TarmacEvent::cpu), or all of them if -1. The
+    // register state, PCs and call depths in the index are then that
+    // CPU's alone, but memory is shared, so writes to it from every
+    // CPU are still recorded. Events from lines that name no CPU are
+    // always included.
+    int cpu = -1;
+
+    // If nonzero, try to keep the resident part of an index file
+    // being built to about this many bytes, by periodically writing
+    // out the data that has stopped changing and dropping it from
+    // memory (see Arena::release). This makes it possible to index a
+    // trace whose index is larger than physical memory, at some cost
+    // in speed. It has no effect on an index built in memory.
+    uint64_t memory_limit = 0;
+
+    // Fill in the content hashes in the memory trees' annotations (see
+    // MemoryAnnotation), which let IndexNavigator::state_equal and
+    // state_diff skip over whole subtrees that match. It costs a pass
+    // over every memory tree after indexing. An index without them
+    // still answers those queries correctly, but they have to hash
+    // every byte in the ranges being compared.
+    bool memory_hashes = false;
+
+    // Time the parser separately from the updates to the index trees
+    // that the events it finds cause, for IndexStats. That reads the
+    // clock twice for every line and every event, so it's only done
+    // when the statistics are wanted straight away (--stats);
+    // otherwise only whole phases of indexing are timed.
+    bool split_timings = false;
+
     bool can_store_on_disk() const {
         /*
          * At present, we only permit disk-based indexes if they
@@ -67,11 +98,149 @@ struct IndexerDiagnostics {
     bool debug_call_heuristics = false;
 };
 
+// Register and memory contents for run_indexer to start from, when
+// the trace file being indexed begins partway through an execution
+// whose earlier state is known from elsewhere (e.g. it was cut out of
+// a longer trace by tarmac-slice).
+struct IndexerSeed {
+    struct Range {
+        char type; // 'r' or 'm', as in the memory tree
+        Addr addr;
+        std::vector<unsigned char> data;
+    };
+    std::vector<Range> ranges;
+    unsigned max_sve_bits = 128;
+};
+
 void run_indexer(const TracePair &trace, const IndexerParams &iparams,
                  const IndexerDiagnostics &idiags, const ParseParams &pparams);
+void run_indexer(const TracePair &trace, const IndexerParams &iparams,
+                 const IndexerDiagnostics &idiags, const ParseParams &pparams,
+                 const IndexerSeed &seed);
+
+// Range of bytes of a trace file for run_indexer to index as one
+// shard of an index built in pieces (see "Index shards" in
+// index_ds.hh). The range should run between two offsets returned by
+// shard_boundary, so that the shards fit together.
+struct IndexerShard {
+    uint64_t start, end;
+};
+
+void run_indexer(const TracePair &trace, const IndexerParams &iparams,
+                 const IndexerDiagnostics &idiags, const ParseParams &pparams,
+                 const IndexerShard &shard);
+
+// Return the offset in a trace file at which shard number n of
+// 'count' should start (or, for n == count, the end of the file).
+// The offsets are spread evenly through the file, and then moved
+// forward to the start of the next line beginning a new instruction,
+// so that no event is divided between shards. If the shards are of an
+// index of one CPU (see IndexerParams::cpu), only that CPU's
+// instructions begin one.
+uint64_t shard_boundary(const std::string &tarmac_filename,
+                        const ParseParams &pparams, unsigned n,
+                        unsigned count, int cpu = -1);
+
+// Combine the shards of an index, built by run_indexer from ranges
+// of a trace file covering the whole of it, into a single index of
+// the file. That's the same as run_indexer would have built in one
+// pass, except that the indexer's internal flags register appears to
+// have been written at the start of each shard. The shards may be
+// given in any order. Of 'iparams', only memory_hashes is used, since
+// everything else was decided when the shards were built.
+void merge_index_shards(const TracePair &trace, const IndexerParams &iparams,
+                        const std::vector<std::string> &shard_filenames);
+
+// Identification of the contents of a trace file, stored in its index
+// so that the index can be recognised as still valid even if the
+// trace file's timestamp has changed, e.g. by copying it to another
+// machine. The sampled hash covers the file size, the head and tail
+// of the file, and a fixed number of blocks spread evenly through it,
+// so it can be checked cheaply however large the file is. The full
+// hash covers every byte, and is only checked on request.
+struct TraceFingerprint {
+    uint64_t size = 0;
+    uint64_t sampled_hash = 0;
+    uint64_t full_hash = 0;
+};
+
+// Compute the fingerprint of a trace file, including the full hash
+// only if 'full' is set. Returns false if the file can't be read.
+bool trace_fingerprint(const std::string &tarmac_filename, bool full,
+                       TraceFingerprint &out);
+
+// The same for the trace file of a TracePair, except that if the
+// trace is to be read from a binary trace file, this returns the
+// fingerprint recorded in that, so the text file need not be present.
+bool trace_fingerprint(const TracePair &trace, bool full,
+                       TraceFingerprint &out);
+
+// Counts and timings gathered by the indexer, recorded in the index
+// file so that they can be shown later by the --stats option or
+// 'tarmac-indextool --header', to see where the time and space went.
+struct IndexStats {
+    // Trace lines read, and events of each type found in them.
+    uint64_t lines = 0;
+    uint64_t instruction_events = 0, register_events = 0,
+             memory_events = 0, exception_events = 0, text_events = 0;
+
+    // Time in microseconds spent reading the trace and indexing its
+    // events as they were found, and in the processing done after the
+    // end of the trace. If IndexerParams::split_timings was set, the
+    // first is also split into the time spent in the parser itself and
+    // in updating the index trees; otherwise those are both 0.
+    uint64_t read_us = 0, parse_us = 0, update_us = 0, postprocess_us = 0;
+
+    // Work done by each tree, and index space taken up by other data.
+    TreeStats seqtree, bypctree, memtree, memsubtree;
+    uint64_t call_depth_array_bytes = 0;
+    uint64_t memory_data_bytes = 0; // register and memory contents
+    uint64_t total_bytes = 0;
+    uint64_t arena_resizes = 0;
+
+    // Peak resident memory of the indexing process, in bytes, and the
+    // number of times it released part of the index from memory to
+    // keep within IndexerParams::memory_limit.
+    uint64_t peak_resident_bytes = 0, memory_releases = 0;
+
+    // The largest resident size of the index file itself that the
+    // indexer measured while keeping within the memory limit (0 if
+    // there wasn't one).
+    uint64_t peak_index_resident_bytes = 0;
+
+    // Call fn on a reference to each of the above values, always in
+    // the same order, as used for storing them in the index file.
+    template <class Fn> void for_each_value(Fn fn)
+    {
+        for (uint64_t *v :
+             {&lines, &instruction_events, &register_events, &memory_events,
+              &exception_events, &text_events, &read_us, &parse_us,
+              &update_us, &postprocess_us, &call_depth_array_bytes,
+              &memory_data_bytes, &total_bytes, &arena_resizes})
+            fn(*v);
+        for (TreeStats *t : {&seqtree, &bypctree, &memtree, &memsubtree}) {
+            fn(t->nodes_allocated);
+            fn(t->nodes_cloned);
+            fn(t->bytes);
+        }
+        // Values added since the first version of the statistics go
+        // at the end, so that an index written without them still
+        // reads correctly.
+        fn(peak_resident_bytes);
+        fn(memory_releases);
+        fn(peak_index_resident_bytes);
+    }
+
+    void print(std::ostream &os) const;
+};
 
 enum class IndexHeaderState { OK, WrongMagic, Incomplete };
-IndexHeaderState check_index_header(const std::string &index_filename);
+// If the header is OK and 'fingerprint' is not null, also returns the
+// fingerprint of the trace file the index was built from; similarly,
+// 'cpu' receives the CPU the index covers (see IndexerParams::cpu).
+IndexHeaderState check_index_header(const std::string &index_filename,
+                                    TraceFingerprint *fingerprint = nullptr,
+                                    int *cpu = nullptr);
 
 class IndexReader {
     const std::string index_filename;
@@ -80,12 +249,15 @@ class IndexReader {
     mutable std::ifstream tarmac;
     bool bigend, thumbonly, aarch64_used;
     unsigned max_sve_bits;
+    int indexed_cpu;
+    TraceFingerprint fingerprint;
+    IndexStats index_stats;
 
     std::string read_tarmac(OFF_T pos, OFF_T len) const;
 
   public:
     AVLDisk<MemoryPayload, MemoryAnnotation> memtree;
-    AVLDisk<MemorySubPayload> memsubtree;
+    AVLDisk<MemorySubPayload, MemorySubAnnotation> memsubtree;
     AVLDisk<SeqOrderPayload, SeqOrderAnnotation> seqtree;
     AVLDisk<ByPCPayload> bypctree;
     OFF_T seqroot, bypcroot;
@@ -103,6 +275,16 @@ class IndexReader {
         return *arena->getptr<diskint<OFF_T>>(pos);
     }
 
+    // Size of the index data, i.e. one more than the largest offset
+    // that can validly be passed to index_offset().
+    OFF_T index_size() const { return arena->curr_offset(); }
+
+    // Return a hash of the known contents of the address range
+    // [lo,hi] of one address space ('r' or 'm') in a memory tree.
+    // Equal contents give equal hashes, whichever trees or even index
+    // files they came from; see MemoryAnnotation.
+    uint64_t memory_hash(OFF_T memroot, char type, Addr lo, Addr hi) const;
+
     std::vector<std::string> get_trace_lines(const SeqOrderPayload &node) const;
     std::string get_trace_line(const SeqOrderPayload &node, unsigned lineno) const;
 
@@ -112,21 +294,40 @@ class IndexReader {
     bool isBigEndian() const { return bigend; }
     bool isAArch64() const { return aarch64_used; }
     bool isThumbOnly() const { return thumbonly; }
+    int indexedCPU() const { return indexed_cpu; } // -1 for all
     unsigned maxSVEBits() const { return max_sve_bits; }
+    const TraceFingerprint &traceFingerprint() const { return fingerprint; }
+    const IndexStats &stats() const { return index_stats; }
     ParseParams parseParams() const;
 };
 
+// A range of addresses in one address space ('r' or 'm') in which
+// two register and memory states differ. See IndexNavigator::state_diff.
+struct StateDifference {
+    char type;
+    Addr lo, hi; // inclusive
+};
+
 class IndexNavigator {
-    std::shared_ptr<Image> image;
-    uint64_t load_offset; // (loaded address) - (address in image file)
+    std::shared_ptr<const ImageSet> images;
+
+    void state_diff_range(OFF_T memroot, const IndexNavigator &other,
+                          OFF_T other_memroot, char type, Addr lo, Addr hi,
+                          std::vector<StateDifference> &out) const;
 
   public:
     IndexReader index;
 
     IndexNavigator(const TracePair &trace,
-                   std::shared_ptr<Image> image = nullptr,
+                   std::shared_ptr<const ImageSet> images = nullptr)
+        : images(images), index(trace)
+    {
+    }
+
+    IndexNavigator(const TracePair &trace, std::shared_ptr<Image> image,
                    uint64_t load_offset = 0)
-        : image(image), load_offset(load_offset), index(trace)
+        : IndexNavigator(trace,
+                         std::make_shared<ImageSet>(image, load_offset))
     {
     }
 
@@ -152,8 +353,8 @@ class IndexNavigator {
         return index.get_index_filename();
     }
 
-    bool has_image() const { return bool(image); }
-    std::shared_ptr<Image> get_image() const { return image; }
+    bool has_image() const { return images && !images->empty(); }
+    std::shared_ptr<const ImageSet> get_images() const { return images; }
 
     bool lookup_symbol(const std::string &name, uint64_t &addr) const;
     bool lookup_symbol(const std::string &name, uint64_t &addr,
@@ -174,6 +375,29 @@ class IndexNavigator {
                      const void **outdata, Addr *outaddr, size_t *outsize,
                      unsigned *outline) const;
 
+    // Compare the register and memory state in 'memroot' with the
+    // state in 'other_memroot', which belongs to the index of 'other'
+    // (possibly the same navigator, or one for a different trace).
+    // The comparison can cover all registers and memory, or one range
+    // of one address space. It works by comparing hashes of whole
+    // subtrees, so it takes time logarithmic in the size of the state
+    // for each range that differs.
+    //
+    // state_diff lists the maximal ranges that differ, in address
+    // order. A byte that's known in one state and unknown in the
+    // other counts as a difference.
+    bool state_equal(OFF_T memroot, const IndexNavigator &other,
+                     OFF_T other_memroot) const;
+    bool state_equal(OFF_T memroot, const IndexNavigator &other,
+                     OFF_T other_memroot, char type, Addr lo, Addr hi) const;
+    std::vector<StateDifference> state_diff(OFF_T memroot,
+                                            const IndexNavigator &other,
+                                            OFF_T other_memroot) const;
+    std::vector<StateDifference> state_diff(OFF_T memroot,
+                                            const IndexNavigator &other,
+                                            OFF_T other_memroot, char type,
+                                            Addr lo, Addr hi) const;
+
     // Read the iflags at a given time.
     unsigned get_iflags(OFF_T memroot) const;
 
@@ -189,6 +413,14 @@ class IndexNavigator {
 
     bool node_at_time(Time t, SeqOrderPayload *node) const;
     bool node_at_line(unsigned line, SeqOrderPayload *node) const;
+
+    // Count the nodes of the sequential-order tree, i.e. the
+    // instruction-sized events of the trace, and find one by its
+    // position in that sequence (counting from zero). Two traces of
+    // the same program can be aligned by these positions even if
+    // their timestamps and line numbers differ.
+    unsigned node_count() const;
+    bool node_at_position(unsigned pos, SeqOrderPayload *node) const;
     bool get_previous_node(SeqOrderPayload &in, SeqOrderPayload *out) const;
     bool get_next_node(SeqOrderPayload &in, SeqOrderPayload *out) const;
     bool find_buffer_limit(bool end, SeqOrderPayload *node) const;
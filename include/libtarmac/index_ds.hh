@@ -328,6 +328,26 @@ ignore every subtree that doesn't contain any modification later than
 the earlier cutoff time; iterate over whatever is left of the tree
 under that filtered view.)
 
+ * A hash of the contents of all the memory in the subtree. This is
+   the sum (mod 2^64) of a hash of every individual byte, including
+   its address-space identifier and address. Since the sum doesn't
+   depend on how the bytes are grouped, it depends only on the
+   contents of the memory, not on how it happens to be divided into
+   nodes or on the shape of the tree - so it's meaningful to compare
+   it between different memory trees, or even different index files.
+   Combined with the address-sorted layout, this lets you compare two
+   whole ``memtree`` roots, or any range of addresses in them, by
+   comparing hashes, descending only into ranges that differ.
+
+The content of a memory sub-tree can still change after a ``memtree``
+node refers to it, so the hash annotations can't be computed when a
+node is made. Instead, the indexer fills them all in with a final pass
+over every ``memtree`` root, after the whole trace has been read. (Each
+annotation also has a flag saying it's been done, so that the pass
+visits each node only once, however many trees share it.) The memory
+sub-trees themselves are annotated with a sum of their byte hashes in
+the same way, which is computed normally as they're built.
+
 Memory sub-trees
 ~~~~~~~~~~~~~~~~
 
@@ -372,6 +392,30 @@ values are all congruent to 0 mod 4 (A32 and A64) or 1 or 3 mod 4
 (Thumb, since we use the 'low bit set' representation understood by
 BX).
 
+Index shards
+~~~~~~~~~~~~
+
+A large trace can be indexed in pieces, each covering a range of
+bytes of the trace file, by separate processes. Each piece, or
+*shard*, is an index file in the above format, with its line numbers
+counted from the start of its own range, and an extra header
+(``ShardHeader`` below) describing how it fits together with the
+others.
+
+Every shard but the first starts with the whole of memory *and* the
+registers covered by two memory sub-trees, standing for the unknown
+state left by the previous shards. When the shards are merged into a
+single index, every ``memtree`` entry citing one of those sub-trees is
+replaced with the corresponding range of the final memory tree of the
+previous shard, and any data the shard learned by reading memory
+covered by them is filled in to the previous shard's sub-trees, just
+as if it had been read during a single pass over the whole trace.
+
+Each shard also lists the transfers of control it saw, with enough of
+the state at each one for the merger to run the heuristic that
+matches calls with returns over the whole trace, and then fill in
+the call depths of the merged ``seqtree``.
+
  */
 
 /* ----------------------------------------------------------------------
@@ -403,8 +447,89 @@ struct FileHeader {
     // the file (e.g. because of an initial header line), this stores
     // the offset, for adjusting line numbers shown during browsing.
     diskint<unsigned> lineno_offset;
+
+    // Identification of the trace file contents the index was built
+    // from, used to decide whether the index is still valid. See
+    // TraceFingerprint.
+    diskint<uint64_t> trace_size;
+    diskint<uint64_t> trace_sampled_hash;
+    diskint<uint64_t> trace_full_hash;
+
+    // Offset of the statistics gathered while building the index
+    // (see IndexStats), stored as a count of values followed by the
+    // values themselves, each a diskint<uint64_t>.
+    diskint<OFF_T> stats;
+
+    // One more than the number of the CPU whose events the index
+    // covers, in a multi-core trace, or 0 if it covers all of them.
+    // See IndexerParams::cpu.
+    diskint<unsigned> cpu;
+
+    // Offset of a ShardHeader, if this file is one shard of an index
+    // built in pieces, or 0 in an ordinary index.
+    diskint<OFF_T> shard;
+};
+
+/* ----------------------------------------------------------------------
+ * Extra header for an index shard, describing the part of the trace
+ * it covers and the state that has to be carried over between shards
+ * when they are merged.
+ */
+struct ShardHeader {
+    // Byte range of the trace file covered by the shard.
+    diskint<OFF_T> trace_start, trace_end;
+
+    // Lines in that range, counted as the shard's seqtree numbers them
+    // (i.e. from its first event), and in total.
+    diskint<unsigned> lines, file_lines;
+
+    // Offsets of the roots of the memory sub-trees standing for the
+    // memory and registers at the start of the shard, or 0 in the
+    // first shard.
+    diskint<OFF_T> memory_at_start, registers_at_start;
+
+    // Array of the transfers of control the shard saw (ShardTransfer
+    // below). A shard can't tell which of them are calls and returns
+    // by itself, because a call made in an earlier shard might return
+    // in this one, so the merger does that for all the shards at once.
+    diskint<OFF_T> transfers;
+    diskint<unsigned> ntransfers;
+
+    // The state of that analysis at the end of the shard, to carry on
+    // into the next one: the address and return address expected to
+    // follow the last instruction (~0 if there were no instructions),
+    // the number of instructions since lr was last written, the
+    // highest stack pointer value written after the last transfer,
+    // and SHARD_LR_INHERITED if lr_age counts from the start of the
+    // shard.
+    diskint<Addr> final_expected_pc, final_expected_lr;
+    diskint<unsigned> final_lr_age, final_flags;
+    diskint<Addr> final_max_sp;
 };
 
+struct ShardTransfer {
+    diskint<unsigned> line;  // first line of the node transferred to
+    diskint<unsigned> flags; // see below
+    diskint<Addr> pc;        // address transferred to
+    diskint<Addr> sp;        // stack pointer, or ~0 if the shard didn't know
+    diskint<Addr> lr;        // link register, if SHARD_LR_KNOWN
+    diskint<Addr> expected_lr; // return address of a call from here
+
+    // Instructions since lr was written or the last transfer, and the
+    // highest stack pointer value written since the last transfer (or
+    // 0 if none was).
+    diskint<unsigned> lr_age;
+    diskint<Addr> max_sp;
+};
+
+// Flag definitions for ShardTransfer::flags and ShardHeader::final_flags
+#define SHARD_FIRST 0x1U  // the shard's first instruction, whose predecessor
+                          // it didn't see, so it may not be a transfer
+#define SHARD_LR_KNOWN 0x2U     // the shard knew the value of lr
+#define SHARD_LR_INHERITED 0x4U // lr_age counts from the start of the
+                                // shard, because neither lr nor a transfer
+                                // had been seen since then
+
 // Flag definitions for FileHeader::flags
 #define FLAG_BIGEND 0x00000001U // trace was believed big-endian at index time
 #define FLAG_AARCH64_USED 0x00000002U // trace includes AArch64 execution state
@@ -475,6 +600,34 @@ struct CallDepthArrayEntry {
     diskint<OFF_T> leftlink, rightlink;
 };
 
+/* ----------------------------------------------------------------------
+ * Content hashes for the memory tree. Each known byte of register or
+ * memory state contributes a pseudo-random value depending on its
+ * address space, address and contents, and the hash of a region is
+ * the sum of the contributions of its bytes, so that it doesn't
+ * matter how the region is split up.
+ */
+
+inline uint64_t memory_byte_hash(char type, Addr addr, unsigned char value)
+{
+    auto mix = [](uint64_t h) {
+        // the splitmix64 finaliser
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    };
+    return mix(mix(addr) + ((unsigned char)type << 8 | value));
+}
+
+inline uint64_t memory_block_hash(char type, Addr addr,
+                                  const unsigned char *data, size_t size)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < size; i++)
+        hash += memory_byte_hash(type, addr + i, data[i]);
+    return hash;
+}
+
 /* ----------------------------------------------------------------------
  * Payload and annotation formats for the memory tree
  */
@@ -515,6 +668,12 @@ struct MemoryAnnotation {
     // node's subtree was last touched
     diskint<unsigned> latest;
 
+    // Sum of memory_byte_hash() over every known byte in this node's
+    // subtree. Only valid once 'hashed' is set, by the indexer's
+    // final pass.
+    diskint<uint64_t> hash;
+    diskint<unsigned char> hashed;
+
     MemoryAnnotation() : latest(0) {}
     MemoryAnnotation(const MemoryPayload &p) : latest(p.trace_file_firstline) {}
     MemoryAnnotation(const MemoryAnnotation &lhs, const MemoryAnnotation &rhs)
@@ -533,6 +692,9 @@ struct MemorySubPayload {
     // This is always just a raw range of bytes in the file
     diskint<OFF_T> contents;
 
+    // memory_block_hash() of the contents
+    diskint<uint64_t> hash;
+
     int cmp(const struct MemorySubPayload &rhs) const
     {
         if (hi < rhs.lo)
@@ -543,6 +705,19 @@ struct MemorySubPayload {
     }
 };
 
+struct MemorySubAnnotation {
+    // Sum of the hashes of all the payloads in this node's subtree
+    diskint<uint64_t> hash;
+
+    MemorySubAnnotation() {}
+    MemorySubAnnotation(const MemorySubPayload &p) : hash(p.hash) {}
+    MemorySubAnnotation(const MemorySubAnnotation &lhs,
+                        const MemorySubAnnotation &rhs)
+        : hash(lhs.hash + rhs.hash)
+    {
+    }
+};
+
 /* ----------------------------------------------------------------------
  * Payload format for the PC tree
  */
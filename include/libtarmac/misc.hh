@@ -86,6 +86,22 @@ bool get_file_timestamp(const std::string &filename, uint64_t *out_timestamp);
 bool is_interactive();
 std::string get_error_message();
 
+// The largest amount of physical memory, in bytes, that the process
+// has had resident at once so far, or 0 if that isn't known.
+uint64_t peak_resident_memory();
+
+// Size of the huge pages that index arenas ask the operating system
+// for, to save TLB misses when searching large trees.
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Resize a block of memory that the operating system can back with
+// huge pages, keeping its contents, or allocate one if 'block' is
+// null. Returns nullptr, leaving the old block alone, if that fails
+// or the platform has no huge pages. Such a block must be freed with
+// free_huge_page_block, passing the size it was last given.
+void *resize_huge_page_block(void *block, size_t oldsize, size_t newsize);
+void free_huge_page_block(void *block, size_t size);
+
 FILE *fopen_wrapper(const char *filename, const char *mode);
 struct tm localtime_wrapper(time_t t);
 std::string asctime_wrapper(struct tm tm);
@@ -94,6 +110,35 @@ bool get_conf_path(const std::string &filename, std::string &out);
 
 bool get_environment_variable(const std::string &varname, std::string &out);
 
+// The absolute name of an existing file, or 'path' unchanged if that
+// can't be determined.
+std::string absolute_path(const std::string &path);
+
+// Rename a file, replacing any existing file of the new name.
+bool rename_file(const std::string &from, const std::string &to);
+
+// Create a directory, and any of its parents that don't exist yet. It
+// isn't an error if the directory already exists.
+bool make_directories(const std::string &path);
+
+// An exclusive lock on a file, which is created if it doesn't already
+// exist. Constructing one of these waits until no other process holds
+// a lock on the same file, and the lock is held until the object is
+// destroyed. The lock is only advisory: it excludes other users of
+// this class, not other ways of accessing the file.
+class FileLock {
+    struct PlatformData;
+
+    const std::string filename;
+    PlatformData *pdata;
+
+  public:
+    FileLock(const std::string &filename);
+    ~FileLock();
+    FileLock(const FileLock &) = delete;
+    FileLock &operator=(const FileLock &) = delete;
+};
+
 #ifdef _WIN32
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
@@ -28,6 +28,12 @@
 
 struct TarmacEvent {
     Time time;
+
+    // In a trace interleaving several CPUs, the number from the cpuN
+    // trace source identifier on the line this event came from, or -1
+    // if the line didn't have one.
+    int cpu = -1;
+
     TarmacEvent(Time time) : time(time) {}
     TarmacEvent() = default;
     TarmacEvent(const TarmacEvent &) = default;
@@ -152,6 +158,64 @@ class ParseReceiver {
     // parse_warning can return true to automatically upgrade the
     // warning to an error
     virtual bool parse_warning(const std::string & /*msg*/) { return false; }
+
+    // A receiver that ignores highlight() can return false here, which
+    // lets the parser use faster code for the commonest kinds of line
+    // once it has recognised the dialect of the trace.
+    virtual bool wants_highlights() const { return true; }
+};
+
+// ParseReceiver that passes on to another receiver only the events
+// from one CPU of a multi-core trace (and those with no CPU id), the
+// same ones the indexer uses when it's given a CPU. This is for
+// re-parsing trace lines found via an index built that way. A
+// negative cpu passes everything on.
+class CPUFilter : public ParseReceiver {
+    ParseReceiver &out;
+    int cpu;
+
+    bool wanted(const TarmacEvent &ev) const
+    {
+        return cpu < 0 || ev.cpu < 0 || ev.cpu == cpu;
+    }
+
+  public:
+    CPUFilter(ParseReceiver &out, int cpu) : out(out), cpu(cpu) {}
+
+    void got_event(InstructionEvent &ev) override
+    {
+        if (wanted(ev))
+            out.got_event(ev);
+    }
+    void got_event(RegisterEvent &ev) override
+    {
+        if (wanted(ev))
+            out.got_event(ev);
+    }
+    void got_event(MemoryEvent &ev) override
+    {
+        if (wanted(ev))
+            out.got_event(ev);
+    }
+    void got_event(TextOnlyEvent &ev) override
+    {
+        if (wanted(ev))
+            out.got_event(ev);
+    }
+    void got_event(ExceptionEvent &ev) override
+    {
+        if (wanted(ev))
+            out.got_event(ev);
+    }
+    void highlight(size_t start, size_t end, HighlightClass hc) override
+    {
+        out.highlight(start, end, hc);
+    }
+    bool parse_warning(const std::string &msg) override
+    {
+        return out.parse_warning(msg);
+    }
+    bool wants_highlights() const override { return out.wants_highlights(); }
 };
 class TarmacLineParserImpl;
 class TarmacLineParser {
@@ -161,6 +225,11 @@ class TarmacLineParser {
     TarmacLineParser(const ParseParams &params, ParseReceiver &);
     ~TarmacLineParser();
     void parse(const std::string &s) const;
+
+    // The name of the Tarmac dialect that the parser has recognised
+    // from the first lines of its input, and is using a faster code
+    // path for, or "" if none.
+    std::string dialect() const;
 };
 
 #endif // LIBTARMAC_PARSER_HH
@@ -23,6 +23,7 @@
 
 #include <ostream>
 #include <string>
+#include <vector>
 
 /*
  * List macro giving the known general register _classes_. For each
@@ -109,6 +110,13 @@ Addr reg_offset(const RegisterId &reg, unsigned internal_flags);
 bool reg_needs_iflags(RegPrefix pfx);
 bool reg_needs_iflags(const RegisterId &reg);
 
+// Find the registers whose storage overlaps the range [lo,hi] of the
+// register address space, in address order. Aliased register classes
+// are not reported separately, but the names are chosen to suit the
+// execution state given in iflags: rN rather than xN in AArch32, and
+// vN or qN rather than zN if only the low 128 bits are involved.
+std::vector<RegisterId> regs_in_range(Addr lo, Addr hi, unsigned iflags);
+
 /*
  * Bit values for the 'internal_flags' fake register.
  */
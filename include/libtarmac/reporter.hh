@@ -27,15 +27,24 @@
 enum class IndexUpdateCheck {
     OK,             // no rebuild needed
     Missing,        // rebuild needed: index not present
-    TooOld,         // rebuild needed: index older than trace file
+    Changed,        // rebuild needed: trace file contents have changed
     WrongFormat,    // rebuild needed: index has wrong file format version
     Incomplete,     // rebuild needed: previous generation did not finish
+    WrongCPU,       // rebuild needed: index covers a different CPU
     Forced,         // rebuild explicitly requested by user
     InMemory,       // index is not stored on disk at all, so must be built
 };
 
 struct TracePair;
 
+// A snapshot of how far the indexer has got, passed to
+// Reporter::indexing_progress() and Reporter::indexing_done().
+struct IndexingProgress {
+    std::streampos pos = 0;            // bytes of the trace file read
+    unsigned long long lines = 0;      // lines of the trace file read
+    unsigned long long index_size = 0; // bytes of index written so far
+};
+
 /*
  * A Reporter is an object that knows how to display diagnostics to
  * the user, and perhaps exit in the case where diagnostics are fatal.
@@ -50,6 +59,7 @@ struct TracePair;
 class Reporter {
   protected:
     bool verbose = false, progress = false;
+    std::ostream *progress_stream = nullptr;
 
   public:
     virtual ~Reporter() = default;
@@ -85,10 +95,20 @@ class Reporter {
 
     void set_indexing_progress(bool val) { progress = val; }
 
-    // Report progress during file indexing.
+    // Also write progress reports in a machine-readable form to this
+    // stream, if the implementation supports it. Null to turn off.
+    void set_indexing_progress_stream(std::ostream *os)
+    {
+        progress_stream = os;
+    }
+
+    // Report progress during file indexing. The indexer only calls
+    // indexing_progress every few thousand lines, so that it costs
+    // nothing noticeable, but that can still be much more often than
+    // is worth updating a display.
     virtual void indexing_start(std::streampos total) = 0;
-    virtual void indexing_progress(std::streampos pos) = 0;
-    virtual void indexing_done() = 0;
+    virtual void indexing_progress(const IndexingProgress &prog) = 0;
+    virtual void indexing_done(const IndexingProgress &prog) = 0;
 };
 
 std::unique_ptr<Reporter> make_cli_reporter();
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Routines for scanning Tarmac text quickly: finding the ends of
+ * lines, runs of whitespace, words and hex digits, and converting hex
+ * digits to binary.
+ *
+ * Apart from finding line ends, which the C library's memchr already
+ * does as fast as anything we could write, each routine has a portable
+ * implementation, and on x86-64, SSE2 and AVX2 implementations, of
+ * which the fastest that the CPU supports is chosen at run time. All
+ * of them give exactly the same results, including treating bytes
+ * outside ASCII according to the current locale, as the <cctype>
+ * functions do.
+ */
+
+#ifndef LIBTARMAC_SCAN_HH
+#define LIBTARMAC_SCAN_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum class ScanImpl { Portable, SSE2, AVX2 };
+
+struct ScanRoutines {
+    const char *name;
+
+    // Each of these returns the first position in [p,end) that is
+    // not in the named class of characters, or end if there isn't one.
+    // 'word' characters are the ones the Tarmac parser allows in a
+    // word: alphanumerics, '_', '-', '.' and '#'.
+    const char *(*skip_space)(const char *p, const char *end);
+    const char *(*skip_word)(const char *p, const char *end);
+    const char *(*skip_hex)(const char *p, const char *end);
+
+    // Convert the 2*nbytes hex digits at 'hex' into nbytes bytes,
+    // keeping them in the same order. Returns false if any of the
+    // characters is not a hex digit, in which case the contents of
+    // 'out' are unspecified.
+    bool (*hex_to_bytes)(const char *hex, size_t nbytes, uint8_t *out);
+};
+
+// Return a particular implementation of the routines, or nullptr if
+// it isn't supported by this build or this CPU.
+const ScanRoutines *scan_routines(ScanImpl impl);
+
+// The fastest supported implementation, used by the functions below.
+extern const ScanRoutines *best_scan_routines;
+
+inline const char *scan_space(const char *p, const char *end)
+{
+    return best_scan_routines->skip_space(p, end);
+}
+inline const char *scan_word(const char *p, const char *end)
+{
+    return best_scan_routines->skip_word(p, end);
+}
+inline const char *scan_hex(const char *p, const char *end)
+{
+    return best_scan_routines->skip_hex(p, end);
+}
+// Returns the first '\n' in [p,end), or end if there isn't one.
+inline const char *scan_newline(const char *p, const char *end)
+{
+    const void *nl = memchr(p, '\n', end - p);
+    return nl ? static_cast<const char *>(nl) : end;
+}
+inline bool hex_to_bytes(const char *hex, size_t nbytes, uint8_t *out)
+{
+    return best_scan_routines->hex_to_bytes(hex, nbytes, out);
+}
+
+#endif // LIBTARMAC_SCAN_HH
@@ -20,9 +20,12 @@
 #define TARMAC_MAIN_COMMON_HH
 
 #include "libtarmac/argparse.hh"
+#include "libtarmac/image.hh"
 #include "libtarmac/index.hh"
 #include "libtarmac/misc.hh"
 
+#include <fstream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -50,6 +53,15 @@ class TarmacUtilityBase {
     bool only_index() const { return onlyIndex; }
     bool is_verbose() const { return verbose; }
 
+    // The name of the index file that goes with a trace file, if it
+    // isn't specified explicitly or kept in the index cache. This
+    // depends on the indexing options, such as --cpu.
+    std::string defaultIndexFilename(const std::string &tarmac_filename) const;
+    // The same for a trace being indexed, which is named after the
+    // binary trace if it's indexed from one, so that the index sits
+    // next to the file named on the command line.
+    std::string defaultIndexFilename(const TracePair &trace) const;
+
     // Functions that clients can call before add_options(), to signal
     // which functionality is present and/or relevant in this tool, so
     // as to control its command-line options and behaviour.
@@ -58,8 +70,48 @@ class TarmacUtilityBase {
         iparams = iparams_;
     }
 
-    std::string image_filename;
-    uint64_t load_offset = 0;
+    // For tools that examine the index file itself: if an index file
+    // already exists, use it as it is, instead of rebuilding it
+    // because it is out of date or unfinished. (It is still rebuilt
+    // if the user asks for that with --force-index.)
+    void keep_existing_index() { keep_index = true; }
+
+    // For tools that write index files of their own, instead of
+    // finding, checking and perhaps rebuilding the index of the
+    // trace: leave out the options that control that, and don't do it
+    // in setup().
+    void builds_own_index()
+    {
+        own_index = true;
+        indexing = Troolean::No;
+    }
+
+    // For tools that only parse the trace, without indexing it at
+    // all: as builds_own_index(), but also leave out the options that
+    // only affect how an index is built.
+    void does_not_index()
+    {
+        builds_own_index();
+        no_index = true;
+    }
+
+    // For tools that compare register and memory states: build the
+    // memory trees' content hashes when indexing (see
+    // IndexerParams::memory_hashes).
+    void want_memory_hashes() { iparams.memory_hashes = true; }
+
+    // One of these for each --image option on the command line, with
+    // the --load-offset and --image-range options that follow it.
+    struct ImageSpec {
+        std::string filename;
+        uint64_t load_offset = 0;
+        bool has_range = false;
+        Addr lo = 0, hi = 0;
+    };
+    std::vector<ImageSpec> image_specs;
+
+    // The images loaded by setup(), or null if none were specified.
+    std::shared_ptr<ImageSet> images;
 
   protected:
     enum class Troolean { No, Auto, Yes };
@@ -68,19 +120,52 @@ class TarmacUtilityBase {
     bool can_use_image = true;
     bool onlyIndex = false;
     bool index_on_disk = true;
+    bool strict_index_check = false;
+    bool keep_index = false;
+    bool own_index = false;
+    bool no_index = false;
+    bool show_stats = false;
     // Marks whether bigend was specified via a parameter
     bool bigend_explicit = false;
     bool bigend = false;
     bool thumbonly = false;
     bool verbose;
     bool show_progress_meter;
+    std::string progress_filename; // machine-readable progress, if non-empty
+    std::unique_ptr<std::ofstream> progress_stream;
+    bool use_symbol_cache = false;
+    std::string symbol_cache_filename;
+    std::string index_cache_dir; // empty if not using an index cache
 
     IndexerParams iparams;
     IndexerDiagnostics idiags;
 
+    // The parsing options selected on the command line.
+    ParseParams parse_params() const;
+
     void updateIndexIfNeeded(const TracePair &trace) const;
 
+    // Load the images, if any, and reconcile their endianness with
+    // the command-line options. 'index_filename' is used to decide
+    // where to put the symbol cache, if one was asked for without
+    // saying where.
+    void setupImages(const std::string &index_filename);
+
+    // If an index cache directory is configured, and the trace has no
+    // index file name of its own, point it at the index in the cache
+    // that matches the trace contents and our indexing parameters.
+    void useIndexCache(TracePair &trace) const;
+
+    // If the trace file named on the command line is a binary trace,
+    // arrange to index from that, while still reading trace lines
+    // from the text trace file it was made from.
+    void useBinaryTrace(TracePair &trace);
+
   private:
+    // The ImageSpec that a --load-offset or --image-range option
+    // applies to.
+    ImageSpec &current_image_spec();
+
     // Subclass-dependent functionality.
     virtual void postProcessOptions() = 0;
     virtual void setupIndex() const = 0;
@@ -115,7 +200,7 @@ struct TarmacUtilityMT : public TarmacUtilityBase {
     std::vector<TracePair> traces;
 
     virtual void add_options(Argparse &ap) override;
-    virtual void postProcessOptions() override {}
+    virtual void postProcessOptions() override;
     virtual void setupIndex() const override
     {
         for (const TracePair &trace : traces)
@@ -22,10 +22,13 @@
 #include "libtarmac/reporter.hh"
 
 #include <cassert>
+#include <cctype>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <queue>
 #include <sstream>
+#include <stdexcept>
 
 using std::cout;
 using std::deque;
@@ -416,3 +419,62 @@ void Argparse::help(ostream &os)
     showopt(programname + " --help", _("display this text"),
             SPECIALHELPINDENT1);
 }
+
+// Parse a number with an optional unit suffix from 'units', each of
+// which multiplies it by a further 1024.
+static unsigned long long parse_number(const string &s, const char *units,
+                                       const string &errmsg,
+                                       unsigned long long min,
+                                       unsigned long long max)
+{
+    // std::stoull accepts leading spaces and a minus sign, so only
+    // let it see strings that start with a digit.
+    if (s.empty() || !isdigit((unsigned char)s[0]))
+        throw ArgparseError(errmsg);
+
+    size_t pos;
+    unsigned long long value;
+    try {
+        value = std::stoull(s, &pos, 0);
+    } catch (const std::invalid_argument &) {
+        throw ArgparseError(errmsg);
+    } catch (const std::out_of_range &) {
+        throw ArgparseError(format(_("'{}': numeric value out of range"), s));
+    }
+
+    if (pos + 1 == s.size() && *units) {
+        const char *unit = strchr(units, toupper((unsigned char)s[pos]));
+        if (unit) {
+            unsigned shift = 10 * (unit - units + 1);
+            if (value > (ULLONG_MAX >> shift))
+                throw ArgparseError(
+                    format(_("'{}': numeric value out of range"), s));
+            value <<= shift;
+            pos++;
+        }
+    }
+    if (pos != s.size())
+        throw ArgparseError(errmsg);
+
+    if (value < min)
+        throw ArgparseError(format(_("'{}': value must be at least {}"), s,
+                                   min));
+    if (value > max)
+        throw ArgparseError(format(_("'{}': value must be at most {}"), s,
+                                   max));
+    return value;
+}
+
+unsigned long long parse_unsigned(const string &s, unsigned long long min,
+                                  unsigned long long max)
+{
+    return parse_number(
+        s, "", format(_("'{}': unable to parse numeric value"), s), min, max);
+}
+
+unsigned long long parse_size(const string &s, unsigned long long min,
+                              unsigned long long max)
+{
+    return parse_number(s, "KMG", format(_("'{}': unable to parse size"), s),
+                        min, max);
+}
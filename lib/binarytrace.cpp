@@ -0,0 +1,435 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/binarytrace.hh"
+#include "libtarmac/disktree.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using std::endl;
+using std::ifstream;
+using std::ofstream;
+using std::ostringstream;
+using std::string;
+
+static const char binary_trace_magic[16 + 1] = "TarmacBinaryV001";
+
+// Record tags.
+enum : unsigned char {
+    TAG_END,         // final position in original file
+    TAG_LINE,        // length of the next line of the original file
+    TAG_INSTRUCTION, // time, effect, pc, iset, width, instruction, disasm
+    TAG_REGISTER,    // time, prefix, index, offset, byte count, bytes
+    TAG_MEMORY,      // time, read/known flags, size, addr, contents
+    TAG_EXCEPTION,   // time
+    TAG_TEXT,        // time, type, message
+    TAG_TRUNCATED,   // discard the line just replayed, and stop there
+    TAG_CPU,         // CPU id + 1 (0 for none) of the events that follow
+};
+
+// Header flags.
+enum : unsigned {
+    BT_FLAG_BIGEND = 1,
+    BT_FLAG_THUMB_ONLY = 2,
+};
+
+bool is_binary_trace(const string &filename)
+{
+    ifstream ifs(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+    char magic[16];
+    return ifs.read(magic, sizeof(magic)) &&
+           !memcmp(magic, binary_trace_magic, sizeof(magic));
+}
+
+class BinaryTraceWriter : public ParseReceiver {
+    string filename, tarmac_filename;
+    ofstream ofs;
+    string buf; // records not yet written to ofs
+    uint64_t written = 0;
+    Time prev_time = 0;
+    int prev_cpu = -1;
+
+  public:
+    unsigned lineno = 0; // for parse warnings
+
+    BinaryTraceWriter(const string &filename, const string &tarmac_filename)
+        : filename(filename), tarmac_filename(tarmac_filename)
+    {
+        ofs.open(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+        if (ofs.fail())
+            reporter->err(1, "%s: open", filename.c_str());
+        buf.append(binary_trace_magic, 16);
+    }
+
+    void byte(unsigned char b) { buf.push_back(b); }
+
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80) {
+            buf.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        buf.push_back((unsigned char)value);
+    }
+
+    void str(const string &s)
+    {
+        varint(s.size());
+        buf.append(s);
+    }
+
+    // Start an event record, preceded by a change of CPU if the
+    // event's differs from the last one's.
+    void event(unsigned char tag, const TarmacEvent &ev)
+    {
+        if (ev.cpu != prev_cpu) {
+            byte(TAG_CPU);
+            varint(ev.cpu + 1);
+            prev_cpu = ev.cpu;
+        }
+        byte(tag);
+        time(ev.time);
+    }
+
+    void time(Time t)
+    {
+        int64_t delta = (int64_t)(t - prev_time);
+        varint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        prev_time = t;
+    }
+
+    void flush(bool force = false)
+    {
+        if (buf.size() >= 65536 || force) {
+            ofs.write(buf.data(), buf.size());
+            written += buf.size();
+            buf.clear();
+        }
+    }
+
+    uint64_t bytes_written() const { return written + buf.size(); }
+
+    void close()
+    {
+        flush(true);
+        ofs.close();
+        if (ofs.fail())
+            reporter->err(1, "%s: write", filename.c_str());
+    }
+
+    void got_event(InstructionEvent &ev) override
+    {
+        event(TAG_INSTRUCTION, ev);
+        byte(ev.effect);
+        varint(ev.pc);
+        byte(ev.iset);
+        byte(ev.width);
+        varint(ev.instruction);
+        str(ev.disassembly);
+    }
+
+    void got_event(RegisterEvent &ev) override
+    {
+        event(TAG_REGISTER, ev);
+        byte((unsigned char)ev.reg.prefix);
+        varint(ev.reg.index);
+        varint(ev.offset);
+        varint(ev.bytes.size());
+        buf.append((const char *)ev.bytes.data(), ev.bytes.size());
+    }
+
+    void got_event(MemoryEvent &ev) override
+    {
+        event(TAG_MEMORY, ev);
+        byte((ev.read ? 1 : 0) | (ev.known ? 2 : 0));
+        varint(ev.size);
+        varint(ev.addr);
+        varint(ev.contents);
+    }
+
+    void got_event(ExceptionEvent &ev) override
+    {
+        event(TAG_EXCEPTION, ev);
+    }
+
+    void got_event(TextOnlyEvent &ev) override
+    {
+        event(TAG_TEXT, ev);
+        str(ev.type);
+        str(ev.msg);
+    }
+
+    bool parse_warning(const string &msg) override;
+    bool wants_highlights() const override { return false; }
+};
+
+bool BinaryTraceWriter::parse_warning(const string &msg)
+{
+    reporter->indexing_warning(tarmac_filename, lineno, msg);
+    return false;
+}
+
+void write_binary_trace(const string &tarmac_filename,
+                        const string &binary_filename,
+                        const ParseParams &pparams)
+{
+    TraceFingerprint fp;
+    if (!trace_fingerprint(tarmac_filename, true, fp))
+        reporter->err(1, "%s: read", tarmac_filename.c_str());
+
+    ifstream ifs(tarmac_filename.c_str(),
+                 std::ios_base::in | std::ios_base::binary);
+    if (ifs.fail())
+        reporter->err(1, "%s: open", tarmac_filename.c_str());
+
+    BinaryTraceWriter w(binary_filename, tarmac_filename);
+    unsigned flags = 0;
+    if (pparams.bigend)
+        flags |= BT_FLAG_BIGEND;
+    if (pparams.iset_specified && pparams.iset == THUMB)
+        flags |= BT_FLAG_THUMB_ONLY;
+    w.varint(flags);
+    w.varint(fp.size);
+    w.varint(fp.sampled_hash);
+    w.varint(fp.full_hash);
+    // Record where the text trace is in a form that still finds it
+    // from whatever directory the binary trace is used in.
+    w.str(absolute_path(tarmac_filename));
+
+    TarmacLineParser parser(pparams, w);
+    IndexingProgress prog;
+    reporter->indexing_start(fp.size);
+
+    // Track the position in the file the same way as the indexer
+    // does, so that an index built from the binary trace is the same
+    // as one built from the text.
+    string line;
+    while (true) {
+        if (ifs.eof()) {
+            prog.pos = fp.size;
+            break;
+        }
+        if (!getline(ifs, line))
+            break;
+
+        w.lineno++;
+        w.byte(TAG_LINE);
+        w.varint(line.size() + 1);
+        try {
+            parser.parse(line);
+        } catch (const TarmacParseError &e) {
+            if (ifs.eof()) {
+                ostringstream oss;
+                oss << e.msg << endl
+                    << _("ignoring parse error on partial last line "
+                         "(trace truncated?)");
+                reporter->indexing_warning(tarmac_filename, w.lineno,
+                                           oss.str());
+                w.byte(TAG_TRUNCATED);
+                break;
+            } else {
+                remove(binary_filename.c_str());
+                reporter->indexing_error(tarmac_filename, w.lineno, e.msg);
+            }
+        }
+
+        prog.pos += line.size() + 1;
+        prog.lines++;
+        if (prog.lines % 4096 == 0) {
+            prog.index_size = w.bytes_written();
+            reporter->indexing_progress(prog);
+        }
+        w.flush();
+    }
+
+    // If we stopped at a partial last line, the events the parser
+    // found in it before failing have been written, the same as the
+    // indexer would have processed them, and prog.pos is the start of
+    // that line, which is where the indexer would have stopped.
+    w.byte(TAG_END);
+    w.varint(prog.pos);
+    prog.index_size = w.bytes_written();
+    reporter->indexing_done(prog);
+    w.close();
+}
+
+BinaryTraceReader::BinaryTraceReader(const string &filename)
+    : filename(filename), rev(0, RegisterId{}, 0, {}), tev(0, "", "")
+{
+    if (!is_binary_trace(filename))
+        reporter->errx(1, _("%s: not a binary trace file"), filename.c_str());
+
+    file = std::make_shared<MMapFile>(filename, false);
+    data = file->getptr<unsigned char>(0);
+    end = data + file->curr_offset();
+    pos = data + 16;
+
+    unsigned flags = varint();
+    hdr.pparams.bigend = (flags & BT_FLAG_BIGEND) != 0;
+    if (flags & BT_FLAG_THUMB_ONLY) {
+        hdr.pparams.iset_specified = true;
+        hdr.pparams.iset = THUMB;
+    }
+    hdr.fingerprint.size = varint();
+    hdr.fingerprint.sampled_hash = varint();
+    hdr.fingerprint.full_hash = varint();
+    string_into(hdr.tarmac_filename);
+}
+
+void BinaryTraceReader::corrupt() const
+{
+    reporter->errx(1, _("%s: binary trace file is truncated or corrupt"),
+                   filename.c_str());
+}
+
+unsigned char BinaryTraceReader::byte()
+{
+    if (pos == end)
+        corrupt();
+    return *pos++;
+}
+
+uint64_t BinaryTraceReader::varint()
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        if (pos == end || shift > 63)
+            corrupt();
+        unsigned char b = *pos++;
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return value;
+    }
+}
+
+Time BinaryTraceReader::time()
+{
+    uint64_t zz = varint();
+    prev_time += (Time)((zz >> 1) ^ -(zz & 1));
+    return prev_time;
+}
+
+void BinaryTraceReader::string_into(string &out)
+{
+    uint64_t len = varint();
+    if ((uint64_t)(end - pos) < len)
+        corrupt();
+    out.assign((const char *)pos, len);
+    pos += len;
+}
+
+bool BinaryTraceReader::next_line(ParseReceiver &recv, size_t &linelen)
+{
+    if (finished)
+        return false;
+
+    unsigned char tag = byte();
+    if (tag == TAG_END) {
+        final_pos = varint();
+        finished = true;
+        return false;
+    }
+    if (tag != TAG_LINE)
+        corrupt();
+    linelen = varint();
+
+    while (true) {
+        if (pos == end)
+            corrupt();
+        switch (*pos) {
+        case TAG_LINE:
+        case TAG_END:
+            return true; // leave this for the next call
+        case TAG_TRUNCATED:
+            pos++;
+            if (byte() != TAG_END)
+                corrupt();
+            final_pos = varint();
+            finished = true;
+            return false;
+        case TAG_INSTRUCTION: {
+            pos++;
+            iev.time = time();
+            iev.cpu = cpu;
+            iev.effect = (InstructionEffect)byte();
+            iev.pc = varint();
+            iev.iset = (ISet)byte();
+            iev.width = byte();
+            iev.instruction = varint();
+            string_into(iev.disassembly);
+            recv.got_event(iev);
+            break;
+        }
+        case TAG_REGISTER: {
+            pos++;
+            rev.time = time();
+            rev.cpu = cpu;
+            rev.reg.prefix = (RegPrefix)byte();
+            rev.reg.index = varint();
+            rev.offset = varint();
+            uint64_t len = varint();
+            if ((uint64_t)(end - pos) < len)
+                corrupt();
+            rev.bytes.assign(pos, pos + len);
+            pos += len;
+            recv.got_event(rev);
+            break;
+        }
+        case TAG_MEMORY: {
+            pos++;
+            Time t = time();
+            unsigned char flags = byte();
+            size_t size = varint();
+            Addr addr = varint();
+            unsigned long long contents = varint();
+            MemoryEvent ev(t, flags & 1, size, addr, (flags & 2) != 0,
+                           contents);
+            ev.cpu = cpu;
+            recv.got_event(ev);
+            break;
+        }
+        case TAG_EXCEPTION: {
+            pos++;
+            ExceptionEvent ev(time());
+            ev.cpu = cpu;
+            recv.got_event(ev);
+            break;
+        }
+        case TAG_TEXT: {
+            pos++;
+            tev.time = time();
+            tev.cpu = cpu;
+            string_into(tev.type);
+            string_into(tev.msg);
+            recv.got_event(tev);
+            break;
+        }
+        case TAG_CPU:
+            pos++;
+            cpu = (int)varint() - 1;
+            break;
+        default:
+            corrupt();
+        }
+    }
+}
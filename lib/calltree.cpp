@@ -42,14 +42,16 @@ using std::vector;
 
 string CallTree::getFunctionName(Addr addr) const
 {
+    uint64_t load_offset;
     if (IN.has_image())
-        if (const Symbol *Symb = IN.get_image()->find_symbol(addr)) {
+        if (const Symbol *Symb =
+                IN.get_images()->find_symbol(addr, &load_offset)) {
             ostringstream oss;
             oss << Symb->getName();
             if (options.show_offsets) {
-                Addr offset = addr - Symb->addr;
+                Addr offset = addr - (Symb->addr + load_offset);
                 if (offset)
-                    oss << " + " << hex << showbase << addr;
+                    oss << " + " << hex << showbase << offset;
             }
             return oss.str();
         }
@@ -28,9 +28,10 @@
 #include <stdint.h>
 #include <string.h>
 
-#include <sstream>
+#include <map>
+#include <string>
+#include <vector>
 
-using std::ostringstream;
 using std::string;
 
 static constexpr unsigned EI_MAG0 = 0;
@@ -51,17 +52,58 @@ static constexpr unsigned ELFCLASS64 = 2;
 static constexpr unsigned ELFDATA2LSB = 1;
 static constexpr unsigned ELFDATA2MSB = 2;
 
+static constexpr uint64_t SHF_COMPRESSED = 0x800;
+
+static constexpr unsigned DW_LNS_copy = 1;
+static constexpr unsigned DW_LNS_advance_pc = 2;
+static constexpr unsigned DW_LNS_advance_line = 3;
+static constexpr unsigned DW_LNS_set_file = 4;
+static constexpr unsigned DW_LNS_const_add_pc = 8;
+static constexpr unsigned DW_LNS_fixed_advance_pc = 9;
+
+static constexpr unsigned DW_LNE_end_sequence = 1;
+static constexpr unsigned DW_LNE_set_address = 2;
+static constexpr unsigned DW_LNE_define_file = 3;
+
+static constexpr unsigned DW_LNCT_path = 1;
+static constexpr unsigned DW_LNCT_directory_index = 2;
+
+static constexpr unsigned DW_FORM_data2 = 0x05;
+static constexpr unsigned DW_FORM_data4 = 0x06;
+static constexpr unsigned DW_FORM_data8 = 0x07;
+static constexpr unsigned DW_FORM_string = 0x08;
+static constexpr unsigned DW_FORM_block = 0x09;
+static constexpr unsigned DW_FORM_block1 = 0x0a;
+static constexpr unsigned DW_FORM_data1 = 0x0b;
+static constexpr unsigned DW_FORM_sdata = 0x0d;
+static constexpr unsigned DW_FORM_strp = 0x0e;
+static constexpr unsigned DW_FORM_udata = 0x0f;
+static constexpr unsigned DW_FORM_data16 = 0x1e;
+static constexpr unsigned DW_FORM_line_strp = 0x1f;
+
 uint64_t ElfSectionHeader::entries() const { return sh_size / sh_entsize; }
 
+constexpr unsigned ElfLineRow::NO_FILE;
+
 class ElfCommonBase : public ElfFile {
     FILE *fp;
 
+    // Contents of every section we've been asked to look inside,
+    // indexed by file offset. Symbol and string tables are read from
+    // the file in one go the first time they're needed, and all
+    // further decoding works directly on the buffer, instead of
+    // seeking and reading the file once per symbol or per character.
+    mutable std::map<uint64_t, std::vector<uint8_t>> section_cache;
+
   public:
     ElfCommonBase(FILE *fp) : fp(fp) {}
     ~ElfCommonBase() { fclose(fp); }
 
     virtual bool setup() = 0;
 
+    const std::vector<uint8_t> *
+    section_data(const ElfSectionHeader &shdr) const override;
+
   protected:
     bool read(size_t offset, size_t size, void *output) const;
 };
@@ -77,6 +119,22 @@ bool ElfCommonBase::read(size_t offset, size_t size, void *output) const
     return true;
 }
 
+const std::vector<uint8_t> *
+ElfCommonBase::section_data(const ElfSectionHeader &shdr) const
+{
+    auto it = section_cache.find(shdr.sh_offset);
+    if (it != section_cache.end() && it->second.size() == shdr.sh_size)
+        return &it->second;
+
+    std::vector<uint8_t> data(shdr.sh_size);
+    if (shdr.sh_size && !read(shdr.sh_offset, shdr.sh_size, data.data()))
+        return nullptr;
+
+    auto &slot = section_cache[shdr.sh_offset];
+    slot = std::move(data);
+    return &slot;
+}
+
 static uint64_t read_integer_le(const void *vp, size_t size)
 {
     const uint8_t *p = reinterpret_cast<const uint8_t *>(vp);
@@ -108,10 +166,401 @@ struct ByteOrder {
     }
 };
 
+/*
+ * Decoder for the line number programs in a DWARF .debug_line section
+ * (DWARF versions 2 to 5). Each compilation unit's program drives a
+ * small state machine whose output rows map code addresses to source
+ * positions; we keep only the address, file and line of each row, and
+ * ignore columns, statement flags and VLIW operation indices.
+ *
+ * All reads are bounds-checked against the end of the current unit.
+ * Running off the end sets 'overrun', which abandons the unit.
+ */
+template <class ByteOrder> class DwarfLineDecoder {
+    const uint8_t *p = nullptr, *end = nullptr;
+    bool overrun = false;
+
+    // Other string sections that DWARF 5 file tables can refer to.
+    // Either can be null if the file doesn't have it.
+    const std::vector<uint8_t> *line_str, *str;
+
+    std::vector<string> &files;
+    std::vector<ElfLineRow> &rows;
+    std::map<string, unsigned> file_indices;
+
+    void skip(uint64_t size)
+    {
+        if (have(size))
+            p += size;
+    }
+
+    bool have(uint64_t size)
+    {
+        if (size > (uint64_t)(end - p)) {
+            overrun = true;
+            p = end;
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t fixed(size_t size)
+    {
+        return have(size) ? ByteOrder::get(&p, size) : 0;
+    }
+
+    uint64_t uleb()
+    {
+        uint64_t val = 0;
+        for (unsigned shift = 0; have(1); shift += 7) {
+            uint8_t byte = *p++;
+            if (shift < 64)
+                val |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return val;
+    }
+
+    int64_t sleb()
+    {
+        uint64_t val = 0;
+        for (unsigned shift = 0; have(1); shift += 7) {
+            uint8_t byte = *p++;
+            if (shift < 64)
+                val |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                if ((byte & 0x40) && shift + 7 < 64)
+                    val |= ~(uint64_t)0 << (shift + 7);
+                break;
+            }
+        }
+        return val;
+    }
+
+    string cstring()
+    {
+        const void *nul = memchr(p, '\0', end - p);
+        if (!nul) {
+            overrun = true;
+            p = end;
+            return string();
+        }
+        string toret(reinterpret_cast<const char *>(p),
+                     reinterpret_cast<const char *>(nul));
+        p = reinterpret_cast<const uint8_t *>(nul) + 1;
+        return toret;
+    }
+
+    static string section_string(const std::vector<uint8_t> *data,
+                                 uint64_t offset)
+    {
+        if (!data || offset >= data->size())
+            return string();
+        const char *start =
+            reinterpret_cast<const char *>(data->data()) + offset;
+        size_t maxlen = data->size() - offset;
+        const void *nul = memchr(start, '\0', maxlen);
+        return string(start, nul ? (const char *)nul - start : maxlen);
+    }
+
+    // Read one attribute value from a DWARF 5 directory or file name
+    // table, as a string or a number depending on its form. Returns
+    // false for forms we don't understand, since then we can't even
+    // tell how long the value is.
+    bool form_value(uint64_t form, unsigned offset_size, string &sval,
+                    uint64_t &nval)
+    {
+        switch (form) {
+        case DW_FORM_string:
+            sval = cstring();
+            return true;
+        case DW_FORM_line_strp:
+            sval = section_string(line_str, fixed(offset_size));
+            return true;
+        case DW_FORM_strp:
+            sval = section_string(str, fixed(offset_size));
+            return true;
+        case DW_FORM_data1:
+            nval = fixed(1);
+            return true;
+        case DW_FORM_data2:
+            nval = fixed(2);
+            return true;
+        case DW_FORM_data4:
+            nval = fixed(4);
+            return true;
+        case DW_FORM_data8:
+            nval = fixed(8);
+            return true;
+        case DW_FORM_udata:
+            nval = uleb();
+            return true;
+        case DW_FORM_sdata:
+            nval = sleb();
+            return true;
+        case DW_FORM_data16:
+            skip(16);
+            return true;
+        case DW_FORM_block1:
+            nval = fixed(1);
+            skip(nval);
+            return true;
+        case DW_FORM_block:
+            nval = uleb();
+            skip(nval);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Read a DWARF 5 directory or file name table, returning the
+    // path and directory index of each entry.
+    bool entry_table(unsigned offset_size,
+                     std::vector<std::pair<string, uint64_t>> &entries)
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> formats;
+        for (unsigned i = 0, n = fixed(1); i < n; i++) {
+            uint64_t content_type = uleb();
+            uint64_t form = uleb();
+            formats.emplace_back(content_type, form);
+        }
+
+        uint64_t count = uleb();
+        if (count > (uint64_t)(end - p))
+            return false;
+        for (uint64_t i = 0; i < count && !overrun; i++) {
+            string path;
+            uint64_t dir = 0;
+            for (const auto &format : formats) {
+                string sval;
+                uint64_t nval = 0;
+                if (!form_value(format.second, offset_size, sval, nval))
+                    return false;
+                if (format.first == DW_LNCT_path)
+                    path = sval;
+                else if (format.first == DW_LNCT_directory_index)
+                    dir = nval;
+            }
+            entries.emplace_back(path, dir);
+        }
+        return !overrun;
+    }
+
+    static string join_path(const string &dir, const string &name)
+    {
+        if (dir.empty() || name.empty() || name[0] == '/' ||
+            name[0] == '\\' || (name.size() > 1 && name[1] == ':'))
+            return name;
+        if (dir.back() == '/' || dir.back() == '\\')
+            return dir + name;
+        return dir + "/" + name;
+    }
+
+    unsigned file_index(const string &path)
+    {
+        auto it = file_indices.find(path);
+        if (it != file_indices.end())
+            return it->second;
+        unsigned index = files.size();
+        files.push_back(path);
+        file_indices[path] = index;
+        return index;
+    }
+
+    unsigned file_index(const std::vector<string> &dirs, const string &name,
+                        uint64_t dir)
+    {
+        return file_index(join_path(dir < dirs.size() ? dirs[dir] : "", name));
+    }
+
+    void decode_unit(unsigned offset_size)
+    {
+        unsigned version = fixed(2);
+        if (version < 2 || version > 5)
+            return;
+        if (version >= 5)
+            skip(2); // address_size, segment_selector_size
+
+        uint64_t header_length = fixed(offset_size);
+        if (!have(header_length))
+            return;
+        const uint8_t *program = p + header_length;
+
+        unsigned min_inst_length = fixed(1);
+        if (version >= 4)
+            skip(1); // maximum_operations_per_instruction
+        skip(1);     // default_is_stmt
+        int line_base = (int8_t)fixed(1);
+        unsigned line_range = fixed(1);
+        unsigned opcode_base = fixed(1);
+        if (overrun || line_range == 0 || opcode_base == 0)
+            return;
+        std::vector<uint8_t> opcode_lengths(opcode_base, 0);
+        for (unsigned i = 1; i < opcode_base; i++)
+            opcode_lengths[i] = fixed(1);
+
+        // Translate the unit's directory and file tables into indices
+        // in our overall file list. Before DWARF 5, file numbers
+        // start at 1, and directory 0 (the compilation directory) is
+        // implicit and not given here.
+        std::vector<string> dirs;
+        std::vector<unsigned> unit_files;
+        if (version >= 5) {
+            std::vector<std::pair<string, uint64_t>> entries;
+            if (!entry_table(offset_size, entries))
+                return;
+            for (const auto &entry : entries)
+                dirs.push_back(entry.first);
+            entries.clear();
+            if (!entry_table(offset_size, entries))
+                return;
+            for (const auto &entry : entries)
+                unit_files.push_back(
+                    file_index(dirs, entry.first, entry.second));
+        } else {
+            dirs.push_back("");
+            for (string dir = cstring(); !dir.empty(); dir = cstring())
+                dirs.push_back(dir);
+            unit_files.push_back(ElfLineRow::NO_FILE);
+            for (string name = cstring(); !name.empty(); name = cstring()) {
+                uint64_t dir = uleb();
+                uleb(); // modification time
+                uleb(); // file length
+                unit_files.push_back(file_index(dirs, name, dir));
+            }
+        }
+        if (overrun || program > end)
+            return;
+
+        // Run the line number program.
+        p = program;
+        uint64_t address = 0, file = 1;
+        int64_t line = 1;
+        auto emit = [&](bool end_sequence) {
+            ElfLineRow row;
+            row.address = address;
+            row.file = ElfLineRow::NO_FILE;
+            if (file < unit_files.size())
+                row.file = unit_files[file];
+            row.line = line;
+            row.end_sequence = end_sequence;
+            rows.push_back(row);
+        };
+
+        while (p < end) {
+            unsigned opcode = fixed(1);
+            if (opcode >= opcode_base) {
+                // Special opcode: advance address and line together,
+                // and emit a row.
+                unsigned adjusted = opcode - opcode_base;
+                address += (uint64_t)(adjusted / line_range) * min_inst_length;
+                line += line_base + (int)(adjusted % line_range);
+                emit(false);
+            } else if (opcode == 0) {
+                // Extended opcode, with its own length prefix.
+                uint64_t length = uleb();
+                if (length == 0 || !have(length))
+                    break;
+                const uint8_t *next = p + length;
+                switch (fixed(1)) {
+                case DW_LNE_end_sequence:
+                    emit(true);
+                    address = 0;
+                    file = 1;
+                    line = 1;
+                    break;
+                case DW_LNE_set_address:
+                    if (length - 1 <= 8)
+                        address = fixed(length - 1);
+                    break;
+                case DW_LNE_define_file: {
+                    string name = cstring();
+                    uint64_t dir = uleb();
+                    unit_files.push_back(file_index(dirs, name, dir));
+                    break;
+                }
+                }
+                p = next;
+            } else {
+                switch (opcode) {
+                case DW_LNS_copy:
+                    emit(false);
+                    break;
+                case DW_LNS_advance_pc:
+                    address += uleb() * min_inst_length;
+                    break;
+                case DW_LNS_advance_line:
+                    line += sleb();
+                    break;
+                case DW_LNS_set_file:
+                    file = uleb();
+                    break;
+                case DW_LNS_const_add_pc:
+                    address += (uint64_t)((255 - opcode_base) / line_range) *
+                               min_inst_length;
+                    break;
+                case DW_LNS_fixed_advance_pc:
+                    address += fixed(2);
+                    break;
+                default:
+                    // Skip the operands of anything else, including
+                    // standard opcodes newer than we know about.
+                    for (unsigned i = 0; i < opcode_lengths[opcode]; i++)
+                        uleb();
+                    break;
+                }
+            }
+        }
+    }
+
+  public:
+    DwarfLineDecoder(const std::vector<uint8_t> *line_str,
+                     const std::vector<uint8_t> *str,
+                     std::vector<string> &files, std::vector<ElfLineRow> &rows)
+        : line_str(line_str), str(str), files(files), rows(rows)
+    {
+        for (unsigned i = 0; i < files.size(); i++)
+            file_indices[files[i]] = i;
+    }
+
+    void decode(const std::vector<uint8_t> &data)
+    {
+        const uint8_t *unit = data.data(), *section_end = unit + data.size();
+        while (unit < section_end) {
+            p = unit;
+            end = section_end;
+            overrun = false;
+
+            uint64_t length = fixed(4);
+            unsigned offset_size = 4;
+            if (length == 0xffffffff) {
+                length = fixed(8);
+                offset_size = 8;
+            }
+            if (!have(length))
+                return;
+            const uint8_t *unit_end = p + length;
+
+            // If a unit is malformed, drop any rows it emitted after
+            // its last complete sequence, but keep going with the
+            // next unit, whose position we know from the length.
+            end = unit_end;
+            decode_unit(offset_size);
+            while (!rows.empty() && !rows.back().end_sequence)
+                rows.pop_back();
+
+            unit = unit_end;
+        }
+    }
+};
+
 template <class ByteOrder, unsigned AddrSize>
 class ElfCommon : public ElfCommonBase {
     bool got_hdr = false;
     ElfHeader hdr;
+    std::vector<uint8_t> shdr_table;
 
   private:
     using ElfCommonBase::ElfCommonBase;
@@ -142,12 +591,14 @@ class ElfCommon : public ElfCommonBase {
         return true;
     }
 
-    bool read_section_header(uint64_t offset, ElfSectionHeader &shdr) const
+    bool read_section_header(unsigned index, ElfSectionHeader &shdr) const
     {
-        uint8_t data[16 + 6 * AddrSize];
-        if (!read(offset, sizeof(data), data))
+        constexpr size_t size = 16 + 6 * AddrSize;
+        uint64_t offset = (uint64_t)hdr.e_shentsize * index;
+        if (hdr.e_shentsize < size || offset + size > shdr_table.size())
             return false;
 
+        const uint8_t *data = shdr_table.data() + offset;
         const uint8_t *p = data;
         shdr.sh_name = ByteOrder::get(&p, 4);
         shdr.sh_type = ByteOrder::get(&p, 4);
@@ -159,19 +610,31 @@ class ElfCommon : public ElfCommonBase {
         shdr.sh_info = ByteOrder::get(&p, 4);
         shdr.sh_addralign = ByteOrder::get(&p, AddrSize);
         shdr.sh_entsize = ByteOrder::get(&p, AddrSize);
-        assert(p == data + sizeof(data));
+        assert(p == data + size);
         return true;
     }
 
     // Symtab entry format is so different that it has to be devolved
     // to the 32/64 bit specific subclasses
-    virtual bool read_symbol(uint64_t offset, ElfSymbol &sym) const = 0;
-    ;
+    virtual void decode_symbol(const uint8_t *data, ElfSymbol &sym) const = 0;
+    virtual size_t symbol_size() const = 0;
+
+    bool read_section_header_table()
+    {
+        // Read the entire section header table in one go, so that
+        // later section_header() calls don't need to touch the file.
+        shdr_table.resize((size_t)hdr.e_shentsize * hdr.e_shnum);
+        if (shdr_table.empty())
+            return true;
+        return read(hdr.e_shoff, shdr_table.size(), shdr_table.data());
+    }
 
     bool setup() override
     {
         if (!read_header())
             return false;
+        if (!read_section_header_table())
+            return false;
         return true;
     }
 
@@ -181,42 +644,88 @@ class ElfCommon : public ElfCommonBase {
     {
         if (index >= hdr.e_shnum)
             return false;
-        return read_section_header(hdr.e_shoff + hdr.e_shentsize * index, out);
+        return read_section_header(index, out);
     }
 
     bool symbol(const ElfSectionHeader &shdr, unsigned symbolindex,
                 ElfSymbol &out) const override
     {
-        if (symbolindex >= shdr.entries())
+        if (shdr.sh_entsize < symbol_size() || symbolindex >= shdr.entries())
+            return false;
+        const std::vector<uint8_t> *data = section_data(shdr);
+        if (!data)
             return false;
-        return read_symbol(shdr.sh_offset + shdr.sh_entsize * symbolindex, out);
+        uint64_t offset = shdr.sh_entsize * symbolindex;
+        if (offset + symbol_size() > data->size())
+            return false;
+        decode_symbol(data->data() + offset, out);
+        return true;
     }
 
     string strtab_string(const ElfSectionHeader &shdr,
                          unsigned offset) const override
     {
-        ostringstream os;
-        while (offset < shdr.sh_size) {
-            char c;
-            if (!read(shdr.sh_offset + offset++, 1, &c))
-                break;
-            if (c == '\0')
-                break;
-            os << c;
+        const std::vector<uint8_t> *data = section_data(shdr);
+        if (!data || offset >= data->size())
+            return string();
+        const char *start =
+            reinterpret_cast<const char *>(data->data()) + offset;
+        size_t maxlen = data->size() - offset;
+        const void *end = memchr(start, '\0', maxlen);
+        return string(start, end ? (const char *)end - start : maxlen);
+    }
+
+    bool find_section(const string &name,
+                      ElfSectionHeader &out) const override
+    {
+        ElfSectionHeader names;
+        if (!section_header(hdr.e_shstrndx, names))
+            return false;
+        for (unsigned i = 0; i < hdr.e_shnum; i++) {
+            ElfSectionHeader shdr;
+            if (read_section_header(i, shdr) &&
+                strtab_string(names, shdr.sh_name) == name) {
+                out = shdr;
+                return true;
+            }
         }
-        return os.str();
+        return false;
+    }
+
+    bool debug_line(std::vector<string> &files,
+                    std::vector<ElfLineRow> &rows) const override
+    {
+        // We don't decompress SHF_COMPRESSED debug sections, so those
+        // are treated the same as having no line table at all.
+        ElfSectionHeader shdr;
+        if (!find_section(".debug_line", shdr) ||
+            (shdr.sh_flags & SHF_COMPRESSED))
+            return false;
+        const std::vector<uint8_t> *data = section_data(shdr);
+        if (!data)
+            return false;
+
+        const std::vector<uint8_t> *line_str = nullptr, *str = nullptr;
+        if (find_section(".debug_line_str", shdr) &&
+            !(shdr.sh_flags & SHF_COMPRESSED))
+            line_str = section_data(shdr);
+        if (find_section(".debug_str", shdr) &&
+            !(shdr.sh_flags & SHF_COMPRESSED))
+            str = section_data(shdr);
+
+        DwarfLineDecoder<ByteOrder> decoder(line_str, str, files, rows);
+        decoder.decode(*data);
+        return true;
     }
 };
 
 template <class ByteOrder> class Elf32 : public ElfCommon<ByteOrder, 4> {
     using ElfCommon<ByteOrder, 4>::ElfCommon;
 
-    bool read_symbol(uint64_t offset, ElfSymbol &sym) const override
-    {
-        uint8_t data[16];
-        if (!ElfCommonBase::read(offset, sizeof(data), data))
-            return false;
+    size_t symbol_size() const override { return 16; }
 
+    void decode_symbol(const uint8_t *data, ElfSymbol &sym) const override
+    {
         const uint8_t *p = data;
         sym.st_name = ByteOrder::get(&p, 4);
         sym.st_value = ByteOrder::get(&p, 4);
@@ -224,25 +733,21 @@ template <class ByteOrder> class Elf32 : public ElfCommon<ByteOrder, 4> {
         uint8_t st_info = ByteOrder::get(&p, 1);
         uint8_t st_other = ByteOrder::get(&p, 1);
         sym.st_shndx = ByteOrder::get(&p, 2);
-        assert(p == data + sizeof(data));
+        assert(p == data + symbol_size());
 
         sym.st_bind = st_info >> 4;
         sym.st_type = st_info & 0xF;
         sym.st_visibility = st_other & 0x3;
-
-        return true;
     }
 };
 
 template <class ByteOrder> class Elf64 : public ElfCommon<ByteOrder, 8> {
     using ElfCommon<ByteOrder, 8>::ElfCommon;
 
-    bool read_symbol(uint64_t offset, ElfSymbol &sym) const override
-    {
-        uint8_t data[24];
-        if (!ElfCommonBase::read(offset, sizeof(data), data))
-            return false;
+    size_t symbol_size() const override { return 24; }
 
+    void decode_symbol(const uint8_t *data, ElfSymbol &sym) const override
+    {
         const uint8_t *p = data;
         sym.st_name = ByteOrder::get(&p, 4);
         uint8_t st_info = ByteOrder::get(&p, 1);
@@ -250,13 +755,11 @@ template <class ByteOrder> class Elf64 : public ElfCommon<ByteOrder, 8> {
         sym.st_shndx = ByteOrder::get(&p, 2);
         sym.st_value = ByteOrder::get(&p, 8);
         sym.st_size = ByteOrder::get(&p, 8);
-        assert(p == data + sizeof(data));
+        assert(p == data + symbol_size());
 
         sym.st_bind = st_info >> 4;
         sym.st_type = st_info & 0xF;
         sym.st_visibility = st_other & 0x3;
-
-        return true;
     }
 };
 
@@ -16,28 +16,55 @@
  * This file is part of Tarmac Trace Utilities
  */
 
+#include "libtarmac/disktree.hh"
 #include "libtarmac/image.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/elf.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <cstring>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <type_traits>
 
 using std::ostringstream;
 using std::string;
 using std::vector;
 
+// Three-way comparison of two symbol names, in the same order as
+// std::string's.
+static int compare_names(const char *a, size_t alen, const char *b,
+                         size_t blen)
+{
+    int cmp = memcmp(a, b, std::min(alen, blen));
+    if (cmp)
+        return cmp;
+    return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
 string Symbol::getName() const
 {
     if (multiple) {
         ostringstream oss;
-        oss << name << "@0x" << std::hex << addr;
+        oss << string(name, namelen) << "@0x" << std::hex << addr;
         return oss.str();
     }
-    return name;
+    return string(name, namelen);
+}
+
+bool Symbol::operator<(const Symbol &other) const
+{
+    return compare_names(name, namelen, other.name, other.namelen) < 0;
+}
+
+bool Symbol::has_name(const char *othername, size_t otherlen) const
+{
+    return compare_names(name, namelen, othername, otherlen) == 0;
 }
 
 static inline bool want_to_index_symbol(string name)
@@ -66,45 +93,14 @@ static inline bool want_to_index_symbol(string name)
     return true;
 }
 
-void Image::add_symbol(const Symbol &sym_)
-{
-    // store the symbol
-    symbols.push_front(sym_);
-
-    // Ensure we got the address to the symbol now stored
-    Symbol &sym = symbols.front();
-
-    // address -> symbol map
-    auto &syms = addrtab[sym.addr];
-    syms.push_back(&sym);
-
-    // name -> symbol map
-    auto &dups = symtab[sym.name];
-    if (dups.size() > 0) {
-        // There's already at least one symbol with this name. Mark
-        // the new one as multiple, meaning it will need
-        // disambiguation when the address is printed later.
-        sym.multiple = true;
-        if (dups.size() == 1) {
-            // And if there was previously only one symbol with the
-            // same name, then that one isn't yet marked as multiple,
-            // so do that too.
-            //
-            // The symbol pointer in 'dups' is a const pointer, but we
-            // know it's also an element of the 'symbols' list, which
-            // we're allowed to mutate in this function (indeed we
-            // already have done). So it's safe to cast away the const
-            // and modify it.
-            const_cast<Symbol *>(dups.front())->multiple = true;
-        }
-    }
-    dups.push_back(&sym);
-}
-
 void Image::load_headers() { is_big_end = elf_file->is_big_endian(); }
 
 void Image::load_symboltable()
 {
+    // The names are all collected in 'symbol_names' before any symbol
+    // refers to them, since it may move as it grows.
+    vector<size_t> name_offsets;
+
     for (unsigned i = 0, e = elf_file->nsections(); i < e; i++) {
         ElfSectionHeader shdr;
         if (!elf_file->section_header(i, shdr) || shdr.sh_type != SHT_SYMTAB)
@@ -152,39 +148,193 @@ void Image::load_symboltable()
 
             string symbol_name =
                 elf_file->strtab_string(strtab_shdr, sym.st_name);
-            if (want_to_index_symbol(symbol_name))
-                add_symbol(Symbol(static_cast<Addr>(sym.st_value), sym.st_size,
-                                  symbol_name, binding, kind));
+            if (want_to_index_symbol(symbol_name)) {
+                name_offsets.push_back(symbol_names.size());
+                symbol_names += symbol_name;
+                symbols.emplace_back(static_cast<Addr>(sym.st_value),
+                                     sym.st_size, nullptr,
+                                     symbol_name.size(), binding, kind);
+            }
         }
     }
+
+    for (size_t i = 0; i < symbols.size(); i++)
+        symbols[i].name = symbol_names.data() + name_offsets[i];
 }
 
-const Symbol *Image::find_symbol(Addr address) const
+void Image::build_address_tables()
+{
+    // Sort the symbols by address, keeping load order for symbols at
+    // the same address. Within a group of symbols at the same
+    // address, we prefer the first one loaded.
+    vector<unsigned> syms(symbols.size());
+    for (unsigned i = 0; i < syms.size(); i++)
+        syms[i] = i;
+    std::stable_sort(syms.begin(), syms.end(), [this](unsigned a, unsigned b) {
+        return symbols[a].addr < symbols[b].addr;
+    });
+
+    for (unsigned i : syms) {
+        if (label_addrs.empty() || label_addrs.back() != symbols[i].addr) {
+            label_addrs.push_back(symbols[i].addr);
+            label_syms.push_back(i);
+        }
+    }
+
+    // Now sweep through the address space, maintaining a heap of the
+    // sized symbols containing the current address. The one we want
+    // to report is the one that starts latest (i.e. the innermost, if
+    // they nest), and if several start at the same address, the first
+    // one loaded, which is the one with the lowest index in 'sized'.
+    vector<unsigned> sized;
+    vector<Addr> ends, boundaries;
+    for (unsigned i : syms) {
+        const Symbol &sym = symbols[i];
+        if (sym.size == 0)
+            continue;
+        Addr end = sym.addr + sym.size;
+        if (end < sym.addr)
+            end = ~(Addr)0; // clip symbols that wrap round the top
+        sized.push_back(i);
+        ends.push_back(end);
+        boundaries.push_back(sym.addr);
+        boundaries.push_back(end);
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                     boundaries.end());
+
+    auto lower_priority = [this, &sized](size_t a, size_t b) {
+        if (symbols[sized[a]].addr != symbols[sized[b]].addr)
+            return symbols[sized[a]].addr < symbols[sized[b]].addr;
+        return a > b;
+    };
+    std::priority_queue<size_t, vector<size_t>, decltype(lower_priority)>
+        active(lower_priority);
+
+    size_t next = 0;
+    for (Addr boundary : boundaries) {
+        while (next < sized.size() && symbols[sized[next]].addr == boundary)
+            active.push(next++);
+        // Symbols that ended before here are discarded lazily, when
+        // they reach the top of the heap.
+        while (!active.empty() && ends[active.top()] <= boundary)
+            active.pop();
+
+        unsigned sym = active.empty() ? NO_SYMBOL : sized[active.top()];
+        if (interval_syms.empty() || interval_syms.back() != sym) {
+            interval_starts.push_back(boundary);
+            interval_syms.push_back(sym);
+        }
+    }
+}
+
+// FNV-1a, used for the symbol name hash table and the symbol cache
+// key. It has to be stable across runs, because both of those can be
+// stored on disk.
+static uint64_t fnv1a(const void *vdata, size_t len,
+                      uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    const unsigned char *data = static_cast<const unsigned char *>(vdata);
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static uint64_t hash_name(const char *name, size_t namelen)
+{
+    return fnv1a(name, namelen);
+}
+
+void Image::build_name_tables()
+{
+    name_order.resize(symbols.size());
+    for (unsigned i = 0; i < name_order.size(); i++)
+        name_order[i] = i;
+    std::stable_sort(name_order.begin(), name_order.end(),
+                     [this](unsigned a, unsigned b) {
+                         return symbols[a] < symbols[b];
+                     });
+
+    vector<unsigned> group_starts;
+    for (size_t i = 0; i < name_order.size();) {
+        size_t j = i + 1;
+        const Symbol &first = symbols[name_order[i]];
+        while (j < name_order.size() &&
+               symbols[name_order[j]].has_name(first.name, first.namelen))
+            j++;
+
+        // If there's more than one symbol with this name, mark them
+        // all as multiple, meaning they will need disambiguation when
+        // the address is printed later.
+        if (j - i > 1)
+            for (size_t k = i; k < j; k++)
+                symbols[name_order[k]].multiple = true;
+
+        group_starts.push_back(i);
+        i = j;
+    }
+
+    if (group_starts.empty())
+        return;
+
+    size_t size = 1;
+    while (size < 2 * group_starts.size())
+        size *= 2;
+    name_hash.assign(size, 0);
+    for (unsigned start : group_starts) {
+        const Symbol &sym = symbols[name_order[start]];
+        size_t pos = hash_name(sym.name, sym.namelen) & (size - 1);
+        while (name_hash[pos])
+            pos = (pos + 1) & (size - 1);
+        name_hash[pos] = start + 1;
+    }
+}
+
+const Symbol *Image::find_symbol_uncached(Addr address) const
 {
     // Instead of seeing symbols as object with a size, we use them as
     // labels. We give priority to symbols with a size. This should
     // work reasonable well given the assumption that objects don't
     // have much overlap with each other.
 
-    const Symbol *backup_sym = nullptr;
-    auto it = addrtab.upper_bound(address);
+    auto it = std::upper_bound(interval_starts.begin(), interval_starts.end(),
+                               address);
+    if (it != interval_starts.begin()) {
+        unsigned index = interval_syms[it - interval_starts.begin() - 1];
+        if (index != NO_SYMBOL)
+            return &symbols[index];
+    }
 
-    // 'address' is before all symbols
-    if (it == addrtab.begin())
-        return nullptr;
+    // No sized symbol contains 'address', so fall back to the nearest
+    // symbol that starts before it.
+    it = std::upper_bound(label_addrs.begin(), label_addrs.end(), address);
+    if (it == label_addrs.begin())
+        return nullptr; // 'address' is before all symbols
+    return &symbols[label_syms[it - label_addrs.begin() - 1]];
+}
 
-    // find the first symbol that contains or starts before 'address'
-    for (--it; it != addrtab.begin(); --it) {
-        const vector<const Symbol *> &syms = it->second;
+namespace {
+struct LookupCacheEntry {
+    uint64_t image_id = 0; // 0 never matches a real Image
+    Addr addr;
+    const Symbol *sym;
+};
+constexpr size_t lookup_cache_size = 256;
+thread_local LookupCacheEntry lookup_cache[lookup_cache_size];
+std::atomic<uint64_t> next_lookup_cache_id{1};
+} // namespace
 
-        for (const Symbol *sym : syms) {
-            if (sym->size != 0 && address - sym->addr < sym->size)
-                return sym;
-            if (!backup_sym)
-                backup_sym = sym;
-        }
+const Symbol *Image::find_symbol(Addr address) const
+{
+    LookupCacheEntry &ent =
+        lookup_cache[(address ^ (address >> 8)) % lookup_cache_size];
+    if (ent.image_id != lookup_cache_id || ent.addr != address) {
+        ent.image_id = lookup_cache_id;
+        ent.addr = address;
+        ent.sym = find_symbol_uncached(address);
     }
-    return backup_sym;
+    return ent.sym;
 }
 
 const Symbol *Image::find_symbol(const string &name) const
@@ -206,27 +356,443 @@ const Symbol *Image::find_symbol(const string &name) const
 
 const Symbol *Image::find_symbol(const string &name, int index) const
 {
-    const vector<const Symbol *> *res = find_all_symbols(name);
-    if (res)
-        try {
-            return res->at(index);
-        } catch (std::out_of_range e) {
-        }
+    vector<const Symbol *> res = find_all_symbols(name);
+    if (index >= 0 && (size_t)index < res.size())
+        return res[index];
     return nullptr;
 }
 
-Image::Image(const string &image_filename) : image_filename(image_filename)
+vector<const Symbol *> Image::find_all_symbols(const string &name) const
+{
+    vector<const Symbol *> res;
+    if (name_hash.empty())
+        return res;
+
+    // The table is never full when it's built, but one loaded from a
+    // damaged symbol cache might be, so stop after looking at every
+    // slot.
+    size_t mask = name_hash.size() - 1;
+    size_t pos = hash_name(name.data(), name.size()) & mask;
+    for (size_t probes = 0; probes < name_hash.size() && name_hash[pos];
+         probes++, pos = (pos + 1) & mask) {
+        size_t start = name_hash[pos] - 1;
+        if (!symbols[name_order[start]].has_name(name.data(), name.size()))
+            continue;
+        for (size_t i = start;
+             i < name_order.size() &&
+             symbols[name_order[i]].has_name(name.data(), name.size());
+             i++)
+            res.push_back(&symbols[name_order[i]]);
+        break;
+    }
+    return res;
+}
+
+vector<const Symbol *>
+Image::find_all_symbols_starting_with(const string &name) const
+{
+    vector<const Symbol *> res;
+    auto it = std::lower_bound(name_order.begin(), name_order.end(), name,
+                               [this](unsigned index, const string &name) {
+                                   const Symbol &sym = symbols[index];
+                                   return compare_names(sym.name, sym.namelen,
+                                                        name.data(),
+                                                        name.size()) < 0;
+                               });
+    for (; it != name_order.end(); ++it) {
+        const Symbol &sym = symbols[*it];
+        if (sym.namelen < name.size() ||
+            memcmp(sym.name, name.data(), name.size()))
+            break;
+        res.push_back(&sym);
+    }
+    return res;
+}
+
+void Image::build_line_table() const
+{
+    line_table_built = true;
+
+    vector<ElfLineRow> rows;
+    if (!elf_file->debug_line(source_files, rows))
+        return;
+
+    // Sequences from different compilation units can come in any
+    // order, so sort all the rows by address. Where several rows share
+    // an address, only the last one in the program (or a real row in
+    // preference to the end of an adjacent sequence) really describes
+    // the code there.
+    vector<unsigned> order(rows.size());
+    for (unsigned i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&rows](unsigned a, unsigned b) {
+                         return rows[a].address < rows[b].address;
+                     });
+
+    for (size_t i = 0; i < order.size();) {
+        Addr addr = rows[order[i]].address;
+        LineInfo info = {ElfLineRow::NO_FILE, 0};
+        for (; i < order.size() && rows[order[i]].address == addr; i++) {
+            const ElfLineRow &row = rows[order[i]];
+            if (!row.end_sequence && row.file != ElfLineRow::NO_FILE)
+                info = {row.file, row.line};
+        }
+
+        if (!line_info.empty() && line_info.back().file == info.file &&
+            line_info.back().line == info.line)
+            continue;
+        line_addrs.push_back(addr);
+        line_info.push_back(info);
+    }
+}
+
+bool Image::find_source_line(Addr address, string &file, unsigned &line) const
+{
+    if (!line_table_built)
+        build_line_table();
+
+    auto it = std::upper_bound(line_addrs.begin(), line_addrs.end(), address);
+    if (it == line_addrs.begin())
+        return false;
+    const LineInfo &info = line_info[it - line_addrs.begin() - 1];
+    if (info.file == ElfLineRow::NO_FILE)
+        return false;
+    file = source_files[info.file];
+    line = info.line;
+    return true;
+}
+
+/*
+ * On-disk symbol cache.
+ *
+ * The cache file contains the same flat tables that Image builds in
+ * memory, laid out in the same style as the index file (big-endian
+ * diskint fields, with arrays referred to by their file offset). A
+ * loaded cache stays mapped for the lifetime of the Image, and the
+ * symbol names are used where they lie in the mapping, so loading it
+ * costs no more than decoding the fixed-size fields of each table.
+ *
+ * It's keyed on the identity of the image file rather than its
+ * contents, so that checking the key doesn't cost as much I/O as
+ * parsing the symbol table would: the file's size and modification
+ * time, and a hash of its section headers and of its GNU build ID
+ * note, if it has one. The section headers are already in memory,
+ * and the build ID note is a few dozen bytes.
+ */
+
+struct Image::SymbolCacheKey {
+    uint64_t size, timestamp, hash;
+};
+
+namespace {
+
+struct SymbolCacheMagic {
+    static const char reference_copy[16 + 1];
+    char magic[16];
+    void setup() { memcpy(magic, reference_copy, 16); }
+    bool check() const { return memcmp(magic, reference_copy, 16) == 0; }
+};
+const char SymbolCacheMagic::reference_copy[16 + 1] = "TarmacSymCacheV1";
+
+struct SymbolCacheHeader {
+    SymbolCacheMagic magic;
+    diskint<uint64_t> image_size, image_timestamp, image_hash;
+    diskint<unsigned> flags;
+    diskint<unsigned> nsymbols, nintervals, nlabels, name_hash_size;
+    diskint<OFF_T> symbols, interval_starts, interval_syms, label_addrs,
+        label_syms, name_order, name_hash;
+};
+
+constexpr unsigned SYMCACHE_BIGEND = 1;
+
+struct SymbolCacheEntry {
+    diskint<Addr> addr;
+    diskint<uint64_t> size;
+    diskint<OFF_T> name; // file offset of the name, not NUL-terminated
+    diskint<unsigned> namelen;
+    unsigned char binding, kind, multiple, padding;
+};
+
+} // namespace
+
+bool Image::get_symbol_cache_key(SymbolCacheKey &key) const
+{
+    if (!get_file_timestamp(image_filename, &key.timestamp))
+        return false;
+
+    FILE *fp = fopen_wrapper(image_filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    bool ok = fseek(fp, 0, SEEK_END) == 0;
+    long size = ftell(fp);
+    fclose(fp);
+    if (!ok || size < 0)
+        return false;
+    key.size = size;
+
+    uint64_t hash = fnv1a(nullptr, 0);
+    for (unsigned i = 0, e = elf_file->nsections(); i < e; i++) {
+        ElfSectionHeader shdr;
+        if (!elf_file->section_header(i, shdr))
+            continue;
+        uint64_t fields[] = {
+            shdr.sh_name,   shdr.sh_type,   shdr.sh_link,
+            shdr.sh_info,   shdr.sh_flags,  shdr.sh_addr,
+            shdr.sh_offset, shdr.sh_size,   shdr.sh_entsize,
+        };
+        hash = fnv1a(fields, sizeof(fields), hash);
+    }
+
+    ElfSectionHeader build_id;
+    if (elf_file->find_section(".note.gnu.build-id", build_id)) {
+        const vector<uint8_t> *data = elf_file->section_data(build_id);
+        if (!data)
+            return false;
+        hash = fnv1a(data->data(), data->size(), hash);
+    }
+
+    key.hash = hash;
+    return true;
+}
+
+bool Image::load_symbol_cache(const string &filename, const SymbolCacheKey &key)
+{
+    // Check the header with ordinary file I/O before mapping the file,
+    // so that a cache that can't be read, or was made from a different
+    // image, is passed over and the image parsed instead.
+    SymbolCacheHeader hdr;
+    FILE *fp = fopen_wrapper(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    bool ok = fread(&hdr, sizeof(hdr), 1, fp) == 1;
+    fclose(fp);
+    if (!ok || !hdr.magic.check() || hdr.image_size != key.size ||
+        hdr.image_timestamp != key.timestamp || hdr.image_hash != key.hash ||
+        bool(hdr.flags & SYMCACHE_BIGEND) != is_big_end)
+        return false;
+
+    std::unique_ptr<MMapFile> cache(new MMapFile(filename, false));
+    MMapFile &arena = *cache;
+    OFF_T filesize = arena.curr_offset();
+    auto in_range = [filesize](OFF_T offset, uint64_t count, size_t size) {
+        return offset >= 0 && offset <= filesize &&
+               count <= (uint64_t)(filesize - offset) / size;
+    };
+
+    // The file might have been replaced since we read the header.
+    if (!in_range(0, 1, sizeof(SymbolCacheHeader)) ||
+        memcmp(arena.getptr<SymbolCacheHeader>(0), &hdr, sizeof(hdr)))
+        return false;
+
+    unsigned nsymbols = hdr.nsymbols, nintervals = hdr.nintervals;
+    unsigned nlabels = hdr.nlabels, name_hash_size = hdr.name_hash_size;
+    if (!in_range(hdr.symbols, nsymbols, sizeof(SymbolCacheEntry)) ||
+        !in_range(hdr.interval_starts, nintervals, sizeof(diskint<Addr>)) ||
+        !in_range(hdr.interval_syms, nintervals, sizeof(diskint<unsigned>)) ||
+        !in_range(hdr.label_addrs, nlabels, sizeof(diskint<Addr>)) ||
+        !in_range(hdr.label_syms, nlabels, sizeof(diskint<unsigned>)) ||
+        !in_range(hdr.name_order, nsymbols, sizeof(diskint<unsigned>)) ||
+        !in_range(hdr.name_hash, name_hash_size, sizeof(diskint<unsigned>)))
+        return false;
+
+    auto array = [&arena](OFF_T offset, unsigned count, auto *dummy) {
+        using T = std::remove_pointer_t<decltype(dummy)>;
+        return count ? arena.getptr<T>(offset) : nullptr;
+    };
+
+    auto *entries = array(hdr.symbols, nsymbols, (SymbolCacheEntry *)nullptr);
+    vector<Symbol> loaded;
+    loaded.reserve(nsymbols);
+    for (unsigned i = 0; i < nsymbols; i++) {
+        const SymbolCacheEntry &ent = entries[i];
+        unsigned namelen = ent.namelen;
+        if (!in_range(ent.name, namelen, 1))
+            return false;
+        const char *name = namelen ? arena.getptr<char>(ent.name) : "";
+        loaded.emplace_back(ent.addr, ent.size, name, namelen,
+                            (Symbol::binding_type)ent.binding,
+                            (Symbol::kind_type)ent.kind);
+        loaded.back().multiple = ent.multiple;
+    }
+
+    auto copy_indices = [&](OFF_T offset, unsigned count,
+                            vector<unsigned> &out, bool allow_none) {
+        auto *src = array(offset, count, (diskint<unsigned> *)nullptr);
+        out.resize(count);
+        for (unsigned i = 0; i < count; i++) {
+            out[i] = src[i];
+            if (out[i] >= nsymbols && !(allow_none && out[i] == NO_SYMBOL))
+                return false;
+        }
+        return true;
+    };
+    auto copy_addrs = [&](OFF_T offset, unsigned count, vector<Addr> &out) {
+        auto *src = array(offset, count, (diskint<Addr> *)nullptr);
+        out.resize(count);
+        for (unsigned i = 0; i < count; i++)
+            out[i] = src[i];
+    };
+
+    copy_addrs(hdr.interval_starts, nintervals, interval_starts);
+    copy_addrs(hdr.label_addrs, nlabels, label_addrs);
+    if (!copy_indices(hdr.interval_syms, nintervals, interval_syms, true) ||
+        !copy_indices(hdr.label_syms, nlabels, label_syms, false) ||
+        !copy_indices(hdr.name_order, nsymbols, name_order, false))
+        return false;
+
+    // name_hash entries are positions in name_order plus 1, so they're
+    // range-checked differently.
+    auto *hash_src = array(hdr.name_hash, name_hash_size,
+                           (diskint<unsigned> *)nullptr);
+    if (name_hash_size & (name_hash_size - 1))
+        return false;          // must be a power of 2
+    name_hash.resize(name_hash_size);
+    for (unsigned i = 0; i < name_hash_size; i++) {
+        name_hash[i] = hash_src[i];
+        if (name_hash[i] > nsymbols)
+            return false;
+    }
+
+    symbols = std::move(loaded);
+    symbol_cache = std::move(cache);
+    return true;
+}
+
+void Image::save_symbol_cache(const string &filename,
+                              const SymbolCacheKey &key) const
+{
+    MemArena arena;
+
+    OFF_T hdroff = arena.alloc(sizeof(SymbolCacheHeader));
+
+    auto write_indices = [&arena](const vector<unsigned> &v) {
+        OFF_T off = arena.alloc(v.size() * sizeof(diskint<unsigned>));
+        for (size_t i = 0; i < v.size(); i++)
+            *arena.getptr<diskint<unsigned>>(
+                off + i * sizeof(diskint<unsigned>)) = v[i];
+        return off;
+    };
+    auto write_addrs = [&arena](const vector<Addr> &v) {
+        OFF_T off = arena.alloc(v.size() * sizeof(diskint<Addr>));
+        for (size_t i = 0; i < v.size(); i++)
+            *arena.getptr<diskint<Addr>>(off + i * sizeof(diskint<Addr>)) =
+                v[i];
+        return off;
+    };
+
+    OFF_T symoff = arena.alloc(symbols.size() * sizeof(SymbolCacheEntry));
+    for (size_t i = 0; i < symbols.size(); i++) {
+        const Symbol &sym = symbols[i];
+        OFF_T nameoff = arena.alloc(sym.namelen);
+        if (sym.namelen)
+            memcpy(arena.getptr<char>(nameoff), sym.name, sym.namelen);
+
+        SymbolCacheEntry &ent = *arena.getptr<SymbolCacheEntry>(
+            symoff + i * sizeof(SymbolCacheEntry));
+        ent.addr = sym.addr;
+        ent.size = sym.size;
+        ent.name = nameoff;
+        ent.namelen = sym.namelen;
+        ent.binding = (unsigned char)sym.binding;
+        ent.kind = (unsigned char)sym.kind;
+        ent.multiple = sym.multiple;
+        ent.padding = 0;
+    }
+
+    OFF_T interval_starts_off = write_addrs(interval_starts);
+    OFF_T interval_syms_off = write_indices(interval_syms);
+    OFF_T label_addrs_off = write_addrs(label_addrs);
+    OFF_T label_syms_off = write_indices(label_syms);
+    OFF_T name_order_off = write_indices(name_order);
+    OFF_T name_hash_off = write_indices(name_hash);
+
+    // Now all the allocation is done, it's safe to hold on to a
+    // pointer into the arena.
+    SymbolCacheHeader &hdr = *arena.getptr<SymbolCacheHeader>(hdroff);
+    hdr.magic.setup();
+    hdr.image_size = key.size;
+    hdr.image_timestamp = key.timestamp;
+    hdr.image_hash = key.hash;
+    hdr.flags = is_big_end ? SYMCACHE_BIGEND : 0;
+    hdr.nsymbols = symbols.size();
+    hdr.nintervals = interval_starts.size();
+    hdr.nlabels = label_addrs.size();
+    hdr.name_hash_size = name_hash.size();
+    hdr.symbols = symoff;
+    hdr.interval_starts = interval_starts_off;
+    hdr.interval_syms = interval_syms_off;
+    hdr.label_addrs = label_addrs_off;
+    hdr.label_syms = label_syms_off;
+    hdr.name_order = name_order_off;
+    hdr.name_hash = name_hash_off;
+
+    // Write to a temporary file and rename it into place, so that
+    // another tool run reading the cache concurrently never sees a
+    // partly written one.
+    string tmpname = filename + ".tmp";
+    FILE *fp = fopen_wrapper(tmpname.c_str(), "wb");
+    if (!fp) {
+        reporter->warn(_("%s: unable to write symbol cache"), tmpname.c_str());
+        return;
+    }
+    size_t size = arena.curr_offset();
+    bool ok = fwrite(arena.getptr<char>(0), 1, size, fp) == size;
+    ok = (fclose(fp) == 0) && ok;
+    if (ok && rename(tmpname.c_str(), filename.c_str()) != 0) {
+        // On Windows, rename() won't replace an existing file
+        remove(filename.c_str());
+        ok = rename(tmpname.c_str(), filename.c_str()) == 0;
+    }
+    if (!ok) {
+        reporter->warn(_("%s: unable to write symbol cache"),
+                       filename.c_str());
+        remove(tmpname.c_str());
+    }
+}
+
+Image::Image(const string &image_filename, const string &symbol_cache_filename)
+    : image_filename(image_filename)
 {
     elf_file = elf_open(image_filename);
     if (!elf_file)
         reporter->errx(1, _("Cannot open ELF file \"%s\""),
                        image_filename.c_str());
     load_headers();
+    lookup_cache_id = next_lookup_cache_id++;
+
+    SymbolCacheKey key;
+    bool use_cache = !symbol_cache_filename.empty() &&
+                     get_symbol_cache_key(key);
+    if (use_cache && load_symbol_cache(symbol_cache_filename, key))
+        return;
+
+    symbols.clear();
+    interval_starts.clear();
+    interval_syms.clear();
+    label_addrs.clear();
+    label_syms.clear();
+    name_order.clear();
+    name_hash.clear();
+
     load_symboltable();
+    build_address_tables();
+    build_name_tables();
+
+    if (use_cache)
+        save_symbol_cache(symbol_cache_filename, key);
 }
 
 Image::~Image() {}
 
+bool Image::lowest_symbol_address(Addr &out) const
+{
+    if (label_addrs.empty())
+        return false;
+    out = label_addrs.front();
+    return true;
+}
+
 void Image::dump()
 {
     printf(_("Image '%s':\n"), image_filename.c_str());
@@ -237,6 +803,113 @@ void Image::dump()
     }
 }
 
+ImageSet::ImageSet(std::shared_ptr<Image> image, uint64_t load_offset)
+{
+    if (image) {
+        ImageMapping mapping;
+        mapping.image = image;
+        mapping.load_offset = load_offset;
+        add(mapping);
+    }
+}
+
+void ImageSet::add(const ImageMapping &mapping)
+{
+    mappings.push_back(mapping);
+    build_regions();
+}
+
+void ImageSet::build_regions()
+{
+    // There are only ever a handful of mappings, so it's fine to
+    // recompute everything from scratch each time one is added, and
+    // to check every mapping against every region boundary.
+    vector<Addr> starts(mappings.size());
+    vector<bool> has_start(mappings.size());
+    vector<Addr> boundaries{0};
+    for (size_t i = 0; i < mappings.size(); i++) {
+        const ImageMapping &m = mappings[i];
+        if (m.has_range) {
+            boundaries.push_back(m.lo);
+            if (m.hi + 1 != 0)
+                boundaries.push_back(m.hi + 1);
+        } else if (m.image->lowest_symbol_address(starts[i])) {
+            starts[i] += m.load_offset;
+            has_start[i] = true;
+            boundaries.push_back(starts[i]);
+        }
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                     boundaries.end());
+
+    region_starts.clear();
+    region_mappings.clear();
+    for (Addr boundary : boundaries) {
+        unsigned chosen = NO_MAPPING;
+        for (size_t i = 0; i < mappings.size(); i++) {
+            const ImageMapping &m = mappings[i];
+            if (m.has_range && m.lo <= boundary && boundary <= m.hi) {
+                chosen = i;
+                break;
+            }
+        }
+        if (chosen == NO_MAPPING) {
+            // No ranged mapping covers this region, so use the
+            // unranged one that starts closest below it.
+            for (size_t i = 0; i < mappings.size(); i++) {
+                if (has_start[i] && starts[i] <= boundary &&
+                    (chosen == NO_MAPPING || starts[i] > starts[chosen]))
+                    chosen = i;
+            }
+        }
+
+        if (region_mappings.empty() || region_mappings.back() != chosen) {
+            region_starts.push_back(boundary);
+            region_mappings.push_back(chosen);
+        }
+    }
+}
+
+const ImageMapping *ImageSet::mapping_for(Addr addr) const
+{
+    auto it = std::upper_bound(region_starts.begin(), region_starts.end(),
+                               addr);
+    if (it == region_starts.begin())
+        return nullptr;
+    unsigned index = region_mappings[it - region_starts.begin() - 1];
+    return index == NO_MAPPING ? nullptr : &mappings[index];
+}
+
+const Symbol *ImageSet::find_symbol(Addr addr, uint64_t *load_offset) const
+{
+    const ImageMapping *m = mapping_for(addr);
+    if (!m)
+        return nullptr;
+    const Symbol *sym = m->image->find_symbol(addr - m->load_offset);
+    if (sym)
+        *load_offset = m->load_offset;
+    return sym;
+}
+
+const Symbol *ImageSet::find_symbol(const string &name,
+                                    uint64_t *load_offset) const
+{
+    for (const ImageMapping &m : mappings) {
+        if (const Symbol *sym = m.image->find_symbol(name)) {
+            *load_offset = m.load_offset;
+            return sym;
+        }
+    }
+    return nullptr;
+}
+
+bool ImageSet::find_source_line(Addr addr, string &file, unsigned &line) const
+{
+    const ImageMapping *m = mapping_for(addr);
+    return m && m->image->find_source_line(addr - m->load_offset, file, line);
+}
+
 #ifdef TEST
 int main(int argc, char *argv[])
 {
@@ -17,14 +17,17 @@
  */
 
 #include "libtarmac/index.hh"
+#include "libtarmac/binarytrace.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/parser.hh"
 #include "libtarmac/registers.hh"
 #include "libtarmac/reporter.hh"
+#include "libtarmac/scan.hh"
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
@@ -35,6 +38,7 @@
 #include <memory>
 #include <set>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 using std::cout;
@@ -65,6 +69,281 @@ using std::vector;
 // branching for the branch to _not_ be considered a potential function call.
 static constexpr unsigned long long BRANCH_LR_WRITE_THRESHOLD = 8;
 
+// How many trace lines to read between calls to
+// Reporter::indexing_progress. The reporter decides for itself how
+// often to update its display; this just keeps the per-line cost of
+// asking it down to a counter check.
+static constexpr unsigned long long PROGRESS_INTERVAL_LINES = 4096;
+
+/*
+ * Content hashes of ranges of a memory tree, built up from the
+ * MemoryAnnotation and MemorySubAnnotation hash sums. Both functions
+ * descend only the two search paths to the ends of the range, adding
+ * in the annotation of every subtree found to be entirely inside it,
+ * so that they take logarithmic time (plus the cost of hashing the
+ * parts of any tree node that sticks out at the ends).
+ */
+static uint64_t
+memsubtree_range_hash(const AVLDisk<MemorySubPayload, MemorySubAnnotation> &tree,
+                      const Arena &arena, OFF_T nodeoff, char type, Addr lo,
+                      Addr hi, bool above_lo = false, bool below_hi = false)
+{
+    uint64_t hash = 0;
+    while (nodeoff) {
+        MemorySubPayload p;
+        MemorySubAnnotation a;
+        OFF_T lc, rc;
+        tree.read_node(nodeoff, p, a, lc, rc);
+
+        if (above_lo && below_hi)
+            return hash + a.hash;
+        if (p.hi < lo) {
+            nodeoff = rc;
+            continue;
+        }
+        if (p.lo > hi) {
+            nodeoff = lc;
+            continue;
+        }
+
+        Addr olo = max(lo, (Addr)p.lo), ohi = min(hi, (Addr)p.hi);
+        if (olo == p.lo && ohi == p.hi)
+            hash += p.hash;
+        else
+            hash += memory_block_hash(
+                type, olo,
+                arena.getptr<unsigned char>(p.contents) + (olo - p.lo),
+                ohi - olo + 1);
+        hash += memsubtree_range_hash(tree, arena, lc, type, lo, hi, above_lo,
+                                      true);
+        nodeoff = rc;
+        above_lo = true;
+    }
+    return hash;
+}
+
+// Hash of the part of a single memtree node's contents within [lo,hi].
+static uint64_t
+memtree_payload_hash(const AVLDisk<MemorySubPayload, MemorySubAnnotation> &subtree,
+                     const Arena &arena, const MemoryPayload &p, Addr lo,
+                     Addr hi)
+{
+    lo = max(lo, (Addr)p.lo);
+    hi = min(hi, (Addr)p.hi);
+    if (p.raw)
+        return memory_block_hash(
+            p.type, lo, arena.getptr<unsigned char>(p.contents) + (lo - p.lo),
+            hi - lo + 1);
+    OFF_T subroot = *arena.getptr<diskint<OFF_T>>(p.contents);
+    return memsubtree_range_hash(subtree, arena, subroot, p.type, lo, hi);
+}
+
+static uint64_t
+memtree_range_hash(const AVLDisk<MemoryPayload, MemoryAnnotation> &tree,
+                   const AVLDisk<MemorySubPayload, MemorySubAnnotation> &subtree,
+                   const Arena &arena, OFF_T nodeoff, char type, Addr lo,
+                   Addr hi, bool above_lo = false, bool below_hi = false)
+{
+    uint64_t hash = 0;
+    while (nodeoff) {
+        MemoryPayload p;
+        MemoryAnnotation a;
+        OFF_T lc, rc;
+        tree.read_node(nodeoff, p, a, lc, rc);
+
+        if (above_lo && below_hi && a.hashed)
+            return hash + a.hash;
+        if (p.type < type || (p.type == type && p.hi < lo)) {
+            nodeoff = rc;
+            continue;
+        }
+        if (p.type > type || (p.type == type && p.lo > hi)) {
+            nodeoff = lc;
+            continue;
+        }
+
+        hash += memtree_payload_hash(subtree, arena, p, lo, hi);
+        hash += memtree_range_hash(tree, subtree, arena, lc, type, lo, hi,
+                                   above_lo, true);
+        nodeoff = rc;
+        above_lo = true;
+    }
+    return hash;
+}
+
+/*
+ * Read up to 8 bytes of register or memory state from a memory tree,
+ * returning false unless every byte is known. Shared between the
+ * indexer and the shard merger, which both need to look up the
+ * registers they base their call heuristics on.
+ */
+static bool read_memtree_value(
+    const AVLDisk<MemoryPayload, MemoryAnnotation> &memtree,
+    const AVLDisk<MemorySubPayload, MemorySubAnnotation> &memsubtree,
+    const Arena &arena, OFF_T memroot, bool bigend, char type, Addr addr,
+    size_t size, unsigned long long *output)
+{
+    unsigned char data[8], def[8];
+
+    MemoryPayload memp_search;
+    memp_search.type = type;
+    memp_search.lo = addr;
+    memp_search.hi = addr + (size - 1);
+
+    memset(def, 0, size);
+
+    while (memp_search.lo <= memp_search.hi) {
+        bool found;
+        MemoryPayload memp_got;
+        found = memtree.find_leftmost(memroot, memp_search, &memp_got,
+                                      nullptr);
+        if (!found)
+            break;
+
+        Addr addr_lo = max(memp_search.lo, memp_got.lo);
+        Addr addr_hi = min(memp_search.hi, memp_got.hi);
+
+        if (memp_got.raw) {
+            const unsigned char *treedata =
+                arena.getptr<unsigned char>(memp_got.contents);
+            memcpy((char *)data + (addr_lo - addr),
+                   treedata + (addr_lo - memp_got.lo), addr_hi - addr_lo + 1);
+            memset((char *)def + (addr_lo - addr), 1, addr_hi - addr_lo + 1);
+        } else {
+            OFF_T subroot =
+                *arena.getptr<diskint<OFF_T>>(memp_got.contents);
+            MemorySubPayload msp, msp_found;
+            msp.lo = addr_lo;
+            msp.hi = addr_hi;
+            while (msp.lo <= msp.hi && memsubtree.find_leftmost(
+                                           subroot, msp, &msp_found, nullptr)) {
+                Addr subaddr_lo = max(msp.lo, msp_found.lo);
+                Addr subaddr_hi = min(msp.hi, msp_found.hi);
+                const unsigned char *treedata =
+                    arena.getptr<unsigned char>(msp_found.contents);
+                memcpy((char *)data + (subaddr_lo - addr),
+                       treedata + (subaddr_lo - msp_found.lo),
+                       subaddr_hi - subaddr_lo + 1);
+                memset((char *)def + (subaddr_lo - addr), 1,
+                       subaddr_hi - subaddr_lo + 1);
+                msp.lo = subaddr_hi + 1;
+            }
+        }
+
+        memp_search.lo = memp_got.hi + 1;
+        if (memp_search.lo == 0) // special case: address space wraparound
+            break;
+    }
+
+    if (memchr(def, '\0', size))
+        return false; // not every byte was available
+
+    if (output) {
+        unsigned long long outval = 0;
+        if (type == 'm' && bigend) {
+            for (size_t i = 0; i < size; i++)
+                outval = (outval << 8) | data[i];
+        } else {
+            for (size_t i = size; i-- > 0;)
+                outval = (outval << 8) | data[i];
+        }
+        *output = outval;
+    }
+    return true;
+}
+
+/*
+ * Fill in the parts of [addr, addr+size) in one address space of a
+ * memory tree that are currently unknown but can be learned in
+ * hindsight, i.e. are covered by sub-memtrees, from 'data'. The
+ * sub-memtrees are modified in place, so every earlier memory tree
+ * sharing them learns the data too. Returns the number of bytes of
+ * contents added to the arena.
+ */
+static uint64_t
+fill_unknown_memory(AVLDisk<MemoryPayload, MemoryAnnotation> &memtree,
+                    AVLDisk<MemorySubPayload, MemorySubAnnotation> &memsubtree,
+                    Arena &arena, OFF_T memroot, char type, Addr addr,
+                    size_t size, const unsigned char *data)
+{
+    uint64_t bytes_added = 0;
+    MemoryPayload memp_search, memp;
+    memp_search.type = type;
+    memp_search.lo = addr;
+    memp_search.hi = addr + (size - 1);
+
+    while (memp_search.lo <= memp_search.hi &&
+           memtree.find_leftmost(memroot, memp_search, &memp, nullptr)) {
+        if (memp.raw) {
+            /*
+             * FIXME: we could add a consistency check here. We're
+             * seeing data being read from memory, and we thought we
+             * already knew what was in that memory. If the data isn't
+             * the same this time, what should we do? We could give a
+             * warning at indexing time, for example. Or we could mark
+             * the memory as indeterminate between the two reads (on
+             * the basis that we don't know when it changed).
+             *
+             * For the moment, we simply ignore it. But if that
+             * changed in future, this would be where to add code.
+             */
+        } else {
+            diskint<OFF_T> *subroot =
+                arena.getptr<diskint<OFF_T>>(memp.contents);
+
+            MemorySubPayload msp;
+            msp.lo = memp_search.lo;
+            msp.hi = min(memp.hi, memp_search.hi);
+
+            while (msp.lo <= msp.hi) {
+                MemorySubPayload msp_found;
+                if (!memsubtree.find_leftmost(*subroot, msp, &msp_found,
+                                              nullptr)) {
+                    msp_found.lo = msp.hi + 1;
+                    msp_found.hi = msp.hi;
+                } else {
+                    /*
+                     * FIXME: similarly to above, we could consistency-check
+                     * the data read from memory _now_ with what was already
+                     * in our tree.
+                     */
+                }
+                if (msp.lo < msp_found.lo) {
+                    MemorySubPayload msp_insert;
+                    msp_insert.lo = msp.lo;
+                    msp_insert.hi = msp_found.lo - 1;
+                    OFF_T contents_offset =
+                        arena.alloc(msp_insert.hi - msp_insert.lo + 1);
+                    bytes_added += msp_insert.hi - msp_insert.lo + 1;
+                    // Take account of alloc() perhaps having
+                    // re-mmapped the file
+                    subroot = arena.getptr<diskint<OFF_T>>(memp.contents);
+                    memcpy(arena.getptr<unsigned char>(contents_offset),
+                           data + (msp.lo - addr),
+                           msp_insert.hi - msp_insert.lo + 1);
+                    msp_insert.contents = contents_offset;
+                    msp_insert.hash = memory_block_hash(
+                        type, msp_insert.lo, data + (msp.lo - addr),
+                        msp_insert.hi - msp_insert.lo + 1);
+
+                    OFF_T new_subroot_value =
+                        memsubtree.insert(*subroot, msp_insert);
+                    // Take account of insert() perhaps having
+                    // re-mmapped the file
+                    subroot = arena.getptr<diskint<OFF_T>>(memp.contents);
+                    *subroot = new_subroot_value;
+                }
+                msp.lo = msp_found.hi + 1;
+            }
+        }
+        memp_search.lo = memp.hi + 1;
+        if (memp_search.lo == 0)
+            break; // special case: address space wraparound!
+    }
+
+    return bytes_added;
+}
+
 struct PendingCall {
     unsigned long long sp, pc;
     unsigned call_line;
@@ -94,6 +373,166 @@ struct CallReturn {
     }
 };
 
+/*
+ * Streaming hash of a sequence of bytes, used for the trace file
+ * fingerprints described in TraceFingerprint. Bytes are gathered into
+ * little-endian 64-bit words according to their position in the
+ * whole stream, so the result doesn't depend on how the input is
+ * divided between calls to update().
+ */
+class TraceHasher {
+    uint64_t state = 0x9e3779b97f4a7c15ULL, word = 0, count = 0;
+
+    static uint64_t mix(uint64_t h)
+    {
+        // the splitmix64 finaliser, as in memory_byte_hash
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+  public:
+    void update(const void *vdata, size_t len)
+    {
+        const unsigned char *data = (const unsigned char *)vdata;
+
+        // Finish off a partial word left over from last time.
+        for (; len > 0 && (count & 7); data++, len--) {
+            word |= (uint64_t)*data << (8 * (count & 7));
+            if (!(++count & 7)) {
+                state = mix(state ^ word);
+                word = 0;
+            }
+        }
+
+        // Whole words, and then the start of a new partial one.
+        for (; len >= 8; data += 8, len -= 8, count += 8) {
+            uint64_t w = 0;
+            for (unsigned i = 0; i < 8; i++)
+                w |= (uint64_t)data[i] << (8 * i);
+            state = mix(state ^ w);
+        }
+        for (; len > 0; data++, len--, count++)
+            word |= (uint64_t)*data << (8 * (count & 7));
+    }
+
+    void update_u64(uint64_t value)
+    {
+        unsigned char bytes[8];
+        for (unsigned i = 0; i < 8; i++)
+            bytes[i] = value >> (8 * i);
+        update(bytes, 8);
+    }
+
+    uint64_t bytes() const { return count; }
+    uint64_t digest() const { return mix(mix(state ^ word) ^ count); }
+};
+
+// Add the time between construction and destruction to a running
+// total, for IndexStats, unless 'enabled' is false, in which case it
+// doesn't even read the clock.
+class StopWatch {
+    using Clock = std::chrono::steady_clock;
+    Clock::duration &total;
+    Clock::time_point start;
+    bool enabled;
+
+  public:
+    StopWatch(Clock::duration &total, bool enabled = true)
+        : total(total), enabled(enabled)
+    {
+        if (enabled)
+            start = Clock::now();
+    }
+    ~StopWatch()
+    {
+        if (enabled)
+            total += Clock::now() - start;
+    }
+
+    static uint64_t microseconds(Clock::duration d)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d)
+            .count();
+    }
+};
+
+// Keeps the resident part of an index file being built within
+// IndexerParams::memory_limit, by telling the arena to release older
+// parts of it.
+//
+// Tree updates and walks both search from the root of a tree whose
+// nodes are spread over the whole file, so they keep reading old
+// parts of it back in. So every so often this asks the arena how much
+// of it is resident, and if that's over the limit, releases it.
+//
+// Asking costs time proportional to the size of the arena, so doing
+// it at a fixed interval would make indexing quadratic in the size of
+// the trace. Instead, each check estimates how fast the resident size
+// is growing per event, and puts off the next check until a quarter
+// of the remaining headroom could have been used up. The estimate
+// only falls gradually, so that a quiet spell (such as a walk over
+// nodes that are already resident) doesn't put the next check off
+// past a busier one.
+class MemoryLimiter {
+    // The fewest updates or visits to allow between checks. Each one
+    // can touch a few dozen pages, so this bounds how far past the
+    // limit the arena can get before being noticed.
+    static constexpr uint64_t MIN_CHECK_INTERVAL = 64;
+
+    Arena &arena;
+    uint64_t limit;
+    uint64_t count = 0, next_check = MIN_CHECK_INTERVAL;
+    uint64_t last_resident = 0, growth_per_event = 0;
+    OFF_T last_offset = 0;
+
+    void check(OFF_T keep)
+    {
+        if (++count < next_check)
+            return;
+
+        // Newly allocated parts of the arena are bound to be resident,
+        // so the growth is at least the amount allocated.
+        uint64_t resident = arena.resident();
+        OFF_T curr = arena.curr_offset();
+        uint64_t growth = max(resident - min(resident, last_resident),
+                              (uint64_t)(curr - last_offset));
+        growth_per_event = max(growth / count + 1, growth_per_event / 2);
+        last_offset = curr;
+        peak_resident = max(peak_resident, resident);
+        if (resident >= limit) {
+            arena.release(curr - min(curr, keep));
+            releases++;
+            resident = arena.resident();
+        }
+
+        last_resident = resident;
+        count = 0;
+        next_check = MIN_CHECK_INTERVAL;
+        if (resident < limit)
+            next_check = max(next_check,
+                             (limit - resident) / 4 / growth_per_event);
+    }
+
+  public:
+    uint64_t releases = 0, peak_resident = 0;
+
+    MemoryLimiter(Arena &arena, uint64_t limit) : arena(arena), limit(limit)
+    {
+    }
+
+    // Call after each event has updated the trees and committed them.
+    // Releases everything but the newest quarter of the limit, which
+    // holds the trees' recently cloned root paths, and so is likely
+    // to be touched again straight away.
+    void updated() { check(limit / 4); }
+
+    // Call for each node visited by a walk over the whole index, such
+    // as the post-processing passes, which can read and write any
+    // part of it, so there's no point keeping the newest part.
+    void visited() { check(0); }
+};
+
 class Index : ParseReceiver {
     TracePair trace;
     IndexerParams iparams;
@@ -104,7 +543,7 @@ class Index : ParseReceiver {
     unsigned long long expected_next_pc, expected_next_lr;
     shared_ptr<Arena> arena;
     AVLDisk<MemoryPayload, MemoryAnnotation> *memtree;
-    AVLDisk<MemorySubPayload> *memsubtree;
+    AVLDisk<MemorySubPayload, MemorySubAnnotation> *memsubtree;
     AVLDisk<SeqOrderPayload, SeqOrderAnnotation> *seqtree;
     Time current_time;
     bool seen_instruction_at_current_time;
@@ -115,6 +554,38 @@ class Index : ParseReceiver {
     ISet last_iset;
     unsigned curr_iflags;
     size_t max_sve_bits;
+    const IndexerSeed *seed = nullptr;
+    TraceHasher trace_hasher; // full hash of the trace file as we read it
+
+    // When building one shard of an index, the range of the trace
+    // file it covers, and the sub-memtrees standing for the unknown
+    // state at the start of it (see ShardHeader).
+    const IndexerShard *shard = nullptr;
+    OFF_T memory_at_start = 0, registers_at_start = 0;
+    vector<ShardTransfer> shard_transfers;
+    unsigned long long shard_max_sp = 0;
+    bool lr_inherited = false;
+
+    // Only used if IndexerParams::memory_limit is set.
+    unique_ptr<MemoryLimiter> limiter;
+
+    // Statistics for the index header. The parse time includes the
+    // update time, which is subtracted at the end.
+    IndexStats stats;
+    std::chrono::steady_clock::duration read_time{}, parse_time{},
+        update_time{}, postprocess_time{};
+    void write_stats();
+
+    IndexingProgress progress() const
+    {
+        IndexingProgress prog;
+        prog.pos = linepos;
+        if (shard)
+            prog.pos -= shard->start;
+        prog.lines = stats.lines;
+        prog.index_size = arena ? arena->curr_offset() : 0;
+        return prog;
+    }
 
     void delete_from_memtree(char type, Addr addr, size_t size);
 
@@ -122,6 +593,12 @@ class Index : ParseReceiver {
     // got_event):
     TarmacLineParser parser;
     unique_ptr<ifstream> ifs;
+    unique_ptr<BinaryTraceReader> binary; // instead of ifs, if not null
+    vector<char> readbuf; // text read from ifs, valid up to readlen
+    size_t readpos = 0, readlen = 0;
+    string curr_line; // kept between lines to reuse its storage
+    bool from_binary = false;
+    TraceFingerprint binary_fingerprint; // if from_binary
     size_t lineno, true_lineno, lineno_offset, prev_lineno;
     bool seen_any_event;
     streampos linepos, oldpos;
@@ -143,9 +620,11 @@ class Index : ParseReceiver {
     Index(const TracePair &trace, const IndexerParams &iparams,
           const IndexerDiagnostics &idiags, const ParseParams &pparams)
         : trace(trace), iparams(iparams), idiags(idiags), pparams(pparams),
-          expected_next_pc(KNOWN_INVALID_PC), arena(nullptr), memtree(nullptr),
+          insns_since_lr_update(BRANCH_LR_WRITE_THRESHOLD),
+          expected_next_pc(KNOWN_INVALID_PC),
+          expected_next_lr(KNOWN_INVALID_PC), arena(nullptr), memtree(nullptr),
           memsubtree(nullptr), seqtree(nullptr), aarch64_used(false),
-          last_iset(ARM), parser(pparams, *this)
+          last_iset(ARM), curr_iflags(0), parser(pparams, *this)
     {
     }
 
@@ -162,6 +641,14 @@ class Index : ParseReceiver {
     }
 
     void got_event_common(TarmacEvent *event, bool is_instruction);
+
+    // True if we're indexing one CPU of a multi-core trace, and this
+    // event belongs to another. Memory events are never ignored,
+    // because memory is shared between all the CPUs.
+    bool other_cpu(const TarmacEvent &ev) const
+    {
+        return iparams.cpu >= 0 && ev.cpu >= 0 && ev.cpu != iparams.cpu;
+    }
     bool parse_warning(const string &msg);
     TarmacEvent *parse_tarmac_line(string line);
     void parse_tarmac_file();
@@ -176,6 +663,8 @@ class Index : ParseReceiver {
                             unsigned long long *output);
     bool read_memtree_reg(const RegisterId &reg, unsigned long long *output);
     void update_sp(unsigned long long sp);
+    bool lr_suggests_call(unsigned long long *lr);
+    void record_shard_transfer(unsigned long long pc, unsigned long long sp);
     void update_pc(unsigned long long pc, unsigned long long next_pc,
                    ISet iset);
     void update_iflags(unsigned iflags);
@@ -185,12 +674,21 @@ class Index : ParseReceiver {
     void got_event(InstructionEvent &ev);
     void got_event(TextOnlyEvent &ev);
     void got_event(ExceptionEvent &ev);
+    bool wants_highlights() const override { return false; }
+
+    void set_seed(const IndexerSeed &seed_) { seed = &seed_; }
+    void set_shard(const IndexerShard &shard_) { shard = &shard_; }
 
     void open_index_file();
     void open_trace_file();
+    void apply_seed();
     bool read_one_trace_line();
+    bool get_trace_line(string &line, bool &newline);
+    bool replay_one_binary_line();
     void finish_reading_trace_file();
     void build_call_tree();
+    void build_memory_hashes();
+    void write_shard_header();
     void finalise_index();
 };
 
@@ -198,6 +696,12 @@ void Index::update_sp(unsigned long long sp)
 {
     curr_sp = sp;
 
+    if (shard) {
+        // The merger expires pending calls on the shard's behalf.
+        shard_max_sp = max(shard_max_sp, sp);
+        return;
+    }
+
     if (iparams.record_calls) {
         for (auto it = pending_calls.begin(); it != pending_calls.end();) {
             if (it->sp >= sp)
@@ -210,6 +714,39 @@ void Index::update_sp(unsigned long long sp)
     }
 }
 
+void Index::record_shard_transfer(unsigned long long pc, unsigned long long sp)
+{
+    ShardTransfer st;
+    unsigned flags = 0;
+    unsigned long long lr;
+    if (expected_next_pc == KNOWN_INVALID_PC)
+        flags |= SHARD_FIRST;
+    if (read_memtree_reg(REG_lr(), &lr))
+        flags |= SHARD_LR_KNOWN;
+    else
+        lr = 0;
+    if (lr_inherited)
+        flags |= SHARD_LR_INHERITED;
+    st.line = prev_lineno;
+    st.flags = flags;
+    st.pc = pc;
+    st.sp = sp;
+    st.lr = lr;
+    st.expected_lr = expected_next_lr;
+    st.lr_age = insns_since_lr_update;
+    st.max_sp = shard_max_sp;
+    shard_transfers.push_back(st);
+    shard_max_sp = 0;
+}
+
+bool Index::lr_suggests_call(unsigned long long *lr)
+{
+    return expected_next_pc != KNOWN_INVALID_PC &&
+           read_memtree_reg(REG_lr(), lr) &&
+           insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD &&
+           absdiff(*lr, expected_next_lr) < 64;
+}
+
 void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
                       ISet iset)
 {
@@ -234,8 +771,14 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
                 << "transfer of control @ " << prev_lineno << ", sp=" << hex
                 << sp << ", pc=" << pc << dec << endl;
 
-        auto it = pending_calls.find(PendingCall(sp, pc));
-        if (it != pending_calls.end()) {
+        set<PendingCall>::iterator it;
+        if (shard) {
+            // A shard doesn't know which calls the earlier shards
+            // left waiting for a return, so it leaves the matching to
+            // the merger, with the details it will need.
+            record_shard_transfer(pc, sp);
+        } else if ((it = pending_calls.find(PendingCall(sp, pc))) !=
+                   pending_calls.end()) {
 
             if (idiags.debug_call_heuristics)
                 idiags.diag() << "  looks like return for call @ "
@@ -255,9 +798,7 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
             found_callrets.insert(CallReturn(it->call_line, +1));
             found_callrets.insert(CallReturn(prev_lineno, -1));
             pending_calls.erase(it);
-        } else if (read_memtree_reg(REG_lr(), &lr) &&
-                   insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD &&
-                   absdiff(lr, expected_next_lr) < 64) {
+        } else if (lr_suggests_call(&lr)) {
 
             if (idiags.debug_call_heuristics)
                 idiags.diag() << "  inserting as pending call with sp=" << hex
@@ -267,8 +808,12 @@ void Index::update_pc(unsigned long long pc, unsigned long long next_pc,
         }
 
         // After a transfer of control, reset insns_since_lr_update to
-        // pretend lr hasn't been updated recently.
-        insns_since_lr_update = BRANCH_LR_WRITE_THRESHOLD;
+        // pretend lr hasn't been updated recently. (Unless a shard
+        // doesn't know if this was a transfer at all.)
+        if (expected_next_pc != KNOWN_INVALID_PC || !shard) {
+            insns_since_lr_update = BRANCH_LR_WRITE_THRESHOLD;
+            lr_inherited = false;
+        }
     }
 
     curr_pc = pc;
@@ -294,6 +839,11 @@ static inline bool reg_update_overwrites_reg(Addr offset, size_t size,
 
 void Index::got_event(RegisterEvent &ev)
 {
+    if (other_cpu(ev))
+        return;
+
+    StopWatch sw(update_time, iparams.split_timings);
+    stats.register_events++;
     got_event_common(&ev, false);
 
     RegisterId reg = ev.reg;
@@ -331,12 +881,16 @@ void Index::got_event(RegisterEvent &ev)
         max_sve_bits = max(max_sve_bits, size * 64);
     }
 
-    if (reg_update_overwrites_reg(offset, size, REG_lr(), curr_iflags))
+    if (reg_update_overwrites_reg(offset, size, REG_lr(), curr_iflags)) {
         insns_since_lr_update = 0;
+        lr_inherited = false;
+    }
 }
 
 void Index::got_event(MemoryEvent &ev)
 {
+    StopWatch sw(update_time, iparams.split_timings);
+    stats.memory_events++;
     got_event_common(&ev, false);
 
     if (!ev.read) {
@@ -353,6 +907,11 @@ void Index::got_event(MemoryEvent &ev)
 
 void Index::got_event(InstructionEvent &ev)
 {
+    if (other_cpu(ev))
+        return;
+
+    StopWatch sw(update_time, iparams.split_timings);
+    stats.instruction_events++;
     got_event_common(&ev, true);
 
     if (insns_since_lr_update < BRANCH_LR_WRITE_THRESHOLD)
@@ -451,10 +1010,23 @@ void Index::got_event(InstructionEvent &ev)
     update_pc(adjusted_pc, adjusted_pc + ev.width / 8, ev.iset);
 }
 
-void Index::got_event(TextOnlyEvent &ev) { got_event_common(&ev, false); }
+void Index::got_event(TextOnlyEvent &ev)
+{
+    if (other_cpu(ev))
+        return;
+
+    StopWatch sw(update_time, iparams.split_timings);
+    stats.text_events++;
+    got_event_common(&ev, false);
+}
 
 void Index::got_event(ExceptionEvent &ev)
 {
+    if (other_cpu(ev))
+        return;
+
+    StopWatch sw(update_time, iparams.split_timings);
+    stats.exception_events++;
     got_event_common(&ev, false);
 
     if (!seen_cpu_exception_at_current_line) {
@@ -498,6 +1070,7 @@ void Index::delete_from_memtree(char type, Addr addr, size_t size)
 unsigned char *Index::make_memtree_update(char type, Addr addr, size_t size)
 {
     OFF_T contents_offset = arena->alloc(size);
+    stats.memory_data_bytes += size;
 
     delete_from_memtree(type, addr, size);
 
@@ -551,6 +1124,7 @@ void Index::update_memtree_if_necessary(char type, Addr addr, size_t size,
 OFF_T Index::make_sub_memtree(char type, Addr addr, size_t size)
 {
     OFF_T newroot_offset = arena->alloc(sizeof(diskint<OFF_T>));
+    stats.memory_data_bytes += sizeof(diskint<OFF_T>);
     *arena->getptr<diskint<OFF_T>>(newroot_offset) = 0;
 
     delete_from_memtree(type, addr, size);
@@ -583,149 +1157,17 @@ void Index::update_memtree_from_read(char type, Addr addr, size_t size,
             data[i] = contents >> (8 * i);
     }
 
-    MemoryPayload memp_search, memp;
-    memp_search.type = type;
-    memp_search.lo = addr;
-    memp_search.hi = addr + (size - 1);
-    memp_search.trace_file_firstline = prev_lineno;
-
-    while (memp_search.lo <= memp_search.hi &&
-           memtree->find_leftmost(memroot, memp_search, &memp, nullptr)) {
-        if (memp.raw) {
-            /*
-             * FIXME: we could add a consistency check here. We're
-             * seeing data being read from memory, and we thought we
-             * already knew what was in that memory. If the data isn't
-             * the same this time, what should we do? We could give a
-             * warning at indexing time, for example. Or we could mark
-             * the memory as indeterminate between the two reads (on
-             * the basis that we don't know when it changed).
-             *
-             * For the moment, we simply ignore it. But if that
-             * changed in future, this would be where to add code.
-             */
-        } else {
-            diskint<OFF_T> *subroot =
-                arena->getptr<diskint<OFF_T>>(memp.contents);
+    stats.memory_data_bytes +=
+        fill_unknown_memory(*memtree, *memsubtree, *arena, memroot, type, addr,
+                            size, data);
+}
 
-            MemorySubPayload msp;
-            msp.lo = memp_search.lo;
-            msp.hi = min(memp.hi, memp_search.hi);
-
-            while (msp.lo <= msp.hi) {
-                MemorySubPayload msp_found;
-                if (!memsubtree->find_leftmost(*subroot, msp, &msp_found,
-                                               nullptr)) {
-                    msp_found.lo = msp.hi + 1;
-                    msp_found.hi = msp.hi;
-                } else {
-                    /*
-                     * FIXME: similarly to above, we could consistency-check
-                     * the data read from memory _now_ with what was already
-                     * in our tree.
-                     */
-                }
-                if (msp.lo < msp_found.lo) {
-                    MemorySubPayload msp_insert;
-                    msp_insert.lo = msp.lo;
-                    msp_insert.hi = msp_found.lo - 1;
-                    OFF_T contents_offset =
-                        arena->alloc(msp_insert.hi - msp_insert.lo + 1);
-                    // Take account of alloc() perhaps having
-                    // re-mmapped the file
-                    subroot = arena->getptr<diskint<OFF_T>>(memp.contents);
-                    memcpy(arena->getptr<unsigned char>(contents_offset),
-                           data + (msp.lo - addr),
-                           msp_insert.hi - msp_insert.lo + 1);
-                    msp_insert.contents = contents_offset;
-
-                    OFF_T new_subroot_value =
-                        memsubtree->insert(*subroot, msp_insert);
-                    // Take account of insert() perhaps having
-                    // re-mmapped the file
-                    subroot = arena->getptr<diskint<OFF_T>>(memp.contents);
-                    *subroot = new_subroot_value;
-                }
-                msp.lo = msp_found.hi + 1;
-            }
-        }
-        memp_search.lo = memp.hi + 1;
-        if (memp_search.lo == 0)
-            break; // special case: address space wraparound!
-    }
-}
-
-bool Index::read_memtree_value(char type, Addr addr, size_t size,
-                               unsigned long long *output)
-{
-    unsigned char data[8], def[8];
-
-    MemoryPayload memp_search;
-    memp_search.type = type;
-    memp_search.lo = addr;
-    memp_search.hi = addr + (size - 1);
-
-    memset(def, 0, size);
-
-    while (memp_search.lo <= memp_search.hi) {
-        bool found;
-        MemoryPayload memp_got;
-        found = memtree->find_leftmost(last_memroot, memp_search, &memp_got,
-                                       nullptr);
-        if (!found)
-            break;
-
-        Addr addr_lo = max(memp_search.lo, memp_got.lo);
-        Addr addr_hi = min(memp_search.hi, memp_got.hi);
-
-        if (memp_got.raw) {
-            const unsigned char *treedata =
-                arena->getptr<unsigned char>(memp_got.contents);
-            memcpy((char *)data + (addr_lo - addr),
-                   treedata + (addr_lo - memp_got.lo), addr_hi - addr_lo + 1);
-            memset((char *)def + (addr_lo - addr), 1, addr_hi - addr_lo + 1);
-        } else {
-            OFF_T subroot =
-                *arena->getptr<diskint<OFF_T>>(memp_got.contents);
-            MemorySubPayload msp, msp_found;
-            msp.lo = addr_lo;
-            msp.hi = addr_hi;
-            while (msp.lo <= msp.hi && memsubtree->find_leftmost(
-                                           subroot, msp, &msp_found, nullptr)) {
-                Addr subaddr_lo = max(msp.lo, msp_found.lo);
-                Addr subaddr_hi = min(msp.hi, msp_found.hi);
-                const unsigned char *treedata =
-                    arena->getptr<unsigned char>(msp_found.contents);
-                memcpy((char *)data + (subaddr_lo - addr),
-                       treedata + (subaddr_lo - msp_found.lo),
-                       subaddr_hi - subaddr_lo + 1);
-                memset((char *)def + (subaddr_lo - addr), 1,
-                       subaddr_hi - subaddr_lo + 1);
-                msp.lo = subaddr_hi + 1;
-            }
-        }
-
-        memp_search.lo = memp_got.hi + 1;
-        if (memp_search.lo == 0) // special case: address space wraparound
-            break;
-    }
-
-    if (memchr(def, '\0', size))
-        return false; // not every byte was available
-
-    if (output) {
-        unsigned long long outval = 0;
-        if (type == 'm' && pparams.bigend) {
-            for (size_t i = 0; i < size; i++)
-                outval = (outval << 8) | data[i];
-        } else {
-            for (size_t i = size; i-- > 0;)
-                outval = (outval << 8) | data[i];
-        }
-        *output = outval;
-    }
-    return true;
-}
+bool Index::read_memtree_value(char type, Addr addr, size_t size,
+                               unsigned long long *output)
+{
+    return ::read_memtree_value(*memtree, *memsubtree, *arena, last_memroot,
+                                pparams.bigend, type, addr, size, output);
+}
 
 bool Index::read_memtree_reg(const RegisterId &reg, unsigned long long *output)
 {
@@ -760,6 +1202,8 @@ class CallDepthArrayTreeWalker {
     Arena *arena;
 
   public:
+    uint64_t bytes = 0; // total size of the arrays we've allocated
+
     CallDepthArrayTreeWalker(Arena *arena) : arena(arena) {}
     CallDepthArrayTreeWalker(const CallDepthArrayTreeWalker &) = delete;
 
@@ -829,6 +1273,7 @@ class CallDepthArrayTreeWalker {
 
         main.call_depth_array =
             arena->alloc(new_arraylen * sizeof(CallDepthArrayEntry));
+        bytes += new_arraylen * sizeof(CallDepthArrayEntry);
         CallDepthArrayEntry *new_array =
             arena->getptr<CallDepthArrayEntry>(main.call_depth_array);
         main.call_depth_arraylen = new_arraylen;
@@ -882,6 +1327,91 @@ class CallDepthArrayTreeWalker {
     }
 };
 
+// Fill in the call_depth field of every node of a finished seqtree,
+// from the list of calls and returns found in it, and then the call
+// depth arrays in its annotations. Returns the total size of the
+// arrays.
+static uint64_t
+build_call_depths(AVLDisk<SeqOrderPayload, SeqOrderAnnotation> &seqtree,
+                  Arena *arena, OFF_T seqroot,
+                  const set<CallReturn> &callrets,
+                  MemoryLimiter *limiter = nullptr)
+{
+    using Visitor = AVLDisk<SeqOrderPayload, SeqOrderAnnotation>::WalkVisitor;
+    auto limited = [limiter](Visitor visitor) -> Visitor {
+        if (!limiter)
+            return visitor;
+        return [visitor, limiter](SeqOrderPayload &p, SeqOrderAnnotation &a,
+                                  OFF_T lc, SeqOrderAnnotation *lca, OFF_T rc,
+                                  SeqOrderAnnotation *rca, OFF_T off) {
+            visitor(p, a, lc, lca, rc, rca, off);
+            limiter->visited();
+        };
+    };
+    {
+        CallDepthCountingTreeWalker visitor(callrets);
+        seqtree.walk(seqroot, WalkOrder::Inorder, limited(ref(visitor)));
+    }
+    {
+        CallDepthArrayTreeWalker visitor(arena);
+        seqtree.walk(seqroot, WalkOrder::Postorder, limited(ref(visitor)));
+        return visitor.bytes;
+    }
+}
+
+static void
+build_memory_hashes(AVLDisk<SeqOrderPayload, SeqOrderAnnotation> &seqtree,
+                    AVLDisk<MemoryPayload, MemoryAnnotation> &memtree,
+                    AVLDisk<MemorySubPayload, MemorySubAnnotation> &memsubtree,
+                    Arena &arena, OFF_T seqroot,
+                    MemoryLimiter *limiter = nullptr)
+{
+    /*
+     * Now that all the memory sub-trees are complete, fill in the
+     * content hash annotations in every memtree root. Each node is
+     * shared between many roots, so we mark the ones we've done, and
+     * never descend into a subtree we've already seen.
+     */
+    auto done = [](const MemoryAnnotation &a) { return a.hashed != 0; };
+    auto visitor = [&](MemoryPayload &p, MemoryAnnotation &a, OFF_T,
+                       MemoryAnnotation *lca, OFF_T, MemoryAnnotation *rca,
+                       OFF_T) {
+        uint64_t hash = memtree_payload_hash(memsubtree, arena, p, p.lo, p.hi);
+        if (lca)
+            hash += lca->hash;
+        if (rca)
+            hash += rca->hash;
+        a.hash = hash;
+        a.hashed = 1;
+        if (limiter)
+            limiter->visited();
+    };
+    seqtree.walk(seqroot, WalkOrder::Inorder,
+                 [&](SeqOrderPayload &sp, SeqOrderAnnotation &, OFF_T,
+                     SeqOrderAnnotation *, OFF_T, SeqOrderAnnotation *,
+                     OFF_T) {
+                     memtree.walk_unless(sp.memory_root, done, visitor);
+                 });
+}
+
+// Store an index's statistics in its arena, and point its header at
+// them. Call this last, so that the total size includes everything.
+static void write_index_stats(Arena &arena, OFF_T header_offset,
+                              IndexStats &stats)
+{
+    unsigned count = 0;
+    stats.for_each_value([&](uint64_t &) { count++; });
+    OFF_T offset = arena.alloc((count + 1) * sizeof(diskint<uint64_t>));
+    stats.total_bytes = arena.curr_offset();
+    stats.arena_resizes = arena.resizes();
+    stats.peak_resident_bytes = peak_resident_memory();
+
+    diskint<uint64_t> *out = arena.getptr<diskint<uint64_t>>(offset);
+    *out++ = count;
+    stats.for_each_value([&](uint64_t &v) { *out++ = v; });
+    arena.getptr<FileHeader>(header_offset)->stats = offset;
+}
+
 void Index::got_event_common(TarmacEvent *event, bool is_instruction)
 {
     /*
@@ -925,6 +1455,8 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
         last_memroot = memroot;
         last_sp = curr_sp;
         memtree->commit();
+        if (limiter)
+            limiter->updated();
 
         if (!event)
             return;
@@ -936,228 +1468,1362 @@ void Index::got_event_common(TarmacEvent *event, bool is_instruction)
         curr_pc = KNOWN_INVALID_PC;
         oldpos = linepos;
 
-        prev_lineno = lineno;
-        seen_any_event = true;
-        seen_cpu_exception_at_current_line = false;
-    }
+        prev_lineno = lineno;
+        seen_any_event = true;
+        seen_cpu_exception_at_current_line = false;
+    }
+
+    if (is_instruction)
+        seen_instruction_at_current_time = true;
+}
+
+bool Index::parse_warning(const string &msg)
+{
+    reporter->indexing_warning(trace.tarmac_filename, lineno + lineno_offset,
+                               msg);
+    return false;
+}
+
+void Index::open_index_file()
+{
+    if (trace.index_on_disk) {
+        remove(trace.index_filename.c_str());
+        // The memory limit is kept by releasing pages of the file a
+        // few at a time, which can't be done to a huge page, so a
+        // limited index is mapped in ordinary pages.
+        arena = make_shared<MMapFile>(
+            trace.index_filename, true,
+            Arena::use_huge_pages && !iparams.memory_limit);
+        if (iparams.memory_limit)
+            limiter = make_unique<MemoryLimiter>(*arena, iparams.memory_limit);
+    } else {
+        arena = trace.memory_index;
+    }
+
+    MagicNumber &magic = *arena->newptr<MagicNumber>();
+
+    header_offset = arena->alloc(sizeof(FileHeader));
+    FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+    hdr.flags = 0;        // ensure FLAG_COMPLETE is not initially set
+    hdr.stats = 0;
+    hdr.cpu = 0;
+    hdr.shard = 0;
+
+    magic.setup();
+
+    memtree = new AVLDisk<MemoryPayload, MemoryAnnotation>(*arena);
+    memsubtree = new AVLDisk<MemorySubPayload, MemorySubAnnotation>(*arena);
+    seqtree = new AVLDisk<SeqOrderPayload, SeqOrderAnnotation>(*arena);
+    bypctree = new AVLDisk<ByPCPayload>(*arena);
+}
+
+void Index::open_trace_file()
+{
+    /*
+     * Read in the input.
+     */
+    if (shard && !trace.binary_filename.empty())
+        reporter->errx(1, _("a binary trace file cannot be indexed in "
+                            "shards"));
+
+    if (!trace.binary_filename.empty()) {
+        // Replay the events from a binary trace, instead of parsing
+        // the text. It was parsed with its own parameters, so record
+        // those in the index.
+        binary = make_unique<BinaryTraceReader>(trace.binary_filename);
+        from_binary = true;
+        binary_fingerprint = binary->header().fingerprint;
+        pparams = binary->header().pparams;
+    } else {
+        ifs = make_unique<ifstream>(trace.tarmac_filename.c_str(),
+                                    std::ios_base::in | std::ios_base::binary);
+        if (ifs->fail())
+            reporter->err(1, "%s: open", trace.tarmac_filename.c_str());
+        readbuf.resize(1 << 20);
+    }
+
+    memroot = seqroot = 0;
+    prev_lineno = 0; // used to fill in last-mod time in make_sub_memtree
+
+    // Set the initial contents of memory to be a sub-memtree, so that
+    // we can fill in anything we later find out about via MR events.
+    //
+    // I cheat slightly here by setting the size parameter to 0,
+    // really meaning the full size of the address space, because I
+    // know that make_sub_memtree will subtract 1 from it and wrap
+    // around.
+    OFF_T initial_memory = make_sub_memtree('m', 0, 0);
+
+    // A shard that starts partway through the trace can't assume
+    // anything about the registers either, so it gives them a
+    // sub-memtree too. These are the two the shard merger replaces
+    // with the state at the end of the previous shard.
+    if (shard && shard->start > 0) {
+        memory_at_start = initial_memory;
+        registers_at_start = make_sub_memtree('r', 0, 0);
+    }
+    if (shard) {
+        // Count instructions from the start of the shard, until lr is
+        // written, for the merger to add to the count carried over
+        // from the previous shard.
+        insns_since_lr_update = 0;
+        lr_inherited = true;
+    }
+    max_sve_bits = 128;
+    if (seed)
+        apply_seed();
+    last_memroot = memroot;
+    current_time = -(Time)1;
+    seen_instruction_at_current_time = false;
+    seen_cpu_exception_at_current_line = false;
+    bypcroot = 0;
+    true_lineno = 0;
+    lineno = 1;
+    oldpos = 0;
+    lineno_offset = 0;
+    seen_any_event = false;
+    prev_lineno = lineno;
+    curr_pc = KNOWN_INVALID_PC;
+
+    if (binary) {
+        reporter->indexing_start(binary_fingerprint.size);
+    } else if (shard) {
+        reporter->indexing_start(shard->end - shard->start);
+        ifs->seekg(shard->start);
+        linepos = oldpos = shard->start;
+    } else {
+        ifs->seekg(0, ios::end);
+        reporter->indexing_start(ifs->tellg());
+        ifs->seekg(0);
+    }
+}
+
+void Index::apply_seed()
+{
+    // Write the seed ranges into the initial memory tree as if they
+    // had been updated before the first line of the trace.
+    for (const IndexerSeed::Range &range : seed->ranges) {
+        if (range.data.empty() ||
+            (range.type == 'm' && !iparams.record_memory))
+            continue;
+        unsigned char *contents =
+            make_memtree_update(range.type, range.addr, range.data.size());
+        memcpy(contents, range.data.data(), range.data.size());
+    }
+    max_sve_bits = max<size_t>(max_sve_bits, seed->max_sve_bits);
+
+    // Pick up the derived indexer state that the seed implies. (The
+    // reads below look in last_memroot, so bring that up to date.)
+    last_memroot = memroot;
+    unsigned long long value;
+    if (read_memtree_value('r', reg_offset(REG_iflags), reg_size(REG_iflags),
+                           &value)) {
+        curr_iflags = value;
+        if (curr_iflags & IFLAG_AARCH64)
+            aarch64_used = true;
+    }
+    if (read_memtree_reg(REG_sp(), &value))
+        curr_sp = value;
+}
+
+bool Index::read_one_trace_line()
+{
+    true_lineno++;
+    if (seen_any_event)
+        lineno++;
+
+    if (binary)
+        return replay_one_binary_line();
+
+    if (shard && (uint64_t)(std::streamoff)linepos >= shard->end) {
+        finish_reading_trace_file();
+        return false;
+    }
+
+    string &line = curr_line;
+    bool newline;
+    if (!get_trace_line(line, newline)) {
+        finish_reading_trace_file();
+        return false;
+    }
+
+    trace_hasher.update(line.data(), line.size());
+    if (newline)
+        trace_hasher.update("\n", 1);
+
+    stats.lines++;
+    try {
+        StopWatch sw(parse_time, iparams.split_timings);
+        parser.parse(line);
+    } catch (TarmacParseError e) {
+        if (!newline) {
+            ostringstream oss;
+            oss << e.msg << endl
+                << _("ignoring parse error on partial last line "
+                     "(trace truncated?)");
+            reporter->indexing_warning(trace.tarmac_filename, lineno,
+                                       oss.str());
+            finish_reading_trace_file();
+            return false;
+        } else {
+            if (trace.index_on_disk)
+                remove(trace.index_filename.c_str());
+            reporter->indexing_error(trace.tarmac_filename, lineno, e.msg);
+        }
+    }
+
+    // Maintain linepos ourselves, rather than calling ifs->tellg() numerous
+    // times. tellg() is a somehow slow function on some platforms, and this
+    // alone allows a 2x speedup in parsing time.
+    linepos += line.size() + (newline ? 1 : 0);
+    if (stats.lines % PROGRESS_INTERVAL_LINES == 0)
+        reporter->indexing_progress(progress());
+
+    return true;
+}
+
+// Read the next line of the trace, without its newline, in large
+// blocks rather than through getline, so that finding the end of each
+// line is a single memchr over the block. Returns false at the end of
+// the file; 'newline' is false if the line was the last one and
+// unterminated (perhaps because the trace was truncated).
+bool Index::get_trace_line(string &line, bool &newline)
+{
+    line.clear();
+    while (true) {
+        if (readpos == readlen) {
+            ifs->read(readbuf.data(), readbuf.size());
+            readpos = 0;
+            readlen = ifs->gcount();
+            if (readlen == 0) {
+                newline = false;
+                return !line.empty();
+            }
+        }
+
+        const char *start = readbuf.data() + readpos;
+        const char *end = readbuf.data() + readlen;
+        const char *nl = scan_newline(start, end);
+        line.append(start, nl);
+        readpos = nl - readbuf.data();
+        if (nl != end) {
+            readpos++;
+            newline = true;
+            return true;
+        }
+    }
+}
+
+bool Index::replay_one_binary_line()
+{
+    size_t linelen;
+    bool got_line;
+    {
+        StopWatch sw(parse_time, iparams.split_timings);
+        got_line = binary->next_line(*this, linelen);
+    }
+    if (!got_line) {
+        linepos = binary->end_position();
+        finish_reading_trace_file();
+        return false;
+    }
+
+    stats.lines++;
+    linepos += linelen;
+    if (stats.lines % PROGRESS_INTERVAL_LINES == 0)
+        reporter->indexing_progress(progress());
+
+    return true;
+}
+
+void Index::finish_reading_trace_file()
+{
+    if (!ifs && !binary)
+        return;
+
+    reporter->indexing_done(progress());
+
+    // Call got_event with no actual event, signalling end-of-file, so
+    // that the last record is output (the same flushing of
+    // accumulated data we'd do on seeing the next instruction, except
+    // that then we stop without processing an instruction).
+    got_event_common(nullptr, false);
+
+    ifs = nullptr;
+    binary = nullptr;
+}
+
+void Index::build_call_tree()
+{
+    /*
+     * Now we've got to the end of the trace and matched up calls to
+     * returns as best we can within our own memory, postprocess the
+     * main seqtree to fill in the call depth fields.
+     */
+    if (iparams.record_calls)
+        stats.call_depth_array_bytes =
+            build_call_depths(*seqtree, arena.get(), seqroot, found_callrets,
+                              limiter.get());
+}
+
+void Index::build_memory_hashes()
+{
+    ::build_memory_hashes(*seqtree, *memtree, *memsubtree, *arena, seqroot,
+                          limiter.get());
+}
+
+void Index::write_stats()
+{
+    stats.read_us = StopWatch::microseconds(read_time);
+    if (iparams.split_timings) {
+        // The parser calls back into the indexer for each event, so
+        // parse_time includes update_time.
+        stats.parse_us = StopWatch::microseconds(parse_time - update_time);
+        stats.update_us = StopWatch::microseconds(update_time);
+    }
+    stats.postprocess_us = StopWatch::microseconds(postprocess_time);
+    stats.seqtree = seqtree->stats();
+    stats.bypctree = bypctree->stats();
+    stats.memtree = memtree->stats();
+    stats.memsubtree = memsubtree->stats();
+    if (limiter) {
+        stats.memory_releases = limiter->releases;
+        stats.peak_index_resident_bytes = limiter->peak_resident;
+    }
+    write_index_stats(*arena, header_offset, stats);
+}
+
+void Index::write_shard_header()
+{
+    OFF_T offset = arena->alloc(sizeof(ShardHeader));
+    OFF_T transfers_offset =
+        arena->alloc(shard_transfers.size() * sizeof(ShardTransfer));
+
+    ShardHeader &shdr = *arena->getptr<ShardHeader>(offset);
+    shdr.trace_start = shard->start;
+    shdr.trace_end = shard->end;
+    shdr.lines = lineno - 1;
+    shdr.file_lines = true_lineno - 1;
+    shdr.memory_at_start = memory_at_start;
+    shdr.registers_at_start = registers_at_start;
+    shdr.transfers = transfers_offset;
+    shdr.ntransfers = shard_transfers.size();
+    shdr.final_expected_pc = expected_next_pc;
+    shdr.final_expected_lr = expected_next_lr;
+    shdr.final_lr_age = insns_since_lr_update;
+    shdr.final_flags = lr_inherited ? SHARD_LR_INHERITED : 0;
+    shdr.final_max_sp = shard_max_sp;
+
+    // Take care not to call getptr for an empty array, which might
+    // be at the very end of the arena.
+    if (!shard_transfers.empty())
+        memcpy(arena->getptr<ShardTransfer>(transfers_offset),
+               shard_transfers.data(),
+               shard_transfers.size() * sizeof(ShardTransfer));
+
+    arena->getptr<FileHeader>(header_offset)->shard = offset;
+}
+
+void Index::finalise_index()
+{
+    if (shard)
+        write_shard_header();
+    write_stats();
+
+    FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+
+    // (A shard is allowed to be empty, if there were no instructions
+    // to start a shard at in its part of the trace.)
+    if (seqroot == 0 && !shard)
+        reporter->errx(1, "error: trace file contains no events at all");
+
+    unsigned flags = 0;
+    if (pparams.bigend)
+        flags |= FLAG_BIGEND;
+    if (pparams.iset_specified && pparams.iset == THUMB)
+        flags |= FLAG_THUMB_ONLY;
+    if (aarch64_used)
+        flags |= FLAG_AARCH64_USED;
+
+    unsigned svelen_flag = ((max_sve_bits + 127) / 128 - 1) * FLAG_SVELEN_UNIT;
+    assert((svelen_flag & ~FLAG_SVELEN_MASK) == 0);
+    flags |= svelen_flag;
+
+    flags |= FLAG_COMPLETE;
+    hdr.flags = flags;
+
+    hdr.seqroot = seqroot;
+    hdr.bypcroot = bypcroot;
+    hdr.lineno_offset = lineno_offset;
+    hdr.cpu = iparams.cpu + 1;
+
+    // We've normally hashed the whole trace file on the way through
+    // it, but if parsing stopped early, hash it again properly. A
+    // shard has only seen part of it, so it leaves the full hash to
+    // the merger.
+    TraceFingerprint fp;
+    if (shard) {
+        if (!trace_fingerprint(trace.tarmac_filename, false, fp))
+            reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
+    } else if (from_binary)
+        fp = binary_fingerprint; // the text file need not be present
+    else if (!trace_fingerprint(trace.tarmac_filename, false, fp))
+        reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
+    else if (trace_hasher.bytes() == fp.size)
+        fp.full_hash = trace_hasher.digest();
+    else if (!trace_fingerprint(trace.tarmac_filename, true, fp))
+        reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
+    hdr.trace_size = fp.size;
+    hdr.trace_sampled_hash = fp.sampled_hash;
+    hdr.trace_full_hash = fp.full_hash;
+}
+
+void Index::parse_tarmac_file()
+{
+    open_index_file();
+    open_trace_file();
+    {
+        StopWatch sw(read_time);
+        while (read_one_trace_line());
+    }
+    if (!shard) {
+        // A shard leaves all of this to the merger.
+        StopWatch sw(postprocess_time);
+        build_call_tree();
+        if (iparams.memory_hashes)
+            build_memory_hashes();
+    }
+    finalise_index();
+}
+
+bool trace_fingerprint(const string &tarmac_filename, bool full,
+                       TraceFingerprint &out)
+{
+    // Sizes of the samples that go into the sampled hash
+    constexpr uint64_t END_SAMPLE = 65536, MID_SAMPLE = 4096;
+    constexpr unsigned MID_SAMPLES = 16;
+
+    ifstream ifs(tarmac_filename.c_str(),
+                 std::ios_base::in | std::ios_base::binary);
+    if (ifs.fail())
+        return false;
+    ifs.seekg(0, ios::end);
+    out.size = ifs.tellg();
+
+    vector<char> buf(1 << 20);
+    TraceHasher sampled;
+    sampled.update_u64(out.size);
+    auto sample = [&](uint64_t pos, uint64_t len) {
+        sampled.update_u64(pos);
+        ifs.seekg(pos);
+        if (!ifs.read(buf.data(), len))
+            return false;
+        sampled.update(buf.data(), len);
+        return true;
+    };
+
+    if (out.size <= 2 * END_SAMPLE + MID_SAMPLES * MID_SAMPLE) {
+        if (!sample(0, out.size))
+            return false;
+    } else {
+        uint64_t span = out.size - 2 * END_SAMPLE - MID_SAMPLE;
+        if (!sample(0, END_SAMPLE))
+            return false;
+        for (unsigned i = 0; i < MID_SAMPLES; i++)
+            if (!sample(END_SAMPLE + span * i / (MID_SAMPLES - 1), MID_SAMPLE))
+                return false;
+        if (!sample(out.size - END_SAMPLE, END_SAMPLE))
+            return false;
+    }
+    out.sampled_hash = sampled.digest();
+
+    out.full_hash = 0;
+    if (full) {
+        TraceHasher hasher;
+        ifs.seekg(0);
+        while (ifs.read(buf.data(), buf.size()) || ifs.gcount() > 0)
+            hasher.update(buf.data(), ifs.gcount());
+        if (hasher.bytes() != out.size)
+            return false;
+        out.full_hash = hasher.digest();
+    }
+
+    return true;
+}
+
+bool trace_fingerprint(const TracePair &trace, bool full,
+                       TraceFingerprint &out)
+{
+    if (trace.binary_filename.empty())
+        return trace_fingerprint(trace.tarmac_filename, full, out);
+    if (!is_binary_trace(trace.binary_filename))
+        return false;
+    BinaryTraceReader reader(trace.binary_filename);
+    out = reader.header().fingerprint;
+    return true;
+}
+
+void IndexStats::print(ostream &os) const
+{
+    os << _("Trace lines read: ") << lines << endl;
+    os << format(_("Events: {} instruction, {} register, {} memory, "
+                   "{} exception, {} text-only"),
+                 instruction_events, register_events, memory_events,
+                 exception_events, text_events)
+       << endl;
+    if (parse_us || update_us)
+        os << format(_("Indexing time: {} us reading the trace ({} us "
+                       "parsing, {} us updating trees), {} us "
+                       "post-processing"),
+                     read_us, parse_us, update_us, postprocess_us)
+           << endl;
+    else
+        os << format(_("Indexing time: {} us reading the trace, {} us "
+                       "post-processing"),
+                     read_us, postprocess_us)
+           << endl;
+
+    auto tree = [&](const char *name, const TreeStats &t) {
+        os << format(_("{}: {} nodes allocated ({} cloned), {} bytes"), name,
+                     t.nodes_allocated, t.nodes_cloned, t.bytes)
+           << endl;
+    };
+    tree(_("Sequential order tree"), seqtree);
+    tree(_("By-PC tree"), bypctree);
+    tree(_("Memory tree"), memtree);
+    tree(_("Memory sub-trees"), memsubtree);
+
+    os << _("Call depth arrays: ") << call_depth_array_bytes << _(" bytes")
+       << endl;
+    os << _("Register and memory contents: ") << memory_data_bytes
+       << _(" bytes") << endl;
+    os << _("Total index size: ") << total_bytes << _(" bytes") << endl;
+    os << _("Index file resizes: ") << arena_resizes << endl;
+    os << format(_("Peak resident memory: {} bytes ({} releases to "
+                   "stay within the memory limit)"),
+                 peak_resident_bytes, memory_releases)
+       << endl;
+    if (peak_index_resident_bytes)
+        os << format(_("Peak resident index file size: {} bytes"),
+                     peak_index_resident_bytes)
+           << endl;
+}
+
+IndexHeaderState check_index_header(const string &index_filename,
+                                    TraceFingerprint *fingerprint, int *cpu)
+{
+    MMapFile arena(index_filename, false);
+
+    MagicNumber &magic = *arena.getptr<MagicNumber>(0);
+    if (!magic.check())
+        return IndexHeaderState::WrongMagic;
+
+    FileHeader &hdr = *arena.getptr<FileHeader>(sizeof(MagicNumber));
+    if (!(hdr.flags & FLAG_COMPLETE))
+        return IndexHeaderState::Incomplete;
+    if (hdr.shard)
+        return IndexHeaderState::Incomplete; // only part of an index
+
+    if (fingerprint) {
+        fingerprint->size = hdr.trace_size;
+        fingerprint->sampled_hash = hdr.trace_sampled_hash;
+        fingerprint->full_hash = hdr.trace_full_hash;
+    }
+    if (cpu)
+        *cpu = (int)hdr.cpu - 1;
+
+    return IndexHeaderState::OK;
+}
+
+void run_indexer(const TracePair &trace, const IndexerParams &iparams,
+                 const IndexerDiagnostics &idiags, const ParseParams &pparams)
+{
+    Index index(trace, iparams, idiags, pparams);
+    index.parse_tarmac_file();
+}
+
+void run_indexer(const TracePair &trace, const IndexerParams &iparams,
+                 const IndexerDiagnostics &idiags, const ParseParams &pparams,
+                 const IndexerSeed &seed)
+{
+    Index index(trace, iparams, idiags, pparams);
+    index.set_seed(seed);
+    index.parse_tarmac_file();
+}
+
+void run_indexer(const TracePair &trace, const IndexerParams &iparams,
+                 const IndexerDiagnostics &idiags, const ParseParams &pparams,
+                 const IndexerShard &shard)
+{
+    Index index(trace, iparams, idiags, pparams);
+    index.set_shard(shard);
+    index.parse_tarmac_file();
+}
+
+namespace {
+
+// ParseReceiver that just notes what kind of events a line contains,
+// for shard_boundary. Like the Index, it only counts memory events
+// from other CPUs than the one being indexed.
+class LineProber : public ParseReceiver {
+    int cpu;
+
+    bool other_cpu(const TarmacEvent &ev) const
+    {
+        return cpu >= 0 && ev.cpu >= 0 && ev.cpu != cpu;
+    }
+
+  public:
+    bool any_event, instruction;
+    Time time;
+
+    LineProber(int cpu) : cpu(cpu) {}
+
+    void reset() { any_event = instruction = false; }
+    void event(const TarmacEvent &ev)
+    {
+        if (!any_event)
+            time = ev.time;
+        any_event = true;
+    }
+
+    void got_event(InstructionEvent &ev) override
+    {
+        if (other_cpu(ev))
+            return;
+        event(ev);
+        instruction = true;
+    }
+    void got_event(RegisterEvent &ev) override
+    {
+        if (!other_cpu(ev))
+            event(ev);
+    }
+    void got_event(MemoryEvent &ev) override { event(ev); }
+    void got_event(TextOnlyEvent &ev) override
+    {
+        if (!other_cpu(ev))
+            event(ev);
+    }
+    void got_event(ExceptionEvent &ev) override
+    {
+        if (!other_cpu(ev))
+            event(ev);
+    }
+    bool wants_highlights() const override { return false; }
+};
+
+} // namespace
+
+uint64_t shard_boundary(const string &tarmac_filename,
+                        const ParseParams &pparams, unsigned n,
+                        unsigned count, int cpu)
+{
+    ifstream ifs(tarmac_filename.c_str(),
+                 std::ios_base::in | std::ios_base::binary);
+    if (ifs.fail())
+        reporter->err(1, "%s: open", tarmac_filename.c_str());
+    ifs.seekg(0, ios::end);
+    uint64_t size = ifs.tellg();
+
+    if (n == 0)
+        return 0;
+    if (n >= count)
+        return size;
+
+    // Read the file a block at a time from just before the nominal
+    // boundary, returning each line that has a newline after it.
+    uint64_t pos = size / count * n + size % count * n / count;
+    ifs.seekg(pos - 1);
+    vector<char> buf;
+    size_t bufpos = 0;
+    auto next_line = [&](string &line) {
+        while (true) {
+            const char *begin = buf.data() + bufpos;
+            const char *end = buf.data() + buf.size();
+            const char *nl = scan_newline(begin, end);
+            if (nl != end) {
+                line.assign(begin, nl);
+                bufpos = nl + 1 - buf.data();
+                return true;
+            }
+            buf.erase(buf.begin(), buf.begin() + bufpos);
+            bufpos = 0;
+            size_t len = buf.size();
+            buf.resize(len + 16384);
+            ifs.read(buf.data() + len, 16384);
+            buf.resize(len + ifs.gcount());
+            if (buf.size() == len)
+                return false;
+        }
+    };
+
+    // Start from the first whole line after the nominal boundary.
+    string line;
+    if (!next_line(line))
+        return size;
+    pos += line.size();
+
+    // Move on to the first instruction that is sure to start a new
+    // node of the seqtree, i.e. one that isn't at the same time as an
+    // earlier event with no instruction. So we need to have seen at
+    // least one line with an event before it.
+    LineProber prober(cpu);
+    TarmacLineParser parser(pparams, prober);
+    bool seen_event = false, prev_instruction = false;
+    Time prev_time = 0;
+    while (next_line(line)) {
+        prober.reset();
+        try {
+            parser.parse(line);
+        } catch (const TarmacParseError &) {
+            // Not a line we can start at, but the indexer will
+            // report it in whichever shard it ends up in.
+        }
+        if (prober.any_event) {
+            if (prober.instruction && seen_event &&
+                (prober.time != prev_time || prev_instruction))
+                return pos;
+            seen_event = true;
+            prev_time = prober.time;
+            prev_instruction = prober.instruction;
+        }
+        pos += line.size() + 1;
+    }
+    return size;
+}
+
+namespace {
+
+// Keyfinders for splitting trees with AVLDisk::split. ShardSplitBefore
+// puts everything sorting before a given payload on the left;
+// MemorySplit puts the memtree entries of one address space that
+// start below a given address (or at it, if 'inclusive') on the
+// left, along with all of any address space sorting before it.
+template <class Payload> class ShardSplitBefore {
+    const Payload &key;
+
+  public:
+    ShardSplitBefore(const Payload &key) : key(key) {}
+    int cmp(const Payload &rhs) const { return key.cmp(rhs) > 0 ? +1 : -1; }
+};
+
+class MemorySplit {
+    char type;
+    Addr addr;
+    bool inclusive;
+
+  public:
+    MemorySplit(char type, Addr addr, bool inclusive)
+        : type(type), addr(addr), inclusive(inclusive)
+    {
+    }
+    int cmp(const MemoryPayload &rhs) const
+    {
+        if (rhs.type != type)
+            return rhs.type < type ? +1 : -1;
+        return rhs.lo < addr || (inclusive && rhs.lo == addr) ? +1 : -1;
+    }
+};
+
+// Find the last element of a tree.
+template <class Payload, class Annotation>
+bool tree_last(const AVLDisk<Payload, Annotation> &tree, OFF_T root,
+               Payload *out)
+{
+    if (!root)
+        return false;
+    while (true) {
+        Annotation a;
+        OFF_T lc, rc;
+        tree.read_node(root, *out, a, lc, rc);
+        if (!rc)
+            return true;
+        root = rc;
+    }
+}
+
+struct IndexShard {
+    string filename;
+    shared_ptr<Arena> arena;
+    FileHeader hdr;
+    ShardHeader shdr;
+};
+
+/*
+ * Combines index shards into one index. Each shard's trees are copied
+ * into the new index with their line numbers moved up past the
+ * previous shards', and then joined on to the end of (or, for the
+ * by-PC tree, merged into) the trees built from the previous shards.
+ * Memory trees are copied node by node, replacing every entry that
+ * stands for the state at the start of the shard with that range of
+ * the final memory tree of the previous one.
+ */
+class ShardMerger {
+    TracePair trace;
+    bool memory_hashes;
+    vector<IndexShard> shards;
 
-    if (is_instruction)
-        seen_instruction_at_current_time = true;
-}
+    shared_ptr<Arena> arena;
+    AVLDisk<MemoryPayload, MemoryAnnotation> memtree;
+    AVLDisk<MemorySubPayload, MemorySubAnnotation> memsubtree;
+    AVLDisk<SeqOrderPayload, SeqOrderAnnotation> seqtree;
+    AVLDisk<ByPCPayload> bypctree;
+    OFF_T header_offset, seqroot = 0, bypcroot = 0;
+    IndexStats stats;
+    std::chrono::steady_clock::duration merge_time{};
+
+    // State carried from one shard to the next: the memory tree at
+    // the end of the shards merged so far, and the number of lines in
+    // them, which is added to the line numbers in the next shard.
+    OFF_T final_memroot = 0;
+    unsigned line_base = 0;
+
+    set<CallReturn> callrets;
+
+    // While copying a shard, the trees in it, and the nodes, memory
+    // sub-trees and raw data already copied from it.
+    const IndexShard *shard;
+    unique_ptr<AVLDisk<MemoryPayload, MemoryAnnotation>> src_memtree;
+    unique_ptr<AVLDisk<MemorySubPayload, MemorySubAnnotation>>
+        src_memsubtree;
+    unique_ptr<AVLDisk<SeqOrderPayload, SeqOrderAnnotation>> src_seqtree;
+    unique_ptr<AVLDisk<ByPCPayload>> src_bypctree;
+    std::unordered_map<OFF_T, OFF_T> copied_nodes, copied_subtrees;
+    std::unordered_map<OFF_T, pair<OFF_T, size_t>> copied_data;
+
+    static shared_ptr<Arena> open_output(const TracePair &trace);
+    IndexShard open_shard(const string &filename);
+    vector<IndexShard> open_shards(const vector<string> &filenames);
+    void check_shards(const vector<IndexShard> &shards);
+
+    OFF_T copy_data(OFF_T offset, size_t size);
+    OFF_T copy_memsubtree(OFF_T root);
+    OFF_T copy_memtree(OFF_T node);
+    OFF_T copy_seqtree(OFF_T node);
+    OFF_T copy_bypctree(OFF_T node);
+    OFF_T bypc_union(OFF_T a, OFF_T b);
+    OFF_T extract_memory(OFF_T root, char type, Addr lo, Addr hi);
+    void fill_in_hindsight();
+    void merge_shard(const IndexShard &shard);
+
+    bool read_reg(OFF_T memroot, const RegisterId &reg64,
+                  const RegisterId &reg32, unsigned long long *value);
+    void find_calls();
+    void write_header();
 
-bool Index::parse_warning(const string &msg)
-{
-    reporter->indexing_warning(trace.tarmac_filename, lineno + lineno_offset,
-                               msg);
-    return false;
-}
+  public:
+    ShardMerger(const TracePair &trace, bool memory_hashes,
+                const vector<string> &filenames);
+    void merge();
+};
 
-void Index::open_index_file()
+ShardMerger::ShardMerger(const TracePair &trace, bool memory_hashes,
+                         const vector<string> &filenames)
+    : trace(trace), memory_hashes(memory_hashes),
+      shards(open_shards(filenames)), arena(open_output(trace)),
+      memtree(*arena), memsubtree(*arena), seqtree(*arena), bypctree(*arena)
 {
-    if (trace.index_on_disk) {
-        remove(trace.index_filename.c_str());
-        arena = make_shared<MMapFile>(trace.index_filename, true);
-    } else {
-        arena = trace.memory_index;
-    }
-
+    // Lay out the start of the file as the indexer does.
     MagicNumber &magic = *arena->newptr<MagicNumber>();
-
+    magic.setup();
     header_offset = arena->alloc(sizeof(FileHeader));
     FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
-    hdr.flags = 0;        // ensure FLAG_COMPLETE is not initially set
-
-    magic.setup();
-
-    memtree = new AVLDisk<MemoryPayload, MemoryAnnotation>(*arena);
-    memsubtree = new AVLDisk<MemorySubPayload>(*arena);
-    seqtree = new AVLDisk<SeqOrderPayload, SeqOrderAnnotation>(*arena);
-    bypctree = new AVLDisk<ByPCPayload>(*arena);
+    hdr.flags = 0; // ensure FLAG_COMPLETE is not initially set
+    hdr.stats = 0;
+    hdr.shard = 0;
 }
 
-void Index::open_trace_file()
+shared_ptr<Arena> ShardMerger::open_output(const TracePair &trace)
 {
-    /*
-     * Read in the input.
-     */
-    ifs = make_unique<ifstream>(trace.tarmac_filename.c_str(),
-                                std::ios_base::in | std::ios_base::binary);
-    if (ifs->fail())
-        reporter->err(1, "%s: open", trace.tarmac_filename.c_str());
-
-    memroot = seqroot = 0;
-    prev_lineno = 0; // used to fill in last-mod time in make_sub_memtree
+    if (!trace.index_on_disk)
+        return trace.memory_index;
+    remove(trace.index_filename.c_str());
+    return make_shared<MMapFile>(trace.index_filename, true);
+}
 
-    // Set the initial contents of memory to be a sub-memtree, so that
-    // we can fill in anything we later find out about via MR events.
-    //
-    // I cheat slightly here by setting the size parameter to 0,
-    // really meaning the full size of the address space, because I
-    // know that make_sub_memtree will subtract 1 from it and wrap
-    // around.
-    make_sub_memtree('m', 0, 0);
-    last_memroot = memroot;
-    current_time = -(Time)1;
-    seen_instruction_at_current_time = false;
-    seen_cpu_exception_at_current_line = false;
-    bypcroot = 0;
-    true_lineno = 0;
-    lineno = 1;
-    oldpos = 0;
-    lineno_offset = 0;
-    seen_any_event = false;
-    prev_lineno = lineno;
-    curr_pc = KNOWN_INVALID_PC;
-    max_sve_bits = 128;
+IndexShard ShardMerger::open_shard(const string &filename)
+{
+    IndexShard shard;
+    shard.filename = filename;
+    shard.arena = make_shared<MMapFile>(filename, false);
 
-    ifs->seekg(0, ios::end);
-    reporter->indexing_start(ifs->tellg());
-    ifs->seekg(0);
+    if (!shard.arena->getptr<MagicNumber>(0)->check())
+        reporter->errx(1, _("%s: magic number did not match"),
+                       filename.c_str());
+    shard.hdr = *shard.arena->getptr<FileHeader>(sizeof(MagicNumber));
+    if (!(shard.hdr.flags & FLAG_COMPLETE))
+        reporter->errx(1, _("%s: index shard was not completed"),
+                       filename.c_str());
+    if (!shard.hdr.shard)
+        reporter->errx(1, _("%s: index file is not an index shard"),
+                       filename.c_str());
+    shard.shdr = *shard.arena->getptr<ShardHeader>(shard.hdr.shard);
+    return shard;
 }
 
-bool Index::read_one_trace_line()
+vector<IndexShard> ShardMerger::open_shards(const vector<string> &filenames)
 {
-    true_lineno++;
-    if (seen_any_event)
-        lineno++;
+    // Check the shards before the output file is created, so that a
+    // failed merge doesn't leave a broken index behind. Empty shards
+    // are sorted before a non-empty one starting at the same place.
+    vector<IndexShard> list;
+    for (const string &filename : filenames)
+        list.push_back(open_shard(filename));
+    std::sort(list.begin(), list.end(),
+              [](const IndexShard &a, const IndexShard &b) {
+                  return a.shdr.trace_start != b.shdr.trace_start
+                             ? a.shdr.trace_start < b.shdr.trace_start
+                             : a.shdr.trace_end < b.shdr.trace_end;
+              });
+    check_shards(list);
+    return list;
+}
 
-    if (ifs->eof()) {
-        // If getline() above returned a truncated line, then it
-        // will have set the fail flag on the stream, which will
-        // have made ifs->tellg return -1. So clear the error flags,
-        // find out the final file position, and leave this loop
-        // before trying to read anything else.
-        ifs->clear();
-        linepos = ifs->tellg();
-        finish_reading_trace_file();
-        return false;
+void ShardMerger::check_shards(const vector<IndexShard> &shards)
+{
+    TraceFingerprint fp;
+    if (!trace_fingerprint(trace.tarmac_filename, false, fp))
+        reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
+
+    const unsigned same_flags = FLAG_BIGEND | FLAG_THUMB_ONLY;
+    uint64_t pos = 0;
+    for (const IndexShard &shard : shards) {
+        if (shard.hdr.trace_size != fp.size ||
+            shard.hdr.trace_sampled_hash != fp.sampled_hash)
+            reporter->errx(1, _("%s: index shard was not built from %s"),
+                           shard.filename.c_str(),
+                           trace.tarmac_filename.c_str());
+        if ((shard.hdr.flags & same_flags) !=
+                (shards[0].hdr.flags & same_flags) ||
+            shard.hdr.cpu != shards[0].hdr.cpu)
+            reporter->errx(1, _("%s: index shard was built with different "
+                                "options from %s"),
+                           shard.filename.c_str(),
+                           shards[0].filename.c_str());
+        if ((uint64_t)shard.shdr.trace_start != pos)
+            reporter->errx(1, _("%s: index shards do not cover bytes "
+                                "%llu-%llu"),
+                           trace.tarmac_filename.c_str(),
+                           (unsigned long long)pos,
+                           (unsigned long long)shard.shdr.trace_start);
+        pos = shard.shdr.trace_end;
     }
+    if (pos != fp.size)
+        reporter->errx(1, _("%s: index shards do not cover bytes %llu-%llu"),
+                       trace.tarmac_filename.c_str(), (unsigned long long)pos,
+                       (unsigned long long)fp.size);
+}
 
-    string line;
-    if (!getline(*ifs, line)) {
-        finish_reading_trace_file();
-        return false;
-    }
+OFF_T ShardMerger::copy_data(OFF_T offset, size_t size)
+{
+    // Entries in a memory tree that were divided by later writes
+    // share their original data, so reuse a copy of the whole of it
+    // for the part below the write.
+    auto it = copied_data.find(offset);
+    if (it != copied_data.end() && it->second.second >= size)
+        return it->second.first;
+
+    OFF_T newoffset = arena->alloc(size);
+    memcpy(arena->getptr<unsigned char>(newoffset),
+           shard->arena->getptr<unsigned char>(offset), size);
+    copied_data[offset] = make_pair(newoffset, size);
+    return newoffset;
+}
 
-    try {
-        parser.parse(line);
-    } catch (TarmacParseError e) {
-        if (ifs->eof()) {
-            ostringstream oss;
-            oss << e.msg << endl
-                << _("ignoring parse error on partial last line "
-                     "(trace truncated?)");
-            reporter->indexing_warning(trace.tarmac_filename, lineno,
-                                       oss.str());
-            finish_reading_trace_file();
-            return false;
+OFF_T ShardMerger::copy_memsubtree(OFF_T node)
+{
+    if (!node)
+        return 0;
+
+    MemorySubPayload p;
+    MemorySubAnnotation a;
+    OFF_T lc, rc;
+    src_memsubtree->read_node(node, p, a, lc, rc);
+    OFF_T newlc = copy_memsubtree(lc), newrc = copy_memsubtree(rc);
+    p.contents = copy_data(p.contents, p.hi - p.lo + 1);
+    return memsubtree.join(newlc, p, newrc);
+}
+
+OFF_T ShardMerger::copy_memtree(OFF_T node)
+{
+    if (!node)
+        return 0;
+    auto it = copied_nodes.find(node);
+    if (it != copied_nodes.end())
+        return it->second;
+
+    MemoryPayload p;
+    MemoryAnnotation a;
+    OFF_T lc, rc;
+    src_memtree->read_node(node, p, a, lc, rc);
+    OFF_T newlc = copy_memtree(lc), newrc = copy_memtree(rc);
+
+    // The copies are shared between many trees, as the originals
+    // were, so make sure the joins below don't modify them.
+    memtree.commit();
+
+    OFF_T newnode;
+    if (!p.raw && final_memroot &&
+        ((shard->shdr.memory_at_start &&
+          p.contents == shard->shdr.memory_at_start) ||
+         (shard->shdr.registers_at_start &&
+          p.contents == shard->shdr.registers_at_start))) {
+        OFF_T state = extract_memory(final_memroot, p.type, p.lo, p.hi);
+        newnode = memtree.join(memtree.join(newlc, state), newrc);
+    } else {
+        p.trace_file_firstline = p.trace_file_firstline + line_base;
+        if (p.raw) {
+            p.contents = copy_data(p.contents, p.hi - p.lo + 1);
         } else {
-            if (trace.index_on_disk)
-                remove(trace.index_filename.c_str());
-            reporter->indexing_error(trace.tarmac_filename, lineno, e.msg);
+            auto sit = copied_subtrees.find(p.contents);
+            if (sit != copied_subtrees.end()) {
+                p.contents = sit->second;
+            } else {
+                OFF_T subroot = copy_memsubtree(
+                    *shard->arena->getptr<diskint<OFF_T>>(p.contents));
+                OFF_T newcontents = arena->alloc(sizeof(diskint<OFF_T>));
+                *arena->getptr<diskint<OFF_T>>(newcontents) = subroot;
+                copied_subtrees[p.contents] = newcontents;
+                p.contents = newcontents;
+            }
         }
+        newnode = memtree.join(newlc, p, newrc);
     }
 
-    // Maintain linepos ourselves, rather than calling ifs->tellg() numerous
-    // times. tellg() is a somehow slow function on some platforms, and this
-    // alone allows a 2x speedup in parsing time.
-    linepos += line.size() + 1;
-    reporter->indexing_progress(linepos);
-
-    return true;
+    copied_nodes[node] = newnode;
+    return newnode;
 }
 
-void Index::finish_reading_trace_file()
+// Return a new memory tree containing just the part of 'root' in the
+// range [lo,hi] of one address space.
+OFF_T ShardMerger::extract_memory(OFF_T root, char type, Addr lo, Addr hi)
 {
-    if (!ifs)
-        return;
+    OFF_T below, rest, mid, above;
+    memtree.split(root, MemorySplit(type, lo, false), &below, &rest);
+    memtree.commit();
+    memtree.split(rest, MemorySplit(type, hi, true), &mid, &above);
+    memtree.commit();
+
+    auto trim = [](MemoryPayload p, Addr newlo, Addr newhi) {
+        if (p.raw)
+            p.contents = p.contents + (newlo - p.lo);
+        p.lo = newlo;
+        p.hi = newhi;
+        return p;
+    };
 
-    reporter->indexing_done();
+    // Entries that stick out of the range at either end have to be
+    // cut down to fit: the last one starting inside the range, and
+    // the last one starting before it.
+    MemoryPayload p;
+    if (tree_last(memtree, mid, &p) && p.hi > hi) {
+        mid = memtree.remove(mid, p, nullptr, nullptr);
+        mid = memtree.join(mid, trim(p, p.lo, hi), 0);
+    }
+    if (tree_last(memtree, below, &p) && p.type == type && p.hi >= lo)
+        mid = memtree.join(0, trim(p, lo, min(hi, (Addr)p.hi)), mid);
 
-    // Call got_event with no actual event, signalling end-of-file, so
-    // that the last record is output (the same flushing of
-    // accumulated data we'd do on seeing the next instruction, except
-    // that then we stop without processing an instruction).
-    got_event_common(nullptr, false);
+    return mid;
+}
 
-    ifs = nullptr;
+OFF_T ShardMerger::copy_seqtree(OFF_T node)
+{
+    if (!node)
+        return 0;
+
+    SeqOrderPayload p;
+    SeqOrderAnnotation a;
+    OFF_T lc, rc;
+    src_seqtree->read_node(node, p, a, lc, rc);
+    OFF_T newlc = copy_seqtree(lc);
+    p.trace_file_firstline = p.trace_file_firstline + line_base;
+    p.memory_root = copy_memtree(p.memory_root);
+    p.call_depth = 0; // filled in once all the calls are known
+    OFF_T newrc = copy_seqtree(rc);
+    return seqtree.join(newlc, p, newrc);
 }
 
-void Index::build_call_tree()
+OFF_T ShardMerger::copy_bypctree(OFF_T node)
+{
+    if (!node)
+        return 0;
+
+    ByPCPayload p;
+    EmptyAnnotation<ByPCPayload> a;
+    OFF_T lc, rc;
+    src_bypctree->read_node(node, p, a, lc, rc);
+    OFF_T newlc = copy_bypctree(lc), newrc = copy_bypctree(rc);
+    p.trace_file_firstline = p.trace_file_firstline + line_base;
+    return bypctree.join(newlc, p, newrc);
+}
+
+// Merge two by-PC trees with no entries in common, by splitting 'a'
+// around the root of 'b' and recursing on the halves. The trees are
+// used up in the process.
+OFF_T ShardMerger::bypc_union(OFF_T a, OFF_T b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    ByPCPayload p;
+    EmptyAnnotation<ByPCPayload> ann;
+    OFF_T lc, rc, al, ar;
+    bypctree.read_node(b, p, ann, lc, rc);
+    bypctree.split(a, ShardSplitBefore<ByPCPayload>(p), &al, &ar);
+    return bypctree.join(bypc_union(al, lc), p, bypc_union(ar, rc));
+}
+
+void ShardMerger::fill_in_hindsight()
 {
     /*
-     * Now we've got to the end of the trace and matched up calls to
-     * returns as best we can within our own memory, postprocess the
-     * main seqtree to fill in the call depth fields.
+     * Anything the shard found out by reading memory that it didn't
+     * know the contents of at the start was in memory at the end of
+     * the previous shard, so fill it in there, wherever that didn't
+     * know it either. As in the indexer, that updates every earlier
+     * memory tree that shares the same sub-trees.
      */
-    if (iparams.record_calls) {
-        {
-            CallDepthCountingTreeWalker visitor(found_callrets);
-            seqtree->walk(seqroot, WalkOrder::Inorder, ref(visitor));
-        }
-        {
-            CallDepthArrayTreeWalker visitor(arena.get());
-            seqtree->walk(seqroot, WalkOrder::Postorder, ref(visitor));
-        }
+    for (OFF_T start : {(OFF_T)shard->shdr.memory_at_start,
+                        (OFF_T)shard->shdr.registers_at_start}) {
+        if (!start)
+            continue;
+        char type = start == shard->shdr.memory_at_start ? 'm' : 'r';
+        OFF_T subroot = *shard->arena->getptr<diskint<OFF_T>>(start);
+        src_memsubtree->visit(subroot, [&](const MemorySubPayload &p,
+                                           OFF_T) {
+            stats.memory_data_bytes += fill_unknown_memory(
+                memtree, memsubtree, *arena, final_memroot, type, p.lo,
+                p.hi - p.lo + 1,
+                shard->arena->getptr<unsigned char>(p.contents));
+        });
     }
 }
 
-void Index::finalise_index()
+void ShardMerger::merge_shard(const IndexShard &shard_)
 {
-    FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+    shard = &shard_;
+    Arena &src = *shard->arena;
+    src_memtree = make_unique<AVLDisk<MemoryPayload, MemoryAnnotation>>(src);
+    src_memsubtree =
+        make_unique<AVLDisk<MemorySubPayload, MemorySubAnnotation>>(src);
+    src_seqtree =
+        make_unique<AVLDisk<SeqOrderPayload, SeqOrderAnnotation>>(src);
+    src_bypctree = make_unique<AVLDisk<ByPCPayload>>(src);
+    copied_nodes.clear();
+    copied_subtrees.clear();
+    copied_data.clear();
+
+    if (final_memroot)
+        fill_in_hindsight();
+
+    // Find the shard's final state before joining its seqtree on,
+    // which may rearrange it.
+    OFF_T shard_seqroot = copy_seqtree(shard->hdr.seqroot);
+    SeqOrderPayload last;
+    if (tree_last(seqtree, shard_seqroot, &last))
+        final_memroot = last.memory_root;
+
+    seqroot = seqtree.join(seqroot, shard_seqroot);
+    bypcroot = bypc_union(bypcroot, copy_bypctree(shard->hdr.bypcroot));
+
+    const ShardHeader &shdr = shard->shdr;
+    line_base += shdr.lines;
+
+    src_memtree = nullptr;
+    src_memsubtree = nullptr;
+    src_seqtree = nullptr;
+    src_bypctree = nullptr;
+}
 
-    if (seqroot == 0)
-        reporter->errx(1, "error: trace file contains no events at all");
+// Read a register whose identity depends on whether the CPU was in
+// AArch64 state, from the state after a node of the merged index.
+bool ShardMerger::read_reg(OFF_T memroot, const RegisterId &reg64,
+                           const RegisterId &reg32, unsigned long long *value)
+{
+    unsigned long long iflags;
+    if (!read_memtree_value(memtree, memsubtree, *arena, memroot, false, 'r',
+                            reg_offset(REG_iflags), reg_size(REG_iflags),
+                            &iflags))
+        return false;
+    const RegisterId &reg = (iflags & IFLAG_AARCH64) ? reg64 : reg32;
+    return read_memtree_value(memtree, memsubtree, *arena, memroot, false,
+                              'r', reg_offset(reg, iflags), reg_size(reg),
+                              value);
+}
 
-    unsigned flags = 0;
-    if (pparams.bigend)
-        flags |= FLAG_BIGEND;
-    if (pparams.iset_specified && pparams.iset == THUMB)
-        flags |= FLAG_THUMB_ONLY;
-    if (aarch64_used)
-        flags |= FLAG_AARCH64_USED;
+void ShardMerger::find_calls()
+{
+    /*
+     * Run the indexer's heuristic for matching calls with returns
+     * (see Index::update_pc) over the transfers of control recorded by
+     * all the shards in turn, carrying its state from each shard to
+     * the next. Where a shard didn't know the stack pointer or lr at a
+     * transfer, we can now look them up in the merged memory tree.
+     */
+    set<PendingCall> pending_calls;
+    auto expire_calls = [&](unsigned long long max_sp) {
+        // As in Index::update_sp, the stack frame of a call has gone
+        // once the stack pointer rises above it.
+        pending_calls.erase(pending_calls.begin(),
+                            pending_calls.lower_bound(PendingCall(max_sp, 0)));
+    };
+    auto lr_age = [](unsigned age, unsigned flags, unsigned inherited_age) {
+        if (!(flags & SHARD_LR_INHERITED))
+            return age;
+        return (unsigned)min<unsigned long long>(inherited_age + age,
+                                                 BRANCH_LR_WRITE_THRESHOLD);
+    };
 
-    unsigned svelen_flag = ((max_sve_bits + 127) / 128 - 1) * FLAG_SVELEN_UNIT;
-    assert((svelen_flag & ~FLAG_SVELEN_MASK) == 0);
-    flags |= svelen_flag;
+    unsigned long long expected_pc = KNOWN_INVALID_PC;
+    unsigned long long expected_lr = KNOWN_INVALID_PC;
+    unsigned inherited_age = BRANCH_LR_WRITE_THRESHOLD;
+    unsigned line_base = 0;
+    for (const IndexShard &shard : shards) {
+        const ShardHeader &shdr = shard.shdr;
+        const ShardTransfer *transfers =
+            shdr.ntransfers ? shard.arena->getptr<ShardTransfer>(
+                                  shdr.transfers)
+                            : nullptr;
+
+        for (unsigned i = 0; i < shdr.ntransfers; i++) {
+            const ShardTransfer &st = transfers[i];
+            expire_calls(st.max_sp);
+
+            unsigned line = st.line + line_base;
+            unsigned long long pc = st.pc, sp = st.sp, lr = st.lr;
+            unsigned long long next_lr = st.expected_lr;
+            bool may_be_call = true;
+            if (st.flags & SHARD_FIRST) {
+                // The shard couldn't tell if its first instruction
+                // followed on from the previous one, but we can.
+                if (((pc ^ expected_pc) & ~1ULL) == 0)
+                    continue;
+                next_lr = expected_lr;
+                may_be_call = expected_pc != KNOWN_INVALID_PC;
+            }
 
-    flags |= FLAG_COMPLETE;
-    hdr.flags = flags;
+            bool lr_known = (st.flags & SHARD_LR_KNOWN) != 0;
+            SeqOrderPayload key, prev;
+            key.trace_file_firstline = line;
+            if ((sp == ULLONG_MAX || !lr_known) &&
+                seqtree.pred(seqroot, key, &prev, nullptr)) {
+                if (sp == ULLONG_MAX &&
+                    !read_reg(prev.memory_root, REG_64_xsp, REG_32_sp, &sp))
+                    sp = ULLONG_MAX;
+                if (!lr_known)
+                    lr_known = read_reg(prev.memory_root, REG_64_xlr,
+                                        REG_32_lr, &lr);
+            }
 
-    hdr.seqroot = seqroot;
-    hdr.bypcroot = bypcroot;
-    hdr.lineno_offset = lineno_offset;
-}
+            auto it = pending_calls.find(PendingCall(sp, pc));
+            if (it != pending_calls.end()) {
+                callrets.insert(CallReturn(it->call_line, +1));
+                callrets.insert(CallReturn(line, -1));
+                pending_calls.erase(it);
+            } else if (may_be_call && lr_known &&
+                       lr_age(st.lr_age, st.flags, inherited_age) <
+                           BRANCH_LR_WRITE_THRESHOLD &&
+                       absdiff(lr, next_lr) < 64) {
+                pending_calls.insert(PendingCall(sp, lr, line));
+            }
 
-void Index::parse_tarmac_file()
-{
-    open_index_file();
-    open_trace_file();
-    while (read_one_trace_line());
-    build_call_tree();
-    finalise_index();
+            // After this transfer, lr counts as not recently written.
+            inherited_age = BRANCH_LR_WRITE_THRESHOLD;
+        }
+
+        expire_calls(shdr.final_max_sp);
+        if (shdr.final_expected_pc != KNOWN_INVALID_PC) {
+            expected_pc = shdr.final_expected_pc;
+            expected_lr = shdr.final_expected_lr;
+        }
+        inherited_age =
+            lr_age(shdr.final_lr_age, shdr.final_flags, inherited_age);
+        line_base += shdr.lines;
+    }
 }
 
-IndexHeaderState check_index_header(const string &index_filename)
+void ShardMerger::write_header()
 {
-    MMapFile arena(index_filename, false);
+    // Statistics are the totals from the shards, with the time spent
+    // merging counted as post-processing.
+    for (const IndexShard &shard : shards) {
+        if (!shard.hdr.stats)
+            continue;
+        const diskint<uint64_t> *in =
+            shard.arena->getptr<diskint<uint64_t>>(shard.hdr.stats);
+        uint64_t count = *in++;
+        stats.for_each_value([&](uint64_t &v) {
+            if (count > 0) {
+                v += *in++;
+                count--;
+            }
+        });
+    }
+    stats.postprocess_us += StopWatch::microseconds(merge_time);
+    write_index_stats(*arena, header_offset, stats);
+
+    unsigned flags = shards[0].hdr.flags & (FLAG_BIGEND | FLAG_THUMB_ONLY);
+    unsigned svelen = 0;
+    for (const IndexShard &shard : shards) {
+        flags |= shard.hdr.flags & FLAG_AARCH64_USED;
+        svelen = max(svelen, shard.hdr.flags & FLAG_SVELEN_MASK);
+    }
+    flags |= svelen | FLAG_COMPLETE;
+
+    // Lines before the first event of the trace are only counted in
+    // the file_lines of the shards they're in.
+    unsigned lineno_offset = 0;
+    for (const IndexShard &shard : shards) {
+        if (shard.hdr.seqroot) {
+            lineno_offset += shard.hdr.lineno_offset;
+            break;
+        }
+        lineno_offset += shard.shdr.file_lines;
+    }
 
-    MagicNumber &magic = *arena.getptr<MagicNumber>(0);
-    if (!magic.check())
-        return IndexHeaderState::WrongMagic;
+    TraceFingerprint fp;
+    if (!trace_fingerprint(trace.tarmac_filename, true, fp))
+        reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
 
-    FileHeader &hdr = *arena.getptr<FileHeader>(sizeof(MagicNumber));
-    if (!(hdr.flags & FLAG_COMPLETE))
-        return IndexHeaderState::Incomplete;
+    FileHeader &hdr = *arena->getptr<FileHeader>(header_offset);
+    hdr.seqroot = seqroot;
+    hdr.bypcroot = bypcroot;
+    hdr.lineno_offset = lineno_offset;
+    hdr.trace_size = fp.size;
+    hdr.trace_sampled_hash = fp.sampled_hash;
+    hdr.trace_full_hash = fp.full_hash;
+    hdr.cpu = shards[0].hdr.cpu;
+    hdr.flags = flags;
+}
 
-    return IndexHeaderState::OK;
+void ShardMerger::merge()
+{
+    {
+        StopWatch sw(merge_time);
+        for (const IndexShard &shard : shards)
+            merge_shard(shard);
+        if (!seqroot)
+            reporter->errx(1, "error: trace file contains no events at all");
+
+        find_calls();
+        stats.call_depth_array_bytes =
+            build_call_depths(seqtree, arena.get(), seqroot, callrets);
+        if (memory_hashes)
+            build_memory_hashes(seqtree, memtree, memsubtree, *arena,
+                                seqroot);
+    }
+    write_header();
 }
 
-void run_indexer(const TracePair &trace, const IndexerParams &iparams,
-                 const IndexerDiagnostics &idiags, const ParseParams &pparams)
+} // namespace
+
+void merge_index_shards(const TracePair &trace, const IndexerParams &iparams,
+                        const vector<string> &shard_filenames)
 {
-    Index index(trace, iparams, idiags, pparams);
-    index.parse_tarmac_file();
+    ShardMerger merger(trace, iparams.memory_hashes, shard_filenames);
+    merger.merge();
 }
 
 static shared_ptr<Arena> get_index_mapping(const TracePair &trace)
@@ -1181,6 +2847,10 @@ IndexReader::IndexReader(const TracePair &trace)
         reporter->errx(1, _("%s: magic number did not match"),
                        index_filename.c_str());
     FileHeader &hdr = *arena->getptr<FileHeader>(sizeof(MagicNumber));
+    if (hdr.shard)
+        reporter->errx(1, _("%s: index file is one shard of an index, "
+                            "which must be merged with the others first"),
+                       index_filename.c_str());
     seqroot = hdr.seqroot;
     bypcroot = hdr.bypcroot;
     bigend = (hdr.flags & FLAG_BIGEND);
@@ -1189,6 +2859,28 @@ IndexReader::IndexReader(const TracePair &trace)
     max_sve_bits =
         128 * (((hdr.flags & FLAG_SVELEN_MASK) / FLAG_SVELEN_UNIT) + 1);
     lineno_offset = hdr.lineno_offset;
+    indexed_cpu = (int)hdr.cpu - 1;
+    fingerprint.size = hdr.trace_size;
+    fingerprint.sampled_hash = hdr.trace_sampled_hash;
+    fingerprint.full_hash = hdr.trace_full_hash;
+
+    // The statistics are written last, so if the file has been
+    // truncated, use only as many of them as are still there.
+    uint64_t stats_room =
+        hdr.stats && hdr.stats < arena->curr_offset()
+            ? (arena->curr_offset() - hdr.stats) / sizeof(diskint<uint64_t>)
+            : 0;
+    if (stats_room > 0) {
+        const diskint<uint64_t> *in =
+            arena->getptr<diskint<uint64_t>>(hdr.stats);
+        uint64_t count = min((uint64_t)*in++, stats_room - 1);
+        index_stats.for_each_value([&](uint64_t &v) {
+            if (count > 0) {
+                v = *in++;
+                count--;
+            }
+        });
+    }
 }
 
 ParseParams IndexReader::parseParams() const
@@ -1202,6 +2894,13 @@ ParseParams IndexReader::parseParams() const
     return params;
 }
 
+uint64_t IndexReader::memory_hash(OFF_T memroot, char type, Addr lo,
+                                  Addr hi) const
+{
+    return memtree_range_hash(memtree, memsubtree, *arena, memroot, type, lo,
+                              hi);
+}
+
 string IndexReader::read_tarmac(OFF_T pos, OFF_T len) const
 {
     vector<char> vbuf(len);
@@ -1250,20 +2949,13 @@ string IndexReader::get_trace_line(const SeqOrderPayload &node,
 bool IndexNavigator::lookup_symbol(const string &name, uint64_t &addr,
                                    size_t &size) const
 {
-    if (!image)
+    if (!images)
         return false;
 
-    if (const Symbol *sym = image->find_symbol(name)) {
+    uint64_t load_offset;
+    if (const Symbol *sym = images->find_symbol(name, &load_offset)) {
         addr = sym->addr + load_offset;
         size = sym->size;
-
-        /*
-         * FIXME: if the program under test is position-independent,
-         * then it may have been loaded somewhere other than the base
-         * address in the ELF file. It would be useful to have an
-         * option to account for that here, by adjusting the returned
-         * address.
-         */
         return true;
     }
 
@@ -1280,8 +2972,9 @@ string IndexNavigator::get_symbolic_address(Addr addr, bool fallback) const
 {
     ostringstream res;
 
+    uint64_t load_offset;
     const Symbol *sym =
-        image ? image->find_symbol(addr - load_offset) : nullptr;
+        images ? images->find_symbol(addr, &load_offset) : nullptr;
     if (sym) {
         res << sym->getName();
         addr -= (sym->addr + load_offset);
@@ -1643,6 +3336,88 @@ class SeqTimeFinder {
 };
 } // namespace
 
+// The address spaces compared by the whole-state versions of
+// state_equal and state_diff.
+static const char state_address_spaces[] = {'r', 'm'};
+
+bool IndexNavigator::state_equal(OFF_T memroot, const IndexNavigator &other,
+                                 OFF_T other_memroot) const
+{
+    for (char type : state_address_spaces)
+        if (!state_equal(memroot, other, other_memroot, type, 0, ~(Addr)0))
+            return false;
+    return true;
+}
+
+bool IndexNavigator::state_equal(OFF_T memroot, const IndexNavigator &other,
+                                 OFF_T other_memroot, char type, Addr lo,
+                                 Addr hi) const
+{
+    return (index.memory_hash(memroot, type, lo, hi) ==
+            other.index.memory_hash(other_memroot, type, lo, hi));
+}
+
+vector<StateDifference> IndexNavigator::state_diff(OFF_T memroot,
+                                                   const IndexNavigator &other,
+                                                   OFF_T other_memroot) const
+{
+    vector<StateDifference> out;
+    for (char type : state_address_spaces)
+        state_diff_range(memroot, other, other_memroot, type, 0, ~(Addr)0,
+                         out);
+    return out;
+}
+
+vector<StateDifference>
+IndexNavigator::state_diff(OFF_T memroot, const IndexNavigator &other,
+                           OFF_T other_memroot, char type, Addr lo,
+                           Addr hi) const
+{
+    vector<StateDifference> out;
+    state_diff_range(memroot, other, other_memroot, type, lo, hi, out);
+    return out;
+}
+
+void IndexNavigator::state_diff_range(OFF_T memroot,
+                                      const IndexNavigator &other,
+                                      OFF_T other_memroot, char type, Addr lo,
+                                      Addr hi,
+                                      vector<StateDifference> &out) const
+{
+    if (state_equal(memroot, other, other_memroot, type, lo, hi))
+        return;
+
+    // Bisect the range until it's small enough to compare directly.
+    constexpr Addr leaf_size = 64;
+    if (hi - lo >= leaf_size) {
+        Addr mid = lo + (hi - lo) / 2;
+        state_diff_range(memroot, other, other_memroot, type, lo, mid, out);
+        state_diff_range(memroot, other, other_memroot, type, mid + 1, hi,
+                         out);
+        return;
+    }
+
+    size_t size = hi - lo + 1;
+    unsigned char data[leaf_size], def[leaf_size];
+    unsigned char other_data[leaf_size], other_def[leaf_size];
+    getmem(memroot, type, lo, size, data, def);
+    other.getmem(other_memroot, type, lo, size, other_data, other_def);
+    for (size_t i = 0; i < size; i++) {
+        if (def[i] == other_def[i] && (!def[i] || data[i] == other_data[i]))
+            continue;
+        Addr addr = lo + i;
+        if (!out.empty() && out.back().type == type &&
+            out.back().hi + 1 == addr) {
+            out.back().hi = addr;
+        } else {
+            StateDifference diff;
+            diff.type = type;
+            diff.lo = diff.hi = addr;
+            out.push_back(diff);
+        }
+    }
+}
+
 bool IndexNavigator::node_at_time(Time t, SeqOrderPayload *node) const
 {
     return index.seqtree.find_rightmost(index.seqroot, SeqTimeFinder(t), node,
@@ -1672,6 +3447,58 @@ bool IndexNavigator::node_at_line(unsigned line, SeqOrderPayload *node) const
                               nullptr);
 }
 
+static unsigned seqtree_subtree_nodes(const IndexReader &index,
+                                      const SeqOrderAnnotation &annot)
+{
+    // The last entry in the call depth array is the sentinel, whose
+    // cumulative counts cover the whole subtree.
+    auto *array = (const CallDepthArrayEntry *)index.index_offset(
+        annot.call_depth_array);
+    return array[annot.call_depth_arraylen - 1].cumulative_insns;
+}
+
+struct SeqPositionSearcher {
+    const IndexReader &index;
+    unsigned target;
+
+    SeqPositionSearcher(const IndexReader &index, unsigned target)
+        : index(index), target(target)
+    {
+    }
+
+    int operator()(OFF_T, const SeqOrderAnnotation *lhs, OFF_T,
+                   const SeqOrderPayload &, const SeqOrderAnnotation &, OFF_T,
+                   const SeqOrderAnnotation *)
+    {
+        unsigned lhs_nodes = lhs ? seqtree_subtree_nodes(index, *lhs) : 0;
+        if (target < lhs_nodes)
+            return -1;
+        target -= lhs_nodes;
+        if (target == 0)
+            return 0;
+        target--;
+        return +1;
+    }
+};
+
+unsigned IndexNavigator::node_count() const
+{
+    if (!index.seqroot)
+        return 0;
+
+    SeqOrderPayload payload;
+    SeqOrderAnnotation annot;
+    OFF_T lc, rc;
+    index.seqtree.read_node(index.seqroot, payload, annot, lc, rc);
+    return seqtree_subtree_nodes(index, annot);
+}
+
+bool IndexNavigator::node_at_position(unsigned pos, SeqOrderPayload *node) const
+{
+    return index.seqtree.search(index.seqroot,
+                                SeqPositionSearcher(index, pos), node);
+}
+
 bool IndexNavigator::get_previous_node(SeqOrderPayload &in,
                                        SeqOrderPayload *out) const
 {
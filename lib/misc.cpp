@@ -23,8 +23,10 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
+#include <chrono>
 #include <iostream>
 #include <sstream>
 
@@ -63,11 +65,19 @@ class CommandLineReporter : public Reporter {
     void indexing_error(const string &trace_filename,
                         unsigned lineno, const string &msg) override;
     void indexing_start(streampos total) override;
-    void indexing_progress(streampos pos) override;
-    void indexing_done() override;
+    void indexing_progress(const IndexingProgress &prog) override;
+    void indexing_done(const IndexingProgress &prog) override;
+
+    using Clock = std::chrono::steady_clock;
 
     streampos indexing_total_size;
-    int last_shown_progress_percentage;
+    Clock::time_point indexing_start_time, last_meter_time, last_stream_time;
+    size_t last_meter_len;
+
+    void show_progress_meter(const IndexingProgress &prog,
+                             Clock::time_point now, bool done);
+    void write_progress_record(const char *kind, const IndexingProgress &prog,
+                               Clock::time_point now);
 
   public:
     CommandLineReporter() = default;
@@ -133,10 +143,10 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
                          pair.index_filename)
                << endl;
           break;
-      case IndexUpdateCheck::TooOld:
-          clog << format(_("index file {} is older than trace file {}; "
-                           "rebuilding it"),
-                         pair.index_filename, pair.tarmac_filename)
+      case IndexUpdateCheck::Changed:
+          clog << format(_("trace file {} has changed since index file {} "
+                           "was built; rebuilding it"),
+                         pair.tarmac_filename, pair.index_filename)
                << endl;
           break;
       case IndexUpdateCheck::WrongFormat:
@@ -151,6 +161,12 @@ void CommandLineReporter::indexing_status(const TracePair &pair,
                          pair.index_filename)
                << endl;
           break;
+      case IndexUpdateCheck::WrongCPU:
+          clog << format(_("index file {} was built for a different CPU; "
+                           "rebuilding it"),
+                         pair.index_filename)
+               << endl;
+          break;
       case IndexUpdateCheck::OK:
           clog << format(_("index file {} looks ok; not rebuilding it"),
                          pair.index_filename)
@@ -176,31 +192,144 @@ void CommandLineReporter::indexing_error(const string &trace_filename,
     exit(1);
 }
 
+// Minimum intervals between updates of the progress meter, and of the
+// machine-readable progress stream.
+static constexpr std::chrono::milliseconds PROGRESS_METER_INTERVAL{250};
+static constexpr std::chrono::milliseconds PROGRESS_STREAM_INTERVAL{1000};
+
+// Rates and time estimates derived from an IndexingProgress.
+struct ProgressRates {
+    double seconds = 0;       // time since indexing started
+    double bytes_per_s = 0;   // average read rate so far
+    double lines_per_s = 0;
+    bool have_eta = false;    // false until we have a rate to go on
+    double eta_seconds = 0;   // estimated time to the end of the file
+
+    ProgressRates(const IndexingProgress &prog, streampos total,
+                  std::chrono::steady_clock::duration elapsed)
+    {
+        seconds = std::chrono::duration<double>(elapsed).count();
+        if (seconds <= 0)
+            return;
+        std::streamoff pos = prog.pos, end = total;
+        bytes_per_s = pos / seconds;
+        lines_per_s = prog.lines / seconds;
+        if (bytes_per_s > 0 && end >= pos) {
+            have_eta = true;
+            eta_seconds = (end - pos) / bytes_per_s;
+        }
+    }
+};
+
+static string megabytes(double bytes)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.1f", bytes / 1048576);
+    return buf;
+}
+
+static string hms(double seconds)
+{
+    unsigned long s = seconds + 0.5;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%lu:%02lu:%02lu", s / 3600, s / 60 % 60,
+             s % 60);
+    return buf;
+}
+
 void CommandLineReporter::indexing_start(streampos total)
 {
-    last_shown_progress_percentage = -1;
     indexing_total_size = total;
+    indexing_start_time = Clock::now();
+    last_meter_time = last_stream_time = indexing_start_time;
+    last_meter_len = 0;
+
+    if (progress_stream)
+        *progress_stream << "start total=" << total << endl;
 }
 
-void CommandLineReporter::indexing_progress(streampos pos)
+void CommandLineReporter::indexing_progress(const IndexingProgress &prog)
 {
-    if (!progress)
+    if (!progress && !progress_stream)
         return;
 
-    int percentage = 100 * pos / indexing_total_size;
-    if (percentage != last_shown_progress_percentage) {
-        last_shown_progress_percentage = percentage;
-        clog << "\r" << format(_("Reading trace file ({}%)"), percentage);
-        clog.flush();
+    // Only look at the clock here: the indexer already calls us
+    // rarely enough that this is cheap, and it means a slow terminal
+    // or pipe can't become the limiting factor on indexing speed.
+    Clock::time_point now = Clock::now();
+    if (progress && now - last_meter_time >= PROGRESS_METER_INTERVAL) {
+        last_meter_time = now;
+        show_progress_meter(prog, now, false);
+    }
+    if (progress_stream && now - last_stream_time >= PROGRESS_STREAM_INTERVAL) {
+        last_stream_time = now;
+        write_progress_record("progress", prog, now);
     }
 }
 
-void CommandLineReporter::indexing_done()
+void CommandLineReporter::indexing_done(const IndexingProgress &prog)
 {
-    if (!progress)
-        return;
+    Clock::time_point now = Clock::now();
+    if (progress)
+        show_progress_meter(prog, now, true);
+    if (progress_stream)
+        write_progress_record("done", prog, now);
+}
+
+void CommandLineReporter::show_progress_meter(const IndexingProgress &prog,
+                                              Clock::time_point now, bool done)
+{
+    ProgressRates rates(prog, indexing_total_size, now - indexing_start_time);
+
+    string msg;
+    if (done) {
+        msg = format(_("Reading trace file (finished in {}, {} MB/s, "
+                       "{} lines/s, index {} MB)"),
+                     hms(rates.seconds), megabytes(rates.bytes_per_s),
+                     (unsigned long long)rates.lines_per_s,
+                     megabytes(prog.index_size));
+    } else {
+        std::streamoff pos = prog.pos, total = indexing_total_size;
+        int percentage = total > 0 ? 100 * pos / total : 100;
+        msg = format(_("Reading trace file ({}%, {} MB/s, {} lines/s, "
+                       "index {} MB, {} remaining)"),
+                     percentage, megabytes(rates.bytes_per_s),
+                     (unsigned long long)rates.lines_per_s,
+                     megabytes(prog.index_size),
+                     rates.have_eta ? hms(rates.eta_seconds) : "?");
+    }
 
-    clog << "\r" << _("Reading trace file (finished)") << endl;
+    // Overwrite the whole of any longer previous message.
+    size_t len = msg.size();
+    if (len < last_meter_len)
+        msg += string(last_meter_len - len, ' ');
+    last_meter_len = len;
+
+    clog << "\r" << msg;
+    if (done)
+        clog << endl;
+    else
+        clog.flush();
+}
+
+void CommandLineReporter::write_progress_record(const char *kind,
+                                                const IndexingProgress &prog,
+                                                Clock::time_point now)
+{
+    auto elapsed = now - indexing_start_time;
+    ProgressRates rates(prog, indexing_total_size, elapsed);
+
+    std::ostream &os = *progress_stream;
+    os << kind << " bytes=" << prog.pos << " total=" << indexing_total_size
+       << " lines=" << prog.lines << " index_bytes=" << prog.index_size
+       << " elapsed_ms="
+       << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+              .count()
+       << " bytes_per_s=" << (unsigned long long)rates.bytes_per_s
+       << " lines_per_s=" << (unsigned long long)rates.lines_per_s;
+    if (rates.have_eta && strcmp(kind, "progress") == 0)
+        os << " eta_ms=" << (unsigned long long)(rates.eta_seconds * 1000);
+    os << endl;
 }
 
 OFF_T Arena::alloc(size_t size)
@@ -209,19 +338,45 @@ OFF_T Arena::alloc(size_t size)
         OFF_T new_curr_size = (next_offset + size) * 5 / 4 + 65536;
         assert(new_curr_size >= next_offset);
         resize(new_curr_size);
+        resize_count++;
     }
     OFF_T ret = next_offset;
     next_offset += size;
     return ret;
 }
 
+bool Arena::use_huge_pages = true;
+
 MemArena::~MemArena()
 {
-    free(mapping);
+    if (in_huge_page_block)
+        free_huge_page_block(mapping, curr_size);
+    else
+        free(mapping);
 }
 
 void MemArena::resize(size_t newsize)
 {
+    if (huge_pages && (in_huge_page_block || newsize >= HUGE_PAGE_SIZE)) {
+        newsize = (newsize + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *block = resize_huge_page_block(
+            in_huge_page_block ? mapping : nullptr,
+            in_huge_page_block ? curr_size : 0, newsize);
+        if (block) {
+            if (!in_huge_page_block) {
+                memcpy(block, mapping, next_offset);
+                free(mapping);
+                in_huge_page_block = true;
+            }
+            mapping = block;
+            curr_size = newsize;
+            return;
+        }
+        if (in_huge_page_block)
+            reporter->errx(1, _("Out of memory"));
+        huge_pages = false; // not available, so use ordinary memory
+    }
+
     mapping = realloc(mapping, newsize);
     if (!mapping)
         reporter->errx(1, _("Out of memory"));
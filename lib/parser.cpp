@@ -24,6 +24,7 @@
 #include "libtarmac/parser.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/registers.hh"
+#include "libtarmac/scan.hh"
 
 #include <algorithm>
 #include <cassert>
@@ -99,7 +100,11 @@ struct Token {
         assert(isdecimal());
         return stoull(s, NULL, 10);
     }
-    inline bool ishex() const { return isword(hex_digits); }
+    inline bool ishex() const
+    {
+        return isword() && scan_hex(s.data(), s.data() + s.size()) ==
+                               s.data() + s.size();
+    }
     inline bool isregvalue() const { return isword(regvalue_chars); }
     inline bool ishexwithoptionalnamespace() const
     {
@@ -199,6 +204,10 @@ class TarmacLineParserImpl {
         // this variable stores the starting position of the token
         // after the LD or ST, i.e. the address.
         size_t post_event_type_start = 0;
+
+        // CPU id from the previous line, which a continuation of an
+        // LD or ST line inherits along with its event type.
+        int cpu = -1;
     };
 
     string line;
@@ -210,6 +219,34 @@ class TarmacLineParserImpl {
     ParseReceiver *receiver;
     InterLineState next_line;
 
+    // CPU id of the line currently being parsed, or -1 if it has none.
+    int cpu;
+
+    // Tarmac dialects that parse() has a fast path for. Unknown means
+    // we're still looking at the first lines of the trace to decide,
+    // and General means we've decided not to use a fast path.
+    enum class Dialect { Unknown, General, FastModel, Gem5, ES };
+    Dialect dialect = Dialect::Unknown;
+
+    // The dialect is decided by the instruction lines among the first
+    // DETECT_LINES lines of input: it's only chosen if DETECT_INSNS of
+    // them all agree on it, and on the timestamp unit.
+    static constexpr unsigned DETECT_LINES = 1000, DETECT_INSNS = 16;
+    unsigned detect_lines = 0, detect_insns = 0;
+    Dialect detect_candidate;
+    string timestamp_unit; // of the chosen dialect, or "" if none
+
+    // Properties of the line being parsed by parse_general, noted for
+    // the benefit of dialect detection.
+    bool line_has_timestamp, line_has_cpu;
+    string line_unit;
+
+    template <class Event> void emit(Event &ev)
+    {
+        ev.cpu = cpu;
+        receiver->got_event(ev);
+    }
+
     static set<string> known_timestamp_units;
 
     TarmacLineParserImpl(const ParseParams &params, ParseReceiver *receiver)
@@ -217,7 +254,7 @@ class TarmacLineParserImpl {
     {
     }
 
-    inline bool iswordchr(char c)
+    static inline bool iswordchr(char c)
     {
         return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.' ||
                c == '#';
@@ -261,13 +298,10 @@ class TarmacLineParserImpl {
     Token lex()
     {
         // Eat whitespace.
-        if (pos < size && isspace((unsigned char)line[pos])) {
-            size_t startpos = pos;
-            do {
-                pos++;
-            } while (pos < size && isspace((unsigned char)line[pos]));
+        size_t startpos = pos;
+        pos = scan_space(line.data() + pos, line.data() + size) - line.data();
+        if (pos > startpos)
             highlight(startpos, pos, HL_SPACE);
-        }
 
         if (pos == size) {
             Token ret;
@@ -287,8 +321,7 @@ class TarmacLineParserImpl {
         // Otherwise, accumulate a 'word' of alphanumerics,
         // underscore, minus signs, dots and hashes.
         size_t start = pos;
-        while (pos < size && iswordchr(line[pos]))
-            pos++;
+        pos = scan_word(line.data() + pos, line.data() + size) - line.data();
         if (pos > start) {
             Token ret(line.substr(start, pos - start));
             ret.setpos(start, pos);
@@ -316,7 +349,343 @@ class TarmacLineParserImpl {
         return true;
     }
 
-    void parse(const string &line_)
+    void parse(const string &line)
+    {
+        if (dialect == Dialect::Unknown) {
+            // We can't use a fast path at all if the receiver wants to
+            // know how to highlight the line, because the fast paths
+            // don't find that out.
+            if (receiver->wants_highlights() ||
+                ++detect_lines > DETECT_LINES)
+                dialect = Dialect::General;
+        } else if (dialect != Dialect::General &&
+                   !next_line.event_type_is_continuable) {
+            bool parsed = false;
+            switch (dialect) {
+            case Dialect::FastModel:
+                parsed = parse_fast<Dialect::FastModel>(line);
+                break;
+            case Dialect::Gem5:
+                parsed = parse_fast<Dialect::Gem5>(line);
+                break;
+            case Dialect::ES:
+                parsed = parse_fast<Dialect::ES>(line);
+                break;
+            default:
+                break;
+            }
+            if (parsed)
+                return;
+        }
+        parse_general(line);
+    }
+
+    // Called by parse_general for each instruction line, to work out
+    // which dialect the trace is in.
+    void detect_dialect(bool is_ES)
+    {
+        if (dialect != Dialect::Unknown || !line_has_timestamp)
+            return;
+        Dialect d = is_ES         ? Dialect::ES
+                    : line_has_cpu ? Dialect::Gem5
+                                   : Dialect::FastModel;
+        if (detect_insns == 0) {
+            detect_candidate = d;
+            timestamp_unit = line_unit;
+        } else if (d != detect_candidate || line_unit != timestamp_unit) {
+            dialect = Dialect::General;
+            return;
+        }
+        if (++detect_insns == DETECT_INSNS)
+            dialect = detect_candidate;
+    }
+
+    // A word token found by FastLexer, pointing into the input line.
+    struct FastWord {
+        const char *s = nullptr;
+        size_t len = 0;
+
+        bool operator==(const char *lit) const
+        {
+            return len == strlen(lit) && !memcmp(s, lit, len);
+        }
+        bool operator==(const string &str) const
+        {
+            return len == str.size() && !memcmp(s, str.data(), len);
+        }
+        template <class T> bool operator!=(const T &rhs) const
+        {
+            return !(*this == rhs);
+        }
+        bool all_of(const char *permitted_chars) const
+        {
+            for (size_t i = 0; i < len; i++)
+                if (!strchr(permitted_chars, s[i]) || !s[i])
+                    return false;
+            return len > 0;
+        }
+
+        // Parse a hex number of 1 to 16 digits.
+        bool hexvalue(uint64_t *out) const
+        {
+            if (len < 1 || len > 16)
+                return false;
+            uint64_t value = 0;
+            for (size_t i = 0; i < len; i++) {
+                int digit = hexdigit(s[i]);
+                if (digit < 0)
+                    return false;
+                value = (value << 4) | digit;
+            }
+            *out = value;
+            return true;
+        }
+    };
+
+    static inline int hexdigit(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // Splits a line into the same tokens as lex(), but without
+    // copying them or reporting highlights.
+    struct FastLexer {
+        const char *p, *end;
+
+        void skip_space() { p = scan_space(p, end); }
+
+        // Return the next token if it's a word. If it's anything
+        // else, return an empty FastWord, and don't consume it.
+        FastWord word()
+        {
+            skip_space();
+            FastWord w;
+            w.s = p;
+            p = scan_word(p, end);
+            w.len = p - w.s;
+            return w;
+        }
+
+        // Consume the next token if it's the punctuation character c.
+        bool punct(char c)
+        {
+            skip_space();
+            if (p < end && *p == c) {
+                p++;
+                return true;
+            }
+            return false;
+        }
+
+        bool at_eol()
+        {
+            skip_space();
+            return p == end;
+        }
+    };
+
+    // Parse a line in one of the common formats of dialect D, with
+    // exactly the same results as parse_general. Returns false,
+    // without having done anything, if the line isn't one of those.
+    template <Dialect D> bool parse_fast(const string &line)
+    {
+        size_t size = line.find_last_not_of("\r\n");
+        size = (size == string::npos ? line.size() : size + 1);
+        FastLexer lx{line.data(), line.data() + size};
+
+        Time time = next_line.timestamp;
+        int linecpu = -1;
+
+        FastWord w = lx.word();
+        if (w.len && isdigit((unsigned char)w.s[0])) {
+            if (w.len > 19 || !w.all_of(Token::decimal_digits))
+                return false;
+            time = 0;
+            for (size_t i = 0; i < w.len; i++)
+                time = time * 10 + (w.s[i] - '0');
+
+            w = lx.word();
+            if (timestamp_unit.empty()) {
+                if (w.len && known_timestamp_units.count(string(w.s, w.len)))
+                    return false;
+            } else {
+                if (w != timestamp_unit)
+                    return false;
+                w = lx.word();
+            }
+        }
+
+        if (w.len >= 3 && !memcmp(w.s, "cpu", 3)) {
+            FastWord digits{w.s + 3, w.len - 3};
+            if (D != Dialect::Gem5 || digits.len > 6 ||
+                !digits.all_of(Token::decimal_digits))
+                return false;
+            linecpu = 0;
+            for (size_t i = 0; i < digits.len; i++)
+                linecpu = linecpu * 10 + (digits.s[i] - '0');
+            w = lx.word();
+        }
+
+        bool instruction = (D == Dialect::ES ? w == "ES"
+                            : (w == "IT" || w == "IS" || w == "IF"));
+        if (instruction)
+            return parse_fast_instruction<D>(lx, w, time, linecpu);
+        if (w == "R")
+            return parse_fast_register(lx, time, linecpu);
+        if (w.len == 3 && w.s[0] == 'M' && (w.s[1] == 'R' || w.s[1] == 'W') &&
+            strchr("1248", w.s[2]))
+            return parse_fast_memory(lx, w, time, linecpu);
+        return false;
+    }
+
+    // Called when a fast path has accepted a line, to update the
+    // inter-line state the same way parse_general would.
+    void fast_path_accept(Time time, int linecpu)
+    {
+        next_line = InterLineState();
+        next_line.timestamp = time;
+        next_line.cpu = cpu = linecpu;
+    }
+
+    template <Dialect D>
+    bool parse_fast_instruction(FastLexer &lx, FastWord type, Time time,
+                                int linecpu)
+    {
+        uint64_t address, bitpattern;
+        FastWord instruction;
+
+        if (!lx.punct('('))
+            return false;
+        if (D == Dialect::ES) {
+            // ES (address:bitpattern)
+            if (!lx.word().hexvalue(&address) || !lx.punct(':'))
+                return false;
+            instruction = lx.word();
+            if (!lx.punct(')'))
+                return false;
+        } else {
+            // IT (index) address bitpattern, without any of the
+            // variations that parse_general also handles.
+            if (!lx.word().all_of(Token::hex_digits) || !lx.punct(')') ||
+                !lx.word().hexvalue(&address))
+                return false;
+            instruction = lx.word();
+
+            // If that's an instruction set state ("A" being the only
+            // one that looks like hex), the line is in the variant
+            // where the bracketed value was the address.
+            if (instruction == "A")
+                return false;
+        }
+        if (instruction.len > 8 || !instruction.hexvalue(&bitpattern))
+            return false;
+
+        ISet iset;
+        FastWord isettok = lx.word();
+        if (isettok == "A")
+            iset = ARM;
+        else if (isettok == "T" || isettok == "T16" || isettok == "T32")
+            iset = THUMB;
+        else if (isettok == "O")
+            iset = A64;
+        else
+            return false;
+
+        // CPU mode, and a colon before the disassembly.
+        if (!lx.word().len || !lx.punct(':'))
+            return false;
+
+        // The disassembly must start with something lex() would
+        // accept, and in the ES dialect, not with CCFAIL.
+        lx.skip_space();
+        const char *disass = lx.p;
+        if (disass < lx.end &&
+            (!*disass || (!iswordchr(*disass) && !strchr(":()[],<>", *disass))))
+            return false;
+        if (D == Dialect::ES && lx.word() == "CCFAIL")
+            return false;
+
+        fast_path_accept(time, linecpu);
+        InstructionEvent ev(time, type == "IS" ? IE_CCFAIL : IE_EXECUTED,
+                            address, iset, instruction.len * 4, bitpattern,
+                            string(disass, lx.end));
+        emit(ev);
+        return true;
+    }
+
+    bool parse_fast_register(FastLexer &lx, Time time, int linecpu)
+    {
+        FastWord nametok = lx.word();
+        if (!nametok.len)
+            return false;
+        string regname(nametok.s, nametok.len);
+
+        // Leave anything that parse_general treats specially to it.
+        RegisterId reg;
+        if (!lookup_reg_name(reg, regname) ||
+            reg.prefix == RegPrefix::fpcr ||
+            (reg.prefix == RegPrefix::psr && regname == "cpsr") ||
+            !strcasecmp(regname.c_str(), "sp") ||
+            !strncasecmp(regname.c_str(), "sp_", 3))
+            return false;
+
+        // Expect the whole register value as a single hex word, and
+        // nothing after it.
+        size_t nbytes = reg_size(reg);
+        FastWord value = lx.word();
+        vector<uint8_t> bytes(nbytes);
+        if (value.len != 2 * nbytes ||
+            !hex_to_bytes(value.s, nbytes, bytes.data()) || !lx.at_eol())
+            return false;
+
+        // The trace shows the value big-endian, and RegisterEvent
+        // wants it little-endian.
+        std::reverse(bytes.begin(), bytes.end());
+
+        fast_path_accept(time, linecpu);
+        RegisterEvent ev(time, reg, 0, bytes);
+        emit(ev);
+        return true;
+    }
+
+    bool parse_fast_memory(FastLexer &lx, FastWord type, Time time,
+                           int linecpu)
+    {
+        uint64_t addr;
+        if (!lx.word().hexvalue(&addr))
+            return false;
+        if (lx.punct(':') && !lx.word().all_of(Token::hex_digits))
+            return false;
+
+        // The value may be broken up by underscores.
+        FastWord value = lx.word();
+        uint64_t contents = 0;
+        unsigned ndigits = 0;
+        for (size_t i = 0; i < value.len; i++) {
+            if (value.s[i] == '_')
+                continue;
+            int digit = hexdigit(value.s[i]);
+            if (digit < 0 || ++ndigits > 16)
+                return false;
+            contents = (contents << 4) | digit;
+        }
+        if (!ndigits)
+            return false;
+
+        fast_path_accept(time, linecpu);
+        MemoryEvent ev(time, type.s[1] == 'R', type.s[2] - '0', addr, true,
+                       contents);
+        emit(ev);
+        return true;
+    }
+
+    void parse_general(const string &line_)
     {
         // Get the inter-line state referring to the previous line,
         // and replace it with a default-constructed InterLineState
@@ -345,6 +714,9 @@ class TarmacLineParserImpl {
         // Tarmac lines often, but not always, start with a timestamp.
         // If they don't, we default to the previous timestamp.
         Time time = prev_line.timestamp;
+        cpu = -1;
+        line_has_timestamp = line_has_cpu = false;
+        line_unit.clear();
 
         // Before even checking for a timestamp on this line, see if
         // this looks like a continuation of a previous LD or ST
@@ -355,16 +727,20 @@ class TarmacLineParserImpl {
             tok.startpos == prev_line.post_event_type_start) {
             pos = tok.startpos;        // rewind past the next token
             tok = prev_line.event_type_token;
+            cpu = prev_line.cpu;
         } else {
             // With that case ruled out, look for a timestamp.
             if (tok.isdecimal()) {
                 time = tok.decimalvalue();
                 highlight(tok, HL_TIMESTAMP);
                 tok = lex();
+                line_has_timestamp = true;
 
                 if (tok.isword() && (known_timestamp_units.find(tok.s) !=
-                                     known_timestamp_units.end()))
+                                     known_timestamp_units.end())) {
+                    line_unit = tok.s;
                     tok = lex();
+                }
             } else {
                 // Another possibility is that the timestamp and its unit
                 // are smushed together in a single token, with no
@@ -385,12 +761,20 @@ class TarmacLineParserImpl {
         }
         next_line.timestamp = time;
 
-        // Now we can have a trace source identifier (cpu or other component)
-        // If we want multiple streams recongized, this is it.
-        // But for now, we just drop the cpu* identifiers.
+        // Now we can have a trace source identifier (cpu or other
+        // component). In a trace from a multi-core model, cpuN tells
+        // us which core the line came from, so we pass N on in every
+        // event from this line.
         if (tok.starts_with("cpu")) {
+            size_t ndigits = tok.s.size() - 3;
+            if (ndigits > 0 && ndigits <= 6 &&
+                tok.s.find_first_not_of(Token::decimal_digits, 3) ==
+                    string::npos)
+                cpu = std::stoi(tok.s.substr(3));
+            line_has_cpu = true;
             tok = lex();
         }
+        next_line.cpu = cpu;
 
         // Now we definitely expect an event type, and we diverge
         // based on what it is.
@@ -422,7 +806,7 @@ class TarmacLineParserImpl {
                 tok = lex(); // now tok.startpos begins unparsed text
                 highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
                 ExceptionEvent ev(time);
-                receiver->got_event(ev);
+                emit(ev);
                 return;
             }
 
@@ -651,7 +1035,8 @@ class TarmacLineParserImpl {
                 highlight(disass_end, line.size(), HL_SPACE);
             InstructionEvent ev(time, effect, address, iset, width,
                                 bitpattern, line.substr(tok.startpos));
-            receiver->got_event(ev);
+            emit(ev);
+            detect_dialect(is_ES);
         } else if (tok == "R") {
             // Register update.
             tok = lex();
@@ -900,14 +1285,21 @@ class TarmacLineParserImpl {
             if (bits % 8 != 0)
                 parse_error(tok, _("expected register contents to be an integer"
                                    " number of bytes"));
-            for (unsigned pos = 0; pos < bits / 4; pos += 2) {
-                string hex = contents.substr(pos, 2);
-                if (hex == "--") {
-                    // Special value indicating an unknown byte, in flavours of
-                    // Tarmac that include partial register updates.
-                    bytes.push_back(UNKNOWN);
-                } else {
-                    bytes.push_back(stoul(hex, NULL, 16));
+            vector<uint8_t> known(bits / 8);
+            if (hex_to_bytes(contents.data(), known.size(), known.data())) {
+                // The common case: every byte is plain hex.
+                bytes.assign(known.begin(), known.end());
+            } else {
+                for (unsigned pos = 0; pos < bits / 4; pos += 2) {
+                    string hex = contents.substr(pos, 2);
+                    if (hex == "--") {
+                        // Special value indicating an unknown byte, in
+                        // flavours of Tarmac that include partial register
+                        // updates.
+                        bytes.push_back(UNKNOWN);
+                    } else {
+                        bytes.push_back(stoul(hex, NULL, 16));
+                    }
                 }
             }
 
@@ -957,7 +1349,7 @@ class TarmacLineParserImpl {
                     while (offset < bytes.size() && bytes[offset] != UNKNOWN)
                         realbytes.push_back(bytes[offset++]);
                     RegisterEvent ev(time, reg, start, realbytes);
-                    receiver->got_event(ev);
+                    emit(ev);
                 }
             }
         } else if ((tok.isword() && tok.s.substr(0, 1) == "M") ||
@@ -994,7 +1386,7 @@ class TarmacLineParserImpl {
                     highlight(firsttok.startpos, line.size(), HL_TEXT_EVENT);
                     TextOnlyEvent ev(time, tok.s,
                                      line.substr(firsttok.startpos));
-                    receiver->got_event(ev);
+                    emit(ev);
                     return;
                 } else if (pos == 8 && end == 8 && (c == 'D')) {
                     // This is a data-bus access in the Cortex-M4 RTL style.
@@ -1053,7 +1445,7 @@ class TarmacLineParserImpl {
                     highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
                     TextOnlyEvent ev(time, tok.s,
                                      line.substr(firsttok.startpos));
-                    receiver->got_event(ev);
+                    emit(ev);
                     return;
                 } else {
                     parse_error(tok, _("unrecognised parenthesised keyword"));
@@ -1084,7 +1476,7 @@ class TarmacLineParserImpl {
                 }
 
                 MemoryEvent ev(time, read, size, addr, true, contents);
-                receiver->got_event(ev);
+                emit(ev);
             };
 
             if (size <= 8) {
@@ -1180,7 +1572,7 @@ class TarmacLineParserImpl {
 
                     MemoryEvent ev(time, read, j - i, baseaddr + 16 - j, false,
                                    0);
-                    receiver->got_event(ev);
+                    emit(ev);
 
                     i = j;
                 } else {
@@ -1203,7 +1595,7 @@ class TarmacLineParserImpl {
 
                     MemoryEvent ev(time, read, j - i, baseaddr + 16 - j, true,
                                    value);
-                    receiver->got_event(ev);
+                    emit(ev);
 
                     i = j;
                 }
@@ -1213,7 +1605,7 @@ class TarmacLineParserImpl {
             // ES-style format. Sometimes there's an ES token before
             // it, which we handle above.
             ExceptionEvent ev(time);
-            receiver->got_event(ev);
+            emit(ev);
         } else if (tok == "E") {
             // Trace event type that reports (among other things) CPU
             // exceptions in the IT-style format.
@@ -1235,10 +1627,10 @@ class TarmacLineParserImpl {
             if (tok.starts_with("DebugEvent_")) {
                 // Not interesting enough to make an ExceptionEvent
                 TextOnlyEvent ev(time, type, line.substr(tok.startpos));
-                receiver->got_event(ev);
+                emit(ev);
             } else {
                 ExceptionEvent ev(time);
-                receiver->got_event(ev);
+                emit(ev);
             }
         } else if (tok == "Tarmac") {
             // Header line seen at the start of some trace files. Typically
@@ -1280,7 +1672,7 @@ class TarmacLineParserImpl {
             highlight(tok.startpos, line.size(), HL_TEXT_EVENT);
 
             TextOnlyEvent ev(time, type, line.substr(tok.startpos));
-            receiver->got_event(ev);
+            emit(ev);
         }
     }
 };
@@ -1295,6 +1687,20 @@ TarmacLineParser::~TarmacLineParser() { delete pImpl; }
 
 void TarmacLineParser::parse(const string &s) const { pImpl->parse(s); }
 
+string TarmacLineParser::dialect() const
+{
+    switch (pImpl->dialect) {
+    case TarmacLineParserImpl::Dialect::FastModel:
+        return "fastmodel";
+    case TarmacLineParserImpl::Dialect::Gem5:
+        return "gem5";
+    case TarmacLineParserImpl::Dialect::ES:
+        return "es";
+    default:
+        return "";
+    }
+}
+
 set<string> TarmacLineParserImpl::known_timestamp_units = {
     "clk", "ns", "cs", "cyc", "tic", "ps",
 };
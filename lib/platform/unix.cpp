@@ -22,12 +22,17 @@
 #include "libtarmac/intl.hh"
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <sstream>
+#include <vector>
 
 #include <fcntl.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -50,10 +55,11 @@ string get_error_message() { return strerror(errno); }
 
 struct MMapFile::PlatformData {
     int fd;
+    bool released = false; // whether release() has been called
 };
 
-MMapFile::MMapFile(const string &filename, bool writable)
-    : filename(filename), writable(writable)
+MMapFile::MMapFile(const string &filename, bool writable, bool huge_pages)
+    : filename(filename), writable(writable), huge_pages(huge_pages)
 {
     pdata = new PlatformData;
 
@@ -81,15 +87,92 @@ MMapFile::~MMapFile()
     delete pdata;
 }
 
+#ifdef MADV_HUGEPAGE
+// Map 'size' bytes at an address aligned to a huge page, so that the
+// kernel can back every whole huge page of it with one TLB entry, and
+// ask it to. Returns MAP_FAILED if the mmap fails.
+static void *map_huge_page_aligned(size_t size, int prot, int flags, int fd)
+{
+    // Reserve enough address space to be sure of containing an
+    // aligned region of the right size, map over that region, and
+    // give back the ends of the reservation either side of it.
+    size_t reserved = size + HUGE_PAGE_SIZE;
+    void *res = mmap(NULL, reserved, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (res == MAP_FAILED)
+        return MAP_FAILED;
+    uintptr_t start = (uintptr_t)res;
+    uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *block = mmap((void *)aligned, size, prot, flags | MAP_FIXED, fd, 0);
+    if (block == MAP_FAILED) {
+        munmap(res, reserved);
+        return MAP_FAILED;
+    }
+
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t end = (aligned + size + pagesize - 1) & ~(pagesize - 1);
+    if (aligned > start)
+        munmap(res, aligned - start);
+    if (start + reserved > end)
+        munmap((void *)end, start + reserved - end);
+
+    // Only a hint, and filesystems without huge page support in their
+    // page cache ignore it, so failure doesn't matter.
+    madvise(block, size, MADV_HUGEPAGE);
+    return block;
+}
+#endif
+
+void *resize_huge_page_block(void *block, size_t oldsize, size_t newsize)
+{
+#ifdef MADV_HUGEPAGE
+#ifdef MREMAP_MAYMOVE
+    // Grow the block in place if the address space after it is free.
+    if (block && mremap(block, oldsize, newsize, 0) != MAP_FAILED)
+        return block;
+#endif
+
+    void *newblock = map_huge_page_aligned(
+        newsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    if (newblock == MAP_FAILED)
+        return nullptr;
+    if (block) {
+#ifdef MREMAP_FIXED
+        // Move the old pages across rather than copying them, which
+        // keeps any huge pages they already have.
+        if (mremap(block, oldsize, oldsize, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   newblock) == MAP_FAILED)
+#endif
+        {
+            memcpy(newblock, block, oldsize);
+            munmap(block, oldsize);
+        }
+    }
+    return newblock;
+#else
+    return nullptr;
+#endif
+}
+
+void free_huge_page_block(void *block, size_t size) { munmap(block, size); }
+
 void MMapFile::map()
 {
     assert(!mapping);
     if (!curr_size)
         return;
-    mapping = mmap(NULL, curr_size, PROT_READ | (writable ? PROT_WRITE : 0),
-                   MAP_SHARED, pdata->fd, 0);
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && (size_t)curr_size >= HUGE_PAGE_SIZE)
+        mapping = map_huge_page_aligned(curr_size, prot, MAP_SHARED, pdata->fd);
+    else
+#endif
+        mapping = mmap(NULL, curr_size, prot, MAP_SHARED, pdata->fd, 0);
     if (mapping == MAP_FAILED)
         reporter->err(1, "%s: mmap", filename.c_str());
+    // See release().
+    if (pdata->released)
+        madvise(mapping, curr_size, MADV_RANDOM);
 }
 
 void MMapFile::unmap()
@@ -113,6 +196,76 @@ void MMapFile::resize(size_t newsize)
     map();
 }
 
+void MMapFile::release(OFF_T end)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t len = (size_t)(end < curr_size ? end : curr_size);
+    len -= len % pagesize;
+    if (!len)
+        return;
+
+    // The mapping is shared with the file, so once the pages are
+    // written back, discarding them loses nothing: touching them
+    // again reads them back from the file.
+    if (writable && msync(mapping, len, MS_SYNC) < 0)
+        reporter->err(1, "%s: msync", filename.c_str());
+    if (madvise(mapping, len, MADV_DONTNEED) < 0)
+        reporter->err(1, "%s: madvise", filename.c_str());
+    // Pages are read back one at a time as tree searches reach them,
+    // so reading ahead of them would only bring back the pages we've
+    // just released. This applies to the whole mapping, and map()
+    // repeats it for the new mapping made by a resize.
+    madvise(mapping, curr_size, MADV_RANDOM);
+    pdata->released = true;
+#ifdef POSIX_FADV_DONTNEED
+    // Only a hint, so failure doesn't matter.
+    posix_fadvise(pdata->fd, 0, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+uint64_t MMapFile::resident() const
+{
+#ifdef __linux__
+    using mincore_vec_t = unsigned char;
+#else
+    using mincore_vec_t = char;
+#endif
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    std::vector<mincore_vec_t> vec((curr_size + pagesize - 1) / pagesize);
+    if (vec.empty() || mincore(mapping, curr_size, vec.data()) < 0)
+        return 0;
+    uint64_t pages = 0;
+    for (mincore_vec_t v : vec)
+        pages += v & 1;
+    return pages * pagesize;
+}
+
+uint64_t peak_resident_memory()
+{
+#ifdef __linux__
+    // getrusage's figure survives exec, so it would include the peak
+    // of whatever process started this one, whereas VmHWM is reset.
+    if (FILE *fp = fopen("/proc/self/status", "r")) {
+        char line[256];
+        unsigned long long kb;
+        bool found = false;
+        while (!found && fgets(line, sizeof(line), fp))
+            found = sscanf(line, "VmHWM: %llu kB", &kb) == 1;
+        fclose(fp);
+        if (found)
+            return kb * 1024;
+    }
+#endif
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss; // macOS reports it in bytes
+#else
+    return (uint64_t)ru.ru_maxrss * 1024;
+#endif
+}
+
 static bool try_make_conf_path(const char *env_var, const char *suffix,
                                const string &filename, string &out)
 {
@@ -181,6 +334,59 @@ bool get_environment_variable(const string &varname, string &out)
     return true;
 }
 
+string absolute_path(const string &path)
+{
+    char *abs = realpath(path.c_str(), nullptr);
+    if (!abs)
+        return path;
+    string ret = abs;
+    free(abs);
+    return ret;
+}
+
+bool rename_file(const string &from, const string &to)
+{
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool make_directories(const string &path)
+{
+    // Make each prefix of the path that ends before a slash, and then
+    // the whole of it.
+    for (size_t pos = path.find('/', 1);; pos = path.find('/', pos + 1)) {
+        string prefix = path.substr(0, pos);
+        if (mkdir(prefix.c_str(), 0777) < 0 && errno != EEXIST)
+            return false;
+        if (pos == string::npos)
+            break;
+    }
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+struct FileLock::PlatformData {
+    int fd;
+};
+
+FileLock::FileLock(const string &filename) : filename(filename)
+{
+    pdata = new PlatformData;
+
+    pdata->fd = open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+    if (pdata->fd < 0)
+        reporter->err(1, "%s: open", filename.c_str());
+    while (flock(pdata->fd, LOCK_EX) < 0)
+        if (errno != EINTR)
+            reporter->err(1, "%s: flock", filename.c_str());
+}
+
+FileLock::~FileLock()
+{
+    // Closing the file releases the lock
+    close(pdata->fd);
+    delete pdata;
+}
+
 void gettext_setup(bool console_application)
 {
     // On this platform, we don't need to know whether it's a console
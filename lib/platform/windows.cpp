@@ -24,6 +24,7 @@
 #include "libtarmac/cmake.h"
 
 #include <windows.h>
+#include <psapi.h>
 #include <shlobj.h>
 #include <stdlib.h>
 
@@ -81,8 +82,8 @@ struct MMapFile::PlatformData {
     HANDLE mh;
 };
 
-MMapFile::MMapFile(const string &filename, bool writable)
-    : filename(filename), writable(writable)
+MMapFile::MMapFile(const string &filename, bool writable, bool huge_pages)
+    : filename(filename), writable(writable), huge_pages(huge_pages)
 {
     pdata = new PlatformData;
 
@@ -181,6 +182,50 @@ void MMapFile::resize(size_t newsize)
     map();
 }
 
+void MMapFile::release(OFF_T end)
+{
+    size_t len = (size_t)(end < curr_size ? end : curr_size);
+    if (!len)
+        return;
+
+    if (writable && !FlushViewOfFile(mapping, len))
+        reporter->err(1, "%s: FlushViewOfFile", filename.c_str());
+    // Unlocking pages that were never locked removes them from the
+    // working set, which is what we want, although it reports that
+    // as an error.
+    VirtualUnlock(mapping, len);
+}
+
+uint64_t MMapFile::resident() const
+{
+    // There's no convenient way to ask about just this mapping, but
+    // the working set of the whole process is a good enough
+    // approximation while the index is what it's mostly made of.
+    // (QueryWorkingSetEx could ask about each page of the mapping,
+    // but that's as slow as mincore.) The difference means a memory
+    // limit is met less closely, and if it's smaller than the rest of
+    // the process, the index is released at every check; the
+    // documentation of --index-memory-limit says so.
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.WorkingSetSize;
+}
+
+// Large pages on Windows need a privilege that ordinary users don't
+// have, and can't be resized, so arenas stay in ordinary memory.
+void *resize_huge_page_block(void *, size_t, size_t) { return nullptr; }
+
+void free_huge_page_block(void *, size_t) {}
+
+uint64_t peak_resident_memory()
+{
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize;
+}
+
 #if !HAVE_APPDATAPROGRAMDATA
 // Compensate for this not being defined by earlier toolchain versions
 static const GUID FOLDERID_AppDataProgramData = {
@@ -263,6 +308,65 @@ bool get_environment_variable(const string &varname, string &out)
     return true;
 }
 
+string absolute_path(const string &path)
+{
+    char abs[MAX_PATH];
+    DWORD len = GetFullPathName(path.c_str(), MAX_PATH, abs, NULL);
+    if (len == 0 || len >= MAX_PATH)
+        return path;
+    return string(abs, len);
+}
+
+bool rename_file(const string &from, const string &to)
+{
+    return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+bool make_directories(const string &path)
+{
+    // Make each prefix of the path that ends before a separator, and
+    // then the whole of it.
+    for (size_t pos = path.find_first_of("/\\", 1);;
+         pos = path.find_first_of("/\\", pos + 1)) {
+        string prefix = path.substr(0, pos);
+        if (!CreateDirectory(prefix.c_str(), NULL) &&
+            GetLastError() != ERROR_ALREADY_EXISTS)
+            return false;
+        if (pos == string::npos)
+            break;
+    }
+    DWORD attrs = GetFileAttributes(path.c_str());
+    return attrs != INVALID_FILE_ATTRIBUTES &&
+           (attrs & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+struct FileLock::PlatformData {
+    HANDLE fh;
+};
+
+FileLock::FileLock(const string &filename) : filename(filename)
+{
+    pdata = new PlatformData;
+
+    pdata->fh = CreateFile(filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_ALWAYS, 0, NULL);
+    if (pdata->fh == INVALID_HANDLE_VALUE)
+        reporter->err(1, "%s: CreateFile", filename.c_str());
+
+    OVERLAPPED ov = {};
+    if (!LockFileEx(pdata->fh, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD,
+                    &ov))
+        reporter->err(1, "%s: LockFileEx", filename.c_str());
+}
+
+FileLock::~FileLock()
+{
+    // Closing the file releases the lock
+    CloseHandle(pdata->fh);
+    delete pdata;
+}
+
 #if HAVE_LIBINTL
 #error "We didn't expect libintl to be available on Windows, so no setup code"
 #else
@@ -19,6 +19,7 @@
 #include "libtarmac/registers.hh"
 #include "libtarmac/misc.hh"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstdlib>
@@ -26,11 +27,13 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 using std::dec;
 using std::ostream;
 using std::ostringstream;
 using std::string;
+using std::vector;
 
 struct RegPrefixInfo {
     const char *name;
@@ -55,6 +58,15 @@ static const RegPrefixInfo reg_prefixes[] = {
     REGPREFIXLIST(MAKE_REGPREFIX_INFO, MAKE_REGPREFIX_INFO)};
 #undef MAKE_REGPREFIX_INFO
 
+// Whether each register class occupies its own space in the address
+// map, rather than aliasing the next one.
+#define MAKE_REGPREFIX_OWNS_SPACE(id, size, disp, n) true,
+#define MAKE_REGPREFIX_ALIASES(id, size, disp, n) false,
+static const bool reg_prefix_owns_space[] = {
+    REGPREFIXLIST(MAKE_REGPREFIX_OWNS_SPACE, MAKE_REGPREFIX_ALIASES)};
+#undef MAKE_REGPREFIX_OWNS_SPACE
+#undef MAKE_REGPREFIX_ALIASES
+
 ostream &operator<<(ostream &os, const RegisterId &id)
 {
     const RegPrefixInfo &pfx = reg_prefixes[(size_t)id.prefix];
@@ -192,6 +204,37 @@ size_t reg_size(const RegisterId &reg)
     return pfx.size;
 }
 
+vector<RegisterId> regs_in_range(Addr lo, Addr hi, unsigned iflags)
+{
+    vector<RegisterId> regs;
+    bool aarch64 = iflags & IFLAG_AARCH64;
+
+    for (size_t i = 0; i < lenof(reg_prefixes); i++) {
+        const RegPrefixInfo &pfx = reg_prefixes[i];
+        if (!reg_prefix_owns_space[i] || pfx.size == 0 || pfx.disp == 0)
+            continue;
+
+        for (unsigned index = 0; index < pfx.n; index++) {
+            Addr start = pfx.offset + index * pfx.disp;
+            Addr end = start + pfx.size - 1;
+            if (end < lo || start > hi)
+                continue;
+
+            RegisterId reg = {RegPrefix(i), index};
+            if (reg.prefix == RegPrefix::x && !aarch64 && index < 16) {
+                reg.prefix = RegPrefix::r;
+            } else if (reg.prefix == RegPrefix::z) {
+                const RegPrefixInfo &vpfx = reg_prefixes[(size_t)RegPrefix::v];
+                if (std::min(hi, end) < start + vpfx.size)
+                    reg.prefix = aarch64 ? RegPrefix::v : RegPrefix::q;
+            }
+            regs.push_back(reg);
+        }
+    }
+
+    return regs;
+}
+
 const RegisterId REG_iflags = {RegPrefix::internal_flags, 0};
 const RegisterId REG_pc = {RegPrefix::pc, 0};
 const RegisterId REG_32_sp = {RegPrefix::r, 13};
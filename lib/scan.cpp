@@ -0,0 +1,368 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "libtarmac/scan.hh"
+
+#include <ctype.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define SCAN_AVX2 1
+#include <immintrin.h>
+#else
+#include <intrin.h>
+#endif
+#endif
+
+static inline bool isword(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.' ||
+           c == '#';
+}
+
+static inline bool isspc(char c) { return isspace((unsigned char)c); }
+
+static inline int hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// ----------------------------------------------------------------------
+// Portable implementation, also used for the tails of the vectorised
+// ones.
+
+static const char *skip_space_portable(const char *p, const char *end)
+{
+    while (p < end && isspc(*p))
+        p++;
+    return p;
+}
+
+static const char *skip_word_portable(const char *p, const char *end)
+{
+    while (p < end && isword(*p))
+        p++;
+    return p;
+}
+
+static const char *skip_hex_portable(const char *p, const char *end)
+{
+    while (p < end && hexval(*p) >= 0)
+        p++;
+    return p;
+}
+
+static bool hex_to_bytes_portable(const char *hex, size_t nbytes, uint8_t *out)
+{
+    for (size_t i = 0; i < nbytes; i++) {
+        int hi = hexval(hex[2 * i]), lo = hexval(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        out[i] = hi << 4 | lo;
+    }
+    return true;
+}
+
+static const ScanRoutines portable_routines = {
+    "portable",        skip_space_portable, skip_word_portable,
+    skip_hex_portable, hex_to_bytes_portable,
+};
+
+#ifdef SCAN_SSE2
+
+static inline unsigned lowest_set_bit(unsigned mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#endif
+}
+
+// The vector routines classify only ASCII characters themselves. The
+// <cctype> functions may treat some bytes above 0x7F as letters or
+// spaces, depending on the locale, so when a scan stops at one of
+// those, the portable test decides whether to carry on past it.
+template <const char *(*Step)(const char *, const char *),
+          bool (*Scalar)(char)>
+static inline const char *skip_with_fallback(const char *p, const char *end)
+{
+    while (true) {
+        p = Step(p, end);
+        if (p == end || (unsigned char)*p < 0x80 || !Scalar(*p))
+            return p;
+        p++;
+    }
+}
+
+// ----------------------------------------------------------------------
+// SSE2 implementation.
+
+// Byte-wise test of lo <= v <= hi, for lo and hi in ASCII. Bytes
+// above 0x7F are negative as signed values, so they always fail.
+static inline __m128i in_range_sse2(__m128i v, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static inline __m128i isword_sse2(__m128i v)
+{
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i r = _mm_or_si128(in_range_sse2(v, '0', '9'),
+                             in_range_sse2(lower, 'a', 'z'));
+    r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+    return r;
+}
+
+static inline __m128i isspace_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                        in_range_sse2(v, '\t', '\r'));
+}
+
+static inline __m128i isalphahex_sse2(__m128i v)
+{
+    return in_range_sse2(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'f');
+}
+
+static inline __m128i ishex_sse2(__m128i v)
+{
+    return _mm_or_si128(in_range_sse2(v, '0', '9'), isalphahex_sse2(v));
+}
+
+#define SSE2_SKIP(name, classify, tail)                                     \
+    static const char *name(const char *p, const char *end)                 \
+    {                                                                       \
+        for (; end - p >= 16; p += 16) {                                    \
+            __m128i v = _mm_loadu_si128((const __m128i *)p);                \
+            unsigned mask = _mm_movemask_epi8(classify(v)) ^ 0xFFFF;        \
+            if (mask)                                                       \
+                return p + lowest_set_bit(mask);                            \
+        }                                                                   \
+        return tail(p, end);                                                \
+    }
+
+SSE2_SKIP(skip_space_sse2_ascii, isspace_sse2, skip_space_portable)
+SSE2_SKIP(skip_word_sse2_ascii, isword_sse2, skip_word_portable)
+SSE2_SKIP(skip_hex_sse2, ishex_sse2, skip_hex_portable)
+
+static const char *skip_space_sse2(const char *p, const char *end)
+{
+    return skip_with_fallback<skip_space_sse2_ascii, isspc>(p, end);
+}
+
+static const char *skip_word_sse2(const char *p, const char *end)
+{
+    return skip_with_fallback<skip_word_sse2_ascii, isword>(p, end);
+}
+
+// Turn each hex digit into its value, and then combine pairs of
+// values within each 16-bit lane, where the first digit of the pair
+// (the high nibble) is the low byte of the lane.
+static inline __m128i hex_nibbles_sse2(__m128i v)
+{
+    return _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x0F)),
+                        _mm_and_si128(isalphahex_sse2(v), _mm_set1_epi8(9)));
+}
+
+static inline __m128i combine_nibbles_sse2(__m128i n)
+{
+    return _mm_or_si128(
+        _mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0xF0)),
+        _mm_srli_epi16(n, 8));
+}
+
+static bool hex_to_bytes_sse2(const char *hex, size_t nbytes, uint8_t *out)
+{
+    for (; nbytes >= 8; nbytes -= 8, hex += 16, out += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)hex);
+        if (_mm_movemask_epi8(ishex_sse2(v)) != 0xFFFF)
+            return false;
+        __m128i bytes = combine_nibbles_sse2(hex_nibbles_sse2(v));
+        _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(bytes, bytes));
+    }
+    return hex_to_bytes_portable(hex, nbytes, out);
+}
+
+static const ScanRoutines sse2_routines = {
+    "sse2",        skip_space_sse2,   skip_word_sse2,
+    skip_hex_sse2, hex_to_bytes_sse2,
+};
+
+#endif // SCAN_SSE2
+
+#ifdef SCAN_AVX2
+
+// ----------------------------------------------------------------------
+// AVX2 implementation, compiled for that instruction set regardless
+// of the options for the rest of the library, and only used if the
+// CPU turns out to support it.
+
+#define AVX2_FN __attribute__((target("avx2")))
+
+AVX2_FN static inline __m256i in_range_avx2(__m256i v, char lo, char hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+AVX2_FN static inline __m256i isword_avx2(__m256i v)
+{
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i r = _mm256_or_si256(in_range_avx2(v, '0', '9'),
+                                in_range_avx2(lower, 'a', 'z'));
+    r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')));
+    r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+    r = _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+    return r;
+}
+
+AVX2_FN static inline __m256i isspace_avx2(__m256i v)
+{
+    return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                           in_range_avx2(v, '\t', '\r'));
+}
+
+AVX2_FN static inline __m256i isalphahex_avx2(__m256i v)
+{
+    return in_range_avx2(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a',
+                         'f');
+}
+
+AVX2_FN static inline __m256i ishex_avx2(__m256i v)
+{
+    return _mm256_or_si256(in_range_avx2(v, '0', '9'), isalphahex_avx2(v));
+}
+
+// Lines of a trace are mostly short, so after the 32-byte blocks, a
+// 16-byte SSE2 step is worth having before the scalar tail.
+#define AVX2_SKIP(name, classify, tail)                                     \
+    AVX2_FN static const char *name(const char *p, const char *end)         \
+    {                                                                       \
+        for (; end - p >= 32; p += 32) {                                    \
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);             \
+            unsigned mask = ~(unsigned)_mm256_movemask_epi8(classify(v));   \
+            if (mask)                                                       \
+                return p + lowest_set_bit(mask);                            \
+        }                                                                   \
+        return tail(p, end);                                                \
+    }
+
+AVX2_SKIP(skip_space_avx2_ascii, isspace_avx2, skip_space_sse2_ascii)
+AVX2_SKIP(skip_word_avx2_ascii, isword_avx2, skip_word_sse2_ascii)
+AVX2_SKIP(skip_hex_avx2, ishex_avx2, skip_hex_sse2)
+
+static const char *skip_space_avx2(const char *p, const char *end)
+{
+    return skip_with_fallback<skip_space_avx2_ascii, isspc>(p, end);
+}
+
+static const char *skip_word_avx2(const char *p, const char *end)
+{
+    return skip_with_fallback<skip_word_avx2_ascii, isword>(p, end);
+}
+
+AVX2_FN static bool hex_to_bytes_avx2(const char *hex, size_t nbytes,
+                                      uint8_t *out)
+{
+    for (; nbytes >= 16; nbytes -= 16, hex += 32, out += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)hex);
+        if (~(unsigned)_mm256_movemask_epi8(ishex_avx2(v)))
+            return false;
+        __m256i n = _mm256_add_epi8(
+            _mm256_and_si256(v, _mm256_set1_epi8(0x0F)),
+            _mm256_and_si256(isalphahex_avx2(v), _mm256_set1_epi8(9)));
+        __m256i bytes = _mm256_or_si256(
+            _mm256_and_si256(_mm256_slli_epi16(n, 4), _mm256_set1_epi16(0xF0)),
+            _mm256_srli_epi16(n, 8));
+        // packus works within each 128-bit half, leaving the results
+        // in 64-bit elements 0 and 2.
+        bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes),
+                                         0x08);
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(bytes));
+    }
+    return hex_to_bytes_sse2(hex, nbytes, out);
+}
+
+static const ScanRoutines avx2_routines = {
+    "avx2",        skip_space_avx2,   skip_word_avx2,
+    skip_hex_avx2, hex_to_bytes_avx2,
+};
+
+static bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif // SCAN_AVX2
+
+const ScanRoutines *scan_routines(ScanImpl impl)
+{
+    switch (impl) {
+    case ScanImpl::Portable:
+        return &portable_routines;
+    case ScanImpl::SSE2:
+#ifdef SCAN_SSE2
+        return &sse2_routines;
+#else
+        return nullptr;
+#endif
+    case ScanImpl::AVX2:
+#ifdef SCAN_AVX2
+        return cpu_has_avx2() ? &avx2_routines : nullptr;
+#else
+        return nullptr;
+#endif
+    }
+    return nullptr;
+}
+
+static const ScanRoutines *choose_scan_routines()
+{
+    if (const ScanRoutines *r = scan_routines(ScanImpl::AVX2))
+        return r;
+    if (const ScanRoutines *r = scan_routines(ScanImpl::SSE2))
+        return r;
+    return &portable_routines;
+}
+
+// Statically initialised to something that works, so that it's safe
+// to use from other static initialisers that happen to run first.
+const ScanRoutines *best_scan_routines = &portable_routines;
+
+namespace {
+struct ScanRoutinesChooser {
+    ScanRoutinesChooser() { best_scan_routines = choose_scan_routines(); }
+} scan_routines_chooser;
+} // namespace
@@ -18,21 +18,48 @@
 
 #include "libtarmac/disktree.hh"
 #include "libtarmac/tarmacutil.hh"
+#include "libtarmac/binarytrace.hh"
 #include "libtarmac/index.hh"
 #include "libtarmac/intl.hh"
 #include "libtarmac/misc.hh"
 #include "libtarmac/reporter.hh"
 
+#include <ctype.h>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <stdlib.h>
 
 using std::cout;
+using std::ifstream;
 using std::make_shared;
 using std::string;
 
+// Find the configured index cache directory, if any. The environment
+// variable takes priority over the configuration file, whose first
+// line that isn't blank or a comment gives the directory name.
+static string default_index_cache_dir()
+{
+    string dir;
+    if (get_environment_variable("TARMAC_INDEX_CACHE", dir))
+        return dir;
+
+    string conf_path;
+    if (!get_conf_path("index-cache.conf", conf_path))
+        return "";
+    ifstream ifs(conf_path);
+    for (string line; getline(ifs, line);) {
+        while (!line.empty() && isspace((unsigned char)line.back()))
+            line.pop_back();
+        if (!line.empty() && line[0] != '#')
+            return line;
+    }
+    return "";
+}
+
 TarmacUtilityBase::TarmacUtilityBase()
-    : verbose(is_interactive()), show_progress_meter(verbose) {
+    : verbose(is_interactive()), show_progress_meter(verbose),
+      index_cache_dir(default_index_cache_dir()) {
     idiags.diagnostics_stream = &cout;
 }
 
@@ -42,15 +69,49 @@ void TarmacUtilityBase::add_options(Argparse &ap)
         index_on_disk = false;
 
     if (can_use_image) {
-        ap.optval({"--image"}, _("IMAGEFILE"), _("image file name"),
-                  [this](const string &s) { image_filename = s; });
+        ap.optval({"--image"}, _("IMAGEFILE"), _("image file name (can be "
+                  "repeated, if the trace covers more than one image)"),
+                  [this](const string &s) {
+                      if (image_specs.empty() ||
+                          !image_specs.back().filename.empty())
+                          image_specs.emplace_back();
+                      image_specs.back().filename = s;
+                  });
         ap.optval({"--load-offset"}, _("OFFSET"), _("offset from addresses in "
                   "the image file to addresses in the trace"),
                   [this](const string &s) {
-                      load_offset = stoull(s, nullptr, 0);
+                      current_image_spec().load_offset =
+                          stoull(s, nullptr, 0);
+                  });
+        ap.optval({"--image-range"}, _("LO-HI"), _("only use the image file "
+                  "to look up trace addresses in the range LO-HI"),
+                  [this](const string &s) {
+                      size_t dash = s.find('-');
+                      ImageSpec &spec = current_image_spec();
+                      try {
+                          size_t pos1, pos2;
+                          spec.lo = stoull(s.substr(0, dash), &pos1, 0);
+                          spec.hi = stoull(s.substr(dash + 1), &pos2, 0);
+                          if (dash == string::npos || pos1 != dash ||
+                              pos2 != s.size() - dash - 1 || spec.hi < spec.lo)
+                              throw std::invalid_argument("");
+                      } catch (const std::logic_error &) {
+                          throw ArgparseError(format(
+                              _("'{}': unable to parse address range"), s));
+                      }
+                      spec.has_range = true;
+                  });
+        ap.optnoval({"--symbol-cache"}, _("cache the image's symbol table "
+                    "in a file alongside the index"),
+                    [this]() { use_symbol_cache = true; });
+        ap.optval({"--symbol-cache-file"}, _("CACHEFILE"),
+                  _("cache the image's symbol table in CACHEFILE"),
+                  [this](const string &s) {
+                      use_symbol_cache = true;
+                      symbol_cache_filename = s;
                   });
     }
-    if (index_on_disk) {
+    if (index_on_disk && !own_index) {
         ap.optnoval({"--only-index"}, _("generate index and do nothing else"),
                     [this]() {
                         indexing = Troolean::Yes;
@@ -60,6 +121,17 @@ void TarmacUtilityBase::add_options(Argparse &ap)
                     [this]() { indexing = Troolean::Yes; });
         ap.optnoval({"--no-index"}, _("do not regenerate index"),
                     [this]() { indexing = Troolean::No; });
+        ap.optnoval({"--strict"}, _("check the whole of the trace file "
+                    "against the index, instead of a sample, before "
+                    "reusing an existing index"),
+                    [this]() { strict_index_check = true; });
+        ap.optval({"--index-cache"}, _("DIRECTORY"),
+                  _("keep index files in a cache DIRECTORY shared between "
+                    "copies of the same trace file"),
+                  [this](const string &s) { index_cache_dir = s; });
+        ap.optnoval({"--no-index-cache"},
+                    _("do not use the index cache directory"),
+                    [this]() { index_cache_dir.clear(); });
         ap.optnoval({"--memory-index"},
                     _("keep index in memory instead of on disk"),
                     [this]() { index_on_disk = false; });
@@ -80,6 +152,34 @@ void TarmacUtilityBase::add_options(Argparse &ap)
                 [this]() {
                     thumbonly = true;
                 });
+    ap.optval({"--cpu"}, _("N"), _("in a trace from a multi-core model, "
+              "only analyse the execution of CPU N (memory is still shared "
+              "with the other CPUs)"),
+              [this](const string &s) {
+                  size_t pos = 0;
+                  try {
+                      iparams.cpu = std::stoi(s, &pos, 0);
+                  } catch (const std::logic_error &) {
+                      pos = 0;
+                  }
+                  if (pos == 0 || pos != s.size() || iparams.cpu < 0)
+                      throw ArgparseError(
+                          format(_("'{}': expected a CPU number"), s));
+              });
+    ap.optnoval({"-v", "--verbose"}, _("make tool more verbose"),
+                [this]() { verbose = true; });
+    ap.optnoval({"-q", "--quiet"}, _("make tool quiet"),
+                [this]() { verbose = show_progress_meter = false; });
+    ap.optnoval({"--show-progress-meter"},
+                _("force display of the progress meter"),
+                [this]() { show_progress_meter = true; });
+    ap.optval({"--progress-file"}, _("PROGRESSFILE"),
+              _("write machine-readable indexing progress to PROGRESSFILE"),
+              [this](const string &s) { progress_filename = s; });
+
+    // The rest only affect building an index.
+    if (no_index)
+        return;
     ap.optval({"--debug"}, _("TYPE"), _("enable diagnostics of type TYPE "
                 "(use --debug=list for a list)"),
                 [this](const string &s) {
@@ -94,38 +194,56 @@ void TarmacUtilityBase::add_options(Argparse &ap)
                             format(_("unknown diagnostic type '{}'"), s));
                     }
                 });
-    ap.optnoval({"-v", "--verbose"}, _("make tool more verbose"),
-                [this]() { verbose = true; });
-    ap.optnoval({"-q", "--quiet"}, _("make tool quiet"),
-                [this]() { verbose = show_progress_meter = false; });
-    ap.optnoval({"--show-progress-meter"},
-                _("force display of the progress meter"),
-                [this]() { show_progress_meter = true; });
+    ap.optnoval({"--stats"}, _("show statistics about building the index"),
+                [this]() {
+                    show_stats = true;
+                    iparams.split_timings = true;
+                });
+    ap.optval({"--index-memory-limit"}, _("SIZE"),
+              _("while building an index file, try to keep no more than "
+                "SIZE bytes of it in memory (SIZE may end in K, M or G)"),
+              [this](const string &s) {
+                  iparams.memory_limit = parse_size(s, 1);
+              });
+    ap.optnoval({"--no-huge-pages"},
+                _("keep the index in ordinary pages of memory, even where "
+                  "the system supports huge pages"),
+                []() { Arena::use_huge_pages = false; });
 }
 
 void TarmacUtility::add_options(Argparse &ap)
 {
     TarmacUtilityBase::add_options(ap);
 
-    ap.optval({"--index"}, _("INDEXFILE"), _("index file name"),
-              [this](const string &s) { trace.index_filename = s; });
+    if (!own_index)
+        ap.optval({"--index"}, _("INDEXFILE"), _("index file name"),
+                  [this](const string &s) { trace.index_filename = s; });
     ap.positional(_("TRACEFILE"), _("Tarmac trace file to read"),
                   [this](const string &s) { trace.tarmac_filename = s; },
                   trace_required);
 }
 
-static string defaultIndexFilename(string tarmac_filename)
+string
+TarmacUtilityBase::defaultIndexFilename(const string &tarmac_filename) const
 {
+    if (iparams.cpu >= 0)
+        return format("{}.cpu{}.index", tarmac_filename, iparams.cpu);
     return tarmac_filename + ".index";
 }
 
+string TarmacUtilityBase::defaultIndexFilename(const TracePair &trace) const
+{
+    return defaultIndexFilename(trace.binary_filename.empty()
+                                    ? trace.tarmac_filename
+                                    : trace.binary_filename);
+}
+
 void TarmacUtility::postProcessOptions()
 {
+    useBinaryTrace(trace);
+
     trace.index_on_disk = index_on_disk;
-    if (index_on_disk) {
-        if (trace.index_filename.empty())
-            trace.index_filename = defaultIndexFilename(trace.tarmac_filename);
-    } else {
+    if (!index_on_disk) {
         if (indexing == Troolean::No)
             reporter->warnx(_("Ignoring --no-index since index is in memory"));
         if (!trace.index_filename.empty())
@@ -135,20 +253,129 @@ void TarmacUtility::postProcessOptions()
         trace.memory_index = make_shared<MemArena>();
     }
 
-    std::shared_ptr<Image> image =
-        image_filename.empty() ? nullptr
-                               : std::make_shared<Image>(image_filename);
+    // If the index is in memory or in the index cache, put any symbol
+    // cache where the index file would otherwise have been.
+    setupImages(trace.index_on_disk && !trace.index_filename.empty()
+                   ? trace.index_filename
+                   : defaultIndexFilename(trace));
+
+    // Only now choose the index file name, since the images can
+    // change the endianness that the index cache takes into account.
+    if (trace.index_on_disk && trace.index_filename.empty()) {
+        useIndexCache(trace);
+        if (trace.index_filename.empty())
+            trace.index_filename = defaultIndexFilename(trace);
+    }
+}
+
+void TarmacUtilityBase::useIndexCache(TracePair &trace) const
+{
+    if (index_cache_dir.empty() || trace.tarmac_filename.empty())
+        return;
 
-    if (image) {
-        bool is_big_endian = image->is_big_endian();
-        if (bigend_explicit) {
+    // Name the index after the parts of the trace fingerprint that
+    // are cheap to compute, and the options that affect its contents.
+    // The full fingerprint is still checked against the index header
+    // as usual, so two traces that happen to share a name here will
+    // only cause unnecessary rebuilds.
+    TraceFingerprint fp;
+    if (!trace_fingerprint(trace, false, fp))
+        reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
+    if (!make_directories(index_cache_dir))
+        reporter->err(1, "%s: unable to create index cache directory",
+                      index_cache_dir.c_str());
+    trace.index_filename =
+        index_cache_dir + "/" +
+        format("{:x}-{:x}-{}{}{}.index", fp.size, fp.sampled_hash,
+               bigend ? "be" : "le", thumbonly ? "-thumb" : "",
+               iparams.cpu >= 0 ? format("-cpu{}", iparams.cpu) : "");
+    trace.index_shared = true;
+}
+
+void TarmacUtilityBase::useBinaryTrace(TracePair &trace)
+{
+    if (trace.tarmac_filename.empty() ||
+        !is_binary_trace(trace.tarmac_filename))
+        return;
+
+    BinaryTraceReader reader(trace.tarmac_filename);
+    const BinaryTraceHeader &hdr = reader.header();
+    trace.binary_filename = trace.tarmac_filename;
+    trace.tarmac_filename = hdr.tarmac_filename;
+
+    // The events in the binary trace were decoded using the options it
+    // was converted with, so those are the ones that apply.
+    if (bigend_explicit && bigend != hdr.pparams.bigend)
+        reporter->warnx(_("Ignoring endianness option, since binary trace "
+                          "%s was converted with the other endianness"),
+                        trace.binary_filename.c_str());
+    bigend = hdr.pparams.bigend;
+    bigend_explicit = true;
+    thumbonly = hdr.pparams.iset_specified && hdr.pparams.iset == THUMB;
+
+    // Tools will display lines from the text trace, if it's there, so
+    // make sure it's the one the binary trace was made from.
+    TraceFingerprint fp;
+    if (trace_fingerprint(trace.tarmac_filename, false, fp) &&
+        (fp.size != hdr.fingerprint.size ||
+         fp.sampled_hash != hdr.fingerprint.sampled_hash))
+        reporter->errx(1, _("%s: trace file has changed since binary trace "
+                            "%s was made from it"),
+                       trace.tarmac_filename.c_str(),
+                       trace.binary_filename.c_str());
+}
+
+TarmacUtilityBase::ImageSpec &TarmacUtilityBase::current_image_spec()
+{
+    // Options describing an image apply to the most recent --image.
+    // If they come before any --image at all, they apply to the first
+    // one.
+    if (image_specs.empty())
+        image_specs.emplace_back();
+    return image_specs.back();
+}
+
+void TarmacUtilityBase::setupImages(const string &index_filename)
+{
+    bool got_endianness = bigend_explicit;
+
+    for (size_t i = 0; i < image_specs.size(); i++) {
+        const ImageSpec &spec = image_specs[i];
+        if (spec.filename.empty())
+            continue;
+
+        string cache_filename;
+        if (use_symbol_cache) {
+            cache_filename = symbol_cache_filename;
+            if (cache_filename.empty())
+                cache_filename = (index_filename.empty() ? spec.filename
+                                                         : index_filename) +
+                                 ".symcache";
+            if (i > 0)
+                cache_filename += "." + std::to_string(i);
+        }
+
+        ImageMapping mapping;
+        mapping.image = make_shared<Image>(spec.filename, cache_filename);
+        mapping.load_offset = spec.load_offset;
+        mapping.has_range = spec.has_range;
+        mapping.lo = spec.lo;
+        mapping.hi = spec.hi;
+
+        bool is_big_endian = mapping.image->is_big_endian();
+        if (got_endianness) {
             if (bigend != is_big_endian) {
                 reporter->warnx(_("Endianness mismatch between image and "
                                   "provided endianness"));
             }
         } else {
             bigend = is_big_endian;
+            got_endianness = true;
         }
+
+        if (!images)
+            images = make_shared<ImageSet>();
+        images->add(mapping);
     }
 }
 
@@ -159,39 +386,94 @@ void TarmacUtilityMT::add_options(Argparse &ap)
     auto add_pair = [this](const string &s) {
         TracePair pair;
         pair.tarmac_filename = s;
-        pair.index_on_disk = index_on_disk;
-        if (index_on_disk)
-            pair.index_filename = defaultIndexFilename(s);
         traces.push_back(pair);
     };
     ap.positional_multiple(_("TRACEFILE"), _("Tarmac trace files to read"),
                            add_pair);
 }
 
+void TarmacUtilityMT::postProcessOptions()
+{
+    for (TracePair &pair : traces)
+        useBinaryTrace(pair);
+
+    setupImages(traces.empty()
+                   ? ""
+                   : defaultIndexFilename(traces[0]));
+
+    // Fill in the index locations now, so that --memory-index applies
+    // to all the traces regardless of where it appeared on the command
+    // line. This comes after loading the images for the same reason as
+    // in TarmacUtility.
+    for (TracePair &pair : traces) {
+        pair.index_on_disk = index_on_disk;
+        if (index_on_disk) {
+            useIndexCache(pair);
+            if (pair.index_filename.empty())
+                pair.index_filename =
+                    defaultIndexFilename(pair);
+        } else {
+            pair.memory_index = make_shared<MemArena>();
+        }
+    }
+    if (!index_on_disk)
+        indexing = Troolean::Yes;
+}
+
+ParseParams TarmacUtilityBase::parse_params() const
+{
+    ParseParams pparams;
+    pparams.bigend = bigend;
+    if (thumbonly) {
+        pparams.iset_specified = true;
+        pparams.iset = THUMB;
+    }
+    return pparams;
+}
+
 void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
 {
     Troolean doIndexing = indexing; // so we can translate Auto into Yes or No
+    uint64_t index_timestamp;
 
     reporter->set_indexing_verbosity(verbose);
     reporter->set_indexing_progress(show_progress_meter);
 
+    // If the index is shared with other users, hold a lock while we
+    // check and perhaps rebuild it, so that two processes don't try to
+    // build the same one at once.
+    std::unique_ptr<FileLock> lock;
+    if (trace.index_on_disk && trace.index_shared)
+        lock = std::make_unique<FileLock>(trace.index_filename + ".lock");
+
     if (!trace.index_on_disk) {
         // If we're indexing to memory, there can never be an existing index
         doIndexing = Troolean::Yes;
         reporter->indexing_status(trace, IndexUpdateCheck::InMemory);
+    } else if (doIndexing == Troolean::Auto && keep_index &&
+               get_file_timestamp(trace.index_filename, &index_timestamp)) {
+        doIndexing = Troolean::No;
     } else if (doIndexing == Troolean::Auto) {
-        uint64_t trace_timestamp, index_timestamp;
         IndexUpdateCheck status;
+        TraceFingerprint indexed_fp, trace_fp;
+        int indexed_cpu;
 
-        if (!get_file_timestamp(trace.tarmac_filename, &trace_timestamp))
-            reporter->err(1, "%s: stat", trace.tarmac_filename.c_str());
+        // We decide whether the index is up to date by the contents of
+        // the trace file rather than its timestamp, so that copying a
+        // trace and its index elsewhere doesn't force a rebuild. The
+        // trace is only fingerprinted once there's an index header to
+        // compare it with, and hashed in full (for --strict) only if
+        // the cheaper sampled fingerprint matches.
+        auto fingerprint = [&](bool full) {
+            if (!trace_fingerprint(trace, full, trace_fp))
+                reporter->err(1, "%s: read", trace.tarmac_filename.c_str());
+        };
 
         if (!get_file_timestamp(trace.index_filename, &index_timestamp)) {
             status = IndexUpdateCheck::Missing;
-        } else if (index_timestamp < trace_timestamp) {
-            status = IndexUpdateCheck::TooOld;
         } else {
-            switch (check_index_header(trace.index_filename)) {
+            switch (check_index_header(trace.index_filename, &indexed_fp,
+                                       &indexed_cpu)) {
             case IndexHeaderState::WrongMagic:
                 status = IndexUpdateCheck::WrongFormat;
                 break;
@@ -199,7 +481,20 @@ void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
                 status = IndexUpdateCheck::Incomplete;
                 break;
             default:
-                status = IndexUpdateCheck::OK;
+                fingerprint(false);
+                if (indexed_fp.size == trace_fp.size &&
+                    indexed_fp.sampled_hash == trace_fp.sampled_hash &&
+                    strict_index_check)
+                    fingerprint(true);
+                if (indexed_fp.size != trace_fp.size ||
+                    indexed_fp.sampled_hash != trace_fp.sampled_hash ||
+                    (strict_index_check &&
+                     indexed_fp.full_hash != trace_fp.full_hash))
+                    status = IndexUpdateCheck::Changed;
+                else if (indexed_cpu != iparams.cpu)
+                    status = IndexUpdateCheck::WrongCPU;
+                else
+                    status = IndexUpdateCheck::OK;
                 break;
             }
         }
@@ -212,19 +507,40 @@ void TarmacUtilityBase::updateIndexIfNeeded(const TracePair &trace) const
     }
 
     if (doIndexing == Troolean::Yes) {
-        ParseParams pparams;
-        pparams.bigend = bigend;
-        if (thumbonly) {
-            pparams.iset_specified = true;
-            pparams.iset = THUMB;
+        ParseParams pparams = parse_params();
+        if (trace.index_shared) {
+            // Build the new index under a temporary name and then move
+            // it into place, so that another process still reading an
+            // old one isn't disturbed.
+            TracePair tmp = trace;
+            tmp.index_filename += ".tmp";
+            run_indexer(tmp, iparams, idiags, pparams);
+            if (!rename_file(tmp.index_filename, trace.index_filename))
+                reporter->err(1, "%s: rename", tmp.index_filename.c_str());
+        } else {
+            run_indexer(trace, iparams, idiags, pparams);
         }
-        run_indexer(trace, iparams, idiags, pparams);
+    }
+
+    if (show_stats) {
+        IndexReader reader(trace);
+        cout << format(_("Index statistics for {}:"), trace.tarmac_filename)
+             << "\n";
+        reader.stats().print(cout);
     }
 }
 
 void TarmacUtilityBase::setup_noexit()
 {
     postProcessOptions();
+
+    if (!progress_filename.empty()) {
+        progress_stream = std::make_unique<std::ofstream>(progress_filename);
+        if (progress_stream->fail())
+            reporter->err(1, "%s: open", progress_filename.c_str());
+        reporter->set_indexing_progress_stream(progress_stream.get());
+    }
+
     if (indexing != Troolean::No)
         setupIndex();
 }
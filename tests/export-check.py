@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+# Copyright 2024 Arm Limited. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# This file is part of Tarmac Trace Utilities
+
+# Read a file written by tarmac-export with pyarrow, to check that a
+# real Arrow implementation accepts it, and check its rows against the
+# trace file it was exported from. Exits with status 77 (which the
+# test suite treats as 'skipped') if pyarrow isn't installed.
+
+import sys
+import argparse
+
+SKIPPED = 77
+
+class CheckFailure(Exception):
+    pass
+
+def check(cond, msg):
+    if not cond:
+        raise CheckFailure(msg)
+
+def check_export(arrow_file, tarmac_file, batches, reg):
+    import pyarrow.ipc
+
+    reader = pyarrow.ipc.open_file(arrow_file)
+    check(reader.num_record_batches == batches,
+          "{} record batches, expected {}".format(
+              reader.num_record_batches, batches))
+    table = reader.read_all()
+    names = ["line", "lines", "byte_pos", "byte_len", "time", "pc",
+             "call_depth", reg, "symbol"]
+    check(table.schema.names == names,
+          "columns {}, expected {}".format(table.schema.names, names))
+
+    with open(tarmac_file, "rb") as f:
+        trace = f.read()
+
+    # Each row covers the trace lines of one event, in order, with
+    # nothing left out between them.
+    line, pos = 1, 0
+    for i, row in enumerate(table.to_pylist()):
+        where = "row {}".format(i)
+        check(row["time"] == i, where + ": time out of order")
+        check(row["line"] == line and row["byte_pos"] == pos,
+              where + ": doesn't follow on from the previous row")
+        text = trace[pos:pos + row["byte_len"]]
+        check(text.count(b"\n") == row["lines"],
+              where + ": line count doesn't match its bytes")
+        if row["pc"] is not None:
+            check(b"%x" % row["pc"] in text.lower(),
+                  where + ": pc doesn't appear in its trace lines")
+        line += row["lines"]
+        pos += row["byte_len"]
+    check(pos == len(trace), "rows don't cover the whole trace")
+
+    return table.num_rows
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Check a tarmac-export output file using pyarrow.")
+    parser.add_argument("arrow_file", help="Arrow file to check")
+    parser.add_argument("tarmac_file", help="Trace file it was exported from")
+    parser.add_argument("--batches", type=int, required=True,
+                        help="Expected number of record batches")
+    parser.add_argument("--reg", required=True,
+                        help="Register exported as the one extra column")
+    args = parser.parse_args()
+
+    try:
+        import pyarrow
+    except ImportError:
+        print("pyarrow is not installed; skipping")
+        return SKIPPED
+
+    try:
+        rows = check_export(args.arrow_file, args.tarmac_file,
+                            args.batches, args.reg)
+    except CheckFailure as e:
+        print("{}: {}".format(args.arrow_file, e), file=sys.stderr)
+        return 1
+    print("{}: {} rows ok".format(args.arrow_file, rows))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,138 @@
+# Synthetic ELF image with DWARF line information for the code in
+# quicksort.elf, used to test tarmac-profile --source-lines. The
+# instructions are placeholders of the same size as the AArch64 ones
+# in quicksort.tarmac; only the symbols and the line table matter,
+# and the line table maps them to samples/source/quicksort.c,
+# entry.S and semihosting.c by hand. To rebuild it on an x86-64 host:
+#
+#   as --gdwarf-5 -o quicksort-lines.o quicksort-lines.s
+#   ld -Ttext=0x8000 -e _start -o quicksort-lines.elf quicksort-lines.o
+
+        .file 0 "samples/source" "quicksort.c"
+        .file 1 "samples/source" "quicksort.c"
+        .file 2 "samples/source" "entry.S"
+        .file 3 "samples/source" "semihosting.c"
+        .text
+
+        .globl _start
+        .type _start, @function
+_start:
+        .loc 2 24
+        nopl 1(%rax)
+        .loc 2 25
+        nopl 1(%rax)
+        .loc 2 31
+        nopl 1(%rax)
+        .size _start, . - _start
+
+        .globl c_entry
+        .type c_entry, @function
+c_entry:
+        .loc 1 62
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 63
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 64
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 65
+        nopl 1(%rax)
+        .loc 1 66
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .size c_entry, . - c_entry
+
+        .globl quicksort
+        .type quicksort, @function
+quicksort:
+        .loc 1 31
+        nopl 1(%rax)
+        .loc 1 33
+        nopl 1(%rax)
+        .loc 1 31
+        nopl 1(%rax)
+        .loc 1 33
+        nopl 1(%rax)
+        .loc 1 59
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 31
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 41
+        nopl 1(%rax)
+        .loc 1 54
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 57
+        nopl 1(%rax)
+        .loc 1 58
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 37
+        nopl 1(%rax)
+        .loc 1 39
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 41
+        nopl 1(%rax)
+        .loc 1 49
+        nopl 1(%rax)
+        .loc 1 41
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 42
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 47
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 1 48
+        nopl 1(%rax)
+        .loc 1 47
+        nopl 1(%rax)
+        .loc 1 49
+        nopl 1(%rax)
+        .size quicksort, . - quicksort
+
+        .globl sys_exit
+        .type sys_exit, @function
+sys_exit:
+        .loc 3 86
+        nopl 1(%rax)
+        .loc 3 88
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 3 89
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 3 94
+        nopl 1(%rax)
+        .size sys_exit, . - sys_exit
+
+        .globl sys_write0
+        .type sys_write0, @function
+sys_write0:
+        .loc 3 216
+        nopl 1(%rax)
+        .loc 3 217
+        nopl 1(%rax)
+        nopl 1(%rax)
+        .loc 3 218
+        nopl 1(%rax)
+        .size sys_write0, . - sys_write0
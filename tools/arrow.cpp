@@ -0,0 +1,452 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "arrow.hh"
+
+#include "libtarmac/reporter.hh"
+
+#include <algorithm>
+#include <memory>
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace {
+
+/*
+ * Arrow stores its metadata as FlatBuffers. Rather than depend on the
+ * FlatBuffers library, we build the few tables we need as a tree of
+ * FbNode objects, and serialise it front to back: each table is
+ * preceded by its vtable, and followed by the objects it refers to,
+ * so that every offset points forwards as the format requires.
+ */
+
+class FbBuffer {
+  public:
+    vector<uint8_t> data;
+
+    void align(size_t a)
+    {
+        while (data.size() % a)
+            data.push_back(0);
+    }
+
+    size_t put(uint64_t value, unsigned size)
+    {
+        align(size);
+        size_t pos = data.size();
+        for (unsigned i = 0; i < size; i++)
+            data.push_back(value >> (8 * i));
+        return pos;
+    }
+
+    void patch(size_t pos, uint64_t value, unsigned size)
+    {
+        for (unsigned i = 0; i < size; i++)
+            data[pos + i] = value >> (8 * i);
+    }
+
+    // Fill in a uoffset at 'pos' to point to 'target'.
+    void link(size_t pos, size_t target) { patch(pos, target - pos, 4); }
+};
+
+struct FbNode {
+    virtual ~FbNode() = default;
+    virtual size_t write(FbBuffer &fb) const = 0; // returns its position
+};
+using FbRef = shared_ptr<FbNode>;
+
+class FbTable : public FbNode {
+    struct Slot {
+        unsigned id, size;
+        uint64_t value;
+        FbRef child;
+    };
+    vector<Slot> slots;
+
+  public:
+    FbTable *scalar(unsigned id, unsigned size, uint64_t value)
+    {
+        slots.push_back({id, size, value, nullptr});
+        return this;
+    }
+
+    FbTable *child(unsigned id, FbRef child)
+    {
+        slots.push_back({id, 4, 0, child});
+        return this;
+    }
+
+    size_t write(FbBuffer &fb) const override
+    {
+        unsigned nids = 0;
+        for (const Slot &slot : slots)
+            nids = std::max(nids, slot.id + 1);
+
+        fb.align(2);
+        size_t vtable = fb.data.size();
+        fb.data.resize(vtable + 4 + 2 * nids, 0);
+
+        size_t table = fb.put(0, 4);
+        fb.patch(table, table - vtable, 4);
+
+        // Lay out the fields largest first, to waste less padding.
+        vector<const Slot *> order;
+        for (const Slot &slot : slots)
+            order.push_back(&slot);
+        std::stable_sort(order.begin(), order.end(),
+                         [](const Slot *a, const Slot *b) {
+                             return a->size > b->size;
+                         });
+        vector<size_t> field_pos(slots.size());
+        for (const Slot *slot : order) {
+            size_t pos = fb.put(slot->value, slot->size);
+            field_pos[slot - slots.data()] = pos;
+            fb.patch(vtable + 4 + 2 * slot->id, pos - table, 2);
+        }
+        fb.patch(vtable, 4 + 2 * nids, 2);
+        fb.patch(vtable + 2, fb.data.size() - table, 2);
+
+        for (size_t i = 0; i < slots.size(); i++)
+            if (slots[i].child)
+                fb.link(field_pos[i], slots[i].child->write(fb));
+        return table;
+    }
+};
+
+class FbString : public FbNode {
+    string s;
+
+  public:
+    FbString(const string &s) : s(s) {}
+
+    size_t write(FbBuffer &fb) const override
+    {
+        size_t pos = fb.put(s.size(), 4);
+        fb.data.insert(fb.data.end(), s.begin(), s.end());
+        fb.data.push_back(0);
+        return pos;
+    }
+};
+
+// Vector of structs, all of whose members are 64-bit integers.
+class FbStructVector : public FbNode {
+    vector<uint64_t> words;
+    size_t count = 0;
+
+  public:
+    void add(std::initializer_list<uint64_t> members)
+    {
+        words.insert(words.end(), members);
+        count++;
+    }
+
+    size_t write(FbBuffer &fb) const override
+    {
+        // The elements, not the length word, must be 8-byte aligned.
+        while (fb.data.size() % 8 != 4)
+            fb.data.push_back(0);
+        size_t pos = fb.put(count, 4);
+        for (uint64_t word : words)
+            fb.put(word, 8);
+        return pos;
+    }
+};
+
+class FbTableVector : public FbNode {
+    vector<FbRef> elements;
+
+  public:
+    void add(FbRef element) { elements.push_back(element); }
+
+    size_t write(FbBuffer &fb) const override
+    {
+        size_t pos = fb.put(elements.size(), 4);
+        size_t first = fb.data.size();
+        fb.data.resize(first + 4 * elements.size(), 0);
+        for (size_t i = 0; i < elements.size(); i++)
+            fb.link(first + 4 * i, elements[i]->write(fb));
+        return pos;
+    }
+};
+
+vector<uint8_t> serialise(const FbNode &root)
+{
+    FbBuffer fb;
+    fb.put(0, 4);
+    fb.link(0, root.write(fb));
+    fb.align(8);
+    return fb.data;
+}
+
+shared_ptr<FbTable> table() { return make_shared<FbTable>(); }
+
+// Values from the Arrow schema definitions (Schema.fbs, Message.fbs
+// and File.fbs in the Arrow source).
+const uint64_t METADATA_V5 = 4;
+const uint64_t TYPE_INT = 2, TYPE_UTF8 = 5;
+const uint64_t HEADER_SCHEMA = 1, HEADER_DICTIONARY_BATCH = 2,
+               HEADER_RECORD_BATCH = 3;
+
+const char MAGIC[] = "ARROW1";
+
+shared_ptr<FbTable> make_int_type(unsigned bits, bool is_signed)
+{
+    auto t = table();
+    t->scalar(0, 4, bits)->scalar(1, 1, is_signed);
+    return t;
+}
+
+FbRef make_schema(const vector<Arrow::Field> &fields)
+{
+    auto fieldvec = make_shared<FbTableVector>();
+    int64_t dictionary_id = 0;
+    for (const Arrow::Field &f : fields) {
+        auto field = table();
+        field->child(0, make_shared<FbString>(f.name));
+        field->scalar(1, 1, f.nullable);
+        switch (f.type) {
+        case Arrow::Type::UInt32:
+        case Arrow::Type::UInt64:
+            field->scalar(2, 1, TYPE_INT);
+            field->child(3, make_int_type(
+                                f.type == Arrow::Type::UInt32 ? 32 : 64,
+                                false));
+            break;
+        case Arrow::Type::DictionaryString: {
+            field->scalar(2, 1, TYPE_UTF8);
+            field->child(3, table());
+            auto dict = table();
+            dict->scalar(0, 8, dictionary_id++);
+            dict->child(1, make_int_type(32, true));
+            field->child(4, dict);
+            break;
+        }
+        }
+        field->child(5, make_shared<FbTableVector>());
+        fieldvec->add(field);
+    }
+
+    auto schema = table();
+    schema->scalar(0, 2, 0); // little-endian
+    schema->child(1, fieldvec);
+    return schema;
+}
+
+FbRef make_message(uint64_t header_type, FbRef header, uint64_t body_length)
+{
+    auto message = table();
+    message->scalar(0, 2, METADATA_V5);
+    message->scalar(1, 1, header_type);
+    message->child(2, header);
+    message->scalar(3, 8, body_length);
+    return message;
+}
+
+// Describe a sequence of buffers laid out one after another, each
+// padded to a multiple of 8 bytes, as a message body.
+struct BodyLayout {
+    shared_ptr<FbStructVector> buffers = make_shared<FbStructVector>();
+    uint64_t length = 0;
+
+    void add(const vector<uint8_t> &buf)
+    {
+        buffers->add({length, buf.size()});
+        length += (buf.size() + 7) & ~(uint64_t)7;
+    }
+};
+
+} // namespace
+
+namespace Arrow {
+
+void Column::push(uint64_t value)
+{
+    for (unsigned i = 0; i < width; i++)
+        values.push_back(value >> (8 * i));
+    if (!validity.empty()) {
+        if (rows % 8 == 0)
+            validity.push_back(0);
+        validity[rows / 8] |= 1 << (rows % 8);
+    }
+    rows++;
+}
+
+void Column::push_null()
+{
+    if (validity.empty()) {
+        // First null in the column: everything so far was valid.
+        validity.assign((rows + 8) / 8, 0);
+        for (uint64_t i = 0; i < rows; i++)
+            validity[i / 8] |= 1 << (i % 8);
+    } else if (rows % 8 == 0) {
+        validity.push_back(0);
+    }
+    values.insert(values.end(), width, 0);
+    null_count++;
+    rows++;
+}
+
+FileWriter::FileWriter(const string &filename, const vector<Field> &fields)
+    : filename(filename), ofs(filename, std::ios::binary), fields(fields),
+      dictionaries(fields.size())
+{
+    if (!ofs)
+        reporter->err(1, "%s: open", filename.c_str());
+    write(MAGIC, 6);
+    pad(2);
+    write_message(serialise(*make_message(HEADER_SCHEMA, make_schema(fields),
+                                          0)),
+                  {});
+}
+
+void FileWriter::write(const void *data, size_t len)
+{
+    if (!ofs.write((const char *)data, len))
+        reporter->err(1, "%s: write", filename.c_str());
+    pos += len;
+}
+
+void FileWriter::pad(size_t len)
+{
+    static const char zeroes[8] = {};
+    write(zeroes, len);
+}
+
+FileWriter::Block
+FileWriter::write_message(const vector<uint8_t> &metadata,
+                          const vector<const vector<uint8_t> *> &body)
+{
+    Block block;
+    block.offset = pos;
+    block.metadata_length = 8 + metadata.size();
+    block.body_length = 0;
+
+    uint8_t prefix[8] = {0xff, 0xff, 0xff, 0xff};
+    for (unsigned i = 0; i < 4; i++)
+        prefix[4 + i] = metadata.size() >> (8 * i);
+    write(prefix, 8);
+    write(metadata.data(), metadata.size());
+
+    for (const vector<uint8_t> *buf : body) {
+        write(buf->data(), buf->size());
+        size_t padding = -buf->size() & 7;
+        pad(padding);
+        block.body_length += buf->size() + padding;
+    }
+    return block;
+}
+
+void FileWriter::write_batch(const Batch &batch)
+{
+    auto nodes = make_shared<FbStructVector>();
+    BodyLayout layout;
+    vector<const vector<uint8_t> *> body;
+    for (const Column &col : batch.columns) {
+        nodes->add({batch.rows, col.null_count});
+        layout.add(col.validity);
+        layout.add(col.values);
+        body.push_back(&col.validity);
+        body.push_back(&col.values);
+    }
+
+    auto rb = table();
+    rb->scalar(0, 8, batch.rows);
+    rb->child(1, nodes);
+    rb->child(2, layout.buffers);
+    batch_blocks.push_back(write_message(
+        serialise(*make_message(HEADER_RECORD_BATCH, rb, layout.length)),
+        body));
+}
+
+void FileWriter::set_dictionary(unsigned field, vector<string> values)
+{
+    dictionaries[field] = std::move(values);
+}
+
+void FileWriter::close()
+{
+    int64_t dictionary_id = 0;
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].type != Type::DictionaryString)
+            continue;
+
+        const vector<string> &values = dictionaries[i];
+        vector<uint8_t> validity, offsets, data;
+        uint32_t offset = 0;
+        for (size_t j = 0; j <= values.size(); j++) {
+            for (unsigned k = 0; k < 4; k++)
+                offsets.push_back(offset >> (8 * k));
+            if (j < values.size()) {
+                data.insert(data.end(), values[j].begin(), values[j].end());
+                offset += values[j].size();
+            }
+        }
+
+        auto nodes = make_shared<FbStructVector>();
+        nodes->add({values.size(), 0});
+        BodyLayout layout;
+        layout.add(validity);
+        layout.add(offsets);
+        layout.add(data);
+
+        auto rb = table();
+        rb->scalar(0, 8, values.size());
+        rb->child(1, nodes);
+        rb->child(2, layout.buffers);
+        auto db = table();
+        db->scalar(0, 8, dictionary_id++);
+        db->child(1, rb);
+        dictionary_blocks.push_back(write_message(
+            serialise(
+                *make_message(HEADER_DICTIONARY_BATCH, db, layout.length)),
+            {&validity, &offsets, &data}));
+    }
+
+    auto blocks = [](const vector<Block> &bs) {
+        auto vec = make_shared<FbStructVector>();
+        for (const Block &b : bs)
+            vec->add({b.offset, b.metadata_length, b.body_length});
+        return vec;
+    };
+    auto footer = table();
+    footer->scalar(0, 2, METADATA_V5);
+    footer->child(1, make_schema(fields));
+    footer->child(2, blocks(dictionary_blocks));
+    footer->child(3, blocks(batch_blocks));
+    vector<uint8_t> fbytes = serialise(*footer);
+
+    // An end-of-stream marker, for readers that treat the file as a
+    // stream, then the footer, its length and the magic number again.
+    static const uint8_t eos[8] = {0xff, 0xff, 0xff, 0xff};
+    write(eos, 8);
+    write(fbytes.data(), fbytes.size());
+    uint8_t len[4];
+    for (unsigned i = 0; i < 4; i++)
+        len[i] = fbytes.size() >> (8 * i);
+    write(len, 4);
+    write(MAGIC, 6);
+
+    ofs.close();
+    if (!ofs)
+        reporter->err(1, "%s: write", filename.c_str());
+}
+
+} // namespace Arrow
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Minimal writer for the Apache Arrow IPC file format ("Feather
+ * version 2"), which dataframe libraries can load directly. Only the
+ * column types needed by tarmac-export are supported: unsigned
+ * integers, and strings stored as a dictionary of distinct values
+ * referred to by index.
+ */
+
+#ifndef TARMAC_ARROW_HH
+#define TARMAC_ARROW_HH
+
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace Arrow {
+
+enum class Type { UInt32, UInt64, DictionaryString };
+
+struct Field {
+    std::string name;
+    Type type;
+    bool nullable;
+};
+
+// The contents of one column of a record batch. For a
+// DictionaryString column, the values are indices into the
+// dictionary set by FileWriter::set_dictionary.
+class Column {
+    unsigned width;
+    uint64_t rows = 0;
+
+  public:
+    std::vector<uint8_t> values;
+    std::vector<uint8_t> validity; // empty if there are no nulls
+    uint64_t null_count = 0;
+
+    Column(Type type) : width(type == Type::UInt64 ? 8 : 4) {}
+
+    void push(uint64_t value);
+    void push_null();
+};
+
+struct Batch {
+    uint64_t rows = 0;
+    std::vector<Column> columns;
+};
+
+class FileWriter {
+    struct Block {
+        uint64_t offset, body_length;
+        uint32_t metadata_length;
+    };
+
+    std::string filename;
+    std::ofstream ofs;
+    uint64_t pos = 0;
+    std::vector<Field> fields;
+    std::vector<std::vector<std::string>> dictionaries;
+    std::vector<Block> dictionary_blocks, batch_blocks;
+
+    void write(const void *data, size_t len);
+    void pad(size_t len);
+    Block write_message(const std::vector<uint8_t> &metadata,
+                        const std::vector<const std::vector<uint8_t> *> &body);
+
+  public:
+    // Opens the file and writes the schema.
+    FileWriter(const std::string &filename, const std::vector<Field> &fields);
+
+    // Writes a record batch, which must have one column for each field.
+    void write_batch(const Batch &batch);
+
+    // Sets the values that indices in a DictionaryString column refer
+    // to. Since the dictionary is written at the end, it can be built
+    // up while the record batches are being written.
+    void set_dictionary(unsigned field, std::vector<std::string> values);
+
+    // Writes the dictionaries and the file footer, and closes the file.
+    void close();
+};
+
+} // namespace Arrow
+
+#endif // TARMAC_ARROW_HH
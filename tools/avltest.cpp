@@ -20,6 +20,8 @@
 #include "libtarmac/disktree.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
+#include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <map>
@@ -51,28 +53,50 @@ struct TestPayload {
 enum class Test {
     Single,
     Clone,
+    JoinSplit,
+    Remove,
 };
 map<string, Test> testnames = {
     {"single", Test::Single},
     {"clone", Test::Clone},
+    {"joinsplit", Test::JoinSplit},
+    {"remove", Test::Remove},
+};
+
+// Keyfinder for AVLDisk::split, putting every value less than 'limit'
+// on the left.
+struct SplitBefore {
+    int limit;
+    SplitBefore(int limit) : limit(limit) {}
+    int cmp(const TestPayload &rhs) const
+    {
+        return limit > rhs.value ? +1 : -1;
+    }
 };
 
 class AVLTest {
     MemArena arena;
     using Tree = AVLDisk<TestPayload>;
     Tree tree;
+    Tree hwmtree; // in the non-refcounting mode, for join and split
     bool verbose;
 
     void dump(OFF_T root);
     void check(vector<OFF_T> roots);
+    int check_balance(OFF_T root, vector<int> &contents);
+    void check_contents(OFF_T root, int lo, int hi);
+    OFF_T make_range(int lo, int hi);
 
   public:
     AVLTest(bool verbose);
     void test_single();
     void test_clone();
+    void test_joinsplit();
+    void test_remove();
 };
 
-AVLTest::AVLTest(bool verbose) : arena(), tree(arena, true), verbose(verbose)
+AVLTest::AVLTest(bool verbose)
+    : arena(), tree(arena, true), hwmtree(arena), verbose(verbose)
 {
     arena.alloc(16);           // so that no node pointer ends up at 0
 }
@@ -153,6 +177,128 @@ void AVLTest::test_clone()
     }
 }
 
+OFF_T AVLTest::make_range(int lo, int hi)
+{
+    OFF_T root = 0;
+    for (int i = lo; i < hi; i++)
+        root = hwmtree.insert(root, i);
+    hwmtree.commit();
+    return root;
+}
+
+void AVLTest::test_joinsplit()
+{
+    // Join trees of every combination of sizes, including very
+    // different heights, and check that the trees we started with are
+    // unchanged afterwards.
+    for (int nl = 0; nl <= 40; nl += 3) {
+        for (int nr = 0; nr <= 300; nr += nr < 20 ? 1 : 37) {
+            int end = nl + 1 + nr;
+            OFF_T left = make_range(0, nl), right = make_range(nl + 1, end);
+            OFF_T after = make_range(end, end + nl);
+            if (verbose)
+                cout << "joining " << nl << " and " << nr << endl;
+            OFF_T joined3 = hwmtree.join(left, nl, right);
+            OFF_T joined2 = hwmtree.join(right, after);
+            hwmtree.commit();
+            check_contents(joined3, 0, end);
+            check_contents(joined2, nl + 1, end + nl);
+            check_contents(left, 0, nl);
+            check_contents(right, nl + 1, nl + 1 + nr);
+        }
+    }
+
+    // Split a tree at every possible point, and join the halves back
+    // together again.
+    int n = 100;
+    OFF_T root = make_range(0, n);
+    for (int i = -1; i <= n + 1; i++) {
+        if (verbose)
+            cout << "splitting before " << i << endl;
+        OFF_T left, right;
+        hwmtree.split(root, SplitBefore(i), &left, &right);
+        hwmtree.commit();
+        int mid = std::max(0, std::min(i, n));
+        check_contents(left, 0, mid);
+        check_contents(right, mid, n);
+        check_contents(hwmtree.join(left, right), 0, n);
+        hwmtree.commit();
+        check_contents(root, 0, n);
+    }
+}
+
+void AVLTest::test_remove()
+{
+    // Remove every element in a scrambled order from trees in the
+    // non-refcounting mode, both committed (so that removal clones
+    // nodes) and not (so that it modifies them in place), and check
+    // that the tree stays balanced all the way down.
+    int p = 1009;
+    for (bool commit : {false, true}) {
+        OFF_T root = 0;
+        set<int> remaining;
+        for (int i = 1; i < p; i++) {
+            root = hwmtree.insert(root, i);
+            remaining.insert(i);
+        }
+        if (commit)
+            hwmtree.commit();
+
+        for (int i = 1; i < p; i++) {
+            int j = (i * 456) % p;
+            if (verbose)
+                cout << "removing " << j << endl;
+            bool found;
+            TestPayload removed;
+            root = hwmtree.remove(root, TestPayload(j), &found, &removed);
+            assert(found);
+            assert(removed.value == j);
+            remaining.erase(j);
+
+            vector<int> contents;
+            check_balance(root, contents);
+            if (contents != vector<int>(remaining.begin(), remaining.end())) {
+                cout << "tree at " << root << " has wrong contents after "
+                     << "removing " << j << endl;
+                exit(1);
+            }
+        }
+    }
+}
+
+// Check a subtree's heights and balance, returning its height, and
+// append its contents in order to 'contents'.
+int AVLTest::check_balance(OFF_T root, vector<int> &contents)
+{
+    if (!root)
+        return 0;
+    Tree::disknode &dn = *hwmtree.arena.getptr<Tree::disknode>(root);
+    int lh = check_balance(dn.lc, contents);
+    contents.push_back(dn.payload.value);
+    int rh = check_balance(dn.rc, contents);
+    int height = std::max(lh, rh) + 1;
+    if (std::abs(lh - rh) > 1 || dn.height != height) {
+        cout << "node at " << root << " has height " << dn.height
+             << " but subtree heights " << lh << " and " << rh << endl;
+        exit(1);
+    }
+    return height;
+}
+
+// Check that a tree is balanced and contains exactly [lo,hi).
+void AVLTest::check_contents(OFF_T root, int lo, int hi)
+{
+    vector<int> contents, expected;
+    check_balance(root, contents);
+    for (int i = lo; i < hi; i++)
+        expected.push_back(i);
+    if (contents != expected) {
+        cout << "tree at " << root << " should contain [" << lo << "," << hi
+             << "), but has " << contents.size() << " elements" << endl;
+        exit(1);
+    }
+}
+
 void AVLTest::dump(OFF_T root)
 {
     if (!verbose)
@@ -242,6 +388,10 @@ int main(int argc, char **argv)
         t.test_single();
     if (tests_to_run.count(Test::Clone))
         t.test_clone();
+    if (tests_to_run.count(Test::JoinSplit))
+        t.test_joinsplit();
+    if (tests_to_run.count(Test::Remove))
+        t.test_remove();
 
     return 0;
 }
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Convert a text trace file into a binary trace (see binarytrace.hh),
+ * which the other tools can then be given in place of the text, to
+ * index it without parsing it all again.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/binarytrace.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+using std::cout;
+using std::string;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct BinaryUtility : TarmacUtility {
+    string output_filename;
+
+    BinaryUtility()
+    {
+        cannot_use_image();
+        does_not_index();
+    }
+
+    void add_options(Argparse &ap) override
+    {
+        ap.optval({"-o", "--output"}, _("OUTFILE"),
+                  _("binary trace file to write (default: "
+                    "tarmac_filename.bin)"),
+                  [this](const string &s) { output_filename = s; });
+
+        TarmacUtility::add_options(ap);
+    }
+
+    void postProcessOptions() override
+    {
+        if (is_binary_trace(trace.tarmac_filename))
+            reporter->errx(1, _("%s: already a binary trace"),
+                           trace.tarmac_filename.c_str());
+        // Every CPU's events go into the binary trace, and --cpu
+        // applies when it's indexed.
+        if (iparams.cpu >= 0)
+            reporter->warnx(_("Ignoring --cpu, since a binary trace keeps "
+                              "the events of every CPU"));
+        if (output_filename.empty())
+            output_filename = trace.tarmac_filename + ".bin";
+    }
+
+    int run()
+    {
+        reporter->set_indexing_progress(show_progress_meter);
+        write_binary_trace(trace.tarmac_filename, output_filename,
+                           parse_params());
+
+        if (is_verbose())
+            cout << format(_("Wrote binary trace {}\n"), output_filename);
+
+        return 0;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    BinaryUtility bu;
+
+    Argparse ap("tarmac-binary", argc, argv);
+    bu.add_options(ap);
+    ap.parse();
+    bu.setup();
+
+    return bu.run();
+}
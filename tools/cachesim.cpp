@@ -0,0 +1,344 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Estimate cache hit rates for a program, by replaying the instruction
+ * fetches and memory accesses in a trace through a model of one or
+ * more cache hierarchies.
+ *
+ * Each hierarchy has an optional L1 instruction cache, an optional L1
+ * data cache and an optional unified L2. Every cache is
+ * set-associative with LRU replacement, write-back and
+ * write-allocate. L2 sees the misses and write-backs of the L1 caches
+ * (or every access, for a kind of access with no L1), and the levels
+ * are neither inclusive nor exclusive of each other.
+ *
+ * The trace is parsed in chunks by separate threads, each producing a
+ * compact list of accesses, and the lists are replayed in trace order
+ * through all the hierarchies at once.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include "tracechunks.hh"
+
+#include <algorithm>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cout;
+using std::ostream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+enum class AccessKind : uint8_t { Fetch, Read, Write };
+
+struct Access {
+    Addr addr;
+    uint32_t size;
+    AccessKind kind;
+};
+
+class AccessRecorder : public ParseReceiver {
+  public:
+    vector<Access> accesses;
+
+    void got_event(InstructionEvent &ev) override
+    {
+        if (ev.effect == IE_FETCHFAIL)
+            return;
+        accesses.push_back(
+            {ev.pc, std::max(uint32_t(ev.width / 8), 1U), AccessKind::Fetch});
+    }
+
+    void got_event(MemoryEvent &ev) override
+    {
+        accesses.push_back(
+            {ev.addr, std::max(uint32_t(ev.size), 1U),
+             ev.read ? AccessKind::Read : AccessKind::Write});
+    }
+
+    bool wants_highlights() const override { return false; }
+};
+
+struct CacheGeometry {
+    uint64_t size, ways, line;
+};
+
+class Cache {
+    struct Way {
+        uint64_t tag;
+        bool valid, dirty;
+    };
+
+    CacheGeometry geom;
+    uint64_t nsets;
+    // Each set is 'ways' consecutive entries, most recently used first.
+    vector<Way> ways;
+
+  public:
+    uint64_t reads = 0, writes = 0, read_misses = 0, write_misses = 0;
+    uint64_t writebacks = 0;
+
+    Cache(const CacheGeometry &geom)
+        : geom(geom), nsets(geom.size / (geom.ways * geom.line)),
+          ways(nsets * geom.ways, Way{0, false, false})
+    {
+    }
+
+    uint64_t line_size() const { return geom.line; }
+
+    // Access the line containing addr. Returns true on a hit. On a
+    // miss, if a dirty line had to be evicted, sets *evicted to its
+    // address.
+    bool access(Addr addr, bool write, bool *evicted_dirty, Addr *evicted)
+    {
+        uint64_t lineno = addr / geom.line;
+        Way *set = &ways[(lineno % nsets) * geom.ways];
+        Way *end = set + geom.ways;
+        *evicted_dirty = false;
+
+        (write ? writes : reads)++;
+
+        Way *found = std::find_if(set, end, [lineno](const Way &w) {
+            return w.valid && w.tag == lineno;
+        });
+        bool hit = found != end;
+        if (!hit) {
+            (write ? write_misses : read_misses)++;
+            found = end - 1; // the least recently used way
+            if (found->valid && found->dirty) {
+                writebacks++;
+                *evicted_dirty = true;
+                *evicted = found->tag * geom.line;
+            }
+            *found = Way{lineno, true, false};
+        }
+        if (write)
+            found->dirty = true;
+        std::rotate(set, found, found + 1);
+        return hit;
+    }
+};
+
+class Hierarchy {
+    unique_ptr<Cache> l1i, l1d, l2;
+
+    void access_l2(Addr addr, bool write)
+    {
+        bool evicted_dirty;
+        Addr evicted;
+        if (l2)
+            l2->access(addr, write, &evicted_dirty, &evicted);
+    }
+
+    void access_line(Addr addr, AccessKind kind)
+    {
+        bool write = kind == AccessKind::Write;
+        Cache *l1 = kind == AccessKind::Fetch ? l1i.get() : l1d.get();
+        if (!l1) {
+            access_l2(addr, write);
+            return;
+        }
+
+        bool evicted_dirty;
+        Addr evicted;
+        if (!l1->access(addr, write, &evicted_dirty, &evicted)) {
+            if (evicted_dirty)
+                access_l2(evicted, true);
+            // A write miss still has to fetch the rest of the line.
+            access_l2(addr, false);
+        }
+    }
+
+    uint64_t min_line_size() const
+    {
+        uint64_t line = UINT64_MAX;
+        for (const Cache *c : {l1i.get(), l1d.get(), l2.get()})
+            if (c)
+                line = std::min(line, c->line_size());
+        return line;
+    }
+
+  public:
+    string spec;
+
+    Hierarchy(const string &spec);
+
+    void replay(const vector<Access> &accesses)
+    {
+        uint64_t line = min_line_size();
+        for (const Access &a : accesses) {
+            // Split accesses that cross a line boundary of the
+            // smallest lines in the hierarchy. Larger lines just see
+            // the same line accessed twice, which is a hit.
+            Addr first = a.addr / line, last = (a.addr + a.size - 1) / line;
+            for (Addr l = first; l <= last; l++)
+                access_line(l == first ? a.addr : l * line, a.kind);
+        }
+    }
+
+    void print_results(ostream &os) const
+    {
+        os << spec << "\n";
+        auto print = [&os](const char *name, const Cache *c) {
+            if (!c)
+                return;
+            uint64_t accesses = c->reads + c->writes;
+            uint64_t misses = c->read_misses + c->write_misses;
+            std::ostringstream rate;
+            rate << std::fixed << std::setprecision(2)
+                 << (accesses ? 100.0 * misses / accesses : 0.0);
+            os << format(_("  {}: {} accesses ({} reads, {} writes), "
+                           "{} misses ({}%), {} writebacks\n"),
+                         name, accesses, c->reads, c->writes, misses,
+                         rate.str(), c->writebacks);
+        };
+        print("L1I", l1i.get());
+        print("L1D", l1d.get());
+        print("L2", l2.get());
+    }
+};
+
+// A hierarchy is written as a comma-separated list of caches, each
+// in the form LEVEL=SIZE/WAYS/LINE, e.g. "l1d=32K/4/64,l2=1M/16/64".
+Hierarchy::Hierarchy(const string &spec) : spec(spec)
+{
+    std::istringstream iss(spec);
+    string item;
+    while (std::getline(iss, item, ',')) {
+        size_t eq = item.find('=');
+        size_t slash1 = item.find('/', eq);
+        size_t slash2 = slash1 == string::npos ? slash1
+                                               : item.find('/', slash1 + 1);
+        if (eq == string::npos || slash2 == string::npos)
+            throw ArgparseError(format(
+                _("'{}': expected a cache in the form LEVEL=SIZE/WAYS/LINE"),
+                item));
+
+        string level = item.substr(0, eq);
+        CacheGeometry geom;
+        geom.size = parse_size(item.substr(eq + 1, slash1 - eq - 1), 1);
+        geom.ways =
+            parse_unsigned(item.substr(slash1 + 1, slash2 - slash1 - 1), 1);
+        geom.line = parse_size(item.substr(slash2 + 1), 1);
+        if (geom.size % (geom.ways * geom.line))
+            throw ArgparseError(format(
+                _("'{}': cache size must be a multiple of ways times line "
+                  "size"),
+                item));
+
+        unique_ptr<Cache> *slot;
+        if (level == "l1i")
+            slot = &l1i;
+        else if (level == "l1d")
+            slot = &l1d;
+        else if (level == "l2")
+            slot = &l2;
+        else
+            throw ArgparseError(
+                format(_("'{}': unknown cache level (expected l1i, l1d or "
+                         "l2)"),
+                       level));
+        if (*slot)
+            throw ArgparseError(
+                format(_("'{}': cache level given more than once"), level));
+        slot->reset(new Cache(geom));
+    }
+    if (!l1i && !l1d && !l2)
+        throw ArgparseError(format(_("'{}': no caches specified"), spec));
+}
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    vector<unique_ptr<Hierarchy>> hierarchies;
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+
+    Argparse ap("tarmac-cachesim", argc, argv);
+    TarmacUtility tu;
+    tu.cannot_use_image();
+    tu.add_options(ap);
+
+    ap.optval({"-c", "--config"}, _("CACHES"),
+              _("cache hierarchy to simulate, as a comma-separated list of "
+                "LEVEL=SIZE/WAYS/LINE, where LEVEL is l1i, l1d or l2 "
+                "(can be repeated; default: "
+                "l1i=32K/4/64,l1d=32K/4/64,l2=512K/8/64)"),
+              [&](const string &s) {
+                  hierarchies.emplace_back(new Hierarchy(s));
+              });
+    ap.optval({"--threads"}, _("N"),
+              _("number of threads to parse the trace with (default: one "
+                "per processor)"),
+              [&](const string &s) {
+                  threads = parse_unsigned(s, 1, UINT_MAX);
+              });
+
+    ap.parse();
+    tu.setup();
+
+    if (hierarchies.empty())
+        hierarchies.emplace_back(
+            new Hierarchy("l1i=32K/4/64,l1d=32K/4/64,l2=512K/8/64"));
+
+    IndexNavigator IN(tu.trace);
+    for_each_chunk_in_order<vector<Access>>(
+        split_trace(IN, 65536), threads,
+        [&IN](const TraceChunk &chunk) {
+            AccessRecorder recorder;
+            parse_chunk(IN, chunk, recorder);
+            return std::move(recorder.accesses);
+        },
+        [&](const vector<Access> &accesses) {
+            // The hierarchies are independent of each other, so each
+            // can replay the chunk on its own thread.
+            if (threads < 2 || hierarchies.size() < 2) {
+                for (auto &h : hierarchies)
+                    h->replay(accesses);
+                return;
+            }
+            vector<std::future<void>> replays;
+            for (auto &h : hierarchies)
+                replays.push_back(std::async(
+                    std::launch::async,
+                    [&h, &accesses]() { h->replay(accesses); }));
+            for (auto &f : replays)
+                f.get();
+        });
+
+    for (auto &h : hierarchies)
+        h->print_results(cout);
+
+    return 0;
+}
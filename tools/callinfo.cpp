@@ -55,7 +55,7 @@ int main(int argc, char **argv)
     });
     tu.setup();
 
-    CallInfo CI(tu.trace, tu.image_filename, tu.load_offset);
+    CallInfo CI(tu.trace, tu.images);
     CI.run(functions);
 
     return 0;
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Benchmark for the startup cost of loading an ELF image: construct
+ * an Image from each file given on the command line, and report how
+ * many symbols it found and how long it took. Optionally, first write
+ * out a synthetic ELF file with a large symbol table, to simulate
+ * loading something the size of a Linux vmlinux.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/image.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/reporter.hh"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+static void put_le(vector<uint8_t> &out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        out.push_back(value >> (8 * i));
+}
+
+// Write a little-endian ELF64 file containing nothing but a symbol
+// table with 'nsyms' sized function symbols, plus its string table.
+static void write_synthetic_elf(const string &filename, unsigned nsyms)
+{
+    vector<uint8_t> strtab{0}, symtab(24, 0); // both start with a null entry
+    for (unsigned i = 0; i < nsyms; i++) {
+        uint64_t name = strtab.size();
+        string symname = "synthetic_function_" + std::to_string(i);
+        strtab.insert(strtab.end(), symname.begin(), symname.end());
+        strtab.push_back(0);
+
+        put_le(symtab, name, 4);
+        put_le(symtab, (1 << 4) | 2, 1); // STB_GLOBAL, STT_FUNC
+        put_le(symtab, 0, 1);
+        put_le(symtab, 1, 2);
+        put_le(symtab, 0x80000 + 0x40 * (uint64_t)i, 8);
+        put_le(symtab, 0x40, 8);
+    }
+
+    static const char shstrtab_data[] = "\0.symtab\0.strtab\0.shstrtab";
+    vector<uint8_t> shstrtab(shstrtab_data,
+                             shstrtab_data + sizeof(shstrtab_data));
+
+    constexpr uint64_t ehsize = 64, shentsize = 64, shnum = 4;
+    uint64_t symtab_off = ehsize;
+    uint64_t strtab_off = symtab_off + symtab.size();
+    uint64_t shstrtab_off = strtab_off + strtab.size();
+    uint64_t shoff = (shstrtab_off + shstrtab.size() + 7) & ~(uint64_t)7;
+
+    vector<uint8_t> file{0x7f, 'E', 'L', 'F', 2, 1, 1};
+    file.resize(16, 0);
+    put_le(file, 2, 2);    // e_type = ET_EXEC
+    put_le(file, 0xb7, 2); // e_machine = EM_AARCH64
+    put_le(file, 1, 4);    // e_version
+    put_le(file, 0, 8);    // e_entry
+    put_le(file, 0, 8);    // e_phoff
+    put_le(file, shoff, 8);
+    put_le(file, 0, 4); // e_flags
+    put_le(file, ehsize, 2);
+    put_le(file, 0, 2); // e_phentsize
+    put_le(file, 0, 2); // e_phnum
+    put_le(file, shentsize, 2);
+    put_le(file, shnum, 2);
+    put_le(file, 3, 2); // e_shstrndx
+
+    file.insert(file.end(), symtab.begin(), symtab.end());
+    file.insert(file.end(), strtab.begin(), strtab.end());
+    file.insert(file.end(), shstrtab.begin(), shstrtab.end());
+    file.resize(shoff, 0);
+
+    auto section = [&](uint32_t name, uint32_t type, uint64_t offset,
+                       uint64_t size, uint32_t link, uint32_t info,
+                       uint64_t entsize) {
+        put_le(file, name, 4);
+        put_le(file, type, 4);
+        put_le(file, 0, 8); // sh_flags
+        put_le(file, 0, 8); // sh_addr
+        put_le(file, offset, 8);
+        put_le(file, size, 8);
+        put_le(file, link, 4);
+        put_le(file, info, 4);
+        put_le(file, 1, 8); // sh_addralign
+        put_le(file, entsize, 8);
+    };
+    section(0, 0, 0, 0, 0, 0, 0);
+    section(1, SHT_SYMTAB, symtab_off, symtab.size(), 2, 1, 24);
+    section(9, SHT_STRTAB, strtab_off, strtab.size(), 0, 0, 0);
+    section(17, SHT_STRTAB, shstrtab_off, shstrtab.size(), 0, 0, 0);
+
+    FILE *fp = fopen_wrapper(filename.c_str(), "wb");
+    if (!fp)
+        reporter->err(1, "%s: open", filename.c_str());
+    if (fwrite(file.data(), 1, file.size(), fp) != file.size())
+        reporter->err(1, "%s: write", filename.c_str());
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    vector<string> images;
+    unsigned synthetic_symbols = 0;
+    string synthetic_filename = "elfbench-synthetic.elf";
+    unsigned repeats = 1;
+    string symbol_cache_filename;
+
+    Argparse ap("elfbench", argc, argv);
+    ap.optval({"--synthetic"}, "COUNT",
+              "write and load a synthetic ELF file with COUNT symbols",
+              [&](const string &s) {
+                  synthetic_symbols = parse_unsigned(s, 1, UINT_MAX);
+              });
+    ap.optval({"--synthetic-file"}, "FILE",
+              "file name to write the synthetic ELF file to",
+              [&](const string &s) { synthetic_filename = s; });
+    ap.optval({"--symbol-cache"}, "FILE",
+              "load symbols via a symbol cache in FILE",
+              [&](const string &s) { symbol_cache_filename = s; });
+    ap.optval({"--repeat"}, "N", "load each image N times",
+              [&](const string &s) {
+                  repeats = parse_unsigned(s, 1, UINT_MAX);
+              });
+    ap.positional_multiple("IMAGE", "ELF image to load",
+                           [&](const string &s) { images.push_back(s); },
+                           false);
+    ap.parse();
+
+    if (synthetic_symbols) {
+        write_synthetic_elf(synthetic_filename, synthetic_symbols);
+        images.push_back(synthetic_filename);
+    }
+
+    for (const string &filename : images) {
+        using Clock = std::chrono::steady_clock;
+        size_t nsyms = 0;
+        auto start = Clock::now();
+        for (unsigned i = 0; i < repeats; i++) {
+            Image image(filename, symbol_cache_filename);
+            nsyms = image.find_all_symbols_starting_with("").size();
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - start);
+        cout << filename << ": " << nsyms << " symbols, "
+             << elapsed.count() / repeats << " us per load" << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Export the index's sequential-order tree as a table, with one row
+ * per node, in the Apache Arrow IPC file format, for loading into
+ * dataframe and analytics tools.
+ *
+ * The rows are divided into chunks that are each extracted from the
+ * index by a separate thread, since each row costs a couple of tree
+ * searches. The chunks are written as record batches in trace order
+ * as they become ready, with the next ones being extracted meanwhile.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/image.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/registers.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include "arrow.hh"
+#include "tracechunks.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+class Exporter {
+    const IndexNavigator &IN;
+    vector<RegisterId> regs;
+    bool symbols;
+
+    enum { COL_LINE, COL_LINES, COL_BYTE_POS, COL_BYTE_LEN, COL_TIME, COL_PC,
+           COL_CALL_DEPTH, COL_REGS };
+
+    // One chunk of rows. Its symbols are numbered in order of first
+    // appearance in the chunk, and renumbered into the file's single
+    // dictionary when the chunk is written.
+    struct Chunk {
+        Arrow::Batch batch;
+        vector<int> symbol_ids; // -1 for no symbol
+        vector<const Symbol *> chunk_symbols;
+    };
+
+    Chunk extract(unsigned first, unsigned count)
+    {
+        Chunk chunk;
+        for (const Arrow::Field &f : fields())
+            if (f.type != Arrow::Type::DictionaryString)
+                chunk.batch.columns.emplace_back(f.type);
+        chunk.batch.rows = count;
+
+        unordered_map<Addr, int> pc_ids;
+        unordered_map<const Symbol *, int> sym_ids;
+        auto images = IN.get_images();
+
+        SeqOrderPayload node;
+        if (!IN.node_at_position(first, &node))
+            reporter->errx(1, _("unable to find node at position %u"), first);
+        for (unsigned i = 0; i < count; i++) {
+            if (i > 0 && !IN.get_next_node(node, &node))
+                reporter->errx(1, _("unable to find node at position %u"),
+                               first + i);
+
+            vector<Arrow::Column> &cols = chunk.batch.columns;
+            cols[COL_LINE].push(node.trace_file_firstline +
+                                IN.index.lineno_offset);
+            cols[COL_LINES].push(node.trace_file_lines);
+            cols[COL_BYTE_POS].push(node.trace_file_pos);
+            cols[COL_BYTE_LEN].push(node.trace_file_len);
+            cols[COL_TIME].push(node.mod_time);
+            if (node.pc == KNOWN_INVALID_PC)
+                cols[COL_PC].push_null();
+            else
+                cols[COL_PC].push(node.pc);
+            cols[COL_CALL_DEPTH].push(node.call_depth);
+
+            for (size_t r = 0; r < regs.size(); r++) {
+                auto val = IN.get_reg_value(node.memory_root, regs[r]);
+                Arrow::Column &col = cols[COL_REGS + r];
+                if (val.first)
+                    col.push(val.second);
+                else
+                    col.push_null();
+            }
+
+            if (symbols) {
+                auto it = pc_ids.find(node.pc);
+                if (it == pc_ids.end()) {
+                    const Symbol *sym = nullptr;
+                    if (node.pc != KNOWN_INVALID_PC) {
+                        uint64_t load_offset;
+                        sym = images->find_symbol(node.pc, &load_offset);
+                    }
+                    int id = -1;
+                    if (sym) {
+                        auto sit = sym_ids.find(sym);
+                        if (sit == sym_ids.end()) {
+                            sit = sym_ids.emplace(sym, sym_ids.size()).first;
+                            chunk.chunk_symbols.push_back(sym);
+                        }
+                        id = sit->second;
+                    }
+                    it = pc_ids.emplace(node.pc, id).first;
+                }
+                chunk.symbol_ids.push_back(it->second);
+            }
+        }
+        return chunk;
+    }
+
+  public:
+    Exporter(const IndexNavigator &IN, const vector<RegisterId> &regs)
+        : IN(IN), regs(regs), symbols(IN.has_image())
+    {
+    }
+
+    vector<Arrow::Field> fields() const
+    {
+        using Arrow::Type;
+        vector<Arrow::Field> fields = {
+            {"line", Type::UInt32, false},
+            {"lines", Type::UInt32, false},
+            {"byte_pos", Type::UInt64, false},
+            {"byte_len", Type::UInt64, false},
+            {"time", Type::UInt64, false},
+            {"pc", Type::UInt64, true},
+            {"call_depth", Type::UInt32, false},
+        };
+        for (const RegisterId &reg : regs)
+            fields.push_back({reg_name(reg), Type::UInt64, true});
+        // The symbol column goes last, so that the other columns have
+        // the same numbers whether or not it's present.
+        if (symbols)
+            fields.push_back({"symbol", Type::DictionaryString, true});
+        return fields;
+    }
+
+    void run(const string &filename, unsigned threads, unsigned batch_rows,
+             bool verbose)
+    {
+        vector<Arrow::Field> fieldlist = fields();
+        Arrow::FileWriter writer(filename, fieldlist);
+
+        unsigned total = IN.node_count(), batches = 0;
+        unordered_map<const Symbol *, int> file_ids;
+        vector<string> dictionary;
+
+        for_each_chunk_in_order<Chunk>(
+            split_trace(IN, batch_rows), threads,
+            [this](const TraceChunk &tc) {
+                return extract(tc.first_node, tc.nodes);
+            },
+            [&](Chunk &chunk) {
+                if (symbols) {
+                    vector<int> renumber;
+                    for (const Symbol *sym : chunk.chunk_symbols) {
+                        auto it = file_ids.find(sym);
+                        if (it == file_ids.end()) {
+                            it = file_ids.emplace(sym, dictionary.size()).first;
+                            dictionary.push_back(sym->getName());
+                        }
+                        renumber.push_back(it->second);
+                    }
+                    Arrow::Column col(Arrow::Type::DictionaryString);
+                    for (int id : chunk.symbol_ids) {
+                        if (id < 0)
+                            col.push_null();
+                        else
+                            col.push(renumber[id]);
+                    }
+                    chunk.batch.columns.push_back(std::move(col));
+                }
+
+                writer.write_batch(chunk.batch);
+                batches++;
+            });
+
+        if (symbols)
+            writer.set_dictionary(fieldlist.size() - 1, std::move(dictionary));
+        writer.close();
+
+        if (verbose)
+            cout << format(_("Wrote {} rows in {} record batches to {}\n"),
+                           total, batches, filename);
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    string output_filename;
+    vector<RegisterId> regs;
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+    unsigned batch_rows = 65536;
+
+    Argparse ap("tarmac-export", argc, argv);
+    TarmacUtility tu;
+    tu.add_options(ap);
+
+    ap.optval({"-o", "--output"}, _("OUTFILE"),
+              _("file to write (default: tarmac_filename.arrow)"),
+              [&](const string &s) { output_filename = s; });
+    ap.optval({"--reg"}, _("REGISTER"),
+              _("add a column giving the value of REGISTER after each "
+                "instruction (can be repeated)"),
+              [&](const string &s) {
+                  RegisterId reg;
+                  if (!lookup_reg_name(reg, s))
+                      throw ArgparseError(
+                          format(_("'{}': unknown register name"), s));
+                  if (reg_size(reg) > 8)
+                      throw ArgparseError(format(
+                          _("'{}': register is too large to export"), s));
+                  regs.push_back(reg);
+              });
+    ap.optval({"--threads"}, _("N"),
+              _("number of threads to read the index with (default: one "
+                "per processor)"),
+              [&](const string &s) {
+                  threads = parse_unsigned(s, 1, UINT_MAX);
+              });
+    ap.optval({"--batch-rows"}, _("N"),
+              _("number of rows in each record batch of the output file "
+                "(default: 65536)"),
+              [&](const string &s) {
+                  batch_rows = parse_unsigned(s, 1, UINT_MAX);
+              });
+
+    ap.parse();
+    tu.setup();
+
+    if (output_filename.empty())
+        output_filename = tu.trace.tarmac_filename + ".arrow";
+
+    IndexNavigator IN(tu.trace, tu.images);
+    Exporter(IN, regs).run(output_filename, threads, batch_rows,
+                           tu.is_verbose());
+
+    return 0;
+}
@@ -58,7 +58,7 @@ int main(int argc, char **argv)
     ap.parse();
     tu.setup();
 
-    IndexNavigator IN(tu.trace, tu.image_filename, tu.load_offset);
+    IndexNavigator IN(tu.trace, tu.images);
     CallTree CT(IN);
     CT.setOptions(ctopts);
 
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Count the memory reads and writes in a trace, by address bucket
+ * (e.g. page or cache line) and by window of trace time, for sizing
+ * caches and tightly coupled memories. Also report the working set
+ * of each window, i.e. how many distinct buckets it touched.
+ *
+ * The trace is re-parsed in chunks by separate threads, using the
+ * index to find chunk boundaries that don't split an event, and the
+ * per-chunk counts are merged in trace order.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include "arrow.hh"
+#include "tracechunks.hh"
+
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using std::cerr;
+using std::map;
+using std::ostream;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct Counts {
+    uint64_t reads = 0, writes = 0;
+
+    Counts &operator+=(const Counts &rhs)
+    {
+        reads += rhs.reads;
+        writes += rhs.writes;
+        return *this;
+    }
+};
+
+// Cells of the heatmap are keyed by (window number, bucket number).
+using CellMap = map<std::pair<uint64_t, uint64_t>, Counts>;
+
+class HeatmapCounter : public ParseReceiver {
+    Time start, window;
+    uint64_t bucket_size;
+
+  public:
+    CellMap cells;
+
+    HeatmapCounter(Time start, Time window, uint64_t bucket_size)
+        : start(start), window(window), bucket_size(bucket_size)
+    {
+    }
+
+    void got_event(MemoryEvent &ev) override
+    {
+        uint64_t w = ev.time > start ? (ev.time - start) / window : 0;
+        uint64_t first = ev.addr / bucket_size;
+        uint64_t last = (ev.addr + std::max(ev.size, (size_t)1) - 1) /
+                        bucket_size;
+        for (uint64_t b = first; b <= last; b++) {
+            Counts &c = cells[{w, b}];
+            (ev.read ? c.reads : c.writes)++;
+        }
+    }
+
+    bool wants_highlights() const override { return false; }
+};
+
+class Heatmap {
+    const IndexNavigator &IN;
+    Time start = 0, window;
+    uint64_t bucket_size;
+    CellMap cells;
+    uint64_t nwindows = 0;
+
+  public:
+    Heatmap(const IndexNavigator &IN, Time window, uint64_t bucket_size)
+        : IN(IN), window(window), bucket_size(bucket_size)
+    {
+        SeqOrderPayload first, last;
+        if (IN.find_buffer_limit(false, &first) &&
+            IN.find_buffer_limit(true, &last)) {
+            start = first.mod_time;
+            if (!window) {
+                // Default to dividing the trace into about 100 windows.
+                this->window = (last.mod_time - start) / 100 + 1;
+            }
+            nwindows = (last.mod_time - start) / this->window + 1;
+        } else if (!window) {
+            this->window = 1;
+        }
+    }
+
+    void run(unsigned threads)
+    {
+        for_each_chunk_in_order<CellMap>(
+            split_trace(IN, 65536), threads,
+            [this](const TraceChunk &chunk) {
+                HeatmapCounter counter(start, window, bucket_size);
+                parse_chunk(IN, chunk, counter);
+                return std::move(counter.cells);
+            },
+            [this](const CellMap &chunk_cells) {
+                for (const auto &kv : chunk_cells) {
+                    cells[kv.first] += kv.second;
+                    nwindows = std::max(nwindows, kv.first.first + 1);
+                }
+            });
+    }
+
+    void write_csv(ostream &os) const
+    {
+        os << "window_start,address,reads,writes\n";
+        for (const auto &kv : cells)
+            os << start + kv.first.first * window << ","
+               << kv.first.second * bucket_size << "," << kv.second.reads
+               << "," << kv.second.writes << "\n";
+    }
+
+    void write_arrow(const string &filename) const
+    {
+        using Arrow::Type;
+        Arrow::FileWriter writer(filename,
+                                 {{"window_start", Type::UInt64, false},
+                                  {"address", Type::UInt64, false},
+                                  {"reads", Type::UInt64, false},
+                                  {"writes", Type::UInt64, false}});
+        auto new_batch = []() {
+            Arrow::Batch batch;
+            batch.columns.assign(4, Arrow::Column(Type::UInt64));
+            return batch;
+        };
+        Arrow::Batch batch = new_batch();
+        for (const auto &kv : cells) {
+            batch.columns[0].push(start + kv.first.first * window);
+            batch.columns[1].push(kv.first.second * bucket_size);
+            batch.columns[2].push(kv.second.reads);
+            batch.columns[3].push(kv.second.writes);
+            if (++batch.rows == 65536) {
+                writer.write_batch(batch);
+                batch = new_batch();
+            }
+        }
+        if (batch.rows)
+            writer.write_batch(batch);
+        writer.close();
+    }
+
+    // One line per window, including empty ones, giving the total
+    // accesses and the number of bytes in the buckets touched.
+    void write_working_set(ostream &os) const
+    {
+        os << "window_start,reads,writes,bytes_touched,bytes_read,"
+              "bytes_written\n";
+        auto it = cells.begin();
+        for (uint64_t w = 0; w < nwindows; w++) {
+            Counts total;
+            uint64_t touched = 0, read = 0, written = 0;
+            for (; it != cells.end() && it->first.first == w; ++it) {
+                total += it->second;
+                touched++;
+                read += it->second.reads != 0;
+                written += it->second.writes != 0;
+            }
+            os << start + w * window << "," << total.reads << ","
+               << total.writes << "," << touched * bucket_size << ","
+               << read * bucket_size << "," << written * bucket_size << "\n";
+        }
+    }
+
+    void print_summary(ostream &os) const
+    {
+        Counts total;
+        std::set<uint64_t> buckets;
+        for (const auto &kv : cells) {
+            total += kv.second;
+            buckets.insert(kv.first.second);
+        }
+        os << format(_("{} reads and {} writes in {} windows of {}, "
+                       "touching {} buckets of {} bytes\n"),
+                     total.reads, total.writes, nwindows, window,
+                     buckets.size(), bucket_size);
+    }
+};
+
+static void write_file(const string &filename,
+                       const std::function<void(ostream &)> &fn)
+{
+    if (filename.empty() || filename == "-") {
+        fn(std::cout);
+        return;
+    }
+    std::ofstream ofs(filename);
+    if (!ofs)
+        reporter->err(1, "%s: open", filename.c_str());
+    fn(ofs);
+    ofs.close();
+    if (!ofs)
+        reporter->err(1, "%s: write", filename.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    string output_filename, working_set_filename;
+    bool arrow = false;
+    Time window = 0;
+    uint64_t bucket_size = 4096;
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+
+    Argparse ap("tarmac-heatmap", argc, argv);
+    TarmacUtility tu;
+    tu.cannot_use_image();
+    tu.add_options(ap);
+
+    ap.optval({"-o", "--output"}, _("OUTFILE"),
+              _("file to write the heatmap to (default: standard output)"),
+              [&](const string &s) { output_filename = s; });
+    ap.optval({"--format"}, _("FORMAT"),
+              _("format of the heatmap: 'csv' (default) or 'arrow'"),
+              [&](const string &s) {
+                  if (s == "csv")
+                      arrow = false;
+                  else if (s == "arrow")
+                      arrow = true;
+                  else
+                      throw ArgparseError(
+                          format(_("'{}': unknown output format"), s));
+              });
+    ap.optval({"--working-set"}, _("FILE"),
+              _("write the working set of each window to FILE"),
+              [&](const string &s) { working_set_filename = s; });
+    ap.optval({"--bucket-size"}, _("BYTES"),
+              _("size of the address buckets (default: 4096)"),
+              [&](const string &s) { bucket_size = parse_size(s, 1); });
+    ap.optval({"--window"}, _("TIME"),
+              _("length of each time window, in trace timestamp units "
+                "(default: a hundredth of the trace)"),
+              [&](const string &s) { window = parse_unsigned(s, 1); });
+    ap.optval({"--threads"}, _("N"),
+              _("number of threads to parse the trace with (default: one "
+                "per processor)"),
+              [&](const string &s) {
+                  threads = parse_unsigned(s, 1, UINT_MAX);
+              });
+
+    ap.parse([&]() {
+        if (arrow && (output_filename.empty() || output_filename == "-"))
+            throw ArgparseError(_("--format=arrow requires an output file"));
+    });
+    tu.setup();
+
+    IndexNavigator IN(tu.trace);
+    Heatmap heatmap(IN, window, bucket_size);
+    heatmap.run(threads);
+
+    if (arrow)
+        heatmap.write_arrow(output_filename);
+    else
+        write_file(output_filename,
+                   [&](ostream &os) { heatmap.write_csv(os); });
+    if (!working_set_filename.empty())
+        write_file(working_set_filename,
+                   [&](ostream &os) { heatmap.write_working_set(os); });
+    if (tu.is_verbose())
+        heatmap.print_summary(cerr);
+
+    return 0;
+}
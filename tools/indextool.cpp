@@ -22,15 +22,19 @@
 #include "libtarmac/reporter.hh"
 #include "libtarmac/tarmacutil.hh"
 
+#include "indexverify.hh"
+
 #include <stdio.h>
 #include <string.h>
 
 #include <algorithm>
 #include <climits>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <stack>
 #include <string>
+#include <thread>
 #include <vector>
 using std::cerr;
 using std::cout;
@@ -285,11 +289,14 @@ class MemTreeDumper : public TreeDumper<MemoryPayload, MemoryAnnotation> {
     {
         cout << prefix << _("Latest modification time in whole subtree: ")
              << annotation.latest << endl;
+        if (annotation.hashed)
+            cout << prefix << _("Content hash of whole subtree: ") << hex
+                 << annotation.hash << dec << endl;
     }
 };
 
 class MemSubtreeDumper
-    : public TreeDumper<MemorySubPayload, EmptyAnnotation<MemorySubPayload>> {
+    : public TreeDumper<MemorySubPayload, MemorySubAnnotation> {
     using TreeDumper::TreeDumper;
 
     virtual void dump_payload(const string &prefix,
@@ -352,23 +359,6 @@ static void dump_registers(bool got_iflags, unsigned iflags)
     }
 }
 
-static unsigned long long parseint(const string &s)
-{
-    try {
-        size_t pos;
-        unsigned long long toret = stoull(s, &pos, 0);
-        if (pos < s.size())
-            throw ArgparseError(
-                format(_("'{}': unable to parse numeric value"), s));
-        return toret;
-    } catch (std::invalid_argument) {
-        throw ArgparseError(
-            format(_("'{}': unable to parse numeric value"), s));
-    } catch (std::out_of_range) {
-        throw ArgparseError(format(_("'{}': numeric value out of range"), s));
-    }
-}
-
 static void hexdump(const void *vdata, size_t size, Addr startaddr,
                     const std::string &prefix)
 {
@@ -483,6 +473,34 @@ static void dump_memory_at_line(const IndexNavigator &IN, unsigned trace_line,
 
 std::unique_ptr<Reporter> reporter = make_cli_reporter();
 
+// Before opening an index for --verify, check the parts of its header
+// that IndexReader relies on. Returns the number of problems found, or
+// exits if the rest of the file can't be read at all.
+static uint64_t verify_index_header(const string &index_filename)
+{
+    std::ifstream f(index_filename, std::ios::binary | std::ios::ate);
+    if (!f)
+        reporter->err(1, "%s: open", index_filename.c_str());
+    if ((uint64_t)f.tellg() < sizeof(MagicNumber) + sizeof(FileHeader)) {
+        cout << format(_("{}: index file is too short to contain a header\n"),
+                       index_filename);
+        exit(1);
+    }
+
+    switch (check_index_header(index_filename)) {
+    case IndexHeaderState::WrongMagic:
+        cout << format(_("{}: magic number did not match\n"), index_filename);
+        exit(1);
+    case IndexHeaderState::Incomplete:
+        cout << format(_("{}: index file was not completed\n"),
+                       index_filename);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
 int main(int argc, char **argv)
 {
     gettext_setup(true);
@@ -501,11 +519,14 @@ int main(int argc, char **argv)
         ByPCWalk,
         RegMap,
         FullMemByLine,
+        StateDiff,
+        Verify,
     } mode = Mode::None;
     OFF_T root;
-    unsigned trace_line;
+    unsigned trace_line, other_trace_line;
     unsigned iflags = 0;
     bool got_iflags = false;
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
 
     Argparse ap("tarmac-indextool", argc, argv);
     TarmacUtility tu;
@@ -529,26 +550,26 @@ int main(int argc, char **argv)
               _("dump logical content of memory tree with root at OFFSET"),
               [&](const string &s) {
                   mode = Mode::MemVisit;
-                  root = parseint(s);
+                  root = parse_unsigned(s);
               });
     ap.optval({"--memtree"}, _("OFFSET"),
               _("dump physical structure of a memory tree with root at OFFSET"),
               [&](const string &s) {
                   mode = Mode::MemWalk;
-                  root = parseint(s);
+                  root = parse_unsigned(s);
               });
     ap.optval({"--memsub"}, _("OFFSET"),
               _("dump logical content of a memory subtree with root at OFFSET"),
               [&](const string &s) {
                   mode = Mode::MemSubVisit;
-                  root = parseint(s);
+                  root = parse_unsigned(s);
               });
     ap.optval(
         {"--memsubtree"}, _("OFFSET"),
         _("dump physical structure of a memory subtree with root at OFFSET"),
         [&](const string &s) {
             mode = Mode::MemSubWalk;
-            root = parseint(s);
+            root = parse_unsigned(s);
         });
     ap.optnoval({"--bypc"}, _("dump logical content of the by-PC tree"),
                 [&]() { mode = Mode::ByPCVisit; });
@@ -560,7 +581,7 @@ int main(int argc, char **argv)
               _("(for --regmap) specify iflags context to retrieve registers"),
               [&](const string &s) {
                   got_iflags = true;
-                  iflags = parseint(s);
+                  iflags = parse_unsigned(s);
               });
     ap.optnoval({"--omit-index-offsets"},
                 _("do not dump offsets in index file (so that output is more "
@@ -571,7 +592,33 @@ int main(int argc, char **argv)
                 "particular line of the trace file"),
               [&](const string &s) {
                   mode = Mode::FullMemByLine;
-                  trace_line = parseint(s);
+                  trace_line = parse_unsigned(s);
+              });
+
+    ap.optval({"--state-diff"}, _("LINE1,LINE2"),
+              _("list the register and memory ranges whose contents differ "
+                "between two lines of the trace file"),
+              [&](const string &s) {
+                  size_t comma = s.find(',');
+                  if (comma == string::npos)
+                      throw ArgparseError(
+                          format(_("'{}': expected two line numbers "
+                                   "separated by a comma"),
+                                 s));
+                  mode = Mode::StateDiff;
+                  tu.want_memory_hashes();
+                  trace_line = parse_unsigned(s.substr(0, comma));
+                  other_trace_line = parse_unsigned(s.substr(comma + 1));
+              });
+
+    ap.optnoval({"--verify"},
+                _("check the consistency of every tree in the index file"),
+                [&]() { mode = Mode::Verify; });
+    ap.optval({"--threads"}, _("N"),
+              _("(for --verify) number of threads to check the index with "
+                "(default: one per processor)"),
+              [&](const string &s) {
+                  threads = parse_unsigned(s, 1, UINT_MAX);
               });
 
     ap.parse([&]() {
@@ -595,7 +642,17 @@ int main(int argc, char **argv)
         break;
     }
 
-    tu.setup();
+    uint64_t header_problems = 0;
+    if (mode == Mode::Verify) {
+        // Check the index we've got, rather than replacing it if it's
+        // damaged or out of date.
+        tu.keep_existing_index();
+        tu.setup();
+        if (tu.trace.index_on_disk)
+            header_problems = verify_index_header(tu.trace.index_filename);
+    } else {
+        tu.setup();
+    }
     const IndexNavigator IN(tu.trace);
 
     switch (mode) {
@@ -610,6 +667,10 @@ int main(int argc, char **argv)
              << (IN.index.isAArch64() ? "AArch64" : "AArch32") << endl;
         cout << _("Thumb only: ")
              << (IN.index.isThumbOnly() ? "yes" : "no") << endl;
+        if (IN.index.indexedCPU() >= 0)
+            cout << _("CPU indexed: ") << IN.index.indexedCPU() << endl;
+        else
+            cout << _("CPU indexed: all") << endl;
         cout << _("Largest SVE vector register access: ")
              << IN.index.maxSVEBits() << " bits" << endl;
         cout << _("Root of sequential order tree: ") << IN.index.seqroot
@@ -617,6 +678,14 @@ int main(int argc, char **argv)
         cout << _("Root of by-PC tree: ") << IN.index.bypcroot << endl;
         cout << _("Line number adjustment for file header: ")
              << IN.index.lineno_offset << endl;
+        const TraceFingerprint &fp = IN.index.traceFingerprint();
+        cout << _("Trace file size: ") << fp.size << endl;
+        cout << format(_("Trace file sampled hash: {:#x}"),
+                       fp.sampled_hash)
+             << endl;
+        cout << format(_("Trace file full hash: {:#x}"), fp.full_hash)
+             << endl;
+        IN.index.stats().print(cout);
         break;
     }
 
@@ -675,6 +744,47 @@ int main(int argc, char **argv)
         dump_memory_at_line(IN, trace_line, "");
         break;
     }
+
+    case Mode::StateDiff: {
+        SeqOrderPayload node, other_node;
+        if (!IN.node_at_line(trace_line, &node)) {
+            cerr << format(_("Unable to find a node at line {}\n"), trace_line);
+            exit(1);
+        }
+        if (!IN.node_at_line(other_trace_line, &other_node)) {
+            cerr << format(_("Unable to find a node at line {}\n"),
+                           other_trace_line);
+            exit(1);
+        }
+        for (const StateDifference &diff :
+             IN.state_diff(node.memory_root, IN, other_node.memory_root)) {
+            cout << (diff.type == 'r' ? _("register-space") : _("memory"))
+                 << " [" << hex << diff.lo << "-" << diff.hi << dec << "]"
+                 << endl;
+        }
+        break;
+    }
+
+    case Mode::Verify: {
+        const uint64_t max_reports = 100;
+        IndexVerifyResults res = verify_index(IN.index, threads, cout,
+                                              max_reports);
+        if (res.problems > max_reports)
+            cout << format(_("({} more problems not shown)\n"),
+                           res.problems - max_reports);
+        cout << format(_("Sequential order tree: {} nodes\n"), res.seq_nodes)
+             << format(_("By-PC tree: {} nodes\n"), res.bypc_nodes)
+             << format(_("Memory trees: {} distinct nodes\n"), res.mem_nodes)
+             << format(_("Memory subtrees: {} distinct nodes\n"),
+                       res.memsub_nodes);
+        uint64_t problems = header_problems + res.problems;
+        if (problems) {
+            cout << format(_("{} problems found\n"), problems);
+            return 1;
+        }
+        cout << _("No problems found") << endl;
+        break;
+    }
     }
 
     return 0;
@@ -0,0 +1,652 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "indexverify.hh"
+
+#include "libtarmac/intl.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using std::max;
+using std::string;
+using std::vector;
+
+namespace {
+
+template <class Payload, class Annotation> struct Node {
+    OFF_T offset = 0; // 0 means no node, or one we can't safely look at
+    Payload payload;
+    Annotation annotation;
+    OFF_T lc = 0, rc = 0;
+    int height = 0;
+
+    bool read(const AVLDisk<Payload, Annotation> &tree, OFF_T off)
+    {
+        offset = off;
+        return tree.read_node_checked(off, payload, annotation, lc, rc,
+                                      height);
+    }
+};
+
+using SeqNode = Node<SeqOrderPayload, SeqOrderAnnotation>;
+using MemNode = Node<MemoryPayload, MemoryAnnotation>;
+using MemSubNode = Node<MemorySubPayload, MemorySubAnnotation>;
+using ByPCNode = Node<ByPCPayload, EmptyAnnotation<ByPCPayload>>;
+
+// One bit for every place in the index file that a node of one tree
+// could start, set by the first thread to check the node there, so
+// that memory tree nodes shared between many trees are only checked
+// once, and any other node reachable twice is noticed.
+class NodeClaims {
+    size_t node_size;
+    std::unique_ptr<std::atomic<uint64_t>[]> bits;
+
+  public:
+    NodeClaims(OFF_T index_size, size_t node_size)
+        : node_size(node_size),
+          bits(new std::atomic<uint64_t>[index_size / node_size / 64 + 1]())
+    {
+    }
+
+    // Returns true if nobody had claimed the node at this offset.
+    bool claim(OFF_T offset)
+    {
+        uint64_t slot = offset / node_size, mask = 1ULL << (slot % 64);
+        return !(bits[slot / 64].fetch_or(mask) & mask);
+    }
+};
+
+// Whether payload a is correctly placed before payload b in a tree.
+template <class Payload> bool in_order(const Payload &a, const Payload &b)
+{
+    return a.cmp(b) < 0;
+}
+bool in_order(const SeqOrderPayload &a, const SeqOrderPayload &b)
+{
+    return a.cmp(b) < 0 && a.trace_file_pos < b.trace_file_pos;
+}
+
+// Work out what a seqtree node's call depth array should be, from its
+// payload and its children's arrays, in the same way as the indexer.
+vector<CallDepthArrayEntry>
+merge_call_depth_arrays(const SeqOrderPayload &payload,
+                        const vector<CallDepthArrayEntry> &lc,
+                        const vector<CallDepthArrayEntry> &rc)
+{
+    vector<CallDepthArrayEntry> own(2);
+    own[0].call_depth = payload.call_depth;
+    own[0].cumulative_lines = 0;
+    own[0].cumulative_insns = 0;
+    own[1].call_depth = SENTINEL_DEPTH;
+    own[1].cumulative_lines = payload.trace_file_lines;
+    own[1].cumulative_insns = 1;
+
+    enum { OWN, LC, RC, NARRAYS };
+    const vector<CallDepthArrayEntry> *arrays[NARRAYS] = {&own, &lc, &rc};
+    size_t index[NARRAYS] = {0, 0, 0};
+    unsigned clines = 0, cinsns = 0;
+    vector<CallDepthArrayEntry> out;
+    while (true) {
+        unsigned next_depth = UINT_MAX;
+        for (int i = 0; i < NARRAYS; i++)
+            if (index[i] < arrays[i]->size())
+                next_depth = std::min(
+                    next_depth, (unsigned)(*arrays[i])[index[i]].call_depth);
+        if (next_depth == UINT_MAX)
+            break;
+
+        CallDepthArrayEntry e;
+        e.call_depth = next_depth;
+        e.cumulative_lines = clines;
+        e.cumulative_insns = cinsns;
+        e.leftlink = index[LC];
+        e.rightlink = index[RC];
+        out.push_back(e);
+
+        for (int i = 0; i < NARRAYS; i++) {
+            const vector<CallDepthArrayEntry> &a = *arrays[i];
+            if (index[i] < a.size() && a[index[i]].call_depth == next_depth) {
+                if (index[i] + 1 < a.size()) {
+                    clines += a[index[i] + 1].cumulative_lines -
+                              a[index[i]].cumulative_lines;
+                    cinsns += a[index[i] + 1].cumulative_insns -
+                              a[index[i]].cumulative_insns;
+                }
+                index[i]++;
+            }
+        }
+    }
+    return out;
+}
+
+bool same_entry(const CallDepthArrayEntry &a, const CallDepthArrayEntry &b)
+{
+    return a.call_depth == b.call_depth &&
+           a.cumulative_lines == b.cumulative_lines &&
+           a.cumulative_insns == b.cumulative_insns &&
+           a.leftlink == b.leftlink && a.rightlink == b.rightlink;
+}
+
+class Verifier {
+    const IndexReader &index;
+    const OFF_T size;
+    unsigned split_depth;
+    std::ostream &os;
+    const uint64_t max_reports;
+    std::mutex os_mutex;
+    NodeClaims seq_claims, mem_claims, memsub_claims, bypc_claims;
+
+    const char *const SEQ = _("sequential order tree");
+    const char *const MEM = _("memory tree");
+    const char *const MEMSUB = _("memory subtree");
+    const char *const BYPC = _("by-PC tree");
+
+  public:
+    std::atomic<uint64_t> seq_nodes{0}, mem_nodes{0}, memsub_nodes{0},
+        bypc_nodes{0}, problems{0};
+
+    Verifier(const IndexReader &index, unsigned threads, std::ostream &os,
+             uint64_t max_reports)
+        : index(index), size(index.index_size()), split_depth(0), os(os),
+          max_reports(max_reports),
+          seq_claims(size, index.seqtree.node_size()),
+          mem_claims(size, index.memtree.node_size()),
+          memsub_claims(size, index.memsubtree.node_size()),
+          bypc_claims(size, index.bypctree.node_size())
+    {
+        // Hand out subtrees down to a depth giving a few times as many
+        // pieces of work as threads, so that they even out.
+        if (threads > 1) {
+            while (split_depth < 16 && (1U << split_depth) < threads)
+                split_depth++;
+            split_depth += 2;
+        }
+    }
+
+    void problem(const char *tree, OFF_T offset, const string &msg)
+    {
+        if (problems++ < max_reports) {
+            std::lock_guard<std::mutex> lock(os_mutex);
+            os << format(_("{} node at offset {}: {}\n"), tree, offset, msg);
+        }
+    }
+
+    bool in_bounds(OFF_T offset, uint64_t len) const
+    {
+        return offset > 0 && len <= (uint64_t)size &&
+               (uint64_t)offset <= size - len;
+    }
+
+    bool contents_in_bounds(OFF_T offset, Addr lo, Addr hi) const
+    {
+        return hi - lo < (uint64_t)size && in_bounds(offset, hi - lo + 1);
+    }
+
+    // Follow links in one direction from a node to the end of its
+    // subtree. Returns false if the way there is damaged, which will
+    // be reported when those nodes are checked themselves.
+    template <class P, class A>
+    bool find_extreme(const AVLDisk<P, A> &tree, const Node<P, A> &start,
+                      bool rightmost, Node<P, A> &out)
+    {
+        out = start;
+        while (OFF_T next = rightmost ? out.rc : out.lc) {
+            Node<P, A> n;
+            if (!n.read(tree, next) || n.height >= out.height)
+                return false;
+            out = n;
+        }
+        return true;
+    }
+
+    // Check what a node must satisfy in any of the trees, and read its
+    // children. On return, a child's offset is zero unless it is safe
+    // to go on to check it: it could be read, and is lower in the tree
+    // than its parent, so that following links can never lead back
+    // round in a circle.
+    template <class P, class A>
+    void check_node(const AVLDisk<P, A> &tree, const char *name,
+                    const Node<P, A> &n, Node<P, A> (&child)[2])
+    {
+        const OFF_T links[2] = {n.lc, n.rc};
+        bool all_read = true;
+        for (int i = 0; i < 2; i++) {
+            child[i] = Node<P, A>();
+            if (!links[i])
+                continue;
+            if (!child[i].read(tree, links[i])) {
+                problem(name, n.offset,
+                        format(_("child link {} points outside the index"),
+                               links[i]));
+                child[i] = Node<P, A>();
+                all_read = false;
+            } else if (child[i].height < 1 || child[i].height >= n.height) {
+                problem(name, n.offset,
+                        format(_("child at offset {} has height {}, which "
+                                 "is not less than its parent's height {}"),
+                               links[i], child[i].height, n.height));
+                child[i] = Node<P, A>();
+                all_read = false;
+            }
+        }
+
+        if (all_read) {
+            int hl = child[0].height, hr = child[1].height;
+            if (n.height != 1 + max(hl, hr))
+                problem(name, n.offset,
+                        format(_("height is {}, but its subtrees have "
+                                 "heights {} and {}"),
+                               n.height, hl, hr));
+            else if (hl > hr + 1 || hr > hl + 1)
+                problem(name, n.offset,
+                        format(_("unbalanced: its subtrees have heights {} "
+                                 "and {}"),
+                               hl, hr));
+        }
+
+        Node<P, A> extreme;
+        if (child[0].offset && find_extreme(tree, child[0], true, extreme) &&
+            !in_order(extreme.payload, n.payload))
+            problem(name, n.offset,
+                    format(_("out of order with node at offset {} in its "
+                             "left subtree"),
+                           extreme.offset));
+        if (child[1].offset && find_extreme(tree, child[1], false, extreme) &&
+            !in_order(n.payload, extreme.payload))
+            problem(name, n.offset,
+                    format(_("out of order with node at offset {} in its "
+                             "right subtree"),
+                           extreme.offset));
+    }
+
+    // Check the two children of a node, the left one in a separate
+    // thread if we're near enough the top of the tree.
+    template <class Fn>
+    void descend(const OFF_T (&children)[2], unsigned depth, Fn check)
+    {
+        std::future<void> left;
+        if (children[0]) {
+            if (depth < split_depth)
+                left = std::async(std::launch::async, check, children[0],
+                                  depth + 1);
+            else
+                check(children[0], depth + 1);
+        }
+        if (children[1])
+            check(children[1], depth + 1);
+        if (left.valid())
+            left.get();
+    }
+
+    template <class P, class A, class Fn>
+    void check_root(const AVLDisk<P, A> &tree, const char *name, OFF_T root,
+                    Fn check)
+    {
+        Node<P, A> n;
+        if (!root)
+            return;
+        if (!n.read(tree, root))
+            problem(name, root, _("root is outside the index"));
+        else
+            check(root, 0);
+    }
+
+    bool read_call_depth_array(const SeqOrderAnnotation &a,
+                               vector<CallDepthArrayEntry> &out) const
+    {
+        unsigned len = a.call_depth_arraylen;
+        if (len < 2 ||
+            !in_bounds(a.call_depth_array,
+                       (uint64_t)len * sizeof(CallDepthArrayEntry)))
+            return false;
+        auto *entries = static_cast<const CallDepthArrayEntry *>(
+            index.index_offset(a.call_depth_array));
+        out.assign(entries, entries + len);
+        return true;
+    }
+
+    void check_call_depth_array(const SeqNode &n, const SeqNode (&child)[2])
+    {
+        vector<CallDepthArrayEntry> array, child_arrays[2];
+        if (!read_call_depth_array(n.annotation, array)) {
+            problem(SEQ, n.offset,
+                    format(_("call depth array at offset {} with {} entries "
+                             "is not within the index"),
+                           n.annotation.call_depth_array,
+                           n.annotation.call_depth_arraylen));
+            return;
+        }
+
+        // If a child's array can't be read, that's reported when the
+        // child is checked, and we can't check this one against it.
+        if (child[0].offset != n.lc || child[1].offset != n.rc)
+            return;
+        for (int i = 0; i < 2; i++)
+            if (child[i].offset &&
+                !read_call_depth_array(child[i].annotation, child_arrays[i]))
+                return;
+
+        vector<CallDepthArrayEntry> expected = merge_call_depth_arrays(
+            n.payload, child_arrays[0], child_arrays[1]);
+        if (array.size() != expected.size()) {
+            problem(SEQ, n.offset,
+                    format(_("call depth array has {} entries, but its "
+                             "subtrees' arrays imply {}"),
+                           array.size(), expected.size()));
+            return;
+        }
+        for (size_t i = 0; i < array.size(); i++) {
+            if (!same_entry(array[i], expected[i])) {
+                problem(SEQ, n.offset,
+                        format(_("call depth array entry {} does not agree "
+                                 "with its subtrees' arrays"),
+                               i));
+                return;
+            }
+        }
+    }
+
+    void check_seq(OFF_T offset, unsigned depth)
+    {
+        SeqNode n, child[2];
+        n.read(index.seqtree, offset);
+        if (!seq_claims.claim(offset)) {
+            problem(SEQ, offset, _("reachable by more than one path"));
+            return;
+        }
+        seq_nodes++;
+        check_node(index.seqtree, SEQ, n, child);
+        check_call_depth_array(n, child);
+
+        // Check the memory tree giving the state after this node.
+        if (OFF_T memroot = n.payload.memory_root) {
+            MemNode m;
+            if (!m.read(index.memtree, memroot))
+                problem(SEQ, offset,
+                        format(_("memory tree root {} is outside the index"),
+                               memroot));
+            else if (m.annotation.latest > n.payload.trace_file_firstline)
+                problem(SEQ, offset,
+                        format(_("memory tree root {} was last modified at "
+                                 "line {}, later than this node's line {}"),
+                               memroot, m.annotation.latest,
+                               n.payload.trace_file_firstline));
+            else
+                check_mem(memroot);
+        }
+
+        descend({child[0].offset, child[1].offset}, depth,
+                [this](OFF_T off, unsigned d) { check_seq(off, d); });
+    }
+
+    void check_mem(OFF_T offset)
+    {
+        if (!mem_claims.claim(offset))
+            return; // shared with a memory tree we've already checked
+        mem_nodes++;
+
+        MemNode n, child[2];
+        n.read(index.memtree, offset);
+        check_node(index.memtree, MEM, n, child);
+
+        const MemoryPayload &p = n.payload;
+        bool range_ok = p.lo <= p.hi;
+        if (p.type != 'r' && p.type != 'm')
+            problem(MEM, offset,
+                    format(_("unknown address space type {}"),
+                           (unsigned)(unsigned char)p.type));
+        if (!range_ok)
+            problem(MEM, offset,
+                    format(_("address range {:#x}-{:#x} is backwards"),
+                           (Addr)p.lo, (Addr)p.hi));
+
+        // Find this node's own contribution to the memory hash.
+        bool hash_known = false;
+        uint64_t hash = 0;
+        if (p.raw) {
+            if (range_ok && !contents_in_bounds(p.contents, p.lo, p.hi)) {
+                problem(MEM, offset,
+                        format(_("contents at offset {} are not within the "
+                                 "index"),
+                               p.contents));
+            } else if (range_ok) {
+                hash = memory_block_hash(
+                    p.type, p.lo,
+                    static_cast<const unsigned char *>(
+                        index.index_offset(p.contents)),
+                    p.hi - p.lo + 1);
+                hash_known = true;
+            }
+        } else if (!in_bounds(p.contents, sizeof(diskint<OFF_T>))) {
+            problem(MEM, offset,
+                    format(_("memory subtree root pointer at offset {} is "
+                             "not within the index"),
+                           p.contents));
+        } else if (OFF_T subroot = index.index_subtree_root(p.contents)) {
+            MemSubNode s;
+            if (!s.read(index.memsubtree, subroot)) {
+                problem(MEM, offset,
+                        format(_("memory subtree root {} is outside the "
+                                 "index"),
+                               subroot));
+            } else {
+                check_memsub(subroot, p.type);
+                if (range_ok)
+                    hash_known = memsub_range_hash(subroot, s.height + 1,
+                                                   p.type, p.lo, p.hi, hash);
+            }
+        } else {
+            hash_known = true;
+        }
+
+        if (child[0].offset == n.lc && child[1].offset == n.rc) {
+            unsigned latest = p.trace_file_firstline;
+            for (const MemNode &c : child)
+                if (c.offset)
+                    latest = max(latest, (unsigned)c.annotation.latest);
+            if (n.annotation.latest != latest)
+                problem(MEM, offset,
+                        format(_("latest modification recorded as line {}, "
+                                 "but its subtree was last modified at line "
+                                 "{}"),
+                               n.annotation.latest, latest));
+
+            // Memory hashes are only filled in at the end of indexing,
+            // for every node at once.
+            if (n.annotation.hashed) {
+                for (const MemNode &c : child) {
+                    if (!c.offset)
+                        continue;
+                    if (!c.annotation.hashed)
+                        problem(MEM, offset,
+                                format(_("hashed, but its child at offset {} "
+                                         "is not"),
+                                       c.offset));
+                    hash += c.annotation.hash;
+                }
+                if (hash_known && n.annotation.hash != hash)
+                    problem(MEM, offset,
+                            _("hash does not match the contents of its "
+                              "subtree"));
+            }
+        }
+
+        for (const MemNode &c : child)
+            if (c.offset)
+                check_mem(c.offset);
+    }
+
+    void check_memsub(OFF_T offset, char type)
+    {
+        if (!memsub_claims.claim(offset))
+            return;
+        memsub_nodes++;
+
+        MemSubNode n, child[2];
+        n.read(index.memsubtree, offset);
+        check_node(index.memsubtree, MEMSUB, n, child);
+
+        const MemorySubPayload &p = n.payload;
+        if (p.lo > p.hi) {
+            problem(MEMSUB, offset,
+                    format(_("address range {:#x}-{:#x} is backwards"),
+                           (Addr)p.lo, (Addr)p.hi));
+        } else if (!contents_in_bounds(p.contents, p.lo, p.hi)) {
+            problem(MEMSUB, offset,
+                    format(_("contents at offset {} are not within the "
+                             "index"),
+                           p.contents));
+        } else if (p.hash != memory_block_hash(
+                                 type, p.lo,
+                                 static_cast<const unsigned char *>(
+                                     index.index_offset(p.contents)),
+                                 p.hi - p.lo + 1)) {
+            problem(MEMSUB, offset,
+                    _("hash does not match the contents"));
+        }
+
+        if (child[0].offset == n.lc && child[1].offset == n.rc) {
+            uint64_t hash = p.hash;
+            for (const MemSubNode &c : child)
+                if (c.offset)
+                    hash += c.annotation.hash;
+            if (n.annotation.hash != hash)
+                problem(MEMSUB, offset,
+                        _("hash is not the sum of its subtree's hashes"));
+        }
+
+        for (const MemSubNode &c : child)
+            if (c.offset)
+                check_memsub(c.offset, type);
+    }
+
+    // Add up the hash of the part of a memory subtree within [lo,hi],
+    // in the same way as the indexer, using the annotations of subtrees
+    // wholly inside the range. Returns false if the subtree is too
+    // damaged to do it, which will be reported by check_memsub.
+    bool memsub_range_hash(OFF_T offset, int max_height, char type, Addr lo,
+                           Addr hi, uint64_t &hash, bool above_lo = false,
+                           bool below_hi = false)
+    {
+        while (offset) {
+            MemSubNode n;
+            if (!n.read(index.memsubtree, offset) || n.height >= max_height)
+                return false;
+            max_height = n.height;
+            if (above_lo && below_hi) {
+                hash += n.annotation.hash;
+                return true;
+            }
+
+            const MemorySubPayload &p = n.payload;
+            if (p.hi < lo) {
+                offset = n.rc;
+                continue;
+            }
+            if (p.lo > hi) {
+                offset = n.lc;
+                continue;
+            }
+            if (p.lo > p.hi || !contents_in_bounds(p.contents, p.lo, p.hi))
+                return false;
+            Addr olo = max(lo, (Addr)p.lo), ohi = std::min(hi, (Addr)p.hi);
+            hash += memory_block_hash(
+                type, olo,
+                static_cast<const unsigned char *>(
+                    index.index_offset(p.contents)) + (olo - p.lo),
+                ohi - olo + 1);
+            if (!memsub_range_hash(n.lc, max_height, type, lo, hi, hash,
+                                   above_lo, true))
+                return false;
+            offset = n.rc;
+            above_lo = true;
+        }
+        return true;
+    }
+
+    void check_bypc(OFF_T offset, unsigned depth)
+    {
+        ByPCNode n, child[2];
+        n.read(index.bypctree, offset);
+        if (!bypc_claims.claim(offset)) {
+            problem(BYPC, offset, _("reachable by more than one path"));
+            return;
+        }
+        bypc_nodes++;
+        check_node(index.bypctree, BYPC, n, child);
+
+        descend({child[0].offset, child[1].offset}, depth,
+                [this](OFF_T off, unsigned d) { check_bypc(off, d); });
+    }
+
+    void run()
+    {
+        // The by-PC tree is independent of all the others, so check it
+        // alongside them.
+        std::future<void> bypc = std::async(
+            split_depth ? std::launch::async : std::launch::deferred,
+            [this]() {
+                check_root(index.bypctree, BYPC, index.bypcroot,
+                           [this](OFF_T off, unsigned d) {
+                               check_bypc(off, d);
+                           });
+            });
+
+        check_root(index.seqtree, SEQ, index.seqroot,
+                   [this](OFF_T off, unsigned d) { check_seq(off, d); });
+
+        // The root's call depth array counts the nodes in the whole
+        // tree.
+        SeqNode root;
+        vector<CallDepthArrayEntry> array;
+        if (root.read(index.seqtree, index.seqroot) &&
+            read_call_depth_array(root.annotation, array) &&
+            array.back().cumulative_insns != seq_nodes)
+            problem(SEQ, index.seqroot,
+                    format(_("call depth array counts {} nodes in the "
+                             "tree, but {} were found"),
+                           array.back().cumulative_insns,
+                           seq_nodes.load()));
+
+        bypc.get();
+    }
+};
+
+} // namespace
+
+IndexVerifyResults verify_index(const IndexReader &index, unsigned threads,
+                                std::ostream &os, uint64_t max_reports)
+{
+    Verifier v(index, threads, os, max_reports);
+    v.run();
+
+    IndexVerifyResults res;
+    res.seq_nodes = v.seq_nodes;
+    res.bypc_nodes = v.bypc_nodes;
+    res.mem_nodes = v.mem_nodes;
+    res.memsub_nodes = v.memsub_nodes;
+    res.problems = v.problems;
+    return res;
+}
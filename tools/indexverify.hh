@@ -0,0 +1,52 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Consistency checks on the data structures in a finished index file,
+ * for finding damage done to it after the indexer wrote it, or bugs in
+ * the indexer itself.
+ *
+ * Every node reachable from the sequential order tree and the by-PC
+ * tree is checked, including every memory tree and memory subtree
+ * hanging off the sequential order tree: that it lies within the
+ * file, that the tree around it is a correctly ordered and balanced
+ * AVL tree with the heights it claims, and that its annotations agree
+ * with its payload and its children's annotations. Nothing is assumed
+ * about a node before it has been checked, so a damaged index gives
+ * a list of problems rather than a crash.
+ */
+
+#ifndef TARMAC_INDEXVERIFY_HH
+#define TARMAC_INDEXVERIFY_HH
+
+#include "libtarmac/index.hh"
+
+#include <ostream>
+
+struct IndexVerifyResults {
+    uint64_t seq_nodes = 0, bypc_nodes = 0, mem_nodes = 0, memsub_nodes = 0;
+    uint64_t problems = 0;
+};
+
+// Check the index, dividing the trees between up to 'threads' threads.
+// A description of each problem found is written to 'os', up to a
+// limit of 'max_reports', after which they are only counted.
+IndexVerifyResults verify_index(const IndexReader &index, unsigned threads,
+                                std::ostream &os, uint64_t max_reports);
+
+#endif // TARMAC_INDEXVERIFY_HH
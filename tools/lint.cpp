@@ -0,0 +1,279 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Check that a whole trace file parses, without indexing it: report
+ * every parse error and warning with its line number, instead of
+ * stopping at the first error as the indexer does, and summarise what
+ * the trace contains.
+ *
+ * The file is divided into chunks at the same kind of line that index
+ * shards start at, so each chunk can be parsed by a separate thread
+ * with no state carried over from the previous one, and the results
+ * are reported in trace order.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/scan.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include "tracechunks.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct Diagnostic {
+    uint64_t line; // counting from 1 within the chunk
+    bool error;
+    string msg;
+};
+
+struct LintResults {
+    uint64_t lines = 0;
+    uint64_t instructions = 0, registers = 0, memory = 0, text_only = 0;
+    uint64_t exceptions = 0;
+    bool any_time = false;
+    Time first_time = 0, last_time = 0;
+    string dialect;
+    vector<Diagnostic> diags;
+
+    void add(const LintResults &rhs)
+    {
+        lines += rhs.lines;
+        instructions += rhs.instructions;
+        registers += rhs.registers;
+        memory += rhs.memory;
+        text_only += rhs.text_only;
+        exceptions += rhs.exceptions;
+        if (rhs.any_time) {
+            first_time = any_time ? std::min(first_time, rhs.first_time)
+                                  : rhs.first_time;
+            last_time = any_time ? std::max(last_time, rhs.last_time)
+                                 : rhs.last_time;
+            any_time = true;
+        }
+        if (dialect.empty())
+            dialect = rhs.dialect;
+    }
+};
+
+class LintReceiver : public ParseReceiver {
+    LintResults &res;
+
+    void event(const TarmacEvent &ev)
+    {
+        if (!res.any_time) {
+            res.first_time = res.last_time = ev.time;
+            res.any_time = true;
+        }
+        res.first_time = std::min(res.first_time, ev.time);
+        res.last_time = std::max(res.last_time, ev.time);
+    }
+
+  public:
+    LintReceiver(LintResults &res) : res(res) {}
+
+    void got_event(InstructionEvent &ev) override
+    {
+        event(ev);
+        res.instructions++;
+    }
+    void got_event(RegisterEvent &ev) override
+    {
+        event(ev);
+        res.registers++;
+    }
+    void got_event(MemoryEvent &ev) override
+    {
+        event(ev);
+        res.memory++;
+    }
+    void got_event(TextOnlyEvent &ev) override
+    {
+        event(ev);
+        res.text_only++;
+    }
+    void got_event(ExceptionEvent &ev) override
+    {
+        event(ev);
+        res.exceptions++;
+    }
+    bool parse_warning(const string &msg) override
+    {
+        res.diags.push_back({res.lines, false, msg});
+        return false;
+    }
+    bool wants_highlights() const override { return false; }
+};
+
+static LintResults lint_chunk(const string &filename,
+                              const ParseParams &pparams, int cpu,
+                              const TraceChunk &chunk)
+{
+    LintResults res;
+    LintReceiver recv(res);
+    CPUFilter filter(recv, cpu);
+    TarmacLineParser parser(pparams, filter);
+
+    string text = read_chunk(filename, chunk);
+    const char *begin = text.data(), *end = begin + text.size();
+    for (const char *p = begin; p < end;) {
+        const char *nl = scan_newline(p, end), *eol = nl;
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+        res.lines++;
+        try {
+            parser.parse(string(p, eol - p));
+        } catch (const TarmacParseError &e) {
+            if (nl == end) {
+                // As in the indexer, a bad line with no newline after
+                // it is probably a truncated one.
+                res.diags.push_back(
+                    {res.lines, false,
+                     e.msg + "\n" +
+                         _("ignoring parse error on partial last line "
+                           "(trace truncated?)")});
+            } else {
+                res.diags.push_back({res.lines, true, e.msg});
+            }
+        }
+        p = nl + 1;
+    }
+
+    res.dialect = parser.dialect();
+    return res;
+}
+
+struct LintUtility : TarmacUtility {
+    unsigned threads = std::max(1U, std::thread::hardware_concurrency());
+    OFF_T chunk_size = 16 << 20;
+
+    LintUtility()
+    {
+        cannot_use_image();
+        does_not_index();
+    }
+
+    void add_options(Argparse &ap) override
+    {
+        ap.optval({"--threads"}, _("N"),
+                  _("number of threads to parse the trace with (default: "
+                    "one per processor)"),
+                  [this](const string &s) {
+                      threads = parse_unsigned(s, 1, UINT_MAX);
+                  });
+        ap.optval({"--chunk-size"}, _("BYTES"),
+                  _("approximate size of the pieces of the trace given to "
+                    "each thread (default: 16M)"),
+                  [this](const string &s) {
+                      chunk_size = parse_size(s, 1, INT64_MAX);
+                  });
+
+        TarmacUtility::add_options(ap);
+    }
+
+    // A binary trace is checked by checking the text trace it was
+    // made from, with the parsing options it was made with.
+    void postProcessOptions() override { useBinaryTrace(trace); }
+
+    int run()
+    {
+        const string &filename = trace.tarmac_filename;
+        ParseParams pparams = parse_params();
+        vector<TraceChunk> chunks =
+            split_trace_file(filename, pparams, chunk_size);
+
+        reporter->set_indexing_progress(show_progress_meter);
+        reporter->indexing_start(
+            chunks.empty() ? 0 : chunks.back().pos + chunks.back().len);
+
+        LintResults total;
+        IndexingProgress prog;
+        size_t chunks_done = 0;
+        uint64_t errors = 0, warnings = 0;
+        // The parser only gives each warning once, but each chunk has
+        // a parser of its own, so do the same for the whole file here.
+        std::set<string> warnings_reported;
+        for_each_chunk_in_order<LintResults>(
+            chunks, threads,
+            [&](const TraceChunk &chunk) {
+                return lint_chunk(filename, pparams, iparams.cpu, chunk);
+            },
+            [&](const LintResults &res) {
+                for (const Diagnostic &d : res.diags) {
+                    if (!d.error && !warnings_reported.insert(d.msg).second)
+                        continue;
+                    reporter->indexing_warning(filename,
+                                               total.lines + d.line, d.msg);
+                    (d.error ? errors : warnings)++;
+                }
+                total.add(res);
+
+                const TraceChunk &chunk = chunks[chunks_done++];
+                prog.pos = chunk.pos + chunk.len;
+                prog.lines = total.lines;
+                reporter->indexing_progress(prog);
+            });
+        reporter->indexing_done(prog);
+
+        cout << format(_("Dialect: {}\n"), total.dialect.empty()
+                                               ? _("unrecognised")
+                                               : total.dialect)
+             << format(_("Lines: {}\n"), total.lines)
+             << format(_("Instructions: {}\n"), total.instructions)
+             << format(_("Register updates: {}\n"), total.registers)
+             << format(_("Memory accesses: {}\n"), total.memory)
+             << format(_("Text-only events: {}\n"), total.text_only)
+             << format(_("Exceptions: {}\n"), total.exceptions);
+        if (total.any_time)
+            cout << format(_("Time range: {} to {}\n"), total.first_time,
+                           total.last_time);
+        cout << format(_("{} errors, {} warnings\n"), errors, warnings);
+
+        return errors ? 1 : 0;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    LintUtility lu;
+
+    Argparse ap("tarmac-lint", argc, argv);
+    lu.add_options(ap);
+    ap.parse();
+    lu.setup();
+
+    return lu.run();
+}
@@ -26,6 +26,7 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -47,6 +48,7 @@ static ParseParams parse_params;
 
 class TestReceiver : public ParseReceiver {
     ostream &os;
+    bool highlights;
 
     static std::string tostr(InstructionEffect effect) {
         switch (effect) {
@@ -57,13 +59,27 @@ class TestReceiver : public ParseReceiver {
         }
     }
 
+    // Only lines naming a CPU show one, so that the output for
+    // single-core traces is unaffected.
+    static std::string cpustr(const TarmacEvent &ev)
+    {
+        return ev.cpu >= 0 ? " cpu=" + std::to_string(ev.cpu) : "";
+    }
+
   public:
-    TestReceiver(ostream &os) : os(os) {}
+    TestReceiver(ostream &os, bool highlights = true)
+        : os(os), highlights(highlights)
+    {
+    }
+
+    // We never use the highlighting, but by claiming to want it, we
+    // can force the parser to use its general code path.
+    bool wants_highlights() const { return highlights; }
 
     void got_event(RegisterEvent &ev)
     {
         os << "* RegisterEvent"
-           << " time=" << ev.time << " reg=" << ev.reg << hex
+           << " time=" << ev.time << cpustr(ev) << " reg=" << ev.reg << hex
            << " offset=" << ev.offset << " bytes=";
         char buf[3];
         const char *sep = "";
@@ -79,7 +95,7 @@ class TestReceiver : public ParseReceiver {
     void got_event(MemoryEvent &ev)
     {
         os << "* MemoryEvent"
-           << " time=" << ev.time << " read=" << (ev.read ? "true" : "false")
+           << " time=" << ev.time << cpustr(ev) << " read=" << (ev.read ? "true" : "false")
            << " known=" << (ev.known ? "true" : "false") << " addr=" << hex
            << ev.addr << dec << " size=" << ev.size << " contents=" << hex
            << ev.contents << dec << endl;
@@ -88,7 +104,7 @@ class TestReceiver : public ParseReceiver {
     void got_event(InstructionEvent &ev)
     {
         os << "* InstructionEvent"
-           << " time=" << ev.time
+           << " time=" << ev.time << cpustr(ev)
            << " effect=" << tostr(ev.effect)
            << " pc=" << hex << ev.pc << dec
            << " iset="
@@ -101,13 +117,13 @@ class TestReceiver : public ParseReceiver {
 
     void got_event(ExceptionEvent &ev)
     {
-        os << "* ExceptionEvent" << " time=" << ev.time << endl;
+        os << "* ExceptionEvent" << " time=" << ev.time << cpustr(ev) << endl;
     }
 
     void got_event(TextOnlyEvent &ev)
     {
         os << "* TextOnlyEvent"
-           << " time=" << ev.time << " type=\"" << ev.type << "\""
+           << " time=" << ev.time << cpustr(ev) << " type=\"" << ev.type << "\""
            << " text=\"" << ev.msg << "\"" << endl;
     }
 
@@ -136,6 +152,45 @@ void run_tests(istream &is, ostream &os)
     }
 }
 
+// Parse each line with two parsers, one of which is allowed to use
+// its fast paths for the trace's dialect, and report any line on
+// which they disagree.
+void check_fast_path(istream &is, ostream &os)
+{
+    string line;
+    std::ostringstream general_out, fast_out;
+    TestReceiver general_recv(general_out, true), fast_recv(fast_out, false);
+    TarmacLineParser general_parser(parse_params, general_recv);
+    TarmacLineParser fast_parser(parse_params, fast_recv);
+    unsigned lineno = 0, differences = 0;
+
+    while (getline(is, line)) {
+        lineno++;
+        general_out.str("");
+        fast_out.str("");
+        for (auto *p : {&general_parser, &fast_parser}) {
+            try {
+                p->parse(line);
+            } catch (const TarmacParseError &err) {
+                (p == &general_parser ? general_out : fast_out)
+                    << "Parse error: " << err.msg << endl;
+            }
+        }
+        if (general_out.str() != fast_out.str()) {
+            differences++;
+            os << "--- Tarmac line " << lineno << ": " << line << endl
+               << "General parser:" << endl
+               << general_out.str() << "Fast path:" << endl
+               << fast_out.str();
+        }
+    }
+
+    string dialect = fast_parser.dialect();
+    os << lineno << " lines, dialect "
+       << (dialect.empty() ? "not recognised" : dialect) << ", "
+       << differences << " differences" << endl;
+}
+
 class HighlightReceiver : public ParseReceiver {
     string line;
     vector<HighlightClass> highlights;
@@ -235,6 +290,10 @@ int main(int argc, char **argv)
     Argparse ap("parsertest", argc, argv);
     ap.optnoval({"--highlight"}, "syntax-highlight the Tarmac input",
                 [&]() { do_stuff = syntax_highlight; });
+    ap.optnoval({"--check-fast-path"},
+                "check that the parser's fast paths for the input's dialect "
+                "give the same results as its general code",
+                [&]() { do_stuff = check_fast_path; });
     ap.optval({"-o", "--output"}, "OUTFILE",
               "write output to OUTFILE "
               "(default: standard output)",
@@ -22,10 +22,12 @@
 #include "libtarmac/intl.hh"
 #include "libtarmac/reporter.hh"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <sstream>
+#include <vector>
 
 using namespace std;
 
@@ -97,6 +99,83 @@ void ProfileInfo::run(const CallTreeOptions &ctopts)
     P.dump();
 }
 
+void ProfileInfo::run_source_lines()
+{
+    // Count how many times each PC was executed. The by-PC tree has
+    // one node per executed instruction, sorted by PC, so an in-order
+    // walk delivers all the visits to each PC together.
+    using Annotation = EmptyAnnotation<ByPCPayload>;
+    vector<pair<Addr, unsigned long>> pc_counts;
+    index.bypctree.walk(
+        index.bypcroot, WalkOrder::Inorder,
+        [&pc_counts](const ByPCPayload &payload, const Annotation &, OFF_T,
+                     const Annotation *, OFF_T, const Annotation *, OFF_T) {
+            Addr pc = payload.pc;
+            if (pc == CPU_EXCEPTION_PC)
+                return;
+            if (pc_counts.empty() || pc_counts.back().first != pc)
+                pc_counts.emplace_back(pc, 0);
+            pc_counts.back().second++;
+        });
+
+    // Then add up the counts for each source line. Each line's
+    // function is taken from the lowest address it was seen at.
+    struct LineData {
+        unsigned long count = 0;
+        Addr first_pc;
+    };
+    map<pair<string, unsigned>, LineData> lines;
+    unsigned long unknown = 0;
+    auto images = get_images();
+    if (!images)
+        images = make_shared<ImageSet>();
+    for (const auto &pc_count : pc_counts) {
+        string file;
+        unsigned line;
+        if (!images->find_source_line(pc_count.first, file, line)) {
+            unknown += pc_count.second;
+            continue;
+        }
+        LineData &data = lines[make_pair(file, line)];
+        if (!data.count)
+            data.first_pc = pc_count.first;
+        data.count += pc_count.second;
+    }
+
+    // List the hottest lines first, and lines with equal counts in
+    // source order.
+    using LineIter = decltype(lines)::const_iterator;
+    vector<LineIter> sorted;
+    for (auto it = lines.begin(); it != lines.end(); ++it)
+        sorted.push_back(it);
+    stable_sort(sorted.begin(), sorted.end(), [](LineIter a, LineIter b) {
+        return a->second.count > b->second.count;
+    });
+
+    cout << left << setw(12) << _("Count");
+    cout << left << setw(32) << _("Source line");
+    cout << left << _("Function name");
+    cout << '\n';
+
+    for (auto it : sorted) {
+        ostringstream location;
+        location << it->first.first << ':' << it->first.second;
+        uint64_t load_offset;
+        const Symbol *sym =
+            images->find_symbol(it->second.first_pc, &load_offset);
+
+        cout << left << setw(11) << it->second.count << ' ';
+        cout << left << setw(31) << location.str() << ' ';
+        cout << left << (sym ? sym->getName() : "");
+        cout << '\n';
+    }
+    if (unknown) {
+        cout << left << setw(11) << unknown << ' ';
+        cout << left << _("(no line information)");
+        cout << '\n';
+    }
+}
+
 #include "libtarmac/argparse.hh"
 #include "libtarmac/tarmacutil.hh"
 
@@ -110,17 +189,26 @@ int main(int argc, char **argv)
     iparams.record_memory = false;
 
     CallTreeOptions ctopts;
+    bool source_lines = false;
 
     Argparse ap("tarmac-profile", argc, argv);
     TarmacUtility tu;
     tu.set_indexer_params(iparams);
     tu.add_options(ap);
     ctopts.add_options(ap);
+    ap.optnoval({"--source-lines"},
+                _("instead of per-function times, count how often each "
+                  "source line was executed, using the DWARF line tables "
+                  "in the images"),
+                [&]() { source_lines = true; });
     ap.parse();
     tu.setup();
 
-    ProfileInfo PI(tu.trace, tu.image_filename, tu.load_offset);
-    PI.run(ctopts);
+    ProfileInfo PI(tu.trace, tu.images);
+    if (source_lines)
+        PI.run_source_lines();
+    else
+        PI.run(ctopts);
 
     return 0;
 }
@@ -30,6 +30,7 @@ class ProfileInfo : public IndexNavigator {
 
   public:
     void run(const CallTreeOptions &);
+    void run_source_lines();
 };
 
 #endif // TARMAC_PROFILEINFO_HH
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Check and benchmark the implementations of the text scanning
+ * routines in libtarmac/scan.hh.
+ *
+ * First, every implementation that this build and CPU support is run
+ * on random byte strings (including bytes outside ASCII, and every
+ * alignment and length of a short string), and must agree exactly
+ * with the portable one. Then each routine is timed on a buffer of
+ * generated Tarmac-like text, and the throughput written to standard
+ * output as a metric name followed by its value, like ttu-bench.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/scan.hh"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct Random {
+    uint64_t state;
+    Random(uint64_t seed) : state(seed) {}
+    uint32_t operator()()
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state >> 33;
+    }
+};
+
+static vector<const ScanRoutines *> available_routines()
+{
+    vector<const ScanRoutines *> ret;
+    for (ScanImpl impl : {ScanImpl::Portable, ScanImpl::SSE2, ScanImpl::AVX2})
+        if (const ScanRoutines *r = scan_routines(impl))
+            ret.push_back(r);
+    return ret;
+}
+
+static unsigned check_routines(const ScanRoutines *ref,
+                               const ScanRoutines *r)
+{
+    unsigned failures = 0;
+    auto fail = [&](const char *routine, size_t start, size_t len) {
+        if (failures++ < 10)
+            reporter->warnx("%s: %s differs from %s at offset %zu length %zu",
+                            r->name, routine, ref->name, start, len);
+    };
+
+    // Strings drawn from an alphabet weighted towards the characters
+    // the routines distinguish, so that runs of each class are long
+    // enough to cross vector boundaries.
+    static const char alphabet[] = " \t\r\n\v\f_-.#:,()09afAFgzGZ\x80\xa0\xff";
+    Random rng(1);
+    for (unsigned trial = 0; trial < 2000; trial++) {
+        string s(80, '\0');
+        int mode = trial % 4;
+        for (char &c : s) {
+            unsigned n = rng();
+            if (mode == 0)
+                c = (char)n; // any byte at all
+            else if (mode == 1 || n % 16)
+                c = mode == 3 ? "0123456789abcdefABCDEF"[n % 22]
+                    : mode == 2 ? " \t"[n % 2]
+                                : "x0_-.#Z9"[n % 8];
+            else
+                c = alphabet[(n >> 4) % (sizeof(alphabet) - 1)];
+        }
+
+        for (size_t start = 0; start < 40; start++) {
+            for (size_t len = 0; start + len <= s.size(); len++) {
+                const char *p = s.data() + start, *end = p + len;
+                if (r->skip_space(p, end) != ref->skip_space(p, end))
+                    fail("skip_space", start, len);
+                if (r->skip_word(p, end) != ref->skip_word(p, end))
+                    fail("skip_word", start, len);
+                if (r->skip_hex(p, end) != ref->skip_hex(p, end))
+                    fail("skip_hex", start, len);
+
+                if (len % 2)
+                    continue;
+                uint8_t out1[40], out2[40];
+                bool ok1 = r->hex_to_bytes(p, len / 2, out1);
+                bool ok2 = ref->hex_to_bytes(p, len / 2, out2);
+                if (ok1 != ok2 || (ok1 && memcmp(out1, out2, len / 2)))
+                    fail("hex_to_bytes", start, len);
+            }
+        }
+    }
+    return failures;
+}
+
+// Make a buffer of text shaped like a Fast Model trace.
+static string generate_text(size_t size)
+{
+    string text;
+    Random rng(2);
+    char buf[256];
+    while (text.size() < size) {
+        unsigned n = rng();
+        if (n % 3 == 0)
+            snprintf(buf, sizeof(buf),
+                     "%u clk cpu0 IT (%u) %08x %08x O EL1h_s : ADD      "
+                     "x%u,x%u,#%u\n",
+                     n, n / 7, n & ~3U, rng(), n % 31, (n >> 5) % 31,
+                     n % 4096);
+        else if (n % 3 == 1)
+            snprintf(buf, sizeof(buf),
+                     "%u clk cpu0 R X%u %08X%08X\n", n, n % 31, rng(), rng());
+        else
+            snprintf(buf, sizeof(buf),
+                     "%u clk cpu0 MW8 %08x:%012x %08x_%08x\n", n, rng(),
+                     rng(), rng(), rng());
+        text += buf;
+    }
+    text.resize(size);
+    return text;
+}
+
+template <class Fn>
+static void bench(const char *routine, const ScanRoutines *r, size_t bytes,
+                  unsigned repeats, Fn fn)
+{
+    using Clock = std::chrono::steady_clock;
+    volatile size_t sink = 0;
+    auto start = Clock::now();
+    for (unsigned i = 0; i < repeats; i++)
+        sink = sink + fn();
+    double secs =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    cout << routine << "." << r->name << ".mb_per_s "
+         << bytes * (double)repeats / secs / 1e6 << "\n";
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 16 << 20;
+    unsigned repeats = 4;
+
+    Argparse ap("scanbench", argc, argv);
+    ap.optval({"--size"}, "BYTES", "size of the text to benchmark on",
+              [&](const string &s) { size = parse_size(s, 1, SIZE_MAX); });
+    ap.optval({"--repeat"}, "N", "run each benchmark N times",
+              [&](const string &s) {
+                  repeats = parse_unsigned(s, 1, UINT_MAX);
+              });
+    ap.parse();
+
+    vector<const ScanRoutines *> routines = available_routines();
+
+    unsigned failures = 0;
+    for (const ScanRoutines *r : routines)
+        failures += check_routines(routines[0], r);
+    if (failures) {
+        cout << "scan.check failed\n";
+        return 1;
+    }
+    cout << "scan.check ok\n"
+         << "scan.best " << best_scan_routines->name << "\n";
+
+    string text = generate_text(size);
+    const char *begin = text.data(), *end = begin + text.size();
+
+    // A string of hex digits, decoded in 16-byte pieces as if they
+    // were the values of vector registers.
+    string hex;
+    for (unsigned char c : text)
+        hex += "0123456789abcdef"[c % 16];
+    hex.resize(hex.size() & ~(size_t)31);
+    vector<uint8_t> decoded(hex.size() / 2);
+
+    for (const ScanRoutines *r : routines) {
+        bench("tokenise", r, text.size(), repeats, [&]() {
+            // Split into words the way the parser's lexer does,
+            // stepping over punctuation one character at a time.
+            size_t words = 0;
+            for (const char *p = begin; p < end;) {
+                p = r->skip_space(p, end);
+                const char *q = r->skip_word(p, end);
+                if (q > p) {
+                    words += r->skip_hex(p, q) == q;
+                    p = q;
+                } else {
+                    p++;
+                }
+            }
+            return words;
+        });
+        bench("hex_to_bytes", r, hex.size(), repeats, [&]() {
+            size_t ok = 0;
+            for (size_t i = 0; i < hex.size(); i += 32)
+                ok += r->hex_to_bytes(&hex[i], 16, &decoded[i / 2]);
+            return ok;
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Build an index of a large trace file in pieces, which can be run in
+ * parallel, on different machines if need be: each run with --shard
+ * indexes one part of the trace into a shard file, and a final run
+ * with --merge combines them into an ordinary index of the whole.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+struct ShardUtility : TarmacUtility {
+    string output_filename;
+    vector<string> shard_filenames;
+    unsigned shard = 0, count = 0;
+    bool merge = false;
+
+    ShardUtility()
+    {
+        cannot_use_image();
+        builds_own_index();
+    }
+
+    void add_options(Argparse &ap) override
+    {
+        ap.optval({"--shard"}, _("N/COUNT"),
+                  _("index the Nth of COUNT equal parts of the trace file "
+                    "(counting from 0)"),
+                  [this](const string &s) {
+                      size_t slash = s.find('/');
+                      if (slash == string::npos)
+                          throw ArgparseError(
+                              format(_("'{}': expected a shard number and "
+                                       "count, such as 0/4"),
+                                     s));
+                      count = parse_unsigned(s.substr(slash + 1), 1, UINT_MAX);
+                      shard = parse_unsigned(s.substr(0, slash), 0, count - 1);
+                  });
+        ap.optnoval({"--merge"},
+                    _("merge the index shards SHARDFILE... into an index of "
+                      "the whole trace file"),
+                    [this]() { merge = true; });
+        ap.optval({"-o", "--output"}, _("OUTFILE"),
+                  _("file to write (default: tarmac_filename.shardN.index "
+                    "with --shard, or tarmac_filename.index with --merge)"),
+                  [this](const string &s) { output_filename = s; });
+
+        TarmacUtility::add_options(ap);
+
+        ap.positional_multiple(_("SHARDFILE"),
+                               _("with --merge, index shards to merge"),
+                               [this](const string &s) {
+                                   shard_filenames.push_back(s);
+                               },
+                               false);
+    }
+
+    // The output file is named by run(), and shards can't be built
+    // from a binary trace, so there's nothing else to set up.
+    void postProcessOptions() override {}
+
+    void run()
+    {
+        trace.index_on_disk = true;
+
+        if (merge) {
+            trace.index_filename =
+                !output_filename.empty()
+                    ? output_filename
+                    : defaultIndexFilename(trace.tarmac_filename);
+            merge_index_shards(trace, iparams, shard_filenames);
+            if (verbose)
+                cout << format(_("Wrote index {}\n"), trace.index_filename);
+            if (show_stats) {
+                IndexReader reader(trace);
+                cout << format(_("Index statistics for {}:"),
+                               trace.tarmac_filename)
+                     << "\n";
+                reader.stats().print(cout);
+            }
+        } else {
+            if (!output_filename.empty()) {
+                trace.index_filename = output_filename;
+            } else {
+                // Insert the shard number before the .index suffix of
+                // the default index name, which depends on --cpu.
+                string name = defaultIndexFilename(trace.tarmac_filename);
+                name.resize(name.size() - string(".index").size());
+                trace.index_filename =
+                    format("{}.shard{}.index", name, shard);
+            }
+
+            ParseParams pparams = parse_params();
+            IndexerShard range;
+            range.start = shard_boundary(trace.tarmac_filename, pparams,
+                                         shard, count, iparams.cpu);
+            range.end = shard_boundary(trace.tarmac_filename, pparams,
+                                       shard + 1, count, iparams.cpu);
+
+            reporter->set_indexing_progress(show_progress_meter);
+            run_indexer(trace, iparams, idiags, pparams, range);
+            if (verbose)
+                cout << format(
+                    _("Wrote index shard {} (bytes {}-{} of {})\n"),
+                    trace.index_filename, range.start, range.end,
+                    trace.tarmac_filename);
+        }
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    ShardUtility su;
+
+    Argparse ap("tarmac-shard", argc, argv);
+    su.add_options(ap);
+    ap.parse([&]() {
+        if (su.merge == (su.count != 0))
+            throw ArgparseError(_("expected exactly one of --shard and "
+                                  "--merge"));
+        if (su.merge && su.shard_filenames.empty())
+            throw ArgparseError(_("expected index shards to merge"));
+        if (!su.merge && !su.shard_filenames.empty())
+            throw ArgparseError(_("index shards are only expected with "
+                                  "--merge"));
+    });
+    su.setup();
+    su.run();
+
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Cut a window out of a trace file, and write it out as a new trace
+ * file together with a ready-made index. The new index is seeded
+ * with the full register and memory state at the start of the
+ * window, as recorded in the index of the original trace, so that
+ * tools run on the slice still know everything that happened before
+ * it.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::ifstream;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+namespace {
+
+// Finders for the first node at or after a given time, and the last
+// node at or before it, for use with AVLDisk::succ and pred. Neither
+// ever reports an exact match, so succ and pred return the node just
+// beyond the boundary.
+class SeqFirstAtTime {
+    Time t;
+
+  public:
+    SeqFirstAtTime(Time t) : t(t) {}
+    int cmp(const SeqOrderPayload &rhs) const
+    {
+        return t <= rhs.mod_time ? -1 : +1;
+    }
+};
+
+class SeqLastAtTime {
+    Time t;
+
+  public:
+    SeqLastAtTime(Time t) : t(t) {}
+    int cmp(const SeqOrderPayload &rhs) const
+    {
+        return t < rhs.mod_time ? -1 : +1;
+    }
+};
+
+} // namespace
+
+struct SliceWindow {
+    enum class Kind { None, Lines, Time, Function } kind = Kind::None;
+    unsigned long long lo = 0, hi = 0; // for Lines and Time
+    string function;                   // for Function
+    unsigned instance = 1;
+};
+
+static void parse_range(const string &s, unsigned long long &lo,
+                        unsigned long long &hi)
+{
+    size_t dash = s.find('-');
+    try {
+        size_t pos1, pos2;
+        lo = stoull(s.substr(0, dash), &pos1, 0);
+        hi = stoull(s.substr(dash + 1), &pos2, 0);
+        if (dash == string::npos || pos1 != dash ||
+            pos2 != s.size() - dash - 1 || hi < lo)
+            throw std::invalid_argument("");
+    } catch (const std::logic_error &) {
+        throw ArgparseError(format(_("'{}': unable to parse range"), s));
+    }
+}
+
+class Slicer {
+    const IndexNavigator &IN;
+
+    void find_lines(unsigned long long lo, unsigned long long hi,
+                    SeqOrderPayload &first, SeqOrderPayload &last) const
+    {
+        // Convert from line numbers in the file to the numbering
+        // used by the index.
+        unsigned offset = IN.index.lineno_offset;
+        unsigned lo_line = lo > offset ? lo - offset : 1;
+        unsigned hi_line = hi > offset ? hi - offset : 1;
+
+        if (!IN.node_at_line(lo_line, &first))
+            reporter->errx(1, _("line %llu is beyond the end of the trace"),
+                           lo);
+        if (!IN.node_at_line(hi_line, &last))
+            IN.find_buffer_limit(true, &last);
+    }
+
+    void find_time(Time lo, Time hi, SeqOrderPayload &first,
+                   SeqOrderPayload &last) const
+    {
+        if (!IN.index.seqtree.succ(IN.index.seqroot, SeqFirstAtTime(lo),
+                                   &first, nullptr) ||
+            !IN.index.seqtree.pred(IN.index.seqroot, SeqLastAtTime(hi),
+                                   &last, nullptr) ||
+            last.trace_file_firstline < first.trace_file_firstline)
+            reporter->errx(1, _("no trace events in time range %llu-%llu"),
+                           (unsigned long long)lo, (unsigned long long)hi);
+    }
+
+    void find_function(const string &name, unsigned instance,
+                       SeqOrderPayload &first, SeqOrderPayload &last) const
+    {
+        uint64_t addr;
+        size_t pos;
+        try {
+            addr = stoull(name, &pos, 0);
+            if (pos != name.size())
+                throw std::invalid_argument("");
+        } catch (const std::logic_error &) {
+            if (!IN.lookup_symbol(name, addr))
+                reporter->errx(1, _("unable to find symbol '%s'"),
+                               name.c_str());
+        }
+        addr &= ~(uint64_t)1;
+
+        // Find the requested instance of the function's entry point
+        // in the by-PC tree, which lists them in trace order.
+        ByPCPayload finder, found;
+        finder.pc = addr;
+        finder.trace_file_firstline = 0;
+        for (unsigned i = 0; i < instance; i++) {
+            if (!IN.index.bypctree.succ(IN.index.bypcroot, finder, &found,
+                                        nullptr) ||
+                found.pc != addr)
+                reporter->errx(1, _("%s: only %u calls found in trace"),
+                               name.c_str(), i);
+            finder.trace_file_firstline = found.trace_file_firstline;
+        }
+        bool success = IN.node_at_line(found.trace_file_firstline, &first);
+        (void)success; // squash compiler warning if asserts compiled out
+        assert(success);
+
+        // The call ends just before the next node at a shallower call
+        // depth than its first one.
+        unsigned depth = first.call_depth;
+        unsigned line = first.trace_file_firstline - 1;
+        unsigned shallower = IN.lrt_translate(line, 0, UINT_MAX, 0, depth);
+        auto result =
+            IN.lrt_translate_may_fail(shallower, 0, depth, 0, UINT_MAX);
+        SeqOrderPayload after;
+        if (result.first && IN.node_at_line(result.second + 1, &after))
+            IN.get_previous_node(after, &last);
+        else
+            IN.find_buffer_limit(true, &last);
+    }
+
+    // Read the state after the node before the window from the
+    // original index.
+    IndexerSeed make_seed(SeqOrderPayload first) const
+    {
+        IndexerSeed seed;
+        seed.max_sve_bits = IN.index.maxSVEBits();
+
+        SeqOrderPayload prev;
+        if (!IN.get_previous_node(first, &prev))
+            return seed;
+
+        for (char type : {'r', 'm'}) {
+            Addr addr = 0;
+            const void *data;
+            Addr outaddr;
+            size_t outsize;
+            // The size -addr reaches to the top of the address space,
+            // with 0 meaning the whole of it.
+            while (IN.getmem_next(prev.memory_root, type, addr, -addr, &data,
+                                  &outaddr, &outsize, nullptr)) {
+                const unsigned char *bytes = (const unsigned char *)data;
+                seed.ranges.push_back(
+                    {type, outaddr, vector<unsigned char>(bytes,
+                                                          bytes + outsize)});
+                addr = outaddr + outsize;
+                if (addr == 0)
+                    break; // address space wrapped round
+            }
+        }
+        return seed;
+    }
+
+  public:
+    Slicer(const IndexNavigator &IN) : IN(IN) {}
+
+    void run(const SliceWindow &window, const string &output_filename,
+             const string &index_filename, bool verbose)
+    {
+        SeqOrderPayload first, last;
+        switch (window.kind) {
+        case SliceWindow::Kind::Lines:
+            find_lines(window.lo, window.hi, first, last);
+            break;
+        case SliceWindow::Kind::Time:
+            find_time(window.lo, window.hi, first, last);
+            break;
+        case SliceWindow::Kind::Function:
+            find_function(window.function, window.instance, first, last);
+            break;
+        default:
+            assert(false && "no window specified");
+        }
+
+        OFF_T start = first.trace_file_pos;
+        OFF_T end = last.trace_file_pos + last.trace_file_len;
+
+        ifstream ifs(IN.get_tarmac_filename().c_str(),
+                     std::ios_base::in | std::ios_base::binary);
+        if (ifs.fail())
+            reporter->err(1, "%s: open", IN.get_tarmac_filename().c_str());
+        ofstream ofs(output_filename.c_str(),
+                     std::ios_base::out | std::ios_base::binary);
+        if (ofs.fail())
+            reporter->err(1, "%s: open", output_filename.c_str());
+
+        ifs.seekg(start);
+        vector<char> buf(65536);
+        for (OFF_T pos = start; pos < end;) {
+            size_t size = std::min<OFF_T>(buf.size(), end - pos);
+            if (!ifs.read(buf.data(), size))
+                reporter->err(1, "%s: read", IN.get_tarmac_filename().c_str());
+            ofs.write(buf.data(), size);
+            pos += size;
+        }
+        ofs.close();
+        if (ofs.fail())
+            reporter->err(1, "%s: write", output_filename.c_str());
+
+        // Index the new trace file, starting from the state it
+        // inherits from the original. Writing the index after the
+        // trace also makes it look up to date to later tools.
+        TracePair slice;
+        slice.tarmac_filename = output_filename;
+        slice.index_filename = index_filename;
+        slice.index_on_disk = true;
+        IndexerParams iparams;
+        iparams.cpu = IN.index.indexedCPU();
+        run_indexer(slice, iparams, IndexerDiagnostics(),
+                    IN.index.parseParams(), make_seed(first));
+
+        if (verbose) {
+            unsigned offset = IN.index.lineno_offset;
+            cout << format(_("Wrote lines {}-{} of {} to {}\n"),
+                           first.trace_file_firstline + offset,
+                           last.trace_file_firstline + last.trace_file_lines -
+                               1 + offset,
+                           IN.get_tarmac_filename(), output_filename);
+        }
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    SliceWindow window;
+    string output_filename;
+
+    Argparse ap("tarmac-slice", argc, argv);
+    TarmacUtility tu;
+    tu.add_options(ap);
+
+    auto set_kind = [&](SliceWindow::Kind kind) {
+        if (window.kind != SliceWindow::Kind::None)
+            throw ArgparseError(_("expected only one of --lines, --time "
+                                  "and --function"));
+        window.kind = kind;
+    };
+    ap.optval({"--lines"}, _("FIRST-LAST"),
+              _("extract the trace file lines FIRST to LAST inclusive"),
+              [&](const string &s) {
+                  set_kind(SliceWindow::Kind::Lines);
+                  parse_range(s, window.lo, window.hi);
+              });
+    ap.optval({"--time"}, _("FIRST-LAST"),
+              _("extract the events with timestamps FIRST to LAST "
+                "inclusive"),
+              [&](const string &s) {
+                  set_kind(SliceWindow::Kind::Time);
+                  parse_range(s, window.lo, window.hi);
+              });
+    ap.optval({"--function"}, _("FUNCTION"),
+              _("extract one call to FUNCTION (a symbol name or an address)"),
+              [&](const string &s) {
+                  set_kind(SliceWindow::Kind::Function);
+                  window.function = s;
+              });
+    ap.optval({"--instance"}, _("N"),
+              _("with --function, extract the Nth call (default 1)"),
+              [&](const string &s) {
+                  window.instance = parse_unsigned(s, 1, UINT_MAX);
+              });
+    ap.optval({"-o", "--output"}, _("OUTFILE"),
+              _("trace file to write (default: tarmac_filename.slice); its "
+                "index is written alongside it"),
+              [&](const string &s) { output_filename = s; });
+
+    ap.parse([&]() {
+        if (window.kind == SliceWindow::Kind::None)
+            throw ArgparseError(_("expected one of --lines, --time and "
+                                  "--function"));
+    });
+    tu.setup();
+
+    if (output_filename.empty())
+        output_filename = tu.trace.tarmac_filename + ".slice";
+
+    IndexNavigator IN(tu.trace, tu.images);
+    Slicer slicer(IN);
+    slicer.run(window, output_filename,
+               tu.defaultIndexFilename(output_filename), tu.is_verbose());
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+#include "tracechunks.hh"
+
+#include "libtarmac/intl.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/scan.hh"
+
+#include <fstream>
+#include <string>
+
+using std::string;
+using std::vector;
+
+vector<TraceChunk> split_trace(const IndexNavigator &IN,
+                               unsigned nodes_per_chunk)
+{
+    vector<TraceChunk> chunks;
+    unsigned total = IN.node_count();
+    nodes_per_chunk = std::max(nodes_per_chunk, 1U);
+
+    for (unsigned first = 0; first < total; first += nodes_per_chunk) {
+        SeqOrderPayload node;
+        if (!IN.node_at_position(first, &node))
+            reporter->errx(1, _("unable to find node at position %u"), first);
+        TraceChunk chunk;
+        chunk.first_node = first;
+        chunk.nodes = std::min(nodes_per_chunk, total - first);
+        chunk.pos = node.trace_file_pos;
+        if (!chunks.empty())
+            chunks.back().len = chunk.pos - chunks.back().pos;
+        chunks.push_back(chunk);
+    }
+
+    if (!chunks.empty()) {
+        SeqOrderPayload last;
+        if (!IN.find_buffer_limit(true, &last))
+            reporter->errx(1, _("unable to find last node of trace"));
+        chunks.back().len =
+            last.trace_file_pos + last.trace_file_len - chunks.back().pos;
+    }
+    return chunks;
+}
+
+vector<TraceChunk> split_trace_file(const string &filename,
+                                    const ParseParams &pparams,
+                                    OFF_T bytes_per_chunk)
+{
+    std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+    if (!ifs)
+        reporter->err(1, "%s: open", filename.c_str());
+    OFF_T size = ifs.tellg();
+    unsigned count = size / std::max(bytes_per_chunk, (OFF_T)1) + 1;
+
+    vector<TraceChunk> chunks;
+    uint64_t pos = 0;
+    for (unsigned n = 1; n <= count; n++) {
+        uint64_t end = shard_boundary(filename, pparams, n, count);
+        if (end > pos)
+            chunks.push_back(TraceChunk{0, 0, (OFF_T)pos, (OFF_T)(end - pos)});
+        pos = end;
+    }
+    return chunks;
+}
+
+string read_chunk(const string &filename, const TraceChunk &chunk)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+        reporter->err(1, "%s: open", filename.c_str());
+    string text(chunk.len, '\0');
+    ifs.seekg(chunk.pos);
+    if (!ifs.read(&text[0], chunk.len))
+        reporter->err(1, "%s: read", filename.c_str());
+    return text;
+}
+
+void parse_chunk(const IndexNavigator &IN, const TraceChunk &chunk,
+                 ParseReceiver &recv)
+{
+    string text = read_chunk(IN.get_tarmac_filename(), chunk);
+
+    CPUFilter filter(recv, IN.index.indexedCPU());
+    TarmacLineParser parser(IN.index.parseParams(), filter);
+    for (size_t pos = 0; pos < text.size();) {
+        size_t nl =
+            scan_newline(text.data() + pos, text.data() + text.size()) -
+            text.data();
+        size_t end = nl;
+        if (end > pos && text[end - 1] == '\r')
+            end--;
+        try {
+            parser.parse(text.substr(pos, end - pos));
+        } catch (const TarmacParseError &) {
+            // The indexer has already reported these.
+        }
+        pos = nl + 1;
+    }
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Support for tools that re-parse a whole trace file, dividing it
+ * into chunks of whole events that can be parsed by separate threads
+ * (usually using its index to find the boundaries), and then
+ * consuming the results in trace order.
+ */
+
+#ifndef TARMAC_TRACECHUNKS_HH
+#define TARMAC_TRACECHUNKS_HH
+
+#include "libtarmac/index.hh"
+#include "libtarmac/parser.hh"
+
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+
+struct TraceChunk {
+    unsigned first_node, nodes; // range of positions in the seqtree
+    OFF_T pos, len;             // range of bytes in the trace file
+};
+
+// Divide the trace into chunks of up to nodes_per_chunk index nodes.
+std::vector<TraceChunk> split_trace(const IndexNavigator &IN,
+                                    unsigned nodes_per_chunk);
+
+// Divide a trace file that may not have an index into chunks of
+// roughly bytes_per_chunk, starting at the same kind of line as an
+// index shard (see shard_boundary). first_node and nodes are zero.
+std::vector<TraceChunk> split_trace_file(const std::string &filename,
+                                         const ParseParams &pparams,
+                                         OFF_T bytes_per_chunk);
+
+// Read the text of a chunk, through a stream of its own.
+std::string read_chunk(const std::string &filename, const TraceChunk &chunk);
+
+// Parse the lines of one chunk, passing the events to recv. Events
+// from CPUs not covered by the index (see --cpu) are dropped, and
+// lines that fail to parse are ignored, since the indexer will
+// already have complained about them.
+//
+// This reads the trace file through its own stream, so it can be
+// called by several threads at once on the same IndexNavigator.
+void parse_chunk(const IndexNavigator &IN, const TraceChunk &chunk,
+                 ParseReceiver &recv);
+
+// Call work(chunk) on up to 'threads' chunks at once, and
+// consume(result) on each result in the order of the chunks.
+template <class Result, class Work, class Consume>
+void for_each_chunk_in_order(const std::vector<TraceChunk> &chunks,
+                             unsigned threads, Work work, Consume consume)
+{
+    std::deque<std::future<Result>> pending;
+    size_t next = 0;
+    auto launch = [&]() {
+        const TraceChunk &chunk = chunks[next++];
+        pending.push_back(std::async(std::launch::async,
+                                     [&work, &chunk]() { return work(chunk); }));
+    };
+
+    while (next < chunks.size() && pending.size() < std::max(threads, 1U))
+        launch();
+    while (!pending.empty()) {
+        Result result = pending.front().get();
+        pending.pop_front();
+        if (next < chunks.size())
+            launch();
+        consume(result);
+    }
+}
+
+#endif // TARMAC_TRACECHUNKS_HH
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * Find the point where two traces of the same program first diverge.
+ *
+ * The traces are aligned by instruction position (the nth node of
+ * each sequential-order tree), and we binary-search for the first
+ * position at which either the PC or the register and memory state
+ * after the instruction differs. Each probe only needs a tree lookup
+ * and a comparison of memory-tree content hashes, so the search is
+ * logarithmic in the length of the traces.
+ *
+ * The search assumes that once the traces have diverged they stay
+ * diverged. If a difference can go away again, the position found is
+ * still a point of divergence, but not necessarily the first one.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/intl.hh"
+#include "libtarmac/registers.hh"
+#include "libtarmac/reporter.hh"
+#include "libtarmac/tarmacutil.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+class TraceDiff {
+    const IndexNavigator &IN1, &IN2;
+    bool verbose;
+    unsigned probes = 0;
+
+    bool same_at(unsigned pos, SeqOrderPayload &node1, SeqOrderPayload &node2)
+    {
+        probes++;
+        if (!IN1.node_at_position(pos, &node1) ||
+            !IN2.node_at_position(pos, &node2))
+            reporter->errx(1, _("unable to find node at position %u"), pos);
+        return node1.pc == node2.pc &&
+               IN1.state_equal(node1.memory_root, IN2, node2.memory_root);
+    }
+
+    void print_node(const IndexNavigator &IN, const SeqOrderPayload &node)
+    {
+        cout << "  " << IN.get_tarmac_filename() << ": "
+             << format(_("line {}"), node.trace_file_firstline +
+                                         IN.index.lineno_offset);
+        if (node.pc != KNOWN_INVALID_PC) {
+            cout << format(_(", pc {:#x}"), node.pc);
+            string sym = IN.get_symbolic_address(node.pc);
+            if (!sym.empty())
+                cout << " (" << sym << ")";
+        }
+        cout << "\n";
+        for (const string &line : IN.index.get_trace_lines(node))
+            cout << "    " << line << "\n";
+    }
+
+    void print_differences(const SeqOrderPayload &node1,
+                           const SeqOrderPayload &node2)
+    {
+        unsigned iflags = IN1.get_iflags(node1.memory_root);
+        vector<RegisterId> regs;
+        vector<StateDifference> mem;
+        for (const StateDifference &diff :
+             IN1.state_diff(node1.memory_root, IN2, node2.memory_root)) {
+            if (diff.type == 'r') {
+                for (const RegisterId &reg :
+                     regs_in_range(diff.lo, diff.hi, iflags))
+                    if (regs.empty() || regs.back() != reg)
+                        regs.push_back(reg);
+            } else {
+                mem.push_back(diff);
+            }
+        }
+
+        if (!regs.empty()) {
+            cout << _("Differing registers:");
+            for (const RegisterId &reg : regs)
+                cout << " " << reg;
+            cout << "\n";
+        }
+        if (!mem.empty()) {
+            cout << _("Differing memory:");
+            for (const StateDifference &diff : mem)
+                cout << format(" {:#x}-{:#x}", diff.lo, diff.hi);
+            cout << "\n";
+        }
+    }
+
+  public:
+    TraceDiff(const IndexNavigator &IN1, const IndexNavigator &IN2,
+              bool verbose)
+        : IN1(IN1), IN2(IN2), verbose(verbose)
+    {
+    }
+
+    // Returns true if the traces were found to diverge.
+    bool run()
+    {
+        unsigned count1 = IN1.node_count(), count2 = IN2.node_count();
+        unsigned common = std::min(count1, count2);
+        SeqOrderPayload node1, node2;
+
+        if (common == 0 || same_at(common - 1, node1, node2)) {
+            cout << format(_("No divergence in the first {} instructions\n"),
+                           common);
+            if (count1 != count2) {
+                const IndexNavigator &longer = count1 > count2 ? IN1 : IN2;
+                cout << format(_("{} continues for {} more instructions\n"),
+                               longer.get_tarmac_filename(),
+                               std::max(count1, count2) - common);
+            }
+            if (verbose)
+                cout << format(_("{} index probes\n"), probes);
+            return count1 != count2;
+        }
+
+        // Invariant: the traces agree at every position before lo,
+        // and differ at position hi.
+        unsigned lo = 0, hi = common - 1;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (same_at(mid, node1, node2))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        // Re-fetch the nodes at the diverging position, since the
+        // last probe may have been elsewhere.
+        same_at(hi, node1, node2);
+
+        cout << format(_("Traces diverge at instruction {}:\n"), hi);
+        print_node(IN1, node1);
+        print_node(IN2, node2);
+        print_differences(node1, node2);
+        if (verbose)
+            cout << format(_("{} index probes\n"), probes);
+        return true;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    gettext_setup(true);
+
+    Argparse ap("tarmac-tracediff", argc, argv);
+    TarmacUtilityMT tu;
+    tu.want_memory_hashes();
+    tu.add_options(ap);
+
+    ap.parse([&]() {
+        if (tu.traces.size() != 2)
+            throw ArgparseError(_("expected exactly two trace files"));
+    });
+    tu.setup();
+
+    IndexNavigator IN1(tu.traces[0], tu.images);
+    IndexNavigator IN2(tu.traces[1], tu.images);
+
+    TraceDiff diff(IN1, IN2, tu.is_verbose());
+    return diff.run() ? 1 : 0;
+}
@@ -0,0 +1,643 @@
+/*
+ * Copyright 2016-2021 Arm Limited. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * This file is part of Tarmac Trace Utilities
+ */
+
+/*
+ * End-to-end benchmark of the indexer and the index queries that the
+ * tools depend on.
+ *
+ * The input trace can be a real one, or a synthetic one written out
+ * first by this program. Synthetic traces are generated from a
+ * seeded pseudo-random number generator, so the same options always
+ * produce the same trace. They simulate an AArch64 program making
+ * register updates, loads, stores, and properly nested calls and
+ * returns (in the style that the indexer's call heuristics
+ * recognise), in any of the Tarmac dialects that appear in the
+ * samples directory.
+ *
+ * Results are written to standard output one per line, as a metric
+ * name followed by its value, so that they're easy to collect from a
+ * script and compare between builds.
+ */
+
+#include "libtarmac/argparse.hh"
+#include "libtarmac/calltree.hh"
+#include "libtarmac/index.hh"
+#include "libtarmac/misc.hh"
+#include "libtarmac/parser.hh"
+#include "libtarmac/reporter.hh"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+std::unique_ptr<Reporter> reporter = make_cli_reporter();
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// splitmix64, which is small, fast, and gives the same sequence on
+// every platform.
+class Random {
+    uint64_t state;
+
+  public:
+    Random(uint64_t seed) : state(seed) {}
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    uint64_t below(uint64_t n) { return next() % n; }
+};
+
+enum class Dialect { FastModel, Gem5, ES };
+
+struct SyntheticParams {
+    uint64_t lines = 1000000;
+    Dialect dialect = Dialect::FastModel;
+    uint64_t seed = 1;
+
+    // Relative frequencies of the kinds of instruction generated.
+    // Returns are as frequent as calls, when there's a call to
+    // return from.
+    unsigned alu = 60, load = 20, store = 10, call = 2;
+
+    unsigned functions = 64;
+    unsigned max_depth = 32;
+
+    Addr code_base = 0x100000;
+    Addr data_base = 0x40000000, data_size = 1 << 20;
+    Addr stack_top = 0x80000000;
+};
+
+class SyntheticTrace {
+    const SyntheticParams &p;
+    FILE *fp;
+    Random rng;
+    uint64_t lines = 0, insns = 0, time = 0;
+
+    Addr pc, sp;
+    uint64_t regs[31] = {};
+    vector<uint64_t> data, stack;
+    vector<Addr> return_addrs;
+
+    void line(const char *text)
+    {
+        fputs(text, fp);
+        fputc('\n', fp);
+        lines++;
+    }
+
+    void insn(uint32_t encoding, const char *disassembly)
+    {
+        char buf[256];
+        switch (p.dialect) {
+        case Dialect::FastModel:
+            snprintf(buf, sizeof(buf), "%llu clk IT (%llu) %08llx %08x O "
+                     "EL3h_s : %s", (unsigned long long)time,
+                     (unsigned long long)insns, (unsigned long long)pc,
+                     (unsigned)encoding, disassembly);
+            break;
+        case Dialect::Gem5:
+            snprintf(buf, sizeof(buf), "%llu clk cpu0 IT (%llu) %08llx %08x "
+                     "O EL3h_s :   %s", (unsigned long long)time,
+                     (unsigned long long)insns, (unsigned long long)pc,
+                     (unsigned)encoding, disassembly);
+            break;
+        case Dialect::ES:
+            snprintf(buf, sizeof(buf), "%11llu tic ES  (%016llx:%08x) O "
+                     "el3h_s:         %s", (unsigned long long)time,
+                     (unsigned long long)pc, (unsigned)encoding, disassembly);
+            break;
+        }
+        line(buf);
+    }
+
+    // Prefix for the event lines that follow an instruction.
+    string event_prefix() const
+    {
+        switch (p.dialect) {
+        case Dialect::FastModel:
+            return std::to_string(time) + " clk ";
+        case Dialect::Gem5:
+            return std::to_string(time) + " clk cpu0 ";
+        default:
+            return string(20, ' ');
+        }
+    }
+
+    void reg(const char *name, uint64_t value)
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%sR %s %016llx", event_prefix().c_str(),
+                 name, (unsigned long long)value);
+        line(buf);
+    }
+
+    void xreg(unsigned r, uint64_t value)
+    {
+        char name[8];
+        snprintf(name, sizeof(name), "X%u", r);
+        regs[r] = value;
+        reg(name, value);
+    }
+
+    void mem(bool write, Addr addr, uint64_t value)
+    {
+        char buf[256];
+        if (p.dialect == Dialect::ES) {
+            // A 16-byte window of memory, written as one big-endian
+            // number, with the bytes not accessed shown as dots.
+            static const char hex[] = "0123456789abcdef";
+            char window[32];
+            memset(window, '.', 32);
+            unsigned offset = addr & 15;
+            for (unsigned i = 0; i < 8; i++) {
+                unsigned pos = 2 * (15 - (offset + i));
+                unsigned byte = (value >> (8 * i)) & 0xFF;
+                window[pos] = hex[byte >> 4];
+                window[pos + 1] = hex[byte & 15];
+            }
+            snprintf(buf, sizeof(buf), "%s%s %016llx %.8s %.8s %.8s %.8s    "
+                     "S:%010llx    nGnRnE OSH", event_prefix().c_str(),
+                     write ? "ST" : "LD", (unsigned long long)(addr & ~15ULL),
+                     window, window + 8, window + 16, window + 24,
+                     (unsigned long long)(addr & ~15ULL));
+        } else {
+            snprintf(buf, sizeof(buf), "%s%s8 %08llx:%012llx %08llx_%08llx",
+                     event_prefix().c_str(), write ? "MW" : "MR",
+                     (unsigned long long)addr, (unsigned long long)addr,
+                     (unsigned long long)(value >> 32),
+                     (unsigned long long)(value & 0xFFFFFFFF));
+        }
+        line(buf);
+    }
+
+    void set_sp(Addr value)
+    {
+        sp = value;
+        reg("SP_EL3", sp);
+    }
+
+    void next_insn(Addr next_pc)
+    {
+        pc = next_pc;
+        insns++;
+        time += p.dialect == Dialect::Gem5 ? 250 : 1;
+    }
+
+    uint64_t &stack_slot(Addr addr)
+    {
+        return stack[(p.stack_top - addr) / 8 - 1];
+    }
+
+    void alu()
+    {
+        unsigned rd = rng.below(29), rn = rng.below(29);
+        unsigned imm = rng.below(4096);
+        char dis[64];
+        snprintf(dis, sizeof(dis), "ADD      x%u,x%u,#%u", rd, rn, imm);
+        insn(0x91000000 | (imm << 10) | (rn << 5) | rd, dis);
+        xreg(rd, regs[rn] + imm);
+        next_insn(pc + 4);
+    }
+
+    void load()
+    {
+        unsigned rt = rng.below(29);
+        Addr index = rng.below(data.size());
+        char dis[64];
+        snprintf(dis, sizeof(dis), "LDR      x%u,[x28,#%llu]", rt,
+                 (unsigned long long)index * 8);
+        insn(0xf9400380 | rt, dis);
+        mem(false, p.data_base + index * 8, data[index]);
+        xreg(rt, data[index]);
+        next_insn(pc + 4);
+    }
+
+    void store()
+    {
+        unsigned rt = rng.below(29);
+        Addr index = rng.below(data.size());
+        char dis[64];
+        snprintf(dis, sizeof(dis), "STR      x%u,[x28,#%llu]", rt,
+                 (unsigned long long)index * 8);
+        insn(0xf9000380 | rt, dis);
+        data[index] = regs[rt];
+        mem(true, p.data_base + index * 8, data[index]);
+        next_insn(pc + 4);
+    }
+
+    void call()
+    {
+        Addr target = p.code_base + rng.below(p.functions) * 0x10000;
+        char dis[64];
+        snprintf(dis, sizeof(dis), "BL       0x%llx",
+                 (unsigned long long)target);
+        insn(0x94000000, dis);
+        xreg(30, pc + 4);
+        return_addrs.push_back(pc + 4);
+        next_insn(target);
+
+        // Function prologue, saving the return address on the stack.
+        insn(0xd10043ff, "SUB      sp,sp,#0x10");
+        set_sp(sp - 16);
+        if (stack.size() < (p.stack_top - sp) / 8)
+            stack.resize((p.stack_top - sp) / 8);
+        next_insn(pc + 4);
+        insn(0xf90003fe, "STR      x30,[sp,#0]");
+        stack_slot(sp) = regs[30];
+        mem(true, sp, regs[30]);
+        next_insn(pc + 4);
+    }
+
+    void ret()
+    {
+        // Function epilogue, restoring the return address.
+        insn(0xf94003fe, "LDR      x30,[sp,#0]");
+        mem(false, sp, stack_slot(sp));
+        xreg(30, stack_slot(sp));
+        next_insn(pc + 4);
+        insn(0x910043ff, "ADD      sp,sp,#0x10");
+        set_sp(sp + 16);
+        next_insn(pc + 4);
+        insn(0xd65f03c0, "RET");
+        next_insn(return_addrs.back());
+        return_addrs.pop_back();
+    }
+
+  public:
+    SyntheticTrace(const SyntheticParams &p, FILE *fp)
+        : p(p), fp(fp), rng(p.seed), data(std::max<Addr>(p.data_size / 8, 1))
+    {
+    }
+
+    uint64_t generate()
+    {
+        pc = p.code_base;
+        for (unsigned r = 0; r < 31; r++)
+            xreg(r, 0);
+        set_sp(p.stack_top);
+        xreg(28, p.data_base);
+
+        unsigned total = p.alu + p.load + p.store + 2 * p.call;
+        while (lines < p.lines) {
+            unsigned choice = rng.below(total);
+            if (choice < p.alu) {
+                alu();
+            } else if ((choice -= p.alu) < p.load) {
+                load();
+            } else if ((choice -= p.load) < p.store) {
+                store();
+            } else if ((choice -= p.store) < p.call) {
+                if (return_addrs.size() < p.max_depth)
+                    call();
+                else
+                    ret();
+            } else {
+                if (!return_addrs.empty())
+                    ret();
+                else
+                    call();
+            }
+        }
+        return lines;
+    }
+};
+
+// Summary statistics of a set of latency measurements.
+static void report_latencies(const string &name, vector<double> &ns)
+{
+    cout << name << ".count " << ns.size() << "\n";
+    if (ns.empty())
+        return;
+    std::sort(ns.begin(), ns.end());
+    double total = 0;
+    for (double t : ns)
+        total += t;
+    auto percentile = [&](double pc) {
+        return ns[std::min<size_t>(ns.size() - 1, ns.size() * pc / 100)];
+    };
+    cout << name << ".mean_ns " << total / ns.size() << "\n"
+         << name << ".min_ns " << ns.front() << "\n"
+         << name << ".p50_ns " << percentile(50) << "\n"
+         << name << ".p90_ns " << percentile(90) << "\n"
+         << name << ".p99_ns " << percentile(99) << "\n"
+         << name << ".max_ns " << ns.back() << "\n";
+}
+
+template <typename Fn> static double time_ns(Fn fn)
+{
+    auto start = Clock::now();
+    fn();
+    return std::chrono::duration<double, std::nano>(Clock::now() - start)
+        .count();
+}
+
+int main(int argc, char **argv)
+{
+    SyntheticParams sp;
+    bool synthetic = false, generate_only = false, parse_only = false;
+    string tarmac_filename, synthetic_filename = "ttu-bench-synthetic.tarmac";
+    string index_filename;
+    bool memory_index = false;
+    unsigned queries = 10000, calltree_repeats = 1;
+    uint64_t query_seed = 1;
+    Addr mem_lo = sp.data_base, mem_size = sp.data_size;
+    IndexerParams iparams;
+
+    auto parse_mix = [&](const string &s) {
+        size_t pos = 0;
+        while (pos < s.size()) {
+            size_t comma = s.find(',', pos);
+            if (comma == string::npos)
+                comma = s.size();
+            string item = s.substr(pos, comma - pos);
+            size_t eq = item.find('=');
+            string kind = item.substr(0, eq);
+            if (eq == string::npos)
+                throw ArgparseError("'" + item + "': expected KIND=WEIGHT");
+            unsigned value = parse_unsigned(item.substr(eq + 1), 0, UINT_MAX);
+            if (kind == "alu")
+                sp.alu = value;
+            else if (kind == "load")
+                sp.load = value;
+            else if (kind == "store")
+                sp.store = value;
+            else if (kind == "call")
+                sp.call = value;
+            else
+                throw ArgparseError("'" + kind + "': unknown instruction "
+                                    "kind (expected alu, load, store or "
+                                    "call)");
+            pos = comma + 1;
+        }
+    };
+
+    Argparse ap("ttu-bench", argc, argv);
+    ap.optval({"--synthetic"}, "LINES",
+              "write and benchmark a synthetic trace of at least LINES lines",
+              [&](const string &s) {
+                  synthetic = true;
+                  sp.lines = parse_unsigned(s);
+              });
+    ap.optval({"--synthetic-file"}, "FILE",
+              "file name to write the synthetic trace to",
+              [&](const string &s) { synthetic_filename = s; });
+    ap.optnoval({"--generate-only"},
+                "write the synthetic trace and do nothing else",
+                [&]() { generate_only = true; });
+    ap.optnoval({"--parse-only"},
+                "benchmark the parser on its own, without indexing",
+                [&]() { parse_only = true; });
+    ap.optval({"--dialect"}, "DIALECT",
+              "Tarmac dialect of the synthetic trace (fastmodel, gem5, es)",
+              [&](const string &s) {
+                  if (s == "fastmodel")
+                      sp.dialect = Dialect::FastModel;
+                  else if (s == "gem5")
+                      sp.dialect = Dialect::Gem5;
+                  else if (s == "es")
+                      sp.dialect = Dialect::ES;
+                  else
+                      throw ArgparseError("'" + s + "': unknown dialect");
+              });
+    ap.optval({"--seed"}, "N", "random seed for the synthetic trace",
+              [&](const string &s) { sp.seed = parse_unsigned(s); });
+    ap.optval({"--mix"}, "KIND=WEIGHT,...",
+              "relative frequencies of the instruction kinds alu, load, "
+              "store and call in the synthetic trace (default "
+              "alu=60,load=20,store=10,call=2)",
+              parse_mix);
+    ap.optval({"--functions"}, "N", "number of functions to call between",
+              [&](const string &s) {
+                  sp.functions = parse_unsigned(s, 1, UINT_MAX);
+              });
+    ap.optval({"--max-depth"}, "N", "maximum depth of nested calls",
+              [&](const string &s) {
+                  sp.max_depth = parse_unsigned(s, 0, UINT_MAX);
+              });
+    ap.optval({"--data-size"}, "BYTES",
+              "size of the memory region accessed by loads and stores (at "
+              "least 8)",
+              [&](const string &s) {
+                  sp.data_size = mem_size = parse_size(s, 8);
+              });
+    ap.optval({"--index"}, "INDEXFILE", "index file to write",
+              [&](const string &s) { index_filename = s; });
+    ap.optnoval({"--memory-index"}, "build the index in memory instead of "
+                "in an index file",
+                [&]() { memory_index = true; });
+    ap.optnoval({"--no-huge-pages"}, "keep the index in ordinary pages of "
+                "memory (see --no-huge-pages in the other tools)",
+                [&]() { Arena::use_huge_pages = false; });
+    ap.optval({"--memory-limit"}, "BYTES",
+              "limit on the resident index data while indexing (see "
+              "--index-memory-limit in the other tools)",
+              [&](const string &s) {
+                  iparams.memory_limit = parse_size(s, 1);
+              });
+    ap.optval({"--queries"}, "N", "number of each kind of index query to time",
+              [&](const string &s) {
+                  queries = parse_unsigned(s, 0, UINT_MAX);
+              });
+    ap.optval({"--query-seed"}, "N", "random seed for choosing the queries",
+              [&](const string &s) { query_seed = parse_unsigned(s); });
+    ap.optval({"--calltree-repeats"}, "N",
+              "number of times to build the call tree",
+              [&](const string &s) {
+                  calltree_repeats = parse_unsigned(s, 0, UINT_MAX);
+              });
+    ap.optval({"--mem-range"}, "ADDR,SIZE",
+              "memory region to read in the getmem queries (default: the "
+              "region a synthetic trace accesses)",
+              [&](const string &s) {
+                  size_t comma = s.find(',');
+                  if (comma == string::npos)
+                      throw ArgparseError("'" + s + "': expected ADDR,SIZE");
+                  mem_lo = parse_unsigned(s.substr(0, comma));
+                  mem_size = parse_size(s.substr(comma + 1), 8);
+              });
+    ap.positional("TRACEFILE", "existing trace file to benchmark",
+                  [&](const string &s) { tarmac_filename = s; }, false);
+    ap.parse([&]() {
+        if (synthetic == !tarmac_filename.empty())
+            throw ArgparseError("expected exactly one of --synthetic and a "
+                                "trace file name");
+        if (generate_only && !synthetic)
+            throw ArgparseError("--generate-only requires --synthetic");
+        if (sp.alu + sp.load + sp.store + sp.call == 0)
+            throw ArgparseError("--mix: at least one weight must be nonzero");
+    });
+
+    if (synthetic) {
+        tarmac_filename = synthetic_filename;
+        FILE *fp = fopen_wrapper(tarmac_filename.c_str(), "wb");
+        if (!fp)
+            reporter->err(1, "%s: open", tarmac_filename.c_str());
+        auto start = Clock::now();
+        uint64_t lines = SyntheticTrace(sp, fp).generate();
+        if (fclose(fp) != 0)
+            reporter->err(1, "%s: write", tarmac_filename.c_str());
+        cout << "generate.lines " << lines << "\n"
+             << "generate.seconds " << seconds_since(start) << "\n";
+        if (generate_only)
+            return 0;
+    }
+
+    {
+        // Parse every line of the trace without indexing it, to
+        // measure the parser on its own.
+        std::ifstream ifs(tarmac_filename, std::ios::binary);
+        if (!ifs)
+            reporter->err(1, "%s: open", tarmac_filename.c_str());
+        struct : ParseReceiver {
+            bool wants_highlights() const override { return false; }
+        } discard;
+        TarmacLineParser parser(ParseParams(), discard);
+        string line;
+        uint64_t lines = 0, bytes = 0, errors = 0;
+        auto start = Clock::now();
+        while (std::getline(ifs, line)) {
+            lines++;
+            bytes += line.size() + 1;
+            try {
+                parser.parse(line);
+            } catch (const TarmacParseError &) {
+                errors++;
+            }
+        }
+        double secs = seconds_since(start);
+        cout << "parse.seconds " << secs << "\n"
+             << "parse.lines " << lines << "\n"
+             << "parse.errors " << errors << "\n"
+             << "parse.dialect " << parser.dialect() << "\n"
+             << "parse.mb_per_s " << bytes / secs / 1e6 << "\n";
+        if (parse_only)
+            return 0;
+    }
+
+    TracePair trace;
+    trace.tarmac_filename = tarmac_filename;
+    trace.index_on_disk = !memory_index;
+    if (memory_index)
+        trace.memory_index = std::make_shared<MemArena>();
+    else
+        trace.index_filename = index_filename.empty()
+                                   ? tarmac_filename + ".index"
+                                   : index_filename;
+
+    uint64_t trace_size, index_size;
+    {
+        auto start = Clock::now();
+        run_indexer(trace, iparams, IndexerDiagnostics(), ParseParams());
+        double secs = seconds_since(start);
+
+        TraceFingerprint fp;
+        if (!trace_fingerprint(tarmac_filename, false, fp))
+            reporter->err(1, "%s: read", tarmac_filename.c_str());
+        trace_size = fp.size;
+        if (memory_index) {
+            index_size = trace.memory_index->curr_offset();
+        } else {
+            FILE *ifp = fopen_wrapper(trace.index_filename.c_str(), "rb");
+            if (!ifp || fseek(ifp, 0, SEEK_END) != 0)
+                reporter->err(1, "%s: open", trace.index_filename.c_str());
+            index_size = ftell(ifp);
+            fclose(ifp);
+        }
+
+        cout << "index.seconds " << secs << "\n"
+             << "index.trace_bytes " << trace_size << "\n"
+             << "index.index_bytes " << index_size << "\n"
+             << "index.mb_per_s " << trace_size / secs / 1e6 << "\n"
+             << "index.peak_rss_bytes " << peak_resident_memory() << "\n";
+    }
+
+    IndexNavigator IN(trace);
+    SeqOrderPayload last;
+    if (!IN.find_buffer_limit(true, &last))
+        reporter->errx(1, "%s: trace contains no events",
+                       tarmac_filename.c_str());
+    unsigned nlines = last.trace_file_firstline + last.trace_file_lines - 1;
+    cout << "index.lines " << nlines << "\n"
+         << "index.nodes " << IN.node_count() << "\n"
+         << "index.bytes_per_line " << (double)index_size / nlines << "\n";
+    if (iparams.memory_limit)
+        cout << "index.peak_resident_share "
+             << (double)IN.index.stats().peak_index_resident_bytes / index_size
+             << "\n";
+
+    Random rng(query_seed);
+    vector<double> ns;
+
+    for (unsigned i = 0; i < queries; i++) {
+        unsigned line = 1 + rng.below(nlines);
+        SeqOrderPayload node;
+        ns.push_back(time_ns([&]() { IN.node_at_line(line, &node); }));
+    }
+    report_latencies("node_at_line", ns);
+
+    ns.clear();
+    for (unsigned i = 0; i < queries; i++) {
+        SeqOrderPayload node;
+        IN.node_at_line(1 + rng.below(nlines), &node);
+        Addr addr = mem_lo + rng.below(mem_size / 8) * 8;
+        unsigned char data[8], def[8];
+        ns.push_back(time_ns([&]() {
+            IN.getmem(node.memory_root, 'm', addr, 8, data, def);
+        }));
+    }
+    report_latencies("getmem", ns);
+
+    ns.clear();
+    for (unsigned i = 0; i < queries; i++) {
+        unsigned line = rng.below(nlines);
+        unsigned depth = rng.below(sp.max_depth + 1);
+        ns.push_back(time_ns([&]() {
+            IN.lrt_translate_may_fail(line, 0, UINT_MAX, depth, UINT_MAX);
+        }));
+    }
+    report_latencies("lrt_translate", ns);
+
+    ns.clear();
+    for (unsigned i = 0; i < calltree_repeats; i++)
+        ns.push_back(time_ns([&]() { CallTree CT(IN); }));
+    report_latencies("calltree", ns);
+
+    return 0;
+}
@@ -206,7 +206,8 @@ class VCDVisitor : public ParseReceiver {
   public:
     VCDVisitor(VCD::VCDFile &VCD, IndexNavigator &IN, bool UseTarmacTimestamp,
                const CallTreeOptions &ctopts)
-        : TLP(IN.index.parseParams(), *this), VCD(VCD), IN(IN),
+        : Filter(*this, IN.index.indexedCPU()),
+          TLP(IN.index.parseParams(), Filter), VCD(VCD), IN(IN),
           CPU(IN.index.isAArch64() ? CPUDescription::getV8A(VCD)
                                    : CPUDescription::getV7M(VCD)),
           Functions(), Cycle(VCD.addIntSignal("Cycle", 32)),
@@ -286,6 +287,8 @@ class VCDVisitor : public ParseReceiver {
         MemoryAccesses.emplace_back(ev.addr, ev.contents, ev.read);
     }
 
+    virtual bool wants_highlights() const override { return false; }
+
     virtual void got_event(InstructionEvent &ev) override
     {
         bool executed = (ev.effect == IE_EXECUTED);
@@ -309,6 +312,7 @@ class VCDVisitor : public ParseReceiver {
     void finish() { tick(); }
 
   private:
+    CPUFilter Filter;
     TarmacLineParser TLP;
     VCD::VCDFile &VCD;
     IndexNavigator &IN;
@@ -428,7 +432,7 @@ int main(int argc, char **argv)
     if (vcd_filename.size() == 0)
         vcd_filename = tu.trace.tarmac_filename + ".vcd";
 
-    VCDWriter VW(tu.trace, tu.image_filename, tu.load_offset);
+    VCDWriter VW(tu.trace, tu.images);
     VW.run(vcd_filename, no_date, ctopts, use_tarmac_timestamp);
 
     return 0;